@@ -0,0 +1,134 @@
+# -*- coding: utf-8 -*-
+"""WSGI app serving the benchmark scenarios.
+
+    python app.py [--host 127.0.0.1] [--port 8000]
+
+/hello      fixed 12 byte body with Content-Length
+/echo       echo the request body
+/chunked    16 x 1KB chunks, no Content-Length (chunked encoding)
+/file       64KB file through wsgi.file_wrapper (sendfile)
+/ws         websocket echo
+
+--raw serves /hello and /echo through server.run_raw() instead of WSGI.
+"""
+import argparse
+import os
+import tempfile
+
+from meinheld import server, websocket
+
+HELLO = b"Hello world!"
+CHUNK = b"c" * 1024
+FILE_SIZE = 64 * 1024
+
+
+def make_file():
+    fd, path = tempfile.mkstemp(prefix="meinheld-bench-")
+    os.write(fd, b"f" * FILE_SIZE)
+    os.close(fd)
+    return path
+
+
+FILE_PATH = make_file()
+
+
+def hello(environ, start_response):
+    start_response("200 OK", [("Content-Type", "text/plain"),
+                              ("Content-Length", str(len(HELLO)))])
+    return [HELLO]
+
+
+def echo(environ, start_response):
+    length = int(environ.get("CONTENT_LENGTH") or 0)
+    body = environ["wsgi.input"].read(length)
+    start_response("200 OK", [("Content-Type", "application/octet-stream"),
+                              ("Content-Length", str(len(body)))])
+    return [body]
+
+
+def chunked(environ, start_response):
+    start_response("200 OK", [("Content-Type", "text/plain")])
+    for _ in range(16):
+        yield CHUNK
+
+
+def send_file(environ, start_response):
+    start_response("200 OK", [("Content-Type", "application/octet-stream"),
+                              ("Content-Length", str(FILE_SIZE))])
+    return environ["wsgi.file_wrapper"](open(FILE_PATH, "rb"))
+
+
+def ws_echo(environ, start_response):
+    ws = environ.get("wsgi.websocket")
+    if ws is None:
+        start_response("400 Bad Request", [("Content-Length", "0")])
+        return [b""]
+    while True:
+        m = ws.wait()
+        if m is None:
+            break
+        ws.send(m)
+    return [b""]
+
+
+ROUTES = {
+    "/hello": hello,
+    "/echo": echo,
+    "/chunked": chunked,
+    "/file": send_file,
+    "/ws": ws_echo,
+}
+
+
+def not_found(environ, start_response):
+    start_response("404 Not Found", [("Content-Length", "0")])
+    return [b""]
+
+
+def application(environ, start_response):
+    handler = ROUTES.get(environ["PATH_INFO"], not_found)
+    return handler(environ, start_response)
+
+
+RAW_HELLO = server.Response(HELLO, headers=[("Content-Type", "text/plain")])
+RAW_NOT_FOUND = server.Response(status=404)
+
+
+def raw_handler(request):
+    path = request.path
+    if path == "/hello":
+        return RAW_HELLO
+    if path == "/echo":
+        return server.Response(bytes(request.body), headers=[
+            ("Content-Type", "application/octet-stream")])
+    return RAW_NOT_FOUND
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8000)
+    parser.add_argument("--capture", help="record the traffic for replay.py")
+    parser.add_argument("--greenlet-pool", type=int, default=0,
+                        help="reuse up to N greenlets")
+    parser.add_argument("--raw", action="store_true",
+                        help="use server.run_raw() instead of WSGI")
+    args = parser.parse_args()
+
+    server.listen((args.host, args.port))
+    server.set_access_logger(None)
+    server.set_keepalive(10)
+    server.set_greenlet_pool_size(args.greenlet_pool)
+    if args.capture:
+        server.set_capture(args.capture)
+    try:
+        if args.raw:
+            server.run_raw(raw_handler)
+        else:
+            server.run(websocket.WebSocketMiddleware(application))
+    finally:
+        os.unlink(FILE_PATH)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,120 @@
+# -*- coding: utf-8 -*-
+"""Long-polling fan-out, the example/chat pattern.
+
+    python fanout.py [-c 1000] [-d 5] [--port 8914]
+
+Runs a meinheld server and, in the same loop, c greenlets that long-poll it
+over msocket.socket with keep-alive. Every poll suspends its request through
+a Continuation. Once all c are suspended a publisher resumes them at once,
+each answers and polls again. Reports the broadcasts per second and the time
+from the first resume to the last response of a broadcast.
+
+Run it under ``strace -c -f`` to count the syscalls made per broadcast.
+"""
+from __future__ import print_function
+
+import argparse
+import json
+import sys
+import time
+
+from meinheld import patch
+patch.patch_socket()
+
+from meinheld import server
+from meinheld.middleware import ContinuationMiddleware, CONTINUATION_KEY
+
+try:
+    from http.client import HTTPConnection
+except ImportError:
+    from httplib import HTTPConnection
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-c", "--clients", type=int, default=1000)
+    parser.add_argument("-d", "--duration", type=float, default=5)
+    parser.add_argument("--port", type=int, default=8914)
+    parser.add_argument("--json", action="store_true")
+    opts = parser.parse_args()
+
+    waiters = []
+    all_polling = server.Event()
+    all_answered = server.Event()
+    state = {"end": 0, "answered": 0, "running": opts.clients}
+    latencies = []
+
+    def app(environ, start_response):
+        c = environ[CONTINUATION_KEY]
+        waiters.append(c)
+        if len(waiters) == opts.clients:
+            all_polling.set()
+        msg = c.suspend(30)
+        start_response("200 OK", [("Content-Type", "text/plain")])
+        return [msg]
+
+    def client():
+        conn = HTTPConnection("127.0.0.1", opts.port)
+        while True:
+            conn.request("GET", "/poll")
+            body = conn.getresponse().read()
+            if body == b"bye":
+                break
+            state["answered"] += 1
+            if state["answered"] == opts.clients:
+                all_answered.set()
+        conn.close()
+        state["running"] -= 1
+        if state["running"] == 0:
+            server.shutdown()
+
+    def publish(msg):
+        resumed = waiters[:]
+        del waiters[:]
+        all_polling.clear()
+        for c in resumed:
+            c.resume(msg)
+
+    def publisher():
+        state["end"] = time.time() + opts.duration
+        for i in range(opts.clients):
+            server.spawn(client)
+        while time.time() < state["end"]:
+            all_polling.wait()
+            state["answered"] = 0
+            all_answered.clear()
+            begin = time.time()
+            publish(b"message")
+            all_answered.wait()
+            latencies.append(time.time() - begin)
+        all_polling.wait()
+        publish(b"bye")
+
+    server.listen(("127.0.0.1", opts.port))
+    server.set_access_logger(None)
+    server.set_keepalive(30)
+    server.spawn(publisher)
+    begin = time.time()
+    server.run(ContinuationMiddleware(app))
+    elapsed = time.time() - begin
+
+    rounds = len(latencies)
+    result = {"clients": opts.clients, "broadcasts": rounds,
+              "broadcasts_per_sec": rounds / elapsed if elapsed else 0,
+              "resumes_per_sec":
+              rounds * opts.clients / elapsed if elapsed else 0,
+              "mean_ms": 1000 * sum(latencies) / rounds if rounds else 0,
+              "max_ms": 1000 * max(latencies) if rounds else 0}
+    if opts.json:
+        print(json.dumps(result, sort_keys=True))
+    else:
+        print("%d broadcasts to %d clients in %.2fs, %.0f resumes/s, "
+              "%.1fms mean %.1fms max" % (rounds, opts.clients, elapsed,
+                                          result["resumes_per_sec"],
+                                          result["mean_ms"],
+                                          result["max_ms"]),
+              file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,817 @@
+/*
+ * loadgen - small epoll HTTP/1.1 and websocket load generator.
+ *
+ *   cc -O2 -o loadgen loadgen.c -lpthread
+ *   loadgen -c 50 -d 10 127.0.0.1:8000
+ *
+ * Every connection sends a batch of pipeline (-p) requests, waits for all the
+ * responses and sends the next batch. Responses may use Content-Length or
+ * chunked encoding. With -W the connection upgrades to a websocket and sends
+ * batches of masked frames instead, expecting them echoed back.
+ *
+ * The result is printed to stdout as JSON.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RBUF_SIZE (1024 * 64)
+#define MAX_PIPELINE 256
+#define MAX_EVENTS 256
+#define HEADER_PAD_LINE 64
+
+/* log linear latency histogram, relative error < 1 / 2^SUB_BITS */
+#define SUB_BITS 5
+#define MAX_BITS 40
+#define BUCKETS ((MAX_BITS - SUB_BITS + 2) * (1 << SUB_BITS))
+
+enum { S_CONNECTING, S_HANDSHAKE, S_ACTIVE };
+
+enum { R_HEADERS, R_BODY, R_CHUNK_SIZE, R_CHUNK_DATA, R_TRAILER, R_WS_FRAME };
+
+typedef struct {
+  uint64_t requests;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t connects;
+  uint64_t err_connect;
+  uint64_t err_read;
+  uint64_t err_write;
+  uint64_t err_status;
+  uint64_t err_parse;
+  uint64_t lat_sum;
+  uint64_t lat_max;
+  uint64_t lat[BUCKETS];
+} result_t;
+
+typedef struct {
+  int fd;
+  int state;
+  // pending output
+  const char *wbuf;
+  size_t wlen;
+  size_t woff;
+  // batch in flight
+  int outstanding;
+  uint64_t sent_at;
+  // response parser
+  char rbuf[RBUF_SIZE];
+  size_t rlen;
+  int rstate;
+  uint64_t remain;
+  int status;
+  int close_after;
+} conn_t;
+
+typedef struct {
+  pthread_t thread;
+  int epfd;
+  int nconns;
+  conn_t *conns;
+  result_t result;
+} worker_t;
+
+static struct sockaddr_storage addr;
+static socklen_t addrlen;
+static char *host = "127.0.0.1:8000";
+
+static int connections = 50;
+static int threads = 1;
+static double duration = 10;
+static double warmup = 1;
+static int pipeline = 1;
+static int keep_alive = 1;
+static const char *method = "GET";
+static const char *path = "/";
+static size_t body_size = 0;
+static size_t header_size = 0;
+static size_t ws_size = 0;
+
+static char *request_batch;  // pipeline requests
+static size_t request_batch_len;
+static char *handshake;
+static size_t handshake_len;
+
+static uint64_t start_usec, measure_usec, end_usec;
+
+static uint64_t now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bucket_index(uint64_t v) {
+  int msb, shift;
+  if (v < (2 << SUB_BITS)) {
+    return (int)v;
+  }
+  msb = 63 - __builtin_clzll(v);
+  if (msb > MAX_BITS) {
+    return BUCKETS - 1;
+  }
+  shift = msb - SUB_BITS;
+  return ((shift + 1) << SUB_BITS) + (int)((v >> shift) & ((1 << SUB_BITS) - 1));
+}
+
+static uint64_t bucket_upper(int index) {
+  int shift;
+  uint64_t mantissa;
+  if (index < (2 << SUB_BITS)) {
+    return (uint64_t)index;
+  }
+  shift = (index >> SUB_BITS) - 1;
+  mantissa = (index & ((1 << SUB_BITS) - 1)) + (1 << SUB_BITS);
+  return ((mantissa + 1) << shift) - 1;
+}
+
+static uint64_t quantile(const result_t *r, double q) {
+  uint64_t rank, seen = 0, upper;
+  int i;
+
+  if (r->requests == 0) {
+    return 0;
+  }
+  rank = (uint64_t)(q * r->requests + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  for (i = 0; i < BUCKETS; i++) {
+    seen += r->lat[i];
+    if (seen >= rank) {
+      upper = bucket_upper(i);
+      return upper < r->lat_max ? upper : r->lat_max;
+    }
+  }
+  return r->lat_max;
+}
+
+static void record(worker_t *w, uint64_t sent_at, uint64_t now) {
+  uint64_t usec;
+  if (sent_at < measure_usec || now > end_usec) {
+    return;
+  }
+  usec = now - sent_at;
+  w->result.requests++;
+  w->result.lat_sum += usec;
+  w->result.lat[bucket_index(usec)]++;
+  if (usec > w->result.lat_max) {
+    w->result.lat_max = usec;
+  }
+}
+
+static void build_requests(void) {
+  size_t i, len, pad, cap;
+  char *one, *p;
+
+  cap = 1024 + header_size + HEADER_PAD_LINE + body_size;
+  one = malloc(cap);
+  p = one;
+  p += sprintf(p, "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: loadgen\r\n",
+               method, path, host);
+  if (!keep_alive) {
+    p += sprintf(p, "Connection: close\r\n");
+  }
+  // pad headers with lines of HEADER_PAD_LINE bytes
+  for (i = 0; header_size && i * HEADER_PAD_LINE < header_size; i++) {
+    pad = HEADER_PAD_LINE - 16;
+    p += sprintf(p, "X-Pad-%06zu: ", i);
+    memset(p, 'h', pad);
+    p += pad;
+    *p++ = '\r';
+    *p++ = '\n';
+  }
+  if (body_size || strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0) {
+    p += sprintf(p, "Content-Type: application/octet-stream\r\n"
+                    "Content-Length: %zu\r\n",
+                 body_size);
+  }
+  p += sprintf(p, "\r\n");
+  memset(p, 'b', body_size);
+  p += body_size;
+  len = p - one;
+
+  request_batch_len = len * pipeline;
+  request_batch = malloc(request_batch_len);
+  for (i = 0; i < (size_t)pipeline; i++) {
+    memcpy(request_batch + i * len, one, len);
+  }
+  free(one);
+}
+
+static void build_websocket(void) {
+  size_t i, frame_len, hlen;
+  char *frame;
+  unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+
+  handshake = malloc(1024);
+  handshake_len = sprintf(handshake,
+                          "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                          "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                          "Sec-WebSocket-Version: 13\r\n\r\n",
+                          path, host);
+
+  hlen = ws_size < 126 ? 2 : ws_size < 65536 ? 4 : 10;
+  frame_len = hlen + 4 + ws_size;
+  frame = malloc(frame_len);
+  frame[0] = (char)0x81;  // FIN, text
+  if (hlen == 2) {
+    frame[1] = (char)(0x80 | ws_size);
+  } else if (hlen == 4) {
+    frame[1] = (char)(0x80 | 126);
+    frame[2] = (char)(ws_size >> 8);
+    frame[3] = (char)ws_size;
+  } else {
+    frame[1] = (char)(0x80 | 127);
+    for (i = 0; i < 8; i++) {
+      frame[2 + i] = (char)((uint64_t)ws_size >> (56 - i * 8));
+    }
+  }
+  memcpy(frame + hlen, mask, 4);
+  for (i = 0; i < ws_size; i++) {
+    frame[hlen + 4 + i] = (char)('w' ^ mask[i & 3]);
+  }
+  request_batch_len = frame_len * pipeline;
+  request_batch = malloc(request_batch_len);
+  for (i = 0; i < (size_t)pipeline; i++) {
+    memcpy(request_batch + i * frame_len, frame, frame_len);
+  }
+  free(frame);
+}
+
+static void conn_close(worker_t *w, conn_t *c) {
+  if (c->fd != -1) {
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+  }
+}
+
+static int conn_open(worker_t *w, conn_t *c) {
+  struct epoll_event ev;
+  int on = 1;
+
+  c->fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (c->fd == -1) {
+    w->result.err_connect++;
+    return -1;
+  }
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  c->state = S_CONNECTING;
+  c->wbuf = NULL;
+  c->wlen = c->woff = 0;
+  c->outstanding = 0;
+  c->rlen = 0;
+  c->rstate = R_HEADERS;
+  c->close_after = 0;
+  if (connect(c->fd, (struct sockaddr *)&addr, addrlen) == -1 &&
+      errno != EINPROGRESS) {
+    w->result.err_connect++;
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.ptr = c;
+  epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+  w->result.connects++;
+  return 0;
+}
+
+static void conn_reopen(worker_t *w, conn_t *c) {
+  conn_close(w, c);
+  if (now_usec() < end_usec) {
+    conn_open(w, c);
+  }
+}
+
+static void want_write(worker_t *w, conn_t *c, int on) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+  ev.data.ptr = c;
+  epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* write the pending buffer, return -1 on error */
+static int flush(worker_t *w, conn_t *c) {
+  ssize_t r;
+
+  while (c->woff < c->wlen) {
+    r = write(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+    if (r == -1) {
+      if (errno == EAGAIN) {
+        want_write(w, c, 1);
+        return 0;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      w->result.err_write++;
+      return -1;
+    }
+    c->woff += r;
+    w->result.bytes_out += r;
+  }
+  want_write(w, c, 0);
+  return 0;
+}
+
+static int send_batch(worker_t *w, conn_t *c) {
+  c->wbuf = request_batch;
+  c->wlen = request_batch_len;
+  c->woff = 0;
+  c->outstanding = pipeline;
+  c->sent_at = now_usec();
+  c->rstate = ws_size ? R_WS_FRAME : R_HEADERS;
+  return flush(w, c);
+}
+
+static int send_handshake(worker_t *w, conn_t *c) {
+  c->state = S_HANDSHAKE;
+  c->wbuf = handshake;
+  c->wlen = handshake_len;
+  c->woff = 0;
+  c->rstate = R_HEADERS;
+  return flush(w, c);
+}
+
+static void consume(conn_t *c, size_t n) {
+  memmove(c->rbuf, c->rbuf + n, c->rlen - n);
+  c->rlen -= n;
+}
+
+static int header_is(const char *line, size_t len, const char *name) {
+  size_t n = strlen(name);
+  return len > n && strncasecmp(line, name, n) == 0 && line[n] == ':';
+}
+
+static const char *header_value(const char *line, const char *end,
+                                size_t name_len) {
+  const char *v = line + name_len + 1;
+  while (v < end && (*v == ' ' || *v == '\t')) {
+    v++;
+  }
+  return v;
+}
+
+/* parse the response head, return its size, 0 if incomplete, -1 on error */
+static ssize_t parse_head(conn_t *c) {
+  char *end, *line, *eol;
+  int chunked = 0;
+  int64_t length = -1;
+
+  end = memmem(c->rbuf, c->rlen, "\r\n\r\n", 4);
+  if (end == NULL) {
+    return c->rlen == RBUF_SIZE ? -1 : 0;
+  }
+  if (c->rlen < 12 || strncmp(c->rbuf, "HTTP/1.", 7) != 0) {
+    return -1;
+  }
+  c->status = atoi(c->rbuf + 9);
+  c->close_after = !keep_alive || c->rbuf[7] == '0';
+  line = memchr(c->rbuf, '\n', end - c->rbuf) + 1;
+  while (line < end) {
+    eol = memchr(line, '\r', end + 2 - line);
+    if (header_is(line, eol - line, "content-length")) {
+      length = strtoll(header_value(line, eol, 14), NULL, 10);
+    } else if (header_is(line, eol - line, "transfer-encoding")) {
+      chunked = strncasecmp(header_value(line, eol, 17), "chunked", 7) == 0;
+    } else if (header_is(line, eol - line, "connection")) {
+      if (strncasecmp(header_value(line, eol, 10), "close", 5) == 0) {
+        c->close_after = 1;
+      } else if (strncasecmp(header_value(line, eol, 10), "keep-alive", 10) ==
+                 0) {
+        c->close_after = !keep_alive;
+      }
+    }
+    line = eol + 2;
+  }
+  if (chunked) {
+    c->rstate = R_CHUNK_SIZE;
+  } else if (length >= 0) {
+    c->rstate = R_BODY;
+    c->remain = (uint64_t)length;
+  } else if (c->status == 101 || c->status == 204 || c->status == 304) {
+    c->rstate = R_BODY;
+    c->remain = 0;
+  } else {
+    // read until close
+    c->rstate = R_BODY;
+    c->remain = UINT64_MAX;
+    c->close_after = 1;
+  }
+  return end + 4 - c->rbuf;
+}
+
+/* one response (or echoed frame) is done, return -1 to drop the connection */
+static int response_done(worker_t *w, conn_t *c) {
+  uint64_t now = now_usec();
+
+  if (c->state == S_HANDSHAKE) {
+    if (c->status != 101) {
+      w->result.err_status++;
+      return -1;
+    }
+    c->state = S_ACTIVE;
+    return send_batch(w, c);
+  }
+  if (!ws_size && (c->status < 200 || c->status >= 400)) {
+    w->result.err_status++;
+  }
+  record(w, c->sent_at, now);
+  c->outstanding--;
+  if (c->outstanding > 0) {
+    c->rstate = ws_size ? R_WS_FRAME : R_HEADERS;
+    return 0;
+  }
+  if (c->close_after) {
+    return -1;
+  }
+  if (now >= end_usec) {
+    return 0;
+  }
+  return send_batch(w, c);
+}
+
+/* run the parser over the buffered input */
+static int parse(worker_t *w, conn_t *c) {
+  ssize_t n;
+  char *eol;
+  uint64_t take, len;
+  unsigned char *p;
+  size_t hlen;
+
+  for (;;) {
+    switch (c->rstate) {
+      case R_HEADERS:
+        n = parse_head(c);
+        if (n == 0) {
+          return 0;
+        }
+        if (n < 0) {
+          w->result.err_parse++;
+          return -1;
+        }
+        consume(c, n);
+        break;
+      case R_BODY:
+        take = c->remain < c->rlen ? c->remain : c->rlen;
+        consume(c, take);
+        if (c->remain != UINT64_MAX) {
+          c->remain -= take;
+        }
+        if (c->remain != 0) {
+          return 0;
+        }
+        if (response_done(w, c) == -1) {
+          return -1;
+        }
+        if (c->outstanding == 0) {
+          return 0;
+        }
+        break;
+      case R_CHUNK_SIZE:
+        eol = memmem(c->rbuf, c->rlen, "\r\n", 2);
+        if (eol == NULL) {
+          return 0;
+        }
+        if (!isxdigit((unsigned char)c->rbuf[0])) {
+          w->result.err_parse++;
+          return -1;
+        }
+        c->remain = strtoull(c->rbuf, NULL, 16);
+        consume(c, eol + 2 - c->rbuf);
+        if (c->remain == 0) {
+          c->rstate = R_TRAILER;
+        } else {
+          c->remain += 2;  // CRLF after the data
+          c->rstate = R_CHUNK_DATA;
+        }
+        break;
+      case R_CHUNK_DATA:
+        take = c->remain < c->rlen ? c->remain : c->rlen;
+        consume(c, take);
+        c->remain -= take;
+        if (c->remain != 0) {
+          return 0;
+        }
+        c->rstate = R_CHUNK_SIZE;
+        break;
+      case R_TRAILER:
+        eol = memmem(c->rbuf, c->rlen, "\r\n", 2);
+        if (eol == NULL) {
+          return 0;
+        }
+        consume(c, eol + 2 - c->rbuf);
+        if (eol == c->rbuf) {
+          // empty line ends the trailer
+          if (response_done(w, c) == -1) {
+            return -1;
+          }
+          if (c->outstanding == 0) {
+            return 0;
+          }
+        }
+        break;
+      case R_WS_FRAME:
+        if (c->rlen < 2) {
+          return 0;
+        }
+        p = (unsigned char *)c->rbuf;
+        if ((p[0] & 0x0f) == 0x8) {
+          // closed by the server
+          w->result.err_read++;
+          return -1;
+        }
+        len = p[1] & 0x7f;
+        hlen = 2;
+        if (len == 126) {
+          if (c->rlen < 4) {
+            return 0;
+          }
+          len = ((uint64_t)p[2] << 8) | p[3];
+          hlen = 4;
+        } else if (len == 127) {
+          if (c->rlen < 10) {
+            return 0;
+          }
+          len = 0;
+          for (n = 0; n < 8; n++) {
+            len = (len << 8) | p[2 + n];
+          }
+          hlen = 10;
+        }
+        consume(c, hlen);
+        c->remain = len;
+        c->rstate = R_BODY;
+        break;
+    }
+  }
+}
+
+static void on_event(worker_t *w, conn_t *c, uint32_t events) {
+  ssize_t r;
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (c->state == S_CONNECTING) {
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+      w->result.err_connect++;
+      conn_reopen(w, c);
+      return;
+    }
+    if ((ws_size ? send_handshake(w, c)
+                 : (c->state = S_ACTIVE, send_batch(w, c))) == -1) {
+      conn_reopen(w, c);
+    }
+    return;
+  }
+  if ((events & EPOLLOUT) && flush(w, c) == -1) {
+    conn_reopen(w, c);
+    return;
+  }
+  if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+    return;
+  }
+  for (;;) {
+    r = read(c->fd, c->rbuf + c->rlen, RBUF_SIZE - c->rlen);
+    if (r == -1) {
+      if (errno == EAGAIN) {
+        return;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      w->result.err_read++;
+      conn_reopen(w, c);
+      return;
+    }
+    if (r == 0) {
+      if (c->rstate == R_BODY && c->remain == UINT64_MAX) {
+        // close delimited body
+        c->remain = 0;
+        c->rlen = 0;
+        response_done(w, c);
+      } else if (c->outstanding > 0 || c->state != S_ACTIVE) {
+        w->result.err_read++;
+      }
+      conn_reopen(w, c);
+      return;
+    }
+    c->rlen += r;
+    w->result.bytes_in += r;
+    if (parse(w, c) == -1) {
+      conn_reopen(w, c);
+      return;
+    }
+    if (c->outstanding == 0 && now_usec() >= end_usec) {
+      conn_close(w, c);
+      return;
+    }
+  }
+}
+
+static void *worker_main(void *arg) {
+  worker_t *w = arg;
+  struct epoll_event events[MAX_EVENTS];
+  int i, n;
+
+  for (i = 0; i < w->nconns; i++) {
+    w->conns[i].fd = -1;
+    conn_open(w, &w->conns[i]);
+  }
+  while (now_usec() < end_usec) {
+    n = epoll_wait(w->epfd, events, MAX_EVENTS, 100);
+    for (i = 0; i < n; i++) {
+      on_event(w, events[i].data.ptr, events[i].events);
+    }
+    // connections lost to connect errors are retried
+    for (i = 0; i < w->nconns; i++) {
+      if (w->conns[i].fd == -1 && now_usec() < end_usec) {
+        conn_open(w, &w->conns[i]);
+      }
+    }
+  }
+  for (i = 0; i < w->nconns; i++) {
+    conn_close(w, &w->conns[i]);
+  }
+  return NULL;
+}
+
+static void merge(result_t *dst, const result_t *src) {
+  int i;
+  dst->requests += src->requests;
+  dst->bytes_in += src->bytes_in;
+  dst->bytes_out += src->bytes_out;
+  dst->connects += src->connects;
+  dst->err_connect += src->err_connect;
+  dst->err_read += src->err_read;
+  dst->err_write += src->err_write;
+  dst->err_status += src->err_status;
+  dst->err_parse += src->err_parse;
+  dst->lat_sum += src->lat_sum;
+  if (src->lat_max > dst->lat_max) {
+    dst->lat_max = src->lat_max;
+  }
+  for (i = 0; i < BUCKETS; i++) {
+    dst->lat[i] += src->lat[i];
+  }
+}
+
+static void print_json(const result_t *r) {
+  printf(
+      "{\"connections\": %d, \"threads\": %d, \"pipeline\": %d, "
+      "\"duration\": %.3f, \"requests\": %llu, \"rps\": %.1f, "
+      "\"bytes_in\": %llu, \"bytes_out\": %llu, \"connects\": %llu,\n"
+      " \"errors\": {\"connect\": %llu, \"read\": %llu, \"write\": %llu, "
+      "\"status\": %llu, \"parse\": %llu},\n"
+      " \"latency_usec\": {\"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, "
+      "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}}\n",
+      connections, threads, pipeline, duration, (unsigned long long)r->requests,
+      r->requests / duration, (unsigned long long)r->bytes_in,
+      (unsigned long long)r->bytes_out, (unsigned long long)r->connects,
+      (unsigned long long)r->err_connect, (unsigned long long)r->err_read,
+      (unsigned long long)r->err_write, (unsigned long long)r->err_status,
+      (unsigned long long)r->err_parse,
+      r->requests ? (double)r->lat_sum / r->requests : 0.0,
+      (unsigned long long)quantile(r, 0.5),
+      (unsigned long long)quantile(r, 0.9),
+      (unsigned long long)quantile(r, 0.99),
+      (unsigned long long)quantile(r, 0.999), (unsigned long long)r->lat_max);
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: loadgen [options] host:port\n"
+          "  -c conns     connections (50)\n"
+          "  -t threads   threads (1)\n"
+          "  -d secs      measured duration (10)\n"
+          "  -w secs      warmup, not measured (1)\n"
+          "  -p depth     pipelined requests per batch (1)\n"
+          "  -k           close the connection after every request\n"
+          "  -m method    request method (GET)\n"
+          "  -u path      request path (/)\n"
+          "  -b bytes     request body size (0)\n"
+          "  -H bytes     extra request header bytes (0)\n"
+          "  -W bytes     websocket echo with frames of this size\n");
+  exit(2);
+}
+
+static void resolve(const char *hostport) {
+  struct addrinfo hints, *res;
+  char name[256], *port;
+
+  snprintf(name, sizeof(name), "%s", hostport);
+  port = strrchr(name, ':');
+  if (port == NULL) {
+    usage();
+  }
+  *port++ = '\0';
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(name, port, &hints, &res) != 0) {
+    fprintf(stderr, "can't resolve %s\n", hostport);
+    exit(1);
+  }
+  memcpy(&addr, res->ai_addr, res->ai_addrlen);
+  addrlen = res->ai_addrlen;
+  freeaddrinfo(res);
+}
+
+int main(int argc, char **argv) {
+  worker_t *workers;
+  result_t total;
+  int opt, i, n;
+
+  while ((opt = getopt(argc, argv, "c:t:d:w:p:km:u:b:H:W:")) != -1) {
+    switch (opt) {
+      case 'c':
+        connections = atoi(optarg);
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      case 'd':
+        duration = atof(optarg);
+        break;
+      case 'w':
+        warmup = atof(optarg);
+        break;
+      case 'p':
+        pipeline = atoi(optarg);
+        break;
+      case 'k':
+        keep_alive = 0;
+        break;
+      case 'm':
+        method = optarg;
+        break;
+      case 'u':
+        path = optarg;
+        break;
+      case 'b':
+        body_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'H':
+        header_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'W':
+        ws_size = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind < argc) {
+    host = argv[optind];
+  }
+  if (connections < 1 || threads < 1 || threads > connections ||
+      duration <= 0 || warmup < 0 || pipeline < 1 || pipeline > MAX_PIPELINE) {
+    usage();
+  }
+  resolve(host);
+  if (ws_size) {
+    build_websocket();
+  } else {
+    build_requests();
+  }
+
+  start_usec = now_usec();
+  measure_usec = start_usec + (uint64_t)(warmup * 1000000);
+  end_usec = measure_usec + (uint64_t)(duration * 1000000);
+
+  workers = calloc(threads, sizeof(worker_t));
+  for (i = 0; i < threads; i++) {
+    n = connections / threads + (i < connections % threads);
+    workers[i].nconns = n;
+    workers[i].conns = calloc(n, sizeof(conn_t));
+    workers[i].epfd = epoll_create1(0);
+    pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+  }
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    merge(&total, &workers[i].result);
+    close(workers[i].epfd);
+    free(workers[i].conns);
+  }
+  free(workers);
+  print_json(&total);
+  return 0;
+}
@@ -0,0 +1,88 @@
+# -*- coding: utf-8 -*-
+"""Request parser and response writer microbenchmarks.
+
+    python microbench.py [-n 20000] [-r 5] [--json]
+
+Feeds the request corpora in corpus/ through the parser and environ builder
+and writes a few responses to /dev/null, without any network. Reports the
+best of -r rounds in ns/request and PyMem allocations/request.
+
+Corpus files are plain text with LF line endings, the request head is sent
+with CRLF and the body (after the first blank line) as is.
+"""
+from __future__ import print_function
+
+import argparse
+import glob
+import json
+import os
+import sys
+
+from meinheld import server
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+RESPONSES = {
+    "hello": ("200 OK",
+              [("Content-Type", "text/plain"), ("Content-Length", "12")],
+              [b"Hello world!"]),
+    "chunked_16": ("200 OK", [("Content-Type", "text/plain")],
+                   [b"c" * 1024] * 16),
+    "headers_20": ("200 OK",
+                   [("Content-Type", "text/html; charset=utf-8"),
+                    ("Content-Length", "5")] +
+                   [("X-Header-%02d" % i, "value-%02d" % i)
+                    for i in range(18)],
+                   [b"hello"]),
+}
+
+
+def load_corpus(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    head, sep, body = data.partition(b"\n\n")
+    return head.replace(b"\n", b"\r\n") + b"\r\n\r\n" + body
+
+
+def best(fn, rounds):
+    results = [fn() for _ in range(rounds)]
+    return min(results, key=lambda r: r["ns_per_request"])
+
+
+def run(opts):
+    results = {"parse": {}, "response": {}}
+    for path in sorted(glob.glob(os.path.join(HERE, "corpus", "*.http"))):
+        name = os.path.splitext(os.path.basename(path))[0]
+        data = load_corpus(path)
+        results["parse"][name] = best(
+            lambda: server._bench_parse(data, opts.iterations), opts.rounds)
+    for name, (status, headers, body) in sorted(RESPONSES.items()):
+        results["response"][name] = best(
+            lambda: server._bench_response(status, headers, body,
+                                           opts.iterations), opts.rounds)
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-n", "--iterations", type=int, default=20000)
+    parser.add_argument("-r", "--rounds", type=int, default=5)
+    parser.add_argument("--json", action="store_true",
+                        help="print the result as JSON")
+    opts = parser.parse_args()
+
+    results = run(opts)
+    if opts.json:
+        print(json.dumps(results, indent=2, sort_keys=True))
+        return
+    for kind in ("parse", "response"):
+        for name, r in sorted(results[kind].items()):
+            allocs = r["allocs_per_request"]
+            print("%-8s %-14s %9.0f ns/req  %6s allocs/req  %8.0f B/req" % (
+                kind, name, r["ns_per_request"],
+                "-" if allocs is None else "%.1f" % allocs,
+                r["bytes_per_request"]), file=sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
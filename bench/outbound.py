@@ -0,0 +1,87 @@
+# -*- coding: utf-8 -*-
+"""Outbound HTTP through the patched socket module.
+
+    python outbound.py [-c 50] [-d 5] [--size 1024] [--port 8913]
+
+Runs a meinheld server and, in the same loop, c greenlets that send keep-alive
+requests to it with http.client over msocket.socket, so both the client and
+the server side run on green sockets. Reports the requests completed per
+second by the clients.
+"""
+from __future__ import print_function
+
+import argparse
+import json
+import sys
+import time
+
+from meinheld import patch
+patch.patch_socket()
+
+from meinheld import server
+
+try:
+    from http.client import HTTPConnection
+except ImportError:
+    from httplib import HTTPConnection
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-c", "--clients", type=int, default=50)
+    parser.add_argument("-d", "--duration", type=float, default=5)
+    parser.add_argument("--size", type=int, default=1024,
+                        help="response body bytes")
+    parser.add_argument("--port", type=int, default=8913)
+    parser.add_argument("--json", action="store_true")
+    opts = parser.parse_args()
+
+    body = b"x" * opts.size
+    counts = []
+    state = {"end": 0, "running": opts.clients}
+
+    def app(environ, start_response):
+        start_response("200 OK", [("Content-Type", "text/plain")])
+        return [body]
+
+    def client():
+        n = 0
+        conn = HTTPConnection("127.0.0.1", opts.port)
+        while time.time() < state["end"]:
+            conn.request("GET", "/")
+            res = conn.getresponse()
+            if len(res.read()) != opts.size:
+                raise Exception("short response")
+            n += 1
+        conn.close()
+        counts.append(n)
+        state["running"] -= 1
+        if state["running"] == 0:
+            server.shutdown()
+
+    def start():
+        state["end"] = time.time() + opts.duration
+        for i in range(opts.clients):
+            server.spawn(client)
+
+    server.listen(("127.0.0.1", opts.port))
+    server.set_access_logger(None)
+    server.set_keepalive(30)
+    server.spawn(start)
+    begin = time.time()
+    server.run(app)
+    elapsed = time.time() - begin
+
+    total = sum(counts)
+    result = {"clients": opts.clients, "requests": total,
+              "rps": total / elapsed if elapsed else 0}
+    if opts.json:
+        print(json.dumps(result, sort_keys=True))
+    else:
+        print("%d requests in %.2fs, %.0f req/s" % (total, elapsed,
+                                                   result["rps"]),
+              file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,380 @@
+# -*- coding: utf-8 -*-
+"""Replay a traffic capture against a meinheld instance.
+
+    python replay.py capture.bin [-s 1.0] [--pipeline] [-o result.json] \\
+        127.0.0.1:8000
+
+Reads a file written by server.set_capture() and plays every connection back
+with its original timing divided by --speed (0 sends as fast as possible).
+A DATA record waits for the responses to the earlier ones on the same
+connection unless --pipeline is given, so the request order seen by the
+server is the captured one.
+
+Reports the latency distribution (from the last byte of a request to the
+last byte of its response) and a checksum of the response status codes and
+bodies. The checksum is per connection and folded in connection order, so it
+does not depend on the interleaving and two runs against the same app are
+expected to match.
+"""
+from __future__ import print_function
+
+import argparse
+import heapq
+import json
+import selectors
+import socket
+import struct
+import sys
+import time
+import zlib
+
+MAGIC = b"MHCAP001"
+HEADER = struct.Struct("<8sQ")
+RECORD = struct.Struct("<IBxHQI")
+
+OPEN, DATA, CLOSE = 1, 2, 3
+
+
+
+def read_capture(path):
+    """return {conn: [(offset_usec, type, requests, data)]}"""
+    conns = {}
+    with open(path, "rb") as f:
+        magic, _ = HEADER.unpack(f.read(HEADER.size))
+        if magic != MAGIC:
+            raise ValueError("%s is not a capture file" % path)
+        while True:
+            head = f.read(RECORD.size)
+            if len(head) < RECORD.size:
+                break
+            conn, typ, requests, offset, length = RECORD.unpack(head)
+            data = f.read(length)
+            if len(data) < length:
+                break
+            conns.setdefault(conn, []).append((offset, typ, requests, data))
+    return conns
+
+
+class Response(object):
+    """incremental HTTP/1.1 response parser"""
+
+    def __init__(self):
+        self.buf = b""
+        self.reset()
+
+    def reset(self):
+        self.status = None
+        self.remain = None  # body bytes left, -1 until close
+        self.chunked = False
+        self.hash = 0
+
+    def feed(self, data):
+        """yield (status, body hash) for every complete response"""
+        self.buf += data
+        while True:
+            if self.status is None:
+                end = self.buf.find(b"\r\n\r\n")
+                if end < 0:
+                    return
+                self.parse_head(self.buf[:end])
+                self.buf = self.buf[end + 4:]
+            if self.chunked:
+                if not self.read_chunks():
+                    return
+            elif self.remain == -1:
+                self.hash = zlib.crc32(self.buf, self.hash)
+                self.buf = b""
+                return
+            else:
+                n = min(self.remain, len(self.buf))
+                self.hash = zlib.crc32(self.buf[:n], self.hash)
+                self.buf = self.buf[n:]
+                self.remain -= n
+                if self.remain:
+                    return
+            yield self.status, self.hash
+            self.reset()
+
+    def eof(self):
+        """the response delimited by the connection close, if any"""
+        if self.status is not None and self.remain == -1:
+            return self.status, self.hash
+        return None
+
+    def parse_head(self, head):
+        lines = head.split(b"\r\n")
+        self.status = int(lines[0].split()[1])
+        self.hash = zlib.crc32(str(self.status).encode())
+        self.remain = -1
+        for line in lines[1:]:
+            name, _, value = line.partition(b":")
+            name = name.strip().lower()
+            if name == b"content-length":
+                self.remain = int(value)
+            elif name == b"transfer-encoding" and b"chunked" in value.lower():
+                self.chunked = True
+        if self.status in (204, 304) or 100 <= self.status < 200:
+            self.remain = 0
+
+    def read_chunks(self):
+        while True:
+            end = self.buf.find(b"\r\n")
+            if end < 0:
+                return False
+            size = int(self.buf[:end].split(b";")[0], 16)
+            if size == 0:
+                trailer = self.buf.find(b"\r\n\r\n", end)
+                if trailer < 0:
+                    return False
+                self.buf = self.buf[trailer + 4:]
+                return True
+            if len(self.buf) < end + 2 + size + 2:
+                return False
+            self.hash = zlib.crc32(self.buf[end + 2:end + 2 + size],
+                                   self.hash)
+            self.buf = self.buf[end + 2 + size + 2:]
+
+
+class Conn(object):
+
+    def __init__(self, cid, records):
+        self.cid = cid
+        self.records = records
+        self.pos = 0
+        self.sock = None
+        self.out = b""
+        self.out_requests = 0
+        self.inflight = []  # send time per outstanding response
+        self.parser = Response()
+        self.hash = 0
+        self.closing = False
+        self.scheduled = False
+        self.done = False
+
+    def next_offset(self):
+        return self.records[self.pos][0]
+
+
+class Replay(object):
+
+    def __init__(self, opts, conns):
+        self.opts = opts
+        self.host, port = opts.address.rsplit(":", 1)
+        self.port = int(port)
+        self.conns = [Conn(cid, recs) for cid, recs in sorted(conns.items())]
+        self.sel = selectors.DefaultSelector()
+        self.timers = []
+        self.latency = []
+        self.statuses = {}
+        self.errors = {"connect": 0, "read": 0, "write": 0, "parse": 0,
+                       "missing": 0}
+        self.start = 0
+        self.progress = 0  # last response
+
+    def due(self, conn):
+        if self.opts.speed <= 0:
+            return self.start
+        return self.start + conn.next_offset() / 1e6 / self.opts.speed
+
+    def busy(self, conn):
+        return bool(conn.out or conn.out_requests or conn.inflight)
+
+    def schedule(self, conn):
+        if conn.scheduled or conn.done:
+            return
+        if conn.closing or conn.pos >= len(conn.records):
+            if not self.busy(conn):
+                self.finish(conn)
+            return
+        if self.busy(conn) and not self.opts.pipeline:
+            # resumed by the last response
+            return
+        conn.scheduled = True
+        heapq.heappush(self.timers, (self.due(conn), conn.cid, conn))
+
+    def step(self, conn):
+        """run the next record of conn"""
+        _, typ, requests, data = conn.records[conn.pos]
+        conn.pos += 1
+        conn.scheduled = False
+        if typ == OPEN:
+            self.connect(conn)
+        elif typ == DATA:
+            if conn.sock is None:
+                self.connect(conn)
+            conn.out += data
+            conn.out_requests += requests
+            self.flush(conn)
+        elif typ == CLOSE:
+            conn.closing = True
+        self.schedule(conn)
+
+    def connect(self, conn):
+        try:
+            conn.sock = socket.create_connection((self.host, self.port))
+        except socket.error:
+            self.errors["connect"] += 1
+            conn.done = True
+            return
+        conn.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        conn.sock.setblocking(False)
+        self.sel.register(conn.sock, selectors.EVENT_READ, conn)
+
+    def flush(self, conn):
+        if conn.sock is None:
+            return
+        while conn.out:
+            try:
+                n = conn.sock.send(conn.out)
+            except (BlockingIOError, InterruptedError):
+                break
+            except socket.error:
+                self.errors["write"] += 1
+                self.finish(conn)
+                return
+            conn.out = conn.out[n:]
+        events = selectors.EVENT_READ
+        if conn.out:
+            events |= selectors.EVENT_WRITE
+        else:
+            now = time.time()
+            conn.inflight.extend([now] * conn.out_requests)
+            conn.out_requests = 0
+        self.sel.modify(conn.sock, events, conn)
+        if not conn.out:
+            self.schedule(conn)
+
+    def read(self, conn):
+        try:
+            data = conn.sock.recv(65536)
+        except (BlockingIOError, InterruptedError):
+            return
+        except socket.error:
+            self.errors["read"] += 1
+            data = b""
+        try:
+            if data:
+                for status, h in conn.parser.feed(data):
+                    self.response(conn, status, h)
+            else:
+                r = conn.parser.eof()
+                if r is not None:
+                    self.response(conn, *r)
+                self.finish(conn)
+        except (ValueError, IndexError):
+            self.errors["parse"] += 1
+            self.finish(conn)
+
+    def response(self, conn, status, h):
+        now = self.progress = time.time()
+        if conn.inflight:
+            self.latency.append(now - conn.inflight.pop(0))
+        self.statuses[status] = self.statuses.get(status, 0) + 1
+        conn.hash = zlib.crc32(struct.pack("<I", h), conn.hash)
+        self.schedule(conn)
+
+    def finish(self, conn):
+        if conn.done:
+            return
+        conn.done = True
+        self.errors["missing"] += len(conn.inflight) + (
+            1 if conn.out_requests else 0)
+        conn.inflight = []
+        if conn.sock is not None:
+            self.sel.unregister(conn.sock)
+            conn.sock.close()
+            conn.sock = None
+
+    def run(self):
+        self.start = self.progress = time.time()
+        for conn in self.conns:
+            if conn.records:
+                self.schedule(conn)
+        while True:
+            now = time.time()
+            while self.timers and self.timers[0][0] <= now:
+                _, _, conn = heapq.heappop(self.timers)
+                if not conn.done:
+                    self.step(conn)
+            active = [c for c in self.conns if not c.done]
+            if not active:
+                break
+            if not self.timers and now - self.progress > self.opts.timeout:
+                # the server stopped answering
+                for conn in active:
+                    self.finish(conn)
+                break
+            timeout = 0.1
+            if self.timers:
+                timeout = max(0, min(timeout, self.timers[0][0] - now))
+            for key, events in self.sel.select(timeout):
+                conn = key.data
+                if conn.done:
+                    continue
+                if events & selectors.EVENT_WRITE:
+                    self.flush(conn)
+                if not conn.done and events & selectors.EVENT_READ:
+                    self.read(conn)
+        return time.time() - self.start
+
+    def report(self, elapsed):
+        lat = sorted(self.latency)
+
+        def pct(p):
+            if not lat:
+                return 0
+            return int(lat[min(len(lat) - 1, int(len(lat) * p))] * 1e6)
+
+        total = 0
+        for conn in self.conns:
+            total = zlib.crc32(struct.pack("<II", conn.cid, conn.hash), total)
+        return {
+            "connections": len(self.conns),
+            "responses": len(lat),
+            "duration": elapsed,
+            "rps": len(lat) / elapsed if elapsed else 0,
+            "speed": self.opts.speed,
+            "pipeline": self.opts.pipeline,
+            "latency_usec": {
+                "mean": int(sum(lat) / len(lat) * 1e6) if lat else 0,
+                "p50": pct(0.5),
+                "p90": pct(0.9),
+                "p99": pct(0.99),
+                "p999": pct(0.999),
+                "max": int(lat[-1] * 1e6) if lat else 0,
+            },
+            "status": dict((str(k), v) for k, v in self.statuses.items()),
+            "errors": self.errors,
+            "checksum": "%08x" % total,
+        }
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("capture")
+    parser.add_argument("address", help="host:port of the server")
+    parser.add_argument("-s", "--speed", type=float, default=1.0,
+                        help="pacing factor, 0 is as fast as possible")
+    parser.add_argument("--pipeline", action="store_true",
+                        help="send on schedule without waiting for responses")
+    parser.add_argument("--timeout", type=float, default=10,
+                        help="seconds to wait for a response")
+    parser.add_argument("-o", "--output", help="write the JSON here")
+    opts = parser.parse_args()
+
+    replay = Replay(opts, read_capture(opts.capture))
+    result = replay.report(replay.run())
+    data = json.dumps(result, indent=2, sort_keys=True)
+    if opts.output:
+        with open(opts.output, "w") as f:
+            f.write(data + "\n")
+    else:
+        print(data)
+    lat = result["latency_usec"]
+    print("%d responses in %.2fs  p50 %d  p99 %d  max %d usec  checksum %s" % (
+        result["responses"], result["duration"], lat["p50"], lat["p99"],
+        lat["max"], result["checksum"]), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,200 @@
+# -*- coding: utf-8 -*-
+"""Run the benchmark scenarios against meinheld on loopback.
+
+    python run.py [-d 10] [-c 50] [--only hello,post_64k] [-o result.json]
+    python run.py --compare base.json new.json
+
+Every scenario starts a fresh server (app.py), drives it with loadgen and
+records req/s, latency percentiles and the server RSS. The result is written
+as JSON so runs from different commits can be compared.
+"""
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import platform
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def build_loadgen(workdir):
+    out = os.path.join(workdir, "loadgen")
+    cc = os.environ.get("CC", "cc")
+    subprocess.check_call([cc, "-O2", "-o", out,
+                           os.path.join(HERE, "loadgen.c"), "-lpthread"])
+    return out
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def wait_port(port, proc, timeout=10):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if proc.poll() is not None:
+            raise RuntimeError("server exited with %d" % proc.returncode)
+        try:
+            socket.create_connection(("127.0.0.1", port), 0.1).close()
+            return
+        except socket.error:
+            time.sleep(0.05)
+    raise RuntimeError("server did not listen on %d" % port)
+
+
+def read_rss(pid):
+    """return (VmRSS, VmHWM) in KB"""
+    rss = hwm = 0
+    try:
+        with open("/proc/%d/status" % pid) as f:
+            for line in f:
+                if line.startswith("VmRSS:"):
+                    rss = int(line.split()[1])
+                elif line.startswith("VmHWM:"):
+                    hwm = int(line.split()[1])
+    except IOError:
+        pass
+    return rss, hwm
+
+
+def git_commit():
+    try:
+        out = subprocess.check_output(["git", "rev-parse", "--short", "HEAD"],
+                                      cwd=HERE, stderr=subprocess.STDOUT)
+        return out.decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def run_scenario(scenario, opts, loadgen, log):
+    port = free_port()
+    proc = subprocess.Popen([opts.python, os.path.join(HERE, "app.py"),
+                             "--port", str(port)],
+                            stdout=log, stderr=log)
+    try:
+        wait_port(port, proc)
+        rss_start, _ = read_rss(proc.pid)
+        cmd = [loadgen, "-c", str(opts.connections), "-t", str(opts.threads),
+               "-d", str(opts.duration), "-w", str(opts.warmup)]
+        cmd += scenario["args"]
+        cmd.append("127.0.0.1:%d" % port)
+        out = subprocess.check_output(cmd)
+        result = json.loads(out.decode())
+        rss, hwm = read_rss(proc.pid)
+        result["rss_kb"] = {"start": rss_start, "end": rss, "peak": hwm}
+        result["args"] = scenario["args"]
+        return result
+    finally:
+        proc.terminate()
+        proc.wait()
+
+
+def run(opts):
+    with open(opts.scenarios) as f:
+        scenarios = json.load(f)
+    if opts.only:
+        names = opts.only.split(",")
+        scenarios = [s for s in scenarios if s["name"] in names]
+
+    workdir = tempfile.mkdtemp(prefix="meinheld-bench-")
+    try:
+        loadgen = opts.loadgen or build_loadgen(workdir)
+        log = open(os.path.join(workdir, "server.log"), "w")
+        results = {}
+        for scenario in scenarios:
+            r = run_scenario(scenario, opts, loadgen, log)
+            results[scenario["name"]] = r
+            lat = r["latency_usec"]
+            errors = sum(r["errors"].values())
+            print("%-16s %10.1f req/s  p50 %6d  p99 %6d  p999 %6d usec  "
+                  "rss %6d KB  errors %d" % (
+                      scenario["name"], r["rps"], lat["p50"], lat["p99"],
+                      lat["p999"], r["rss_kb"]["end"], errors),
+                  file=sys.stderr)
+        log.close()
+    finally:
+        shutil.rmtree(workdir)
+
+    report = {
+        "meta": {
+            "commit": git_commit(),
+            "date": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+            "python": platform.python_version(),
+            "platform": platform.platform(),
+            "cpus": os.cpu_count() if hasattr(os, "cpu_count") else None,
+            "connections": opts.connections,
+            "threads": opts.threads,
+            "duration": opts.duration,
+            "warmup": opts.warmup,
+        },
+        "scenarios": results,
+    }
+    data = json.dumps(report, indent=2, sort_keys=True)
+    if opts.output:
+        with open(opts.output, "w") as f:
+            f.write(data + "\n")
+    else:
+        print(data)
+
+
+def compare(base_path, new_path):
+    with open(base_path) as f:
+        base = json.load(f)
+    with open(new_path) as f:
+        new = json.load(f)
+
+    def delta(a, b):
+        if not a:
+            return "    n/a"
+        return "%+6.1f%%" % ((b - a) * 100.0 / a)
+
+    print("%-16s %12s %8s %10s %8s %10s %8s" % (
+        "scenario", "req/s", "", "p99 usec", "", "rss KB", ""))
+    for name, b in sorted(new["scenarios"].items()):
+        a = base["scenarios"].get(name)
+        if a is None:
+            continue
+        print("%-16s %12.1f %8s %10d %8s %10d %8s" % (
+            name, b["rps"], delta(a["rps"], b["rps"]),
+            b["latency_usec"]["p99"],
+            delta(a["latency_usec"]["p99"], b["latency_usec"]["p99"]),
+            b["rss_kb"]["end"],
+            delta(a["rss_kb"]["end"], b["rss_kb"]["end"])))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-c", "--connections", type=int, default=50)
+    parser.add_argument("-t", "--threads", type=int, default=1)
+    parser.add_argument("-d", "--duration", type=float, default=10)
+    parser.add_argument("-w", "--warmup", type=float, default=1)
+    parser.add_argument("--only", help="comma separated scenario names")
+    parser.add_argument("--scenarios",
+                        default=os.path.join(HERE, "scenarios.json"))
+    parser.add_argument("--python", default=sys.executable,
+                        help="interpreter running the server")
+    parser.add_argument("--loadgen", help="prebuilt loadgen binary")
+    parser.add_argument("-o", "--output", help="write the JSON here")
+    parser.add_argument("--compare", nargs=2, metavar=("BASE", "NEW"),
+                        help="compare two result files")
+    opts = parser.parse_args()
+
+    if opts.compare:
+        compare(*opts.compare)
+    else:
+        run(opts)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,121 @@
+# -*- coding: utf-8 -*-
+"""Large response bodies with and without MSG_ZEROCOPY.
+
+    python zerocopy.py [-s 1048576] [-n 200] [-c 4] [--threshold 65536]
+
+Forks a meinheld server that answers every request with a body of s bytes,
+once with the zerocopy threshold at 0 and once at --threshold, and fetches
+it n times over c keep-alive connections. Reports MB/s and the zerocopy
+counters of each run.
+
+The loopback always copies, the kernel reports it on the first completion
+and the connection falls back to plain writes. On loopback the run measures
+that fallback costs next to nothing. Point --host at a real NIC to see the
+gain.
+"""
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import signal
+import socket
+import sys
+import threading
+import time
+
+from meinheld import server
+
+
+def serve(opts, threshold, stats_w):
+    body = b"x" * opts.size
+
+    def app(environ, start_response):
+        start_response("200 OK", [("Content-Length", str(len(body)))])
+        return [body]
+
+    server.listen((opts.host, opts.port))
+    server.set_access_logger(None)
+    server.set_keepalive(30)
+    server.set_zerocopy_threshold(threshold)
+    # SIGTERM stops the loop
+    server.run(app)
+    stats = server.get_stats()
+    os.write(stats_w, json.dumps({
+        "zerocopy_sends": stats["zerocopy_sends"],
+        "zerocopy_copied": stats["zerocopy_copied"]}).encode())
+
+
+def fetch(opts, count):
+    s = socket.create_connection((opts.host, opts.port))
+    request = b"GET / HTTP/1.1\r\nHost: bench\r\n\r\n"
+    buf = bytearray(1 << 20)
+    for i in range(count):
+        s.sendall(request)
+        head = b""
+        while b"\r\n\r\n" not in head:
+            head += s.recv(4096)
+        left = opts.size - len(head.split(b"\r\n\r\n", 1)[1])
+        while left > 0:
+            n = s.recv_into(buf)
+            if n == 0:
+                raise IOError("connection closed")
+            left -= n
+    s.close()
+
+
+def run(opts, threshold):
+    stats_r, stats_w = os.pipe()
+    pid = os.fork()
+    if pid == 0:
+        os.close(stats_r)
+        serve(opts, threshold, stats_w)
+        os._exit(0)
+    os.close(stats_w)
+    time.sleep(0.5)
+
+    per = opts.requests // opts.connections
+    threads = [threading.Thread(target=fetch, args=(opts, per))
+               for i in range(opts.connections)]
+    begin = time.time()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.time() - begin
+
+    os.kill(pid, signal.SIGTERM)
+    counters = json.loads(os.read(stats_r, 4096).decode())
+    os.waitpid(pid, 0)
+    os.close(stats_r)
+    total = per * opts.connections * opts.size
+    result = {"threshold": threshold, "elapsed": elapsed,
+              "mb_per_sec": total / elapsed / (1 << 20)}
+    result.update(counters)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-s", "--size", type=int, default=1 << 20)
+    parser.add_argument("-n", "--requests", type=int, default=200)
+    parser.add_argument("-c", "--connections", type=int, default=4)
+    parser.add_argument("--threshold", type=int, default=65536)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8915)
+    parser.add_argument("--json", action="store_true")
+    opts = parser.parse_args()
+
+    results = [run(opts, 0), run(opts, opts.threshold)]
+    if opts.json:
+        print(json.dumps(results, sort_keys=True))
+    else:
+        for r in results:
+            print("threshold %d: %.0f MB/s, %d zerocopy sends, "
+                  "%d copied" % (r["threshold"], r["mb_per_sec"],
+                                 r["zerocopy_sends"], r["zerocopy_copied"]),
+                  file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
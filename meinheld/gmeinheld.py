@@ -22,6 +22,18 @@ class MeinheldWorker(Worker):
 
         server.set_error_logger(self.log)
 
+    def setup_access_log(self):
+        if self.cfg.accesslog is None or self.cfg.logconfig is not None:
+            return
+        # native writer unless logging is customized by logconfig
+        try:
+            server.set_access_log(self.cfg.accesslog,
+                                  self.cfg.access_log_format)
+        except ValueError:
+            # unsupported atom, keep gunicorn logger
+            return
+        server.set_access_logger(None)
+
     def watchdog(self):
         self.notify()
 
@@ -36,6 +48,7 @@ class MeinheldWorker(Worker):
         else:
             fds = [self.socket.fileno()]
 
+        self.setup_access_log()
         server.set_keepalive(self.cfg.keepalive)
         server.set_picoev_max_fd(self.cfg.worker_connections)
 
@@ -111,8 +111,6 @@ else:
     _fileobject = __socket__._fileobject
 gaierror = _socket.gaierror
 
-gethostbyname = _socket.gethostbyname
-getaddrinfo = _socket.getaddrinfo
 
 
 for name in __imports__[:]:
@@ -150,6 +148,11 @@ if 'inet_ntop' not in globals():
 
 from meinheld import server, cancel_wait
 
+getaddrinfo = server.getaddrinfo
+
+def gethostbyname(hostname):
+    return getaddrinfo(hostname, None, AF_INET)[0][4][0]
+
 
 def wait_read(fileno, timeout=None):
     if not timeout:
@@ -167,14 +170,6 @@ def wait_readwrite(fileno, timeout=None):
     server.trampoline(fileno, read=True, write=True, timeout=int(timeout))
 
 
-
-if sys.version_info[:2] < (2, 7):
-    _get_memory = buffer
-else:
-    def _get_memory(string, offset):
-        return memoryview(string)[offset:]
-
-
 class _closedsocket(object):
     __slots__ = []
 
@@ -187,10 +182,6 @@ class _closedsocket(object):
 
 _delegate_methods = ("recv", "recvfrom", "recv_into", "recvfrom_into", "send", "sendto", 'sendall')
 
-timeout_default = object()
-
-use_kqueue = platform.system() in ("Darwin", "FreeBSD")
-
 def internal_accept(s):
     sock = s._sock
     while True:
@@ -211,43 +202,6 @@ def internal_close(s):
     for method in _delegate_methods:
         setattr(s, method, dummy)
 
-def internal_connect(s, address):
-    if s.timeout == 0.0:
-        return s._sock.connect(address)
-
-    # When poll for connect() with kqueue, poll for EVFILT_WRITE.
-    wait = wait_write if use_kqueue else wait_readwrite
-
-    sock = s._sock
-    if s.timeout is None:
-        while True:
-            err = sock.getsockopt(SOL_SOCKET, SO_ERROR)
-            if err:
-                raise error(err, strerror(err))
-            result = sock.connect_ex(address)
-            if not result or result == EISCONN:
-                break
-            elif (result in (EWOULDBLOCK, EINPROGRESS, EALREADY)) or (result == EINVAL and is_windows):
-                wait(sock.fileno())
-            else:
-                raise error(result, strerror(result))
-    else:
-        end = time.time() + s.timeout
-        while True:
-            err = sock.getsockopt(SOL_SOCKET, SO_ERROR)
-            if err:
-                raise error(err, strerror(err))
-            result = sock.connect_ex(address)
-            if not result or result == EISCONN:
-                break
-            elif (result in (EWOULDBLOCK, EINPROGRESS, EALREADY)) or (result == EINVAL and is_windows):
-                timeleft = end - time.time()
-                if timeleft <= 0:
-                    raise timeout('timed out')
-                wait(sock.fileno(), timeout=timeleft)
-            else:
-                raise error(result, strerror(result))
-
 def internal_connect_ex(s, address):
     try:
         return s.connect(address) or 0
@@ -259,149 +213,6 @@ def internal_connect_ex(s, address):
         else:
             raise # gaierror is not silented by connect_ex
 
-def internal_recv(s, *args):
-    # print("internal_recv")
-    sock = s._sock # keeping the reference so that fd is not closed during waiting
-    while True:
-        try:
-            return sock.recv(*args)
-        except error as ex:
-            if ex.errno == EBADF:
-                raise 
-            if ex.errno != EWOULDBLOCK or s.timeout == 0.0:
-                raise
-            # QQQ without clearing exc_info test__refcount.test_clean_exit fails
-            #sys.exc_clear()
-        try:
-            wait_read(sock.fileno(), timeout=s.timeout)
-        except error as ex:
-            if ex.errno == EBADF:
-                return ''
-            raise
-
-def internal_recvfrom(s, *args):
-    # print("internal_recvfrom")
-    sock = s._sock
-    while True:
-        try:
-            return sock.recvfrom(*args)
-        except error as ex:
-            if ex.errno != EWOULDBLOCK or s.timeout == 0.0:
-                raise
-            #sys.exc_clear()
-        wait_read(sock.fileno(), timeout=s.timeout)
-
-def internal_recvfrom_into(s, *args):
-    # print("internal_recvfrom_into")
-    sock = s._sock
-    while True:
-        try:
-            return sock.recvfrom_into(*args)
-        except error as ex:
-            if ex.errno != EWOULDBLOCK or s.timeout == 0.0:
-                raise
-            #sys.exc_clear()
-        wait_read(sock.fileno(), timeout=s.timeout)
-
-def internal_recv_into(s, *args):
-    # print("internal_recv_into")
-    sock = s._sock
-    while True:
-        try:
-            return sock.recv_into(*args)
-        except error as ex:
-            if ex.errno == EBADF:
-                return 0
-            if ex.errno != EWOULDBLOCK or s.timeout == 0.0:
-                raise
-            #sys.exc_clear()
-        try:
-            wait_read(sock.fileno(), timeout=s.timeout)
-        except error as ex:
-            if ex.errno == EBADF:
-                return 0
-            raise
-
-def internal_send(s, data, flags=0, timeout=timeout_default):
-    sock = s._sock
-    if timeout is timeout_default:
-        timeout = s.timeout
-    try:
-        return sock.send(data, flags)
-    except error as ex:
-        if ex.errno != EWOULDBLOCK or timeout == 0.0:
-            raise
-        #sys.exc_clear()
-        try:
-            wait_write(sock.fileno(), timeout=timeout)
-        except error as ex:
-            if ex.errno == EBADF:
-                return 0
-            raise
-        try:
-            return sock.send(data, flags)
-        except error as ex2:
-            if ex2.errno == EWOULDBLOCK:
-                return 0
-            raise
-
-if is_py3():
-    def internal_sendall(s, data, flags=0):
-        # this sendall is also reused by SSL subclasses (both from ssl and sslold modules),
-        # so it should not call s._sock methods directly
-        if s.timeout is None:
-            data_sent = 0
-            while data_sent < len(data):
-                data_sent += s.send(_get_memory(data, data_sent), flags)
-        else:
-            timeleft = s.timeout
-            end = time.time() + timeleft
-            data_sent = 0
-            while True:
-                data_sent += s.send(_get_memory(data, data_sent), flags, timeout=timeleft)
-                if data_sent >= len(data):
-                    break
-                timeleft = end - time.time()
-                if timeleft <= 0:
-                    raise timeout('timed out')
-else:
-    def internal_sendall(s, data, flags=0):
-        if isinstance(data, unicode):
-            data = data.encode()
-        # this sendall is also reused by SSL subclasses (both from ssl and sslold modules),
-        # so it should not call s._sock methods directly
-        if s.timeout is None:
-            data_sent = 0
-            while data_sent < len(data):
-                data_sent += s.send(_get_memory(data, data_sent), flags)
-        else:
-            timeleft = s.timeout
-            end = time.time() + timeleft
-            data_sent = 0
-            while True:
-                data_sent += s.send(_get_memory(data, data_sent), flags, timeout=timeleft)
-                if data_sent >= len(data):
-                    break
-                timeleft = end - time.time()
-                if timeleft <= 0:
-                    raise timeout('timed out')
-
-def internal_sendto(s, *args):
-    sock = s._sock
-    try:
-        return sock.sendto(*args)
-    except error as ex:
-        if ex.errno != EWOULDBLOCK or timeout == 0.0:
-            raise
-        #sys.exc_clear()
-        wait_write(sock.fileno(), timeout=s.timeout)
-        try:
-            return sock.sendto(*args)
-        except error as ex2:
-            if ex2.errno == EWOULDBLOCK:
-                return 0
-            raise
-
 def internal_settimeout(s, howlong):
     if howlong is not None:
         try:
@@ -421,7 +232,7 @@ def internal_shutdown(s, how):
     s._sock.shutdown(how)
 
 if is_py3():
-    class socket(object):
+    class socket(server.GreenSocket):
 
         patched = True
         #__slots__ = ["__weakref__", "_io_refs", "_closed", "_sock", "timeout"]
@@ -483,15 +294,7 @@ if is_py3():
             raise NotImplementedError()
 
         makefile = __socket__.socket.makefile
-        connect = internal_connect
         connect_ex = internal_connect_ex
-        recv = internal_recv
-        recvfrom = internal_recvfrom
-        recvfrom_into = internal_recvfrom_into
-        recv_into = internal_recv_into
-        send = internal_send
-        sendall = internal_sendall
-        sendto = internal_sendto
         settimeout = internal_settimeout
         gettimeout = internal_gettimeout
         shutdown = internal_shutdown
@@ -506,7 +309,7 @@ if is_py3():
             exec(_s % (_m, _m, _m, _m))
         del _m, _s
 else:
-    class socket(object):
+    class socket(server.GreenSocket):
         
         patched = True
 
@@ -578,15 +381,7 @@ else:
         def accept(self):
             raise NotImplementedError()
         close = internal_close
-        connect = internal_connect
         connect_ex = internal_connect_ex
-        recv = internal_recv
-        recvfrom = internal_recvfrom
-        recvfrom_into = internal_recvfrom_into
-        recv_into = internal_recv_into
-        send = internal_send
-        sendall = internal_sendall
-        sendto = internal_sendto
         settimeout = internal_settimeout
         gettimeout = internal_gettimeout
         shutdown = internal_shutdown
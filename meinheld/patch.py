@@ -14,6 +14,8 @@ def patch_socket(aggressive=False):
     _socket.patched = True
     _socket.socket = msocket.socket
     _socket.SocketType = msocket.SocketType
+    _socket.getaddrinfo = msocket.getaddrinfo
+    _socket.gethostbyname = msocket.gethostbyname
     if hasattr(msocket, 'socketpair'):
         _socket.socketpair = msocket.socketpair
     if hasattr(msocket, 'fromfd'):
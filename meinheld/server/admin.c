@@ -0,0 +1,573 @@
+#include "admin.h"
+
+#include <stdarg.h>
+#include <sys/un.h>
+
+#include "buffer.h"
+#include "stats.h"
+
+/**
+ * Admin listener.
+ *
+ * Serves /metrics (OpenMetrics text) and /healthz from the event loop without
+ * calling into Python. Connections are closed after one response.
+ */
+
+#define ADMIN_BACKLOG 64
+#define ADMIN_TIMEOUT_SECS 5
+#define ADMIN_REQ_SIZE 2048
+
+#define OPENMETRICS_TYPE \
+  "application/openmetrics-text; version=1.0.0; charset=utf-8"
+#define TEXT_TYPE "text/plain; charset=utf-8"
+
+typedef struct _admin_conn {
+  int fd;
+  size_t len;
+  char req[ADMIN_REQ_SIZE];
+  buffer_t *res;
+  size_t sent;
+  struct _admin_conn *next;
+} admin_conn_t;
+
+// request duration histogram buckets exported, in usec
+static const uint64_t duration_le_usec[] = {
+    500,    1000,    2500,    5000,    10000,   25000,   50000,
+    100000, 250000,  500000,  1000000, 2500000, 5000000, 10000000};
+static const char *duration_le[] = {
+    "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05",
+    "0.1",    "0.25",  "0.5",    "1.0",   "2.5",  "5.0",   "10.0"};
+
+#define DURATION_BUCKETS (sizeof(duration_le_usec) / sizeof(uint64_t))
+
+// stats_stall_upper in seconds
+static const char *stall_le[STATS_STALL_BUCKETS - 1] = {
+    "0.01", "0.05", "0.1", "0.25", "0.5", "1.0", "5.0"};
+
+static int admin_sock = -1;
+static char *admin_sock_name = NULL;
+static uint8_t draining = 0;
+static admin_conn_t *conns = NULL;
+
+static int listen_fd(int fd) {
+  int res;
+
+  Py_BEGIN_ALLOW_THREADS res = listen(fd, ADMIN_BACKLOG);
+  Py_END_ALLOW_THREADS if (res == -1 || fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+                           fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+    PyErr_SetFromErrno(PyExc_IOError);
+    close(fd);
+    return -1;
+  }
+  admin_sock = fd;
+  return 0;
+}
+
+int admin_listen_inet(const char *host, int port) {
+  struct addrinfo hints, *servinfo, *p;
+  char strport[7];
+  int fd = -1, flag = 1, res;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  snprintf(strport, sizeof(strport), "%d", port);
+
+  if ((res = getaddrinfo(host, strport, &hints, &servinfo)) != 0) {
+    PyErr_SetString(PyExc_IOError, gai_strerror(res));
+    return -1;
+  }
+  for (p = servinfo; p != NULL; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(int));
+#ifdef SO_REUSEPORT
+    // every prefork worker may bind the same admin port
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(int));
+#endif
+    Py_BEGIN_ALLOW_THREADS res = bind(fd, p->ai_addr, p->ai_addrlen);
+    Py_END_ALLOW_THREADS if (res == 0) { break; }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(servinfo);
+  if (fd == -1) {
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+  }
+  return listen_fd(fd);
+}
+
+int admin_listen_unix(const char *path) {
+  struct sockaddr_un saddr;
+  mode_t old_umask;
+  int fd, res;
+
+  if (strlen(path) >= sizeof(saddr.sun_path)) {
+    PyErr_SetString(PyExc_ValueError, "unix socket path too long");
+    return -1;
+  }
+  if (!access(path, F_OK) && unlink(path) < 0) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+  }
+  memset(&saddr, 0, sizeof(saddr));
+  saddr.sun_family = AF_UNIX;
+  strcpy(saddr.sun_path, path);
+
+  old_umask = umask(0);
+  Py_BEGIN_ALLOW_THREADS res =
+      bind(fd, (struct sockaddr *)&saddr, sizeof(saddr));
+  Py_END_ALLOW_THREADS umask(old_umask);
+  if (res == -1) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    close(fd);
+    return -1;
+  }
+  if (listen_fd(fd) == -1) {
+    unlink(path);
+    return -1;
+  }
+  admin_sock_name = strdup(path);
+  return 0;
+}
+
+static void close_conn(picoev_loop *loop, admin_conn_t *conn) {
+  admin_conn_t **p;
+
+  for (p = &conns; *p != NULL; p = &(*p)->next) {
+    if (*p == conn) {
+      *p = conn->next;
+      break;
+    }
+  }
+  if (loop && picoev_is_active(loop, conn->fd)) {
+    picoev_del(loop, conn->fd);
+  }
+  close(conn->fd);
+  if (conn->res) {
+    free_buffer(conn->res);
+  }
+  PyMem_Free(conn);
+}
+
+static int put(buffer_t *b, const char *fmt, ...) {
+  char tmp[256];
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  if (n < 0 || n >= (int)sizeof(tmp)) {
+    return -1;
+  }
+  return write2buf(b, tmp, n) == WRITE_OK ? 0 : -1;
+}
+
+static int put_metric(buffer_t *b, const char *name, const char *type,
+                      const char *help, uint64_t value) {
+  return put(b, "# TYPE %s %s\n# HELP %s %s\n%s%s %llu\n", name, type, name,
+             help, name, strcmp(type, "counter") ? "" : "_total",
+             (unsigned long long)value);
+}
+
+static int put_duration(buffer_t *b, stats_slot_t *s) {
+  static const char *name = "meinheld_request_duration_seconds";
+  uint64_t le_cnt[DURATION_BUCKETS];
+  uint64_t upper, cum = 0;
+  size_t i, j;
+
+  memset(le_cnt, 0, sizeof(le_cnt));
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    if (s->latency[i] == 0) {
+      continue;
+    }
+    // a histogram bucket falls into the first boundary above its upper value
+    upper = stats_bucket_upper((int)i);
+    for (j = 0; j < DURATION_BUCKETS; j++) {
+      if (upper <= duration_le_usec[j]) {
+        le_cnt[j] += s->latency[i];
+        break;
+      }
+    }
+  }
+  if (put(b,
+          "# TYPE %s histogram\n# UNIT %s seconds\n"
+          "# HELP %s Time from request start to response close.\n",
+          name, name, name) == -1) {
+    return -1;
+  }
+  for (j = 0; j < DURATION_BUCKETS; j++) {
+    cum += le_cnt[j];
+    if (put(b, "%s_bucket{le=\"%s\"} %llu\n", name, duration_le[j],
+            (unsigned long long)cum) == -1) {
+      return -1;
+    }
+  }
+  return put(b,
+             "%s_bucket{le=\"+Inf\"} %llu\n%s_count %llu\n"
+             "%s_sum %llu.%06llu\n",
+             name, (unsigned long long)s->latency_count, name,
+             (unsigned long long)s->latency_count, name,
+             (unsigned long long)(s->latency_sum / 1000000),
+             (unsigned long long)(s->latency_sum % 1000000));
+}
+
+static int put_seconds(buffer_t *b, const char *name, const char *type,
+                       const char *help, uint64_t usec) {
+  return put(b,
+             "# TYPE %s %s\n# UNIT %s seconds\n# HELP %s %s\n"
+             "%s%s %llu.%06llu\n",
+             name, type, name, name, help, name,
+             strcmp(type, "counter") ? "" : "_total",
+             (unsigned long long)(usec / 1000000),
+             (unsigned long long)(usec % 1000000));
+}
+
+static int put_loop(buffer_t *b, stats_slot_t *s) {
+  static const char *name = "meinheld_loop_stall_seconds";
+  uint64_t cum = 0;
+  int i;
+
+  if (put_metric(b, "meinheld_loop_iterations", "counter",
+                 "Event loop polls while the lag monitor runs.",
+                 s->loop_iterations) == -1 ||
+      put_seconds(b, "meinheld_loop_busy_seconds", "counter",
+                  "Time the event loop spent running callbacks.",
+                  s->loop_busy) == -1 ||
+      put_seconds(b, "meinheld_loop_lag_max_seconds", "gauge",
+                  "Longest run of the event loop between two polls.",
+                  s->loop_lag_max) == -1 ||
+      put(b,
+          "# TYPE %s histogram\n# UNIT %s seconds\n"
+          "# HELP %s Callbacks blocking the event loop over the threshold.\n",
+          name, name, name) == -1) {
+    return -1;
+  }
+  for (i = 0; i < STATS_STALL_BUCKETS - 1; i++) {
+    cum += s->stall[i];
+    if (put(b, "%s_bucket{le=\"%s\"} %llu\n", name, stall_le[i],
+            (unsigned long long)cum) == -1) {
+      return -1;
+    }
+  }
+  return put(b,
+             "%s_bucket{le=\"+Inf\"} %llu\n%s_count %llu\n"
+             "%s_sum %llu.%06llu\n",
+             name, (unsigned long long)s->stall_count, name,
+             (unsigned long long)s->stall_count, name,
+             (unsigned long long)(s->stall_sum / 1000000),
+             (unsigned long long)(s->stall_sum % 1000000));
+}
+
+static int render_metrics(buffer_t *b) {
+  static const char *classes[] = {"other", "1xx", "2xx", "3xx", "4xx", "5xx"};
+  stats_slot_t total;
+  uint32_t workers;
+  int i;
+
+  workers = stats_sum(&total);
+  if (put_metric(b, "meinheld_workers", "gauge", "Workers sharing the stats.",
+                 workers) == -1 ||
+      put_metric(b, "meinheld_connections_accepted", "counter",
+                 "Accepted connections.", total.accepted) == -1 ||
+      put_metric(b, "meinheld_connections", "gauge", "Open connections.",
+                 total.active) == -1 ||
+      put_metric(b, "meinheld_inflight_requests", "gauge",
+                 "Running WSGI calls.", total.inflight) == -1 ||
+      put_metric(b, "meinheld_suspended_greenlets", "gauge",
+                 "Suspended greenlets.", total.suspended) == -1 ||
+      put_metric(b, "meinheld_accept_paused", "gauge",
+                 "Workers not accepting connections.", total.paused) == -1 ||
+      put_metric(b, "meinheld_keepalive_reuse", "counter",
+                 "Connections kept open for another request.",
+                 total.keepalive_reuse) == -1 ||
+      put_metric(b, "meinheld_pipelined_requests", "counter",
+                 "Requests served from the pipeline queue.",
+                 total.pipelined) == -1 ||
+      put_metric(b, "meinheld_received_bytes", "counter",
+                 "Bytes read from clients.", total.bytes_in) == -1 ||
+      put_metric(b, "meinheld_sent_bytes", "counter", "Bytes sent to clients.",
+                 total.bytes_out) == -1 ||
+      put_metric(b, "meinheld_shed_requests", "counter",
+                 "Requests rejected by admission control.", total.shed) == -1 ||
+      put_metric(b, "meinheld_codel_drops", "counter",
+                 "Requests dropped by queue delay.", total.codel_drops) == -1 ||
+      put_metric(b, "meinheld_greenlet_pool_hits", "counter",
+                 "Requests run on a pooled greenlet.", total.pool_hits) == -1 ||
+      put_metric(b, "meinheld_greenlet_pool_misses", "counter",
+                 "Greenlets created for the pool.", total.pool_misses) == -1 ||
+      put_metric(b, "meinheld_greenlet_pool_idle", "gauge",
+                 "Parked pool greenlets.", total.pool_idle) == -1 ||
+      put_metric(b, "meinheld_thread_pool_jobs", "counter",
+                 "Calls finished on the thread pool.", total.thread_jobs) ==
+          -1 ||
+      put_metric(b, "meinheld_thread_pool_queued", "gauge",
+                 "Calls waiting for a pool thread.", total.thread_queued) ==
+          -1 ||
+      put_metric(b, "meinheld_thread_pool_running", "gauge",
+                 "Calls running on a pool thread.", total.thread_running) ==
+          -1 ||
+      put_metric(b, "meinheld_thread_pool_rejected", "counter",
+                 "Calls refused by the thread queue limit.",
+                 total.thread_rejected) == -1 ||
+      put_metric(b, "meinheld_slow_writes", "counter",
+                 "Responses cut by the write timeout or min send rate.",
+                 total.slow_writes) == -1 ||
+      put_metric(b, "meinheld_zerocopy_sends", "counter",
+                 "MSG_ZEROCOPY sends.", total.zerocopy_sends) == -1 ||
+      put_metric(b, "meinheld_zerocopy_copied", "counter",
+                 "Sockets the kernel copied zerocopy sends on.",
+                 total.zerocopy_copied) == -1 ||
+      put_metric(b, "meinheld_tls_handshakes", "counter",
+                 "TLS connections handed to the kernel.",
+                 total.tls_handshakes) == -1 ||
+      put_metric(b, "meinheld_tls_resumed", "counter",
+                 "TLS handshakes that resumed a session.",
+                 total.tls_resumed) == -1 ||
+      put_metric(b, "meinheld_tls_failed", "counter",
+                 "TLS handshakes that failed or got no kernel TLS.",
+                 total.tls_failed) == -1) {
+    return -1;
+  }
+  if (put(b,
+          "# TYPE meinheld_requests counter\n"
+          "# HELP meinheld_requests Finished requests by status class.\n") ==
+      -1) {
+    return -1;
+  }
+  for (i = STATS_STATUS_1XX; i <= STATS_STATUS_5XX; i++) {
+    if (put(b, "meinheld_requests_total{code=\"%s\"} %llu\n", classes[i],
+            (unsigned long long)total.status[i]) == -1) {
+      return -1;
+    }
+  }
+  if (put(b, "meinheld_requests_total{code=\"%s\"} %llu\n", classes[0],
+          (unsigned long long)total.status[STATS_STATUS_OTHER]) == -1 ||
+      put_duration(b, &total) == -1 || put_loop(b, &total) == -1 ||
+      put(b, "# EOF\n") == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+static int set_response(admin_conn_t *conn, const char *status,
+                        const char *content_type, buffer_t *body, int head) {
+  buffer_t *res;
+  size_t len = body ? body->len : 0;
+
+  res = new_buffer(len + 256, 0);
+  if (put(res,
+          "HTTP/1.1 %s\r\nServer: " SERVER
+          "\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+          "Connection: close\r\n\r\n",
+          status, content_type, len) == -1 ||
+      (!head && body && write2buf(res, body->buf, len) != WRITE_OK)) {
+    free_buffer(res);
+    return -1;
+  }
+  conn->res = res;
+  conn->sent = 0;
+  return 0;
+}
+
+static int set_text_response(admin_conn_t *conn, const char *status,
+                             const char *text, int head) {
+  buffer_t *body;
+  int ret;
+
+  body = new_buffer(64, 0);
+  if (write2buf(body, text, strlen(text)) != WRITE_OK) {
+    free_buffer(body);
+    return -1;
+  }
+  ret = set_response(conn, status, TEXT_TYPE, body, head);
+  free_buffer(body);
+  return ret;
+}
+
+static int handle_request(admin_conn_t *conn) {
+  char *method = conn->req, *path, *end;
+  size_t path_len;
+  buffer_t *body;
+  int head, ret;
+
+  path = strchr(method, ' ');
+  if (path == NULL) {
+    return set_text_response(conn, "400 Bad Request", "bad request\n", 0);
+  }
+  *path++ = '\0';
+  path_len = strcspn(path, " ?\r\n");
+  end = path + path_len;
+  *end = '\0';
+
+  head = !strcmp(method, "HEAD");
+  if (!head && strcmp(method, "GET")) {
+    return set_text_response(conn, "405 Method Not Allowed",
+                             "method not allowed\n", 0);
+  }
+  if (!strcmp(path, "/healthz")) {
+    if (draining) {
+      return set_text_response(conn, "503 Service Unavailable", "draining\n",
+                               head);
+    }
+    return set_text_response(conn, "200 OK", "ok\n", head);
+  }
+  if (!strcmp(path, "/metrics")) {
+    body = new_buffer(4096, 0);
+    if (render_metrics(body) == -1) {
+      free_buffer(body);
+      return -1;
+    }
+    ret = set_response(conn, "200 OK", OPENMETRICS_TYPE, body, head);
+    free_buffer(body);
+    return ret;
+  }
+  return set_text_response(conn, "404 Not Found", "not found\n", head);
+}
+
+static void send_response(picoev_loop *loop, admin_conn_t *conn) {
+  ssize_t r;
+
+  while (conn->sent < conn->res->len) {
+    r = write(conn->fd, conn->res->buf + conn->sent,
+              conn->res->len - conn->sent);
+    if (r == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        picoev_set_events(loop, conn->fd, PICOEV_WRITE);
+        return;
+      }
+      break;
+    }
+    conn->sent += r;
+  }
+  close_conn(loop, conn);
+}
+
+static void read_request(picoev_loop *loop, admin_conn_t *conn) {
+  ssize_t r;
+
+  r = read(conn->fd, conn->req + conn->len, ADMIN_REQ_SIZE - 1 - conn->len);
+  if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return;
+  }
+  if (r <= 0) {
+    close_conn(loop, conn);
+    return;
+  }
+  conn->len += r;
+  conn->req[conn->len] = '\0';
+
+  if (strstr(conn->req, "\r\n\r\n") || strstr(conn->req, "\n\n")) {
+    if (handle_request(conn) == -1) {
+      PyErr_Clear();
+      close_conn(loop, conn);
+      return;
+    }
+  } else if (conn->len == ADMIN_REQ_SIZE - 1) {
+    if (set_text_response(conn, "431 Request Header Fields Too Large",
+                          "request too large\n", 0) == -1) {
+      PyErr_Clear();
+      close_conn(loop, conn);
+      return;
+    }
+  } else {
+    return;
+  }
+  send_response(loop, conn);
+}
+
+static void conn_callback(picoev_loop *loop, int fd, int events,
+                          void *cb_arg) {
+  admin_conn_t *conn = (admin_conn_t *)cb_arg;
+
+  if ((events & PICOEV_TIMEOUT) != 0) {
+    close_conn(loop, conn);
+  } else if ((events & PICOEV_WRITE) != 0) {
+    send_response(loop, conn);
+  } else if ((events & PICOEV_READ) != 0) {
+    read_request(loop, conn);
+  }
+}
+
+static void accept_callback(picoev_loop *loop, int fd, int events,
+                            void *cb_arg) {
+  admin_conn_t *conn;
+  int client_fd, i;
+
+  if ((events & PICOEV_READ) == 0) {
+    return;
+  }
+  for (i = 0; i < 8; ++i) {
+#if linux && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    client_fd = accept(fd, NULL, NULL);
+    if (client_fd != -1) {
+      fcntl(client_fd, F_SETFL, O_NONBLOCK);
+    }
+#endif
+    if (client_fd == -1) {
+      return;
+    }
+    conn = (admin_conn_t *)PyMem_Malloc(sizeof(admin_conn_t));
+    if (conn == NULL) {
+      close(client_fd);
+      return;
+    }
+    conn->fd = client_fd;
+    conn->len = 0;
+    conn->res = NULL;
+    conn->sent = 0;
+    conn->next = conns;
+    conns = conn;
+    // not counted as active, the admin listener never keeps the loop alive
+    if (picoev_add(loop, client_fd, PICOEV_READ, ADMIN_TIMEOUT_SECS,
+                   conn_callback, (void *)conn) != 0) {
+      // not watched, e.g. the fd is beyond max_fd
+      close_conn(NULL, conn);
+    }
+  }
+}
+
+int admin_start(picoev_loop *loop) {
+  if (admin_sock == -1) {
+    return 0;
+  }
+  draining = 0;
+  if (picoev_is_active(loop, admin_sock)) {
+    return 0;
+  }
+  return picoev_add(loop, admin_sock, PICOEV_READ, 0, accept_callback, NULL);
+}
+
+/* report unhealthy while shutting down */
+void admin_drain(void) { draining = 1; }
+
+void admin_stop(picoev_loop *loop) {
+  while (conns) {
+    close_conn(loop, conns);
+  }
+  if (admin_sock == -1) {
+    return;
+  }
+  if (loop && picoev_is_active(loop, admin_sock)) {
+    picoev_del(loop, admin_sock);
+  }
+  close(admin_sock);
+  admin_sock = -1;
+  if (admin_sock_name) {
+    unlink(admin_sock_name);
+    free(admin_sock_name);
+    admin_sock_name = NULL;
+  }
+}
@@ -0,0 +1,17 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include "meinheld.h"
+#include "picoev.h"
+
+int admin_listen_inet(const char *host, int port);
+
+int admin_listen_unix(const char *path);
+
+int admin_start(picoev_loop *loop);
+
+void admin_drain(void);
+
+void admin_stop(picoev_loop *loop);
+
+#endif
@@ -0,0 +1,180 @@
+#include "capture.h"
+
+#include "time_cache.h"
+#include "util.h"
+
+#define CAPTURE_BUF_SIZE 1024 * 64
+#define CAPTURE_FLUSH_MSEC 1000
+
+int capture_fd = -1;
+uint32_t capture_requests = 0;
+
+static char capture_buf[CAPTURE_BUF_SIZE];
+static size_t capture_buf_len = 0;
+static uintptr_t capture_flush_msec = 0;
+
+static uint64_t capture_start = 0;
+static uint64_t capture_written = 0;
+static uint64_t capture_max_bytes = 0;  // 0 is unlimited
+static uint32_t capture_next_conn = 0;
+
+static int write_all(const char *data, size_t len) {
+  ssize_t r;
+
+  while (len > 0) {
+    r = write(capture_fd, data, len);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += r;
+    len -= r;
+  }
+  return 1;
+}
+
+static void put_u16(char *p, uint16_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+}
+
+static void put_u32(char *p, uint32_t v) {
+  put_u16(p, v & 0xffff);
+  put_u16(p + 2, v >> 16);
+}
+
+static void put_u64(char *p, uint64_t v) {
+  put_u32(p, v & 0xffffffff);
+  put_u32(p + 4, v >> 32);
+}
+
+/* stop capturing, the file is kept */
+static void stop_capture(void) {
+  flush_capture();
+  close(capture_fd);
+  capture_fd = -1;
+}
+
+static void put_record(uint32_t conn, uint8_t type, uint32_t requests,
+                       const char *data, size_t len) {
+  char *p;
+  size_t size = CAPTURE_RECORD_SIZE + len;
+
+  if (capture_max_bytes && capture_written + size > capture_max_bytes) {
+    DEBUG("capture limit %llu bytes reached",
+          (unsigned long long)capture_max_bytes);
+    stop_capture();
+    return;
+  }
+  if (capture_buf_len + CAPTURE_RECORD_SIZE > CAPTURE_BUF_SIZE) {
+    flush_capture();
+  }
+  p = capture_buf + capture_buf_len;
+  put_u32(p, conn);
+  p[4] = type;
+  p[5] = 0;
+  put_u16(p + 6, requests > 0xffff ? 0xffff : requests);
+  put_u64(p + 8, get_current_usec() - capture_start);
+  put_u32(p + 16, len);
+  capture_buf_len += CAPTURE_RECORD_SIZE;
+  capture_written += size;
+
+  if (capture_buf_len + len > CAPTURE_BUF_SIZE) {
+    // large reads go straight to the file
+    flush_capture();
+    if (capture_fd >= 0 && write_all(data, len) < 0) {
+      stop_capture();
+    }
+    return;
+  }
+  if (len > 0) {
+    memcpy(capture_buf + capture_buf_len, data, len);
+    capture_buf_len += len;
+  }
+}
+
+int set_capture(const char *path, uint64_t max_bytes) {
+  char header[CAPTURE_HEADER_SIZE];
+  int fd;
+
+  if (capture_fd >= 0) {
+    stop_capture();
+  }
+  if (path == NULL) {
+    return 1;
+  }
+
+  fd = open(path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    return -1;
+  }
+  capture_fd = fd;
+  capture_start = get_current_usec();
+  capture_max_bytes = max_bytes;
+  capture_next_conn = 0;
+  capture_requests = 0;
+  capture_buf_len = 0;
+  capture_flush_msec = current_msec;
+
+  memcpy(header, CAPTURE_MAGIC, 8);
+  put_u64(header + 8, capture_start);
+  if (write_all(header, sizeof(header)) < 0) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    close(fd);
+    capture_fd = -1;
+    return -1;
+  }
+  capture_written = sizeof(header);
+  return 1;
+}
+
+int is_capture_enabled(void) { return capture_fd >= 0; }
+
+uint32_t capture_open(void) {
+  uint32_t conn;
+
+  if (capture_fd < 0) {
+    return 0;
+  }
+  if (++capture_next_conn == 0) {
+    capture_next_conn = 1;
+  }
+  conn = capture_next_conn;
+  put_record(conn, CAPTURE_OPEN, 0, NULL, 0);
+  return conn;
+}
+
+void capture_data(uint32_t conn, const char *buf, size_t len) {
+  if (conn != 0 && capture_fd >= 0) {
+    put_record(conn, CAPTURE_DATA, capture_requests, buf, len);
+  }
+  capture_requests = 0;
+}
+
+void capture_close(uint32_t conn) {
+  if (conn != 0 && capture_fd >= 0) {
+    put_record(conn, CAPTURE_CLOSE, 0, NULL, 0);
+  }
+}
+
+int flush_capture(void) {
+  int ret = 1;
+
+  if (capture_buf_len > 0 && capture_fd >= 0) {
+    DEBUG("flush capture %d bytes", (int)capture_buf_len);
+    ret = write_all(capture_buf, capture_buf_len);
+  }
+  capture_buf_len = 0;
+  capture_flush_msec = current_msec;
+  return ret;
+}
+
+void flush_capture_if_due(void) {
+  if (capture_buf_len > 0 &&
+      current_msec - capture_flush_msec >= CAPTURE_FLUSH_MSEC) {
+    flush_capture();
+  }
+}
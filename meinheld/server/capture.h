@@ -0,0 +1,54 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "meinheld.h"
+
+/**
+ * Traffic capture.
+ *
+ * Records the raw request bytes read by read_request, per connection and
+ * with timing, into a compact binary file that bench/replay.py plays back.
+ * All integers are little endian.
+ *
+ *   header  "MHCAP001" | u64 start (usec since the epoch)
+ *   record  u32 conn | u8 type | u8 0 | u16 requests | u64 offset (usec
+ *           since start) | u32 len | len bytes
+ *
+ * type is CAPTURE_OPEN, CAPTURE_DATA or CAPTURE_CLOSE. requests is the number
+ * of requests completed by a DATA record, so the replayer knows where a
+ * response is due without parsing the requests itself.
+ *
+ * Records are buffered and written when the buffer is full, once a second
+ * from the loop and when the loop ends. Only HTTP traffic is captured, bytes
+ * read after a protocol upgrade are not.
+ */
+
+#define CAPTURE_MAGIC "MHCAP001"
+#define CAPTURE_HEADER_SIZE 16
+#define CAPTURE_RECORD_SIZE 20
+
+#define CAPTURE_OPEN 1
+#define CAPTURE_DATA 2
+#define CAPTURE_CLOSE 3
+
+extern int capture_fd;
+
+// requests completed since the last capture_data
+extern uint32_t capture_requests;
+
+int set_capture(const char *path, uint64_t max_bytes);
+
+int is_capture_enabled(void);
+
+/* start a connection, return its id (0 if not captured) */
+uint32_t capture_open(void);
+
+void capture_data(uint32_t conn, const char *buf, size_t len);
+
+void capture_close(uint32_t conn);
+
+int flush_capture(void);
+
+void flush_capture_if_due(void);
+
+#endif
@@ -29,9 +29,26 @@ typedef struct _client {
   uint8_t content_length_set;  // content_length_set flag
   uint64_t content_length;     // content_length
   uint64_t write_bytes;        // send body length
-  void *bucket;                // write_data
+  void *bucket;                // output queue head, a write_bucket chain
+  void *bucket_tail;           // output queue tail
+  uint64_t queued;             // bytes in the output queue
+  uint8_t body_done;           // the whole body is queued
+  uint64_t sent_bytes;         // bytes written for this response
+  uint64_t blocked_usec;       // the response first waited for the socket
+  uint64_t blocked_sent;       // sent_bytes at blocked_usec
+  uint64_t wait_usec;          // the current wait for the socket started
+  void *zc;                    // zerocopy state, see zerocopy.h
+  int source_fd;               // fd of a spliced response body
+  uint8_t wait_source;         // the response waits for source_fd to read
+  void *ssl;                   // SSL while the TLS handshake runs
+  uint8_t tls;                 // HTTPS, the kernel does the TLS records
   uint8_t response_closed;     // response closed flag
   uint8_t use_cork;            // use TCP_CORK
+  uint8_t inflight;            // counted as in-flight wsgi call
+  uint64_t accept_usec;        // connection accepted
+  uint32_t capture_id;         // capture connection id, 0 if not captured
+  uint8_t so_keepalive;        // SO_KEEPALIVE set by a suspend
+  struct _client *pool_next;   // greenlet pool ready queue
 } client_t;
 
 typedef struct {
@@ -0,0 +1,69 @@
+#include "codel.h"
+
+#include <math.h>
+
+void codel_reset(codel_t *c) {
+  c->first_above_time = 0;
+  c->drop_next = 0;
+  c->count = 0;
+  c->last_count = 0;
+  c->dropping = 0;
+}
+
+/* next drop time, interval / sqrt(count) */
+static inline uint64_t control_law(codel_t *c, uint64_t t) {
+  return t + (uint64_t)(c->interval_usec / sqrt((double)c->count));
+}
+
+/* the delay must stay above target for an interval before dropping */
+static int ok_to_drop(codel_t *c, uint64_t sojourn_usec, uint64_t now_usec) {
+  if (sojourn_usec < c->target_usec) {
+    c->first_above_time = 0;
+    return 0;
+  }
+  if (c->first_above_time == 0) {
+    c->first_above_time = now_usec + c->interval_usec;
+    return 0;
+  }
+  return now_usec >= c->first_above_time;
+}
+
+/**
+ * return 1 when the request should be rejected
+ *
+ * sojourn_usec is the time the request waited between being read and being
+ * dispatched to the application.
+ */
+int codel_should_drop(codel_t *c, uint64_t sojourn_usec, uint64_t now_usec) {
+  uint32_t delta;
+  int drop = ok_to_drop(c, sojourn_usec, now_usec);
+
+  if (c->dropping) {
+    if (!drop) {
+      // delay went below target, leave dropping state
+      c->dropping = 0;
+      return 0;
+    }
+    if (now_usec < c->drop_next) {
+      return 0;
+    }
+    c->count++;
+    c->drop_next = control_law(c, c->drop_next);
+  } else {
+    if (!drop) {
+      return 0;
+    }
+    c->dropping = 1;
+    // start from the previous drop rate if we were dropping recently
+    delta = c->count - c->last_count;
+    if (delta > 1 && now_usec - c->drop_next < 16 * c->interval_usec) {
+      c->count = delta;
+    } else {
+      c->count = 1;
+    }
+    c->last_count = c->count;
+    c->drop_next = control_law(c, now_usec);
+  }
+  c->drop_cnt++;
+  return 1;
+}
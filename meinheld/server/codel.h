@@ -0,0 +1,27 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include "meinheld.h"
+
+/**
+ * CoDel (Controlled Delay) state.
+ *
+ * see http://queue.acm.org/detail.cfm?id=2209336
+ * and RFC 8289
+ */
+typedef struct {
+  uint64_t target_usec;       // acceptable standing queue delay
+  uint64_t interval_usec;     // window the delay must stay above target
+  uint64_t first_above_time;  // time the delay went above target + interval
+  uint64_t drop_next;         // next time to drop while dropping
+  uint32_t count;             // drops since entering dropping state
+  uint32_t last_count;
+  uint8_t dropping;
+  uint64_t drop_cnt;  // total drops
+} codel_t;
+
+void codel_reset(codel_t *c);
+
+int codel_should_drop(codel_t *c, uint64_t sojourn_usec, uint64_t now_usec);
+
+#endif
@@ -0,0 +1,560 @@
+#include "greensocket.h"
+
+#include <math.h>
+#include <sys/socket.h>
+
+#include "resolver.h"
+#include "server.h"
+
+#ifdef PY3
+#define BUFFER_FORMAT "y*"
+#else
+#define BUFFER_FORMAT "s*"
+#endif
+
+#define WOULD_BLOCK(e) ((e) == EAGAIN || (e) == EWOULDBLOCK)
+
+typedef ssize_t (*io_func)(int fd, void *buf, size_t len, int flags);
+
+static PyObject *socket_error = NULL;
+static PyObject *socket_timeout = NULL;
+
+static PyObject *connect_ex_str = NULL;
+static PyObject *recvfrom_str = NULL;
+static PyObject *recvfrom_into_str = NULL;
+static PyObject *sendto_str = NULL;
+
+static double monotonic(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int sock_fd(GreenSocketObject *self) {
+  int fd;
+
+  if (self->sock == NULL) {
+    PyErr_SetString(PyExc_AttributeError, "_sock");
+    return -1;
+  }
+  fd = PyObject_AsFileDescriptor(self->sock);
+  if (fd < 0 && PyErr_ExceptionMatches(PyExc_ValueError)) {
+    // closed
+    PyErr_Clear();
+    errno = EBADF;
+    PyErr_SetFromErrno(socket_error);
+  }
+  return fd;
+}
+
+static int set_error(int err) {
+  PyObject *v;
+
+  v = Py_BuildValue("(is)", err, strerror(err));
+  if (v != NULL) {
+    PyErr_SetObject(socket_error, v);
+    Py_DECREF(v);
+  }
+  return -1;
+}
+
+/* wait until fd is ready, the deadline is set by the first wait */
+static int sock_wait(GreenSocketObject *self, int fd, int event,
+                     double *deadline) {
+  double left;
+  int timeout = 0;
+
+  if (self->timeout > 0) {
+    if (*deadline == 0) {
+      *deadline = monotonic() + self->timeout;
+    }
+    left = *deadline - monotonic();
+    if (left <= 0) {
+      PyErr_SetString(socket_timeout, "timed out");
+      return -1;
+    }
+    timeout = (int)ceil(left);
+  }
+  return green_wait(fd, event, timeout);
+}
+
+static ssize_t do_recv(int fd, void *buf, size_t len, int flags) {
+  return recv(fd, buf, len, flags);
+}
+
+static ssize_t do_send(int fd, void *buf, size_t len, int flags) {
+  return send(fd, buf, len, flags);
+}
+
+static ssize_t green_io(GreenSocketObject *self, int event, io_func func,
+                        void *buf, size_t len, int flags, double *deadline) {
+  ssize_t n;
+  int fd;
+
+  while (1) {
+    // again after every wait, the socket may be closed meanwhile
+    fd = sock_fd(self);
+    if (fd < 0) {
+      return -1;
+    }
+    n = func(fd, buf, len, flags);
+    if (n >= 0) {
+      return n;
+    }
+    if (errno == EINTR) {
+      if (PyErr_CheckSignals()) {
+        return -1;
+      }
+      continue;
+    }
+    if (!WOULD_BLOCK(errno) || self->timeout == 0) {
+      PyErr_SetFromErrno(socket_error);
+      return -1;
+    }
+    if (sock_wait(self, fd, event, deadline) < 0) {
+      return -1;
+    }
+  }
+}
+
+static int would_block(void) {
+#ifdef PY3
+  return PyErr_ExceptionMatches(PyExc_BlockingIOError);
+#else
+  PyObject *type, *value, *tb, *err;
+  long e = 0;
+
+  if (!PyErr_ExceptionMatches(socket_error)) {
+    return 0;
+  }
+  PyErr_Fetch(&type, &value, &tb);
+  PyErr_NormalizeException(&type, &value, &tb);
+  if (value != NULL) {
+    err = PyObject_GetAttrString(value, "errno");
+    if (err != NULL) {
+      e = PyInt_Check(err) ? PyInt_AsLong(err) : 0;
+      Py_DECREF(err);
+    }
+  }
+  PyErr_Clear();
+  PyErr_Restore(type, value, tb);
+  return WOULD_BLOCK(e);
+#endif
+}
+
+/* call a method of _sock and retry while it would block */
+static PyObject *green_call(GreenSocketObject *self, PyObject *name,
+                            PyObject *args, int event) {
+  PyObject *method, *res;
+  double deadline = 0;
+  int fd;
+
+  while (1) {
+    fd = sock_fd(self);
+    if (fd < 0) {
+      return NULL;
+    }
+    method = PyObject_GetAttr(self->sock, name);
+    if (method == NULL) {
+      return NULL;
+    }
+    res = PyObject_Call(method, args, NULL);
+    Py_DECREF(method);
+    if (res != NULL || self->timeout == 0 || !would_block()) {
+      return res;
+    }
+    PyErr_Clear();
+    if (sock_wait(self, fd, event, &deadline) < 0) {
+      return NULL;
+    }
+  }
+}
+
+static PyObject *GreenSocket_recv(GreenSocketObject *self, PyObject *args) {
+  PyObject *buf;
+  Py_ssize_t size;
+  ssize_t n;
+  int flags = 0;
+  double deadline = 0;
+
+  if (!PyArg_ParseTuple(args, "n|i:recv", &size, &flags)) {
+    return NULL;
+  }
+  if (size < 0) {
+    PyErr_SetString(PyExc_ValueError, "negative buffersize in recv");
+    return NULL;
+  }
+  buf = PyBytes_FromStringAndSize(NULL, size);
+  if (buf == NULL) {
+    return NULL;
+  }
+  n = green_io(self, PICOEV_READ, do_recv, PyBytes_AS_STRING(buf), size,
+               flags, &deadline);
+  if (n < 0) {
+    Py_DECREF(buf);
+    return NULL;
+  }
+  if (n != size) {
+    _PyBytes_Resize(&buf, n);
+  }
+  return buf;
+}
+
+static PyObject *GreenSocket_recv_into(GreenSocketObject *self,
+                                       PyObject *args, PyObject *kwargs) {
+  Py_buffer view;
+  Py_ssize_t size = 0;
+  ssize_t n;
+  int flags = 0;
+  double deadline = 0;
+  static char *keywords[] = {"buffer", "nbytes", "flags", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "w*|ni:recv_into", keywords,
+                                   &view, &size, &flags)) {
+    return NULL;
+  }
+  if (size < 0 || size > view.len) {
+    PyBuffer_Release(&view);
+    PyErr_SetString(PyExc_ValueError, "nbytes is greater than the buffer");
+    return NULL;
+  }
+  if (size == 0) {
+    size = view.len;
+  }
+  n = green_io(self, PICOEV_READ, do_recv, view.buf, size, flags, &deadline);
+  PyBuffer_Release(&view);
+  if (n < 0) {
+    return NULL;
+  }
+  return PyLong_FromSsize_t(n);
+}
+
+static PyObject *GreenSocket_send(GreenSocketObject *self, PyObject *args) {
+  Py_buffer view;
+  ssize_t n;
+  int flags = 0;
+  double deadline = 0;
+
+  if (!PyArg_ParseTuple(args, BUFFER_FORMAT "|i:send", &view, &flags)) {
+    return NULL;
+  }
+  n = green_io(self, PICOEV_WRITE, do_send, view.buf, view.len, flags,
+               &deadline);
+  PyBuffer_Release(&view);
+  if (n < 0) {
+    return NULL;
+  }
+  return PyLong_FromSsize_t(n);
+}
+
+static PyObject *GreenSocket_sendall(GreenSocketObject *self,
+                                     PyObject *args) {
+  Py_buffer view;
+  char *buf;
+  Py_ssize_t len;
+  ssize_t n = 0;
+  int flags = 0;
+  double deadline = 0;
+
+  if (!PyArg_ParseTuple(args, BUFFER_FORMAT "|i:sendall", &view, &flags)) {
+    return NULL;
+  }
+  buf = view.buf;
+  len = view.len;
+  while (len > 0) {
+    // the timeout is for the whole call
+    n = green_io(self, PICOEV_WRITE, do_send, buf, len, flags, &deadline);
+    if (n < 0) {
+      break;
+    }
+    buf += n;
+    len -= n;
+  }
+  PyBuffer_Release(&view);
+  if (n < 0) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/* (host, port, ...) with the host looked up by the green resolver, so that
+ * connect_ex does not block on getaddrinfo */
+static PyObject *resolve_address(GreenSocketObject *self, PyObject *address) {
+  PyObject *host, *family, *res, *sockaddr;
+  const char *name;
+  long fam;
+
+  if (!PyTuple_Check(address) || PyTuple_GET_SIZE(address) < 2) {
+    goto asis;
+  }
+  host = PyTuple_GET_ITEM(address, 0);
+  if (PyBytes_Check(host)) {
+    name = PyBytes_AS_STRING(host);
+#ifdef PY3
+  } else if (PyUnicode_Check(host)) {
+    name = PyUnicode_AsUTF8(host);
+    if (name == NULL) {
+      return NULL;
+    }
+#endif
+  } else {
+    goto asis;
+  }
+  if (is_numeric_host(name)) {
+    goto asis;
+  }
+  family = PyObject_GetAttrString(self->sock, "family");
+  if (family == NULL) {
+    return NULL;
+  }
+  fam = PyLong_AsLong(family);
+  Py_DECREF(family);
+  if (fam != AF_INET && fam != AF_INET6) {
+    PyErr_Clear();
+    goto asis;
+  }
+  res = resolver_getaddrinfo(host, PyTuple_GET_ITEM(address, 1), (int)fam,
+                             SOCK_STREAM, 0, 0);
+  if (res == NULL) {
+    return NULL;
+  }
+  if (PyList_GET_SIZE(res) == 0) {
+    Py_DECREF(res);
+    goto asis;
+  }
+  sockaddr = PyTuple_GET_ITEM(PyList_GET_ITEM(res, 0), 4);
+  Py_INCREF(sockaddr);
+  Py_DECREF(res);
+  return sockaddr;
+
+asis:
+  Py_INCREF(address);
+  return address;
+}
+
+static PyObject *GreenSocket_connect(GreenSocketObject *self,
+                                     PyObject *address) {
+  PyObject *res;
+  socklen_t len;
+  long err;
+  int fd, so_err;
+  double deadline = 0;
+
+  if (self->timeout == 0) {
+    return PyObject_CallMethod(self->sock, "connect", "O", address);
+  }
+  address = resolve_address(self, address);
+  if (address == NULL) {
+    return NULL;
+  }
+  while (1) {
+    fd = sock_fd(self);
+    if (fd < 0) {
+      break;
+    }
+    // connect_ex reports errno without raising, gaierror is still raised
+    res = PyObject_CallMethodObjArgs(self->sock, connect_ex_str, address,
+                                     NULL);
+    if (res == NULL) {
+      break;
+    }
+    err = PyLong_AsLong(res);
+    Py_DECREF(res);
+    if (err == -1 && PyErr_Occurred()) {
+      break;
+    }
+    if (err == 0 || err == EISCONN) {
+      Py_DECREF(address);
+      Py_RETURN_NONE;
+    }
+    if (err == EINTR) {
+      continue;
+    }
+    if (err != EINPROGRESS && err != EALREADY && !WOULD_BLOCK(err)) {
+      set_error(err);
+      break;
+    }
+    if (sock_wait(self, fd, PICOEV_WRITE, &deadline) < 0) {
+      break;
+    }
+    so_err = 0;
+    len = sizeof(so_err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_err, &len) == 0 && so_err) {
+      set_error(so_err);
+      break;
+    }
+  }
+  Py_DECREF(address);
+  return NULL;
+}
+
+static PyObject *GreenSocket_recvfrom(GreenSocketObject *self,
+                                      PyObject *args) {
+  return green_call(self, recvfrom_str, args, PICOEV_READ);
+}
+
+static PyObject *GreenSocket_recvfrom_into(GreenSocketObject *self,
+                                           PyObject *args) {
+  return green_call(self, recvfrom_into_str, args, PICOEV_READ);
+}
+
+static PyObject *GreenSocket_sendto(GreenSocketObject *self, PyObject *args) {
+  return green_call(self, sendto_str, args, PICOEV_WRITE);
+}
+
+static PyObject *GreenSocket_get_timeout(GreenSocketObject *self,
+                                         void *closure) {
+  if (self->timeout < 0) {
+    Py_RETURN_NONE;
+  }
+  return PyFloat_FromDouble(self->timeout);
+}
+
+static int GreenSocket_set_timeout(GreenSocketObject *self, PyObject *value,
+                                   void *closure) {
+  double timeout;
+
+  if (value == NULL) {
+    PyErr_SetString(PyExc_TypeError, "can't delete timeout");
+    return -1;
+  }
+  if (value == Py_None) {
+    self->timeout = -1;
+    return 0;
+  }
+  timeout = PyFloat_AsDouble(value);
+  if (timeout == -1 && PyErr_Occurred()) {
+    return -1;
+  }
+  if (timeout < 0) {
+    PyErr_SetString(PyExc_ValueError, "Timeout value out of range");
+    return -1;
+  }
+  self->timeout = timeout;
+  return 0;
+}
+
+static PyObject *GreenSocket_new(PyTypeObject *type, PyObject *args,
+                                 PyObject *kwargs) {
+  GreenSocketObject *self;
+
+  self = (GreenSocketObject *)type->tp_alloc(type, 0);
+  if (self != NULL) {
+    self->timeout = -1;
+  }
+  return (PyObject *)self;
+}
+
+static int GreenSocket_traverse(GreenSocketObject *self, visitproc visit,
+                                void *arg) {
+  Py_VISIT(self->sock);
+  return 0;
+}
+
+static int GreenSocket_clear(GreenSocketObject *self) {
+  Py_CLEAR(self->sock);
+  return 0;
+}
+
+static void GreenSocket_dealloc(GreenSocketObject *self) {
+  PyObject_GC_UnTrack(self);
+  Py_CLEAR(self->sock);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyMethodDef GreenSocket_methods[] = {
+    {"recv", (PyCFunction)GreenSocket_recv, METH_VARARGS,
+     "recv(bufsize[, flags])"},
+    {"recv_into", (PyCFunction)GreenSocket_recv_into,
+     METH_VARARGS | METH_KEYWORDS, "recv_into(buffer[, nbytes[, flags]])"},
+    {"send", (PyCFunction)GreenSocket_send, METH_VARARGS,
+     "send(data[, flags])"},
+    {"sendall", (PyCFunction)GreenSocket_sendall, METH_VARARGS,
+     "sendall(data[, flags])"},
+    {"connect", (PyCFunction)GreenSocket_connect, METH_O, "connect(address)"},
+    {"recvfrom", (PyCFunction)GreenSocket_recvfrom, METH_VARARGS,
+     "recvfrom(bufsize[, flags])"},
+    {"recvfrom_into", (PyCFunction)GreenSocket_recvfrom_into, METH_VARARGS,
+     "recvfrom_into(buffer[, nbytes[, flags]])"},
+    {"sendto", (PyCFunction)GreenSocket_sendto, METH_VARARGS,
+     "sendto(data[, flags], address)"},
+    {NULL, NULL}};
+
+static PyMemberDef GreenSocket_members[] = {
+    {"_sock", T_OBJECT_EX, offsetof(GreenSocketObject, sock), 0,
+     "the nonblocking _socket.socket"},
+    {NULL}};
+
+static PyGetSetDef GreenSocket_getset[] = {
+    {"timeout", (getter)GreenSocket_get_timeout,
+     (setter)GreenSocket_set_timeout, "seconds or None", NULL},
+    {NULL}};
+
+PyTypeObject GreenSocketType = {
+#ifdef PY3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL) 0, /* ob_size */
+#endif
+        "meinheld.server.GreenSocket",  /*tp_name*/
+    sizeof(GreenSocketObject),          /*tp_basicsize*/
+    0,                                  /*tp_itemsize*/
+    (destructor)GreenSocket_dealloc,    /*tp_dealloc*/
+    0,                                  /*tp_print*/
+    0,                                  /*tp_getattr*/
+    0,                                  /*tp_setattr*/
+    0,                                  /*tp_compare*/
+    0,                                  /*tp_repr*/
+    0,                                  /*tp_as_number*/
+    0,                                  /*tp_as_sequence*/
+    0,                                  /*tp_as_mapping*/
+    0,                                  /*tp_hash */
+    0,                                  /*tp_call*/
+    0,                                  /*tp_str*/
+    0,                                  /*tp_getattro*/
+    0,                                  /*tp_setattro*/
+    0,                                  /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+    "cooperative socket operations, base of msocket.socket", /* tp_doc */
+    (traverseproc)GreenSocket_traverse,                      /* tp_traverse */
+    (inquiry)GreenSocket_clear,                              /* tp_clear */
+    0,                   /* tp_richcompare */
+    0,                   /* tp_weaklistoffset */
+    0,                   /* tp_iter */
+    0,                   /* tp_iternext */
+    GreenSocket_methods, /* tp_methods */
+    GreenSocket_members, /* tp_members */
+    GreenSocket_getset,  /* tp_getset */
+    0,                   /* tp_base */
+    0,                   /* tp_dict */
+    0,                   /* tp_descr_get */
+    0,                   /* tp_descr_set */
+    0,                   /* tp_dictoffset */
+    0,                   /* tp_init */
+    0,                   /* tp_alloc */
+    GreenSocket_new,     /* tp_new */
+};
+
+int init_greensocket(void) {
+  PyObject *m;
+
+  m = PyImport_ImportModule("_socket");
+  if (m == NULL) {
+    return -1;
+  }
+  socket_error = PyObject_GetAttrString(m, "error");
+  socket_timeout = PyObject_GetAttrString(m, "timeout");
+  Py_DECREF(m);
+  if (socket_error == NULL || socket_timeout == NULL) {
+    return -1;
+  }
+  connect_ex_str = NATIVE_FROMSTRING("connect_ex");
+  recvfrom_str = NATIVE_FROMSTRING("recvfrom");
+  recvfrom_into_str = NATIVE_FROMSTRING("recvfrom_into");
+  sendto_str = NATIVE_FROMSTRING("sendto");
+  if (connect_ex_str == NULL || recvfrom_str == NULL ||
+      recvfrom_into_str == NULL || sendto_str == NULL) {
+    return -1;
+  }
+  return PyType_Ready(&GreenSocketType);
+}
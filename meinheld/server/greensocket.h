@@ -0,0 +1,26 @@
+#ifndef GREENSOCKET_H
+#define GREENSOCKET_H
+
+#include "meinheld.h"
+
+/**
+ * Base type of msocket.socket.
+ *
+ * Holds the nonblocking _socket.socket in _sock and the timeout. recv,
+ * recv_into, send, sendall and connect call the syscall directly and, when
+ * it would block, wait for the fd in the loop through green_wait and retry,
+ * so no exception is raised on the way. connect looks a host name up with
+ * the green resolver first. recvfrom, recvfrom_into and sendto go through
+ * _sock as they need the address conversions of the socket module.
+ */
+
+typedef struct {
+  PyObject_HEAD PyObject *sock;  // _socket.socket
+  double timeout;                // seconds, < 0 is None
+} GreenSocketObject;
+
+extern PyTypeObject GreenSocketType;
+
+int init_greensocket(void);
+
+#endif
@@ -26,7 +26,7 @@ PyObject *greenlet_new(PyObject *o, PyObject *parent) {
   return (PyObject *)PyGreenlet_New(o, (PyGreenlet *)parent);
 }
 
-PyObject *greenlet_setparent(PyObject *g, PyObject *parent) {
+int greenlet_setparent(PyObject *g, PyObject *parent) {
   import_greenlet();
   return PyGreenlet_SetParent((PyGreenlet *)g, (PyGreenlet *)parent);
 }
@@ -85,3 +85,10 @@ PyObject *get_greenlet_dict(PyObject *o) {
   Py_INCREF(g->dict);
   return g->dict;
 }
+
+void clear_greenlet_dict(PyObject *o) {
+  PyGreenlet *g = (PyGreenlet *)o;
+  if (g->dict != NULL) {
+    PyDict_Clear(g->dict);
+  }
+}
@@ -0,0 +1,892 @@
+#include "greensync.h"
+
+#include <math.h>
+
+#include "server.h"
+
+#define WAIT_PARKED 0
+#define WAIT_WOKEN 1
+#define WAIT_TIMEOUT 2
+
+struct waiter_s {
+  PyObject_HEAD PyObject *greenlet;  // green_current()
+  PyObject *value;                   // the item a Queue hands over
+  PyObject *timer;
+  int state;
+  wait_list_t *list;
+  WaiterObject *prev;
+  WaiterObject *next;
+};
+
+static PyTypeObject WaiterType;
+
+static PyObject *queue_empty = NULL;
+static PyObject *queue_full = NULL;
+
+static WaiterObject *waiter_new(void) {
+  WaiterObject *w;
+
+  w = PyObject_NEW(WaiterObject, &WaiterType);
+  if (w == NULL) {
+    return NULL;
+  }
+  w->greenlet = NULL;
+  w->value = NULL;
+  w->timer = NULL;
+  w->state = WAIT_PARKED;
+  w->list = NULL;
+  w->prev = NULL;
+  w->next = NULL;
+  return w;
+}
+
+static void waiter_link(wait_list_t *list, WaiterObject *w) {
+  Py_INCREF(w);
+  w->list = list;
+  w->prev = list->tail;
+  w->next = NULL;
+  if (list->tail) {
+    list->tail->next = w;
+  } else {
+    list->head = w;
+  }
+  list->tail = w;
+}
+
+static void waiter_unlink(WaiterObject *w) {
+  wait_list_t *list = w->list;
+
+  if (w->prev) {
+    w->prev->next = w->next;
+  } else {
+    list->head = w->next;
+  }
+  if (w->next) {
+    w->next->prev = w->prev;
+  } else {
+    list->tail = w->prev;
+  }
+  w->list = NULL;
+  w->prev = NULL;
+  w->next = NULL;
+  Py_DECREF(w);
+}
+
+static void wait_list_clear(wait_list_t *list) {
+  while (list->head) {
+    waiter_unlink(list->head);
+  }
+}
+
+/* take the first waiter off the list and resume it on the next turn */
+static int wake_first(wait_list_t *list) {
+  WaiterObject *w = list->head;
+
+  if (green_schedule(w->greenlet) == -1) {
+    return -1;
+  }
+  w->state = WAIT_WOKEN;
+  waiter_unlink(w);
+  return 0;
+}
+
+/* the timer of a parked waiter */
+static PyObject *Waiter_call(WaiterObject *self, PyObject *args,
+                             PyObject *kw) {
+  if (self->state == WAIT_PARKED) {
+    if (green_schedule(self->greenlet) == -1) {
+      return NULL;
+    }
+    self->state = WAIT_TIMEOUT;
+    waiter_unlink(self);
+  }
+  Py_RETURN_NONE;
+}
+
+/* park the current greenlet on list until woken or seconds passed, -1 is
+ * no timeout. 1 woken, 0 timed out, -1 on error; then w->state tells
+ * whether it was woken (and handed something) before */
+static int park(wait_list_t *list, WaiterObject *w, int seconds) {
+  PyObject *res;
+  int ret = 1;
+
+  w->greenlet = green_current();
+  if (w->greenlet == NULL) {
+    return -1;
+  }
+  if (seconds > 0) {
+    w->timer = green_call_later(seconds, (PyObject *)w);
+    if (w->timer == NULL) {
+      return -1;
+    }
+  }
+  waiter_link(list, w);
+  while (w->state == WAIT_PARKED) {
+    res = green_suspend();
+    if (res == NULL) {
+      if (w->state == WAIT_PARKED) {
+        waiter_unlink(w);
+      }
+      ret = -1;
+      break;
+    }
+    Py_DECREF(res);
+  }
+  if (w->timer) {
+    green_call_cancel(w->timer);
+    Py_CLEAR(w->timer);
+  }
+  if (ret == 1 && w->state == WAIT_TIMEOUT) {
+    ret = 0;
+  }
+  return ret;
+}
+
+/* -1 no timeout, 0 don't wait, else seconds rounded up. -2 on error */
+static int parse_timeout(PyObject *timeout) {
+  double d;
+
+  if (timeout == Py_None) {
+    return -1;
+  }
+  d = PyFloat_AsDouble(timeout);
+  if (d == -1 && PyErr_Occurred()) {
+    return -2;
+  }
+  if (d == -1) {
+    return -1;
+  }
+  if (d < 0 || d > INT_MAX) {
+    PyErr_SetString(PyExc_ValueError, "timeout value out of range ");
+    return -2;
+  }
+  return (int)ceil(d);
+}
+
+/* blocking and timeout arguments to seconds for park, -2 on error */
+static int wait_seconds(PyObject *block, PyObject *timeout) {
+  int ret;
+
+  ret = PyObject_IsTrue(block);
+  if (ret == -1) {
+    return -2;
+  }
+  if (ret == 0) {
+    return 0;
+  }
+  return parse_timeout(timeout);
+}
+
+static void Waiter_dealloc(WaiterObject *self) {
+  Py_CLEAR(self->greenlet);
+  Py_CLEAR(self->value);
+  Py_CLEAR(self->timer);
+  PyObject_DEL(self);
+}
+
+static PyTypeObject WaiterType = {
+#ifdef PY3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL) 0, /* ob_size */
+#endif
+        "meinheld.server.Waiter",   /*tp_name*/
+    sizeof(WaiterObject),           /*tp_basicsize*/
+    0,                              /*tp_itemsize*/
+    (destructor)Waiter_dealloc,     /*tp_dealloc*/
+    0,                              /*tp_print*/
+    0,                              /*tp_getattr*/
+    0,                              /*tp_setattr*/
+    0,                              /*tp_compare*/
+    0,                              /*tp_repr*/
+    0,                              /*tp_as_number*/
+    0,                              /*tp_as_sequence*/
+    0,                              /*tp_as_mapping*/
+    0,                              /*tp_hash */
+    (ternaryfunc)Waiter_call,       /*tp_call*/
+    0,                              /*tp_str*/
+    0,                              /*tp_getattro*/
+    0,                              /*tp_setattro*/
+    0,                              /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,             /*tp_flags*/
+    "a greenlet parked on a sync object", /* tp_doc */
+};
+
+/* Event */
+
+static PyObject *Event_new(PyTypeObject *type, PyObject *args, PyObject *kw) {
+  EventObject *self;
+
+  self = (EventObject *)type->tp_alloc(type, 0);
+  return (PyObject *)self;
+}
+
+static void Event_dealloc(EventObject *self) {
+  wait_list_clear(&self->waiters);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Event_set(EventObject *self, PyObject *unused) {
+  self->flag = 1;
+  while (self->waiters.head) {
+    if (wake_first(&self->waiters) == -1) {
+      return NULL;
+    }
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *Event_clear(EventObject *self, PyObject *unused) {
+  self->flag = 0;
+  Py_RETURN_NONE;
+}
+
+static PyObject *Event_is_set(EventObject *self, PyObject *unused) {
+  return PyBool_FromLong(self->flag);
+}
+
+static PyObject *Event_wait(EventObject *self, PyObject *args, PyObject *kw) {
+  static char *keywords[] = {"timeout", NULL};
+  PyObject *timeout = Py_None;
+  WaiterObject *w;
+  int seconds, ret;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|O:wait", keywords, &timeout)) {
+    return NULL;
+  }
+  if (self->flag) {
+    Py_RETURN_TRUE;
+  }
+  seconds = parse_timeout(timeout);
+  if (seconds == -2) {
+    return NULL;
+  }
+  if (seconds == 0) {
+    Py_RETURN_FALSE;
+  }
+  w = waiter_new();
+  if (w == NULL) {
+    return NULL;
+  }
+  ret = park(&self->waiters, w, seconds);
+  Py_DECREF(w);
+  if (ret == -1) {
+    return NULL;
+  }
+  return PyBool_FromLong(ret || self->flag);
+}
+
+static PyMethodDef Event_methods[] = {
+    {"set", (PyCFunction)Event_set, METH_NOARGS,
+     "set the flag and wake all waiters"},
+    {"clear", (PyCFunction)Event_clear, METH_NOARGS, "reset the flag"},
+    {"is_set", (PyCFunction)Event_is_set, METH_NOARGS, "the flag"},
+    {"wait", (PyCFunction)Event_wait, METH_VARARGS | METH_KEYWORDS,
+     "wait(timeout=None), False on timeout"},
+    {NULL, NULL}};
+
+PyTypeObject EventType = {
+#ifdef PY3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL) 0, /* ob_size */
+#endif
+        "meinheld.server.Event",              /*tp_name*/
+    sizeof(EventObject),                      /*tp_basicsize*/
+    0,                                        /*tp_itemsize*/
+    (destructor)Event_dealloc,                /*tp_dealloc*/
+    0,                                        /*tp_print*/
+    0,                                        /*tp_getattr*/
+    0,                                        /*tp_setattr*/
+    0,                                        /*tp_compare*/
+    0,                                        /*tp_repr*/
+    0,                                        /*tp_as_number*/
+    0,                                        /*tp_as_sequence*/
+    0,                                        /*tp_as_mapping*/
+    0,                                        /*tp_hash */
+    0,                                        /*tp_call*/
+    0,                                        /*tp_str*/
+    0,                                        /*tp_getattro*/
+    0,                                        /*tp_setattro*/
+    0,                                        /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+    "Event() for greenlets",                  /* tp_doc */
+    0,                                        /* tp_traverse */
+    0,                                        /* tp_clear */
+    0,                                        /* tp_richcompare */
+    0,                                        /* tp_weaklistoffset */
+    0,                                        /* tp_iter */
+    0,                                        /* tp_iternext */
+    Event_methods,                            /* tp_methods */
+    0,                                        /* tp_members */
+    0,                                        /* tp_getset */
+    0,                                        /* tp_base */
+    0,                                        /* tp_dict */
+    0,                                        /* tp_descr_get */
+    0,                                        /* tp_descr_set */
+    0,                                        /* tp_dictoffset */
+    0,                                        /* tp_init */
+    0,                                        /* tp_alloc */
+    Event_new,                                /* tp_new */
+};
+
+/* Lock and Semaphore */
+
+static PyObject *Semaphore_new(PyTypeObject *type, PyObject *args,
+                               PyObject *kw) {
+  static char *keywords[] = {"value", NULL};
+  SemaphoreObject *self;
+  long value = 1;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|l:Semaphore", keywords,
+                                   &value)) {
+    return NULL;
+  }
+  if (value < 0) {
+    PyErr_SetString(PyExc_ValueError, "semaphore value out of range ");
+    return NULL;
+  }
+  self = (SemaphoreObject *)type->tp_alloc(type, 0);
+  if (self != NULL) {
+    self->value = value;
+    self->bound = -1;
+  }
+  return (PyObject *)self;
+}
+
+static PyObject *Lock_new(PyTypeObject *type, PyObject *args, PyObject *kw) {
+  SemaphoreObject *self;
+
+  if (!PyArg_ParseTuple(args, ":Lock")) {
+    return NULL;
+  }
+  self = (SemaphoreObject *)type->tp_alloc(type, 0);
+  if (self != NULL) {
+    self->value = 1;
+    self->bound = 1;
+  }
+  return (PyObject *)self;
+}
+
+static void Semaphore_dealloc(SemaphoreObject *self) {
+  wait_list_clear(&self->waiters);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* pass it to the first waiter or count it back */
+static int semaphore_release(SemaphoreObject *self) {
+  if (self->waiters.head) {
+    return wake_first(&self->waiters);
+  }
+  self->value++;
+  return 0;
+}
+
+static PyObject *Semaphore_acquire(SemaphoreObject *self, PyObject *args,
+                                   PyObject *kw) {
+  static char *keywords[] = {"blocking", "timeout", NULL};
+  PyObject *block = Py_True, *timeout = Py_None;
+  PyObject *err_type, *err_val, *err_tb;
+  WaiterObject *w;
+  int seconds, ret;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|OO:acquire", keywords, &block,
+                                   &timeout)) {
+    return NULL;
+  }
+  if (self->value > 0) {
+    self->value--;
+    Py_RETURN_TRUE;
+  }
+  seconds = wait_seconds(block, timeout);
+  if (seconds == -2) {
+    return NULL;
+  }
+  if (seconds == 0) {
+    Py_RETURN_FALSE;
+  }
+  w = waiter_new();
+  if (w == NULL) {
+    return NULL;
+  }
+  ret = park(&self->waiters, w, seconds);
+  if (ret == -1 && w->state == WAIT_WOKEN) {
+    // killed after it was handed over
+    PyErr_Fetch(&err_type, &err_val, &err_tb);
+    if (semaphore_release(self) == -1) {
+      PyErr_Clear();
+    }
+    PyErr_Restore(err_type, err_val, err_tb);
+  }
+  Py_DECREF(w);
+  if (ret == -1) {
+    return NULL;
+  }
+  return PyBool_FromLong(ret);
+}
+
+static PyObject *Semaphore_release(SemaphoreObject *self, PyObject *unused) {
+  if (self->bound > 0 && self->value >= self->bound) {
+    PyErr_SetString(PyExc_RuntimeError, "release unlocked lock");
+    return NULL;
+  }
+  if (semaphore_release(self) == -1) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *Semaphore_locked(SemaphoreObject *self, PyObject *unused) {
+  return PyBool_FromLong(self->value == 0);
+}
+
+static PyObject *Semaphore_enter(SemaphoreObject *self, PyObject *unused) {
+  PyObject *args, *res;
+
+  args = PyTuple_New(0);
+  if (args == NULL) {
+    return NULL;
+  }
+  res = Semaphore_acquire(self, args, NULL);
+  Py_DECREF(args);
+  return res;
+}
+
+static PyObject *Semaphore_exit(SemaphoreObject *self, PyObject *args) {
+  return Semaphore_release(self, NULL);
+}
+
+static PyMethodDef Semaphore_methods[] = {
+    {"acquire", (PyCFunction)Semaphore_acquire, METH_VARARGS | METH_KEYWORDS,
+     "acquire(blocking=True, timeout=None), False on timeout"},
+    {"release", (PyCFunction)Semaphore_release, METH_NOARGS,
+     "release, the first waiter gets it"},
+    {"locked", (PyCFunction)Semaphore_locked, METH_NOARGS,
+     "True when acquire would wait"},
+    {"__enter__", (PyCFunction)Semaphore_enter, METH_NOARGS, 0},
+    {"__exit__", (PyCFunction)Semaphore_exit, METH_VARARGS, 0},
+    {NULL, NULL}};
+
+static PyMemberDef Semaphore_members[] = {
+    {"value", T_LONG, offsetof(SemaphoreObject, value), READONLY,
+     "the acquires left before waiting"},
+    {NULL}};
+
+PyTypeObject SemaphoreType = {
+#ifdef PY3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL) 0, /* ob_size */
+#endif
+        "meinheld.server.Semaphore",          /*tp_name*/
+    sizeof(SemaphoreObject),                  /*tp_basicsize*/
+    0,                                        /*tp_itemsize*/
+    (destructor)Semaphore_dealloc,            /*tp_dealloc*/
+    0,                                        /*tp_print*/
+    0,                                        /*tp_getattr*/
+    0,                                        /*tp_setattr*/
+    0,                                        /*tp_compare*/
+    0,                                        /*tp_repr*/
+    0,                                        /*tp_as_number*/
+    0,                                        /*tp_as_sequence*/
+    0,                                        /*tp_as_mapping*/
+    0,                                        /*tp_hash */
+    0,                                        /*tp_call*/
+    0,                                        /*tp_str*/
+    0,                                        /*tp_getattro*/
+    0,                                        /*tp_setattro*/
+    0,                                        /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+    "Semaphore(value=1) for greenlets",       /* tp_doc */
+    0,                                        /* tp_traverse */
+    0,                                        /* tp_clear */
+    0,                                        /* tp_richcompare */
+    0,                                        /* tp_weaklistoffset */
+    0,                                        /* tp_iter */
+    0,                                        /* tp_iternext */
+    Semaphore_methods,                        /* tp_methods */
+    Semaphore_members,                        /* tp_members */
+    0,                                        /* tp_getset */
+    0,                                        /* tp_base */
+    0,                                        /* tp_dict */
+    0,                                        /* tp_descr_get */
+    0,                                        /* tp_descr_set */
+    0,                                        /* tp_dictoffset */
+    0,                                        /* tp_init */
+    0,                                        /* tp_alloc */
+    Semaphore_new,                            /* tp_new */
+};
+
+PyTypeObject LockType = {
+#ifdef PY3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL) 0, /* ob_size */
+#endif
+        "meinheld.server.Lock",               /*tp_name*/
+    sizeof(SemaphoreObject),                  /*tp_basicsize*/
+    0,                                        /*tp_itemsize*/
+    (destructor)Semaphore_dealloc,            /*tp_dealloc*/
+    0,                                        /*tp_print*/
+    0,                                        /*tp_getattr*/
+    0,                                        /*tp_setattr*/
+    0,                                        /*tp_compare*/
+    0,                                        /*tp_repr*/
+    0,                                        /*tp_as_number*/
+    0,                                        /*tp_as_sequence*/
+    0,                                        /*tp_as_mapping*/
+    0,                                        /*tp_hash */
+    0,                                        /*tp_call*/
+    0,                                        /*tp_str*/
+    0,                                        /*tp_getattro*/
+    0,                                        /*tp_setattro*/
+    0,                                        /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+    "Lock() for greenlets",                   /* tp_doc */
+    0,                                        /* tp_traverse */
+    0,                                        /* tp_clear */
+    0,                                        /* tp_richcompare */
+    0,                                        /* tp_weaklistoffset */
+    0,                                        /* tp_iter */
+    0,                                        /* tp_iternext */
+    Semaphore_methods,                        /* tp_methods */
+    0,                                        /* tp_members */
+    0,                                        /* tp_getset */
+    0,                                        /* tp_base */
+    0,                                        /* tp_dict */
+    0,                                        /* tp_descr_get */
+    0,                                        /* tp_descr_set */
+    0,                                        /* tp_dictoffset */
+    0,                                        /* tp_init */
+    0,                                        /* tp_alloc */
+    Lock_new,                                 /* tp_new */
+};
+
+/* Queue */
+
+static PyObject *Queue_new(PyTypeObject *type, PyObject *args, PyObject *kw) {
+  static char *keywords[] = {"maxsize", NULL};
+  QueueObject *self;
+  Py_ssize_t maxsize = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|n:Queue", keywords,
+                                   &maxsize)) {
+    return NULL;
+  }
+  self = (QueueObject *)type->tp_alloc(type, 0);
+  if (self != NULL) {
+    self->maxsize = maxsize;
+  }
+  return (PyObject *)self;
+}
+
+static int Queue_traverse(QueueObject *self, visitproc visit, void *arg) {
+  Py_ssize_t i;
+
+  for (i = 0; i < self->cnt; i++) {
+    Py_VISIT(self->items[(self->head + i) % self->size]);
+  }
+  return 0;
+}
+
+static int Queue_clear(QueueObject *self) {
+  PyObject *item;
+
+  while (self->cnt > 0) {
+    item = self->items[self->head];
+    self->head = (self->head + 1) % self->size;
+    self->cnt--;
+    Py_DECREF(item);
+  }
+  return 0;
+}
+
+static void Queue_dealloc(QueueObject *self) {
+  PyObject_GC_UnTrack(self);
+  Queue_clear(self);
+  wait_list_clear(&self->getters);
+  wait_list_clear(&self->putters);
+  PyMem_Free(self->items);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int queue_is_full(QueueObject *self) {
+  return self->maxsize > 0 && self->cnt >= self->maxsize;
+}
+
+static int queue_push(QueueObject *self, PyObject *item) {
+  PyObject **items;
+  Py_ssize_t i, size;
+
+  if (self->cnt == self->size) {
+    size = self->size ? self->size * 2 : 16;
+    items = PyMem_Malloc(sizeof(PyObject *) * size);
+    if (items == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+    for (i = 0; i < self->cnt; i++) {
+      items[i] = self->items[(self->head + i) % self->size];
+    }
+    PyMem_Free(self->items);
+    self->items = items;
+    self->head = 0;
+    self->size = size;
+  }
+  Py_INCREF(item);
+  self->items[(self->head + self->cnt) % self->size] = item;
+  self->cnt++;
+  return 0;
+}
+
+static PyObject *queue_shift(QueueObject *self) {
+  PyObject *item;
+
+  item = self->items[self->head];
+  self->head = (self->head + 1) % self->size;
+  self->cnt--;
+  return item;
+}
+
+/* hand item to the first getter or queue it, the caller checked for room */
+static int queue_offer(QueueObject *self, PyObject *item) {
+  WaiterObject *w = self->getters.head;
+
+  if (w == NULL) {
+    return queue_push(self, item);
+  }
+  Py_INCREF(item);
+  w->value = item;
+  if (wake_first(&self->getters) == -1) {
+    Py_CLEAR(w->value);
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject *queue_put(QueueObject *self, PyObject *item, int seconds) {
+  WaiterObject *w;
+  int ret;
+
+  if (!queue_is_full(self)) {
+    if (queue_offer(self, item) == -1) {
+      return NULL;
+    }
+    Py_RETURN_NONE;
+  }
+  if (seconds == 0) {
+    PyErr_SetNone(queue_full);
+    return NULL;
+  }
+  w = waiter_new();
+  if (w == NULL) {
+    return NULL;
+  }
+  Py_INCREF(item);
+  w->value = item;
+  ret = park(&self->putters, w, seconds);
+  Py_DECREF(w);
+  if (ret == -1) {
+    return NULL;
+  }
+  if (ret == 0) {
+    PyErr_SetNone(queue_full);
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *queue_get(QueueObject *self, int seconds) {
+  PyObject *item, *err_type, *err_val, *err_tb;
+  WaiterObject *w;
+  int ret;
+
+  if (self->cnt > 0) {
+    item = queue_shift(self);
+    w = self->putters.head;
+    if (w != NULL) {
+      // room for the first putter
+      if (queue_push(self, w->value) == -1) {
+        Py_DECREF(item);
+        return NULL;
+      }
+      if (wake_first(&self->putters) == -1) {
+        self->cnt--;
+        Py_DECREF(w->value);
+        Py_DECREF(item);
+        return NULL;
+      }
+      Py_CLEAR(w->value);
+    }
+    return item;
+  }
+  if (seconds == 0) {
+    PyErr_SetNone(queue_empty);
+    return NULL;
+  }
+  w = waiter_new();
+  if (w == NULL) {
+    return NULL;
+  }
+  ret = park(&self->getters, w, seconds);
+  item = w->value;
+  w->value = NULL;
+  Py_DECREF(w);
+  if (ret == -1) {
+    if (item != NULL) {
+      // killed after it was handed over
+      PyErr_Fetch(&err_type, &err_val, &err_tb);
+      if (queue_offer(self, item) == -1) {
+        PyErr_Clear();
+      }
+      Py_DECREF(item);
+      PyErr_Restore(err_type, err_val, err_tb);
+    }
+    return NULL;
+  }
+  if (ret == 0) {
+    PyErr_SetNone(queue_empty);
+    return NULL;
+  }
+  return item;
+}
+
+static PyObject *Queue_put(QueueObject *self, PyObject *args, PyObject *kw) {
+  static char *keywords[] = {"item", "block", "timeout", NULL};
+  PyObject *item, *block = Py_True, *timeout = Py_None;
+  int seconds;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|OO:put", keywords, &item,
+                                   &block, &timeout)) {
+    return NULL;
+  }
+  seconds = wait_seconds(block, timeout);
+  if (seconds == -2) {
+    return NULL;
+  }
+  return queue_put(self, item, seconds);
+}
+
+static PyObject *Queue_get(QueueObject *self, PyObject *args, PyObject *kw) {
+  static char *keywords[] = {"block", "timeout", NULL};
+  PyObject *block = Py_True, *timeout = Py_None;
+  int seconds;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|OO:get", keywords, &block,
+                                   &timeout)) {
+    return NULL;
+  }
+  seconds = wait_seconds(block, timeout);
+  if (seconds == -2) {
+    return NULL;
+  }
+  return queue_get(self, seconds);
+}
+
+static PyObject *Queue_put_nowait(QueueObject *self, PyObject *item) {
+  return queue_put(self, item, 0);
+}
+
+static PyObject *Queue_get_nowait(QueueObject *self, PyObject *unused) {
+  return queue_get(self, 0);
+}
+
+static PyObject *Queue_qsize(QueueObject *self, PyObject *unused) {
+  return PyLong_FromSsize_t(self->cnt);
+}
+
+static PyObject *Queue_empty(QueueObject *self, PyObject *unused) {
+  return PyBool_FromLong(self->cnt == 0);
+}
+
+static PyObject *Queue_full(QueueObject *self, PyObject *unused) {
+  return PyBool_FromLong(queue_is_full(self));
+}
+
+static PyMethodDef Queue_methods[] = {
+    {"put", (PyCFunction)Queue_put, METH_VARARGS | METH_KEYWORDS,
+     "put(item, block=True, timeout=None), queue.Full on timeout"},
+    {"get", (PyCFunction)Queue_get, METH_VARARGS | METH_KEYWORDS,
+     "get(block=True, timeout=None), queue.Empty on timeout"},
+    {"put_nowait", (PyCFunction)Queue_put_nowait, METH_O, "put_nowait(item)"},
+    {"get_nowait", (PyCFunction)Queue_get_nowait, METH_NOARGS,
+     "get_nowait()"},
+    {"qsize", (PyCFunction)Queue_qsize, METH_NOARGS, "the queued items"},
+    {"empty", (PyCFunction)Queue_empty, METH_NOARGS, "no item queued"},
+    {"full", (PyCFunction)Queue_full, METH_NOARGS, "maxsize items queued"},
+    {NULL, NULL}};
+
+static PyMemberDef Queue_members[] = {
+    {"maxsize", T_PYSSIZET, offsetof(QueueObject, maxsize), READONLY,
+     "<= 0 is unbounded"},
+    {NULL}};
+
+PyTypeObject QueueType = {
+#ifdef PY3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL) 0, /* ob_size */
+#endif
+        "meinheld.server.Queue",  /*tp_name*/
+    sizeof(QueueObject),          /*tp_basicsize*/
+    0,                            /*tp_itemsize*/
+    (destructor)Queue_dealloc,    /*tp_dealloc*/
+    0,                            /*tp_print*/
+    0,                            /*tp_getattr*/
+    0,                            /*tp_setattr*/
+    0,                            /*tp_compare*/
+    0,                            /*tp_repr*/
+    0,                            /*tp_as_number*/
+    0,                            /*tp_as_sequence*/
+    0,                            /*tp_as_mapping*/
+    0,                            /*tp_hash */
+    0,                            /*tp_call*/
+    0,                            /*tp_str*/
+    0,                            /*tp_getattro*/
+    0,                            /*tp_setattro*/
+    0,                            /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+    "Queue(maxsize=0) for greenlets",                        /* tp_doc */
+    (traverseproc)Queue_traverse,                            /* tp_traverse */
+    (inquiry)Queue_clear,                                    /* tp_clear */
+    0,             /* tp_richcompare */
+    0,             /* tp_weaklistoffset */
+    0,             /* tp_iter */
+    0,             /* tp_iternext */
+    Queue_methods, /* tp_methods */
+    Queue_members, /* tp_members */
+    0,             /* tp_getset */
+    0,             /* tp_base */
+    0,             /* tp_dict */
+    0,             /* tp_descr_get */
+    0,             /* tp_descr_set */
+    0,             /* tp_dictoffset */
+    0,             /* tp_init */
+    0,             /* tp_alloc */
+    Queue_new,     /* tp_new */
+};
+
+int init_greensync(void) {
+  PyObject *m;
+
+#ifdef PY3
+  m = PyImport_ImportModule("queue");
+#else
+  m = PyImport_ImportModule("Queue");
+#endif
+  if (m == NULL) {
+    return -1;
+  }
+  queue_empty = PyObject_GetAttrString(m, "Empty");
+  queue_full = PyObject_GetAttrString(m, "Full");
+  Py_DECREF(m);
+  if (queue_empty == NULL || queue_full == NULL) {
+    return -1;
+  }
+  if (PyType_Ready(&WaiterType) < 0 || PyType_Ready(&EventType) < 0 ||
+      PyType_Ready(&LockType) < 0 || PyType_Ready(&SemaphoreType) < 0 ||
+      PyType_Ready(&QueueType) < 0) {
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef GREENSYNC_H
+#define GREENSYNC_H
+
+#include "meinheld.h"
+
+/**
+ * Event, Lock, Semaphore and Queue for greenlets.
+ *
+ * A greenlet that has to wait is parked on a FIFO list of the object and
+ * switches to the hub. The one that sets the event, releases the lock or
+ * puts the item takes the first waiter off the list and hands it to
+ * green_schedule, so it is resumed on the next turn of the loop without
+ * any fd or syscall. Ownership is handed over with the wakeup (a released
+ * lock or semaphore goes to the first waiter, a put item to the first
+ * getter) so a running greenlet can't barge in front of the parked ones.
+ *
+ * Timeouts are timers of the loop, whole seconds rounded up.
+ */
+
+typedef struct waiter_s WaiterObject;
+
+typedef struct {
+  WaiterObject *head;
+  WaiterObject *tail;
+} wait_list_t;
+
+typedef struct {
+  PyObject_HEAD int flag;
+  wait_list_t waiters;
+} EventObject;
+
+typedef struct {
+  PyObject_HEAD long value;
+  long bound;  // Lock is 1, Semaphore -1 (none)
+  wait_list_t waiters;
+} SemaphoreObject;
+
+typedef struct {
+  PyObject_HEAD PyObject **items;  // a ring
+  Py_ssize_t head;
+  Py_ssize_t cnt;
+  Py_ssize_t size;
+  Py_ssize_t maxsize;  // <= 0 is unbounded
+  wait_list_t getters;
+  wait_list_t putters;  // the item to put is in their value
+} QueueObject;
+
+extern PyTypeObject EventType;
+extern PyTypeObject LockType;
+extern PyTypeObject SemaphoreType;
+extern PyTypeObject QueueType;
+
+int init_greensync(void);
+
+#endif
@@ -1,8 +1,12 @@
 #include "http_request_parser.h"
 
+#include "capture.h"
 #include "http_parser.h"
 #include "input.h"
+#include "probes.h"
+#include "raw.h"
 #include "response.h"
+#include "router.h"
 #include "server.h"
 #include "util.h"
 
@@ -72,6 +76,7 @@ static PyObject *version_key;
 static PyObject *version_val;
 static PyObject *scheme_key;
 static PyObject *scheme_val;
+static PyObject *https_scheme_val;
 static PyObject *errors_key;
 static PyObject *errors_val;
 static PyObject *multithread_key;
@@ -175,7 +180,8 @@ PyObject *new_environ(client_t *client) {
 
   environ = PyDict_New();
   PyDict_SetItem(environ, version_key, version_val);
-  PyDict_SetItem(environ, scheme_key, scheme_val);
+  PyDict_SetItem(environ, scheme_key,
+                 client->tls ? https_scheme_val : scheme_val);
   PyDict_SetItem(environ, errors_key, errors_val);
   PyDict_SetItem(environ, multithread_key, multithread_val);
   PyDict_SetItem(environ, multiprocess_key, multiprocess_val);
@@ -322,43 +328,40 @@ static int set_query(PyObject *env, char *buf, int len) {
   return 1;
 }
 
+size_t request_path_len(const char *buf, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (buf[i] == '%' && len - i > 2) {
+      i += 2;
+    } else if (buf[i] == '?' || buf[i] == '#') {
+      break;
+    }
+  }
+  return i;
+}
+
+size_t decode_path(char *buf, size_t len) { return urldecode(buf, len); }
+
 static int set_path(PyObject *env, char *buf, int len) {
-  int c, c1, slen;
-  char *s0, *t;
+  int slen;
   PyObject *obj;
 
-  t = s0 = buf;
-  while (len > 0) {
-    c = *buf++;
-    if (c == '%' && len > 2) {
-      c = *buf++;
-      c1 = c;
-      c = *buf++;
-      c = hex2int(c1) * 16 + hex2int(c);
-      len -= 2;
-    } else if (c == '?') {
-      // stop
-      if (set_query(env, buf, len) == -1) {
-        // Error
-        return -1;
-      }
-      break;
-    } else if (c == '#') {
-      // stop
-      // ignore fragment
-      break;
+  slen = request_path_len(buf, len);
+  if (slen < len && buf[slen] == '?') {
+    if (set_query(env, buf + slen + 1, len - slen) == -1) {
+      // Error
+      return -1;
     }
-    *t++ = c;
-    len--;
   }
-  //*t = 0;
-  slen = t - s0;
-  slen = urldecode(s0, slen);
+  // ignore fragment. PATH_INFO has always been decoded twice, keep it so
+  slen = decode_path(buf, slen);
+  slen = decode_path(buf, slen);
 
 #ifdef PY3
-  obj = PyUnicode_DecodeLatin1(s0, slen, "strict");
+  obj = PyUnicode_DecodeLatin1(buf, slen, "strict");
 #else
-  obj = PyBytes_FromStringAndSize(s0, slen);
+  obj = PyBytes_FromStringAndSize(buf, slen);
 #endif
   if (likely(obj != NULL)) {
     PyDict_SetItem(env, path_info_key, obj);
@@ -462,7 +465,6 @@ static request *get_current_request(http_parser *p) {
 
 static int message_begin_cb(http_parser *p) {
   request *req = NULL;
-  PyObject *environ = NULL;
   client_t *client = get_client(p);
 
   DEBUG("message_begin_cb");
@@ -472,18 +474,71 @@ static int message_begin_cb(http_parser *p) {
     return -1;
   }
   req->start_msec = current_msec;
+  req->timing.accept = client->accept_usec;
+  req->timing.first_byte = get_current_usec();
   client->current_req = req;
-  environ = new_environ(client);
   client->complete = 0;
   /* client->bad_request_code = 0; */
   /* client->body_type = BODY_TYPE_NONE; */
   /* client->body_readed = 0; */
   /* client->body_length = 0; */
-  req->environ = environ;
   push_request(client->request_queue, client->current_req);
   return 0;
 }
 
+/* look up the path the way set_path decodes it for PATH_INFO */
+static int route_request(http_parser *p, request *req) {
+  const char *path = "";
+  char *copy = NULL;
+  size_t len = 0;
+
+  if (req->path) {
+    path = req->path->buf;
+    len = req->path->len;
+  }
+  len = request_path_len(path, len);
+  if (memchr(path, '%', len)) {
+    copy = PyMem_Malloc(len + 1);
+    if (copy == NULL) {
+      return -1;
+    }
+    memcpy(copy, path, len);
+    len = decode_path(copy, len);
+    path = copy;
+  }
+  req->app = match_route(p->method, path, len);
+  Py_XINCREF(req->app);
+  PyMem_Free(copy);
+  return 0;
+}
+
+/**
+ * The request line is read, route the request and make its environ.
+ * Fixed responses and run_raw requests only keep the header bytes.
+ */
+static int begin_request(http_parser *p, client_t *client, request *req) {
+  if (route_cnt > 0 && route_request(p, req) < 0) {
+    req->bad_request_code = 500;
+    return -1;
+  }
+  if (raw_mode || (req->app && CheckRawResponse(req->app))) {
+    req->raw = RawRequest_New(client);
+    if (req->raw == NULL) {
+      req->bad_request_code = 500;
+      return -1;
+    }
+    return 0;
+  }
+  req->environ = new_environ(client);
+  if (req->environ == NULL) {
+    req->bad_request_code = 500;
+    return -1;
+  }
+  return 0;
+}
+
+#define request_begun(req) ((req)->environ != NULL || (req)->raw != NULL)
+
 static int add_header(request *req) {
   assert(req->field && req->value);
   PyObject *env = req->environ;
@@ -556,11 +611,50 @@ static int check_field_name(const char *s, size_t len) {
   return ascii;
 }
 
+static int set_raw_error(request *req, buffer_result ret) {
+  switch (ret) {
+    case MEMORY_ERROR:
+      req->bad_request_code = 500;
+      return -1;
+    case LIMIT_OVER:
+      req->bad_request_code = 400;
+      return -1;
+    default:
+      return 0;
+  }
+}
+
+/* run_raw keeps the header bytes, no python objects are made */
+static int raw_header_field(request *req, const char *buf, size_t len) {
+  buffer_result ret;
+
+  if (!check_field_name(buf, len)) {
+    req->bad_request_code = 400;
+    return -1;
+  }
+  ret = raw_request_field(req->raw, buf, len, req->last_header_element == FIELD);
+  req->last_header_element = FIELD;
+  return set_raw_error(req, ret);
+}
+
+static int raw_header_value(request *req, const char *buf, size_t len) {
+  req->last_header_element = VALUE;
+  return set_raw_error(req, raw_request_value(req->raw, buf, len));
+}
+
 static int header_field_cb(http_parser *p, const char *buf, size_t len) {
   request *req = get_current_request(p);
   PyObject *obj = NULL;
   /* DEBUG("field key:%.*s", (int)len, buf); */
 
+  if (unlikely(!request_begun(req)) &&
+      begin_request(p, get_client(p), req) < 0) {
+    return -1;
+  }
+  if (req->raw) {
+    return raw_header_field(req, buf, len);
+  }
+
   if (req->last_header_element != FIELD) {
     if (LIMIT_REQUEST_FIELDS <= req->num_headers) {
       req->bad_request_code = 400;
@@ -601,6 +695,10 @@ static int header_value_cb(http_parser *p, const char *buf, size_t len) {
   request *req = get_current_request(p);
   PyObject *obj;
 
+  if (req->raw) {
+    return raw_header_value(req, buf, len);
+  }
+
   /* DEBUG("field value:%.*s", (int)len, buf); */
   if (likely(req->value == NULL)) {
     obj = PyBytes_FromStringAndSize(buf, len);
@@ -685,6 +783,26 @@ static int body_cb(http_parser *p, const char *buf, size_t len) {
   return 0;
 }
 
+static int raw_headers_complete(http_parser *p, client_t *client, request *req,
+                                uint64_t content_length) {
+  RawRequestObject *raw = (RawRequestObject *)req->raw;
+
+  raw->url = req->path;
+  req->path = NULL;
+  raw->method = p->method;
+  raw->http_minor = p->http_minor;
+  raw->keep_alive = client->keep_alive;
+  req->method = p->method;
+  req->body_length = content_length;
+  PROBE2(request__headers, client->fd, p->method);
+
+  raw->client = ClientObject_New(client);
+  if (unlikely(raw->client == NULL)) {
+    return -1;
+  }
+  return 0;
+}
+
 int headers_complete_cb(http_parser *p) {
   PyObject *obj;
   int ret;
@@ -692,8 +810,13 @@ int headers_complete_cb(http_parser *p) {
 
   client_t *client = get_client(p);
   request *req = client->current_req;
-  PyObject *env = req->environ;
+  PyObject *env = NULL;
 
+  if (!request_begun(req) && begin_request(p, client, req) < 0) {
+    return -1;
+  }
+  env = req->environ;
+  req->timing.headers_complete = get_current_usec();
   DEBUG("should keep alive %d", http_should_keep_alive(p));
   client->keep_alive = http_should_keep_alive(p);
 
@@ -708,6 +831,10 @@ int headers_complete_cb(http_parser *p) {
     }
   }
 
+  if (req->raw) {
+    return raw_headers_complete(p, client, req, content_length);
+  }
+
   if (p->http_major == 1 && p->http_minor == 1) {
     obj = server_protocol_val11;
   } else {
@@ -823,6 +950,7 @@ int headers_complete_cb(http_parser *p) {
   }
   req->body_length = content_length;
   /* client->current_req = NULL; */
+  PROBE2(request__headers, client->fd, p->method);
 
   // keep client data
   obj = ClientObject_New(client);
@@ -844,6 +972,9 @@ int message_complete_cb(http_parser *p) {
   DEBUG("message_complete_cb");
   client->complete = 1;
   client->upgrade = p->upgrade;
+  client->current_req->timing.message_complete = get_current_usec();
+  capture_requests++;
+  PROBE2(request__complete, client->fd, client->current_req->body_length);
 
   /* request *req = client->request_queue->tail; */
   /* req->body = client->body; */
@@ -892,6 +1023,7 @@ void setup_static_env(char *name, int port) {
   version_key = NATIVE_FROMSTRING("wsgi.version");
 
   scheme_val = NATIVE_FROMSTRING("http");
+  https_scheme_val = NATIVE_FROMSTRING("https");
   scheme_key = NATIVE_FROMSTRING("wsgi.url_scheme");
 
   errors_val = PySys_GetObject("stderr");
@@ -969,6 +1101,7 @@ void clear_static_env(void) {
   Py_DECREF(version_val);
   Py_DECREF(scheme_key);
   Py_DECREF(scheme_val);
+  Py_DECREF(https_scheme_val);
   Py_DECREF(errors_key);
   /* Py_DECREF(errors_val); */
   Py_DECREF(multithread_key);
@@ -23,4 +23,13 @@ void dealloc_parser(http_parser *p);
 
 PyObject *new_environ(client_t *client);
 
+/* where the path of a request target ends, before '?' or '#' */
+size_t request_path_len(const char *buf, size_t len);
+
+/**
+ * decode a request path in place, once. Routes and the raw request path
+ * use it, so "%2561" stays "%61" and can't turn into another route.
+ */
+size_t decode_path(char *buf, size_t len);
+
 #endif
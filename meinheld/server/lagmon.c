@@ -0,0 +1,206 @@
+#include "lagmon.h"
+
+#include <pthread.h>
+#include <pythread.h>
+
+#include "log.h"
+#include "stats.h"
+#include "util.h"
+
+uint64_t lag_threshold_usec = 0;
+
+static int threshold_msec = 0;
+
+// set by the loop thread, read by the watchdog
+static volatile uint64_t cb_start = 0;  // 0 while polling
+static volatile int cb_fd = -1;
+static uint64_t busy_start = 0;
+
+static pthread_t watchdog_thread;
+static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watchdog_cond = PTHREAD_COND_INITIALIZER;
+static int watchdog_running = 0;
+static uint64_t reported = 0;
+static long loop_thread_id = 0;
+
+static inline void end_callback(uint64_t now) {
+  uint64_t usec = now > cb_start ? now - cb_start : 0;
+  if (usec >= lag_threshold_usec) {
+    stats_add_stall(usec);
+  }
+}
+
+void lagmon_mark(int fd) {
+  uint64_t now = get_current_usec();
+
+  if (cb_start) {
+    end_callback(now);
+  } else {
+    busy_start = now;
+  }
+  cb_fd = fd;
+  cb_start = now;
+}
+
+void lagmon_idle(void) {
+  uint64_t now = get_current_usec(), busy;
+
+  if (cb_start) {
+    end_callback(now);
+    cb_start = 0;
+  }
+  if (busy_start) {
+    busy = now > busy_start ? now - busy_start : 0;
+    stats->loop_busy += busy;
+    if (busy > stats->loop_lag_max) {
+      stats->loop_lag_max = busy;
+    }
+    busy_start = 0;
+  }
+  stats->loop_iterations++;
+}
+
+int lagmon_set_threshold(int msec) {
+  if (msec < 0) {
+    PyErr_SetString(PyExc_ValueError,
+                    "loop stall threshold value out of range ");
+    return -1;
+  }
+  threshold_msec = msec;
+  if (lag_threshold_usec != 0 && msec != 0) {
+    // running, change the threshold only
+    lag_threshold_usec = (uint64_t)msec * 1000;
+  }
+  return 0;
+}
+
+int lagmon_get_threshold(void) { return threshold_msec; }
+
+static PyObject *get_loop_frame(void) {
+  PyObject *frames, *key, *frame;
+
+  frames = PyObject_CallMethod(PyImport_AddModule("sys"), "_current_frames",
+                               NULL);
+  if (frames == NULL) {
+    return NULL;
+  }
+  key = PyLong_FromLong(loop_thread_id);
+  if (key == NULL) {
+    Py_DECREF(frames);
+    return NULL;
+  }
+  frame = PyDict_GetItem(frames, key);
+  Py_XINCREF(frame);
+  Py_DECREF(key);
+  Py_DECREF(frames);
+  return frame;
+}
+
+/* log the stack of the loop thread as a RuntimeWarning traceback */
+static void report_stall(uint64_t usec, int fd) {
+  PyObject *frame, *back;
+
+  frame = get_loop_frame();
+  if (frame == NULL && PyErr_Occurred()) {
+    PyErr_Clear();
+  }
+  if (fd >= 0) {
+    PyErr_Format(PyExc_RuntimeWarning,
+                 "event loop blocked for %llu ms by fd %d",
+                 (unsigned long long)(usec / 1000), fd);
+  } else {
+    PyErr_Format(PyExc_RuntimeWarning, "event loop blocked for %llu ms",
+                 (unsigned long long)(usec / 1000));
+  }
+  // innermost frame first, like an exception unwinding
+  while (frame != NULL && frame != Py_None) {
+    PyTraceBack_Here((PyFrameObject *)frame);
+    back = PyObject_GetAttrString(frame, "f_back");
+    Py_DECREF(frame);
+    frame = back;
+  }
+  Py_XDECREF(frame);
+  call_error_logger();
+}
+
+static void check_stall(void) {
+  uint64_t start = cb_start, now;
+  int fd = cb_fd;
+  PyGILState_STATE gstate;
+
+  if (start == 0 || start == reported) {
+    return;
+  }
+  now = get_current_usec();
+  if (now < start + lag_threshold_usec) {
+    return;
+  }
+  reported = start;
+  gstate = PyGILState_Ensure();
+  // a callback holding the GIL may have finished meanwhile
+  if (cb_start == start) {
+    report_stall(get_current_usec() - start, fd);
+  }
+  PyGILState_Release(gstate);
+}
+
+static void *watchdog_main(void *arg) {
+  struct timespec ts;
+  uint64_t interval, deadline;
+
+  pthread_mutex_lock(&watchdog_lock);
+  while (watchdog_running) {
+    interval = lag_threshold_usec / 2;
+    if (interval < 1000) {
+      interval = 1000;
+    }
+    deadline = get_current_usec() + interval;
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    pthread_cond_timedwait(&watchdog_cond, &watchdog_lock, &ts);
+    if (!watchdog_running) {
+      break;
+    }
+    pthread_mutex_unlock(&watchdog_lock);
+    check_stall();
+    pthread_mutex_lock(&watchdog_lock);
+  }
+  pthread_mutex_unlock(&watchdog_lock);
+  return NULL;
+}
+
+int lagmon_start(void) {
+  if (threshold_msec == 0 || watchdog_running) {
+    return 0;
+  }
+#if PY_VERSION_HEX < 0x03070000
+  PyEval_InitThreads();
+#endif
+  loop_thread_id = PyThread_get_thread_ident();
+  cb_start = 0;
+  busy_start = 0;
+  reported = 0;
+  lag_threshold_usec = (uint64_t)threshold_msec * 1000;
+  watchdog_running = 1;
+  if (pthread_create(&watchdog_thread, NULL, watchdog_main, NULL) != 0) {
+    watchdog_running = 0;
+    lag_threshold_usec = 0;
+    return -1;
+  }
+  return 0;
+}
+
+void lagmon_stop(void) {
+  if (!watchdog_running) {
+    return;
+  }
+  pthread_mutex_lock(&watchdog_lock);
+  watchdog_running = 0;
+  pthread_cond_signal(&watchdog_cond);
+  pthread_mutex_unlock(&watchdog_lock);
+  // the watchdog may be waiting for the GIL
+  Py_BEGIN_ALLOW_THREADS pthread_join(watchdog_thread, NULL);
+  Py_END_ALLOW_THREADS lag_threshold_usec = 0;
+  cb_start = 0;
+  busy_start = 0;
+}
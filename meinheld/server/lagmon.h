@@ -0,0 +1,45 @@
+#ifndef LAGMON_H
+#define LAGMON_H
+
+#include "meinheld.h"
+
+/**
+ * Event loop lag monitor.
+ *
+ * Every callback run by the loop thread (picoev events and timeouts, timers
+ * and pendings) is marked with lagmon_tick() and the loop marks the point it
+ * goes back to polling with lagmon_wait(). A callback running longer than the
+ * threshold counts as a stall, and a watchdog thread logs the Python stack of
+ * the loop thread to the error logger while the stall is still going on.
+ */
+
+// usec, 0 while the monitor is not running
+extern uint64_t lag_threshold_usec;
+
+void lagmon_mark(int fd);
+
+void lagmon_idle(void);
+
+int lagmon_set_threshold(int msec);
+
+int lagmon_get_threshold(void);
+
+int lagmon_start(void);
+
+void lagmon_stop(void);
+
+/* a callback for fd (-1 for timers) is about to run */
+static inline void lagmon_tick(int fd) {
+  if (unlikely(lag_threshold_usec != 0)) {
+    lagmon_mark(fd);
+  }
+}
+
+/* the loop is about to poll */
+static inline void lagmon_wait(void) {
+  if (unlikely(lag_threshold_usec != 0)) {
+    lagmon_idle();
+  }
+}
+
+#endif
@@ -2,11 +2,92 @@
 
 #include <sys/file.h>
 
-#define LOG_BUF_SIZE 1024 * 16
+#include "raw.h"
+
+#define LOG_BUF_SIZE 1024 * 64
+#define LOG_LINE_SIZE 1024 * 8
 
 static PyObject *access_logger;
 static PyObject *err_logger;
 
+/**
+ * native access log
+ *
+ * The format is compiled once into a list of items. Each request is rendered
+ * from client_t and the request environ (read only) into a per-process
+ * buffer, which is written when full, on flush_access_log_if_due and on
+ * reopen.
+ */
+typedef enum {
+  LOG_LITERAL,
+  LOG_REMOTE_ADDR,   // h
+  LOG_DASH,          // l, u
+  LOG_TIME,          // t
+  LOG_REQUEST_LINE,  // r
+  LOG_METHOD,        // m
+  LOG_PATH,          // U
+  LOG_QUERY,         // q
+  LOG_PROTOCOL,      // H
+  LOG_STATUS,        // s
+  LOG_BYTES_DASH,    // b
+  LOG_BYTES,         // B
+  LOG_ENV,           // f, a, {header}i
+  LOG_TIME_SEC,      // T
+  LOG_TIME_MSEC,     // M
+  LOG_TIME_USEC,     // D
+  LOG_TIME_DECIMAL,  // L
+  LOG_PID,           // p
+  LOG_PHASE,         // {phase}P
+} log_item_type;
+
+typedef struct {
+  log_item_type type;
+  char *str;  // literal
+  size_t len;
+  PyObject *key;  // environ key
+} log_item_t;
+
+typedef struct {
+  char *buf;
+  size_t len;
+} log_line_t;
+
+/**
+ * %{phase}P is the usec spent between two request timestamps.
+ */
+typedef struct {
+  const char *name;
+  size_t from;  // offset in req_timing_t
+  size_t to;
+} log_phase_t;
+
+#define PHASE(name, from, to) \
+  { name, offsetof(req_timing_t, from), offsetof(req_timing_t, to) }
+
+static const log_phase_t log_phases[] = {
+    PHASE("wait", accept, first_byte),
+    PHASE("header", first_byte, headers_complete),
+    PHASE("body", headers_complete, message_complete),
+    PHASE("queue", message_complete, app_start),
+    PHASE("app", app_start, app_end),
+    PHASE("start", app_end, first_write),
+    PHASE("send", first_write, last_write),
+    {NULL, 0, 0}};
+
+static log_item_t *log_items = NULL;
+static int log_items_size = 0;
+static char *log_path = NULL;
+static int log_fd = -1;
+static char log_buf[LOG_BUF_SIZE];
+static size_t log_buf_len = 0;
+static uintptr_t log_flush_msec = 0;
+static uintptr_t log_flush_interval = 1000;
+static char log_pid[16];
+
+static PyObject *server_protocol_key;
+static PyObject *path_info_key;
+static PyObject *query_string_key;
+
 int set_access_logger(PyObject *obj) {
   if (access_logger != NULL) {
     Py_DECREF(access_logger);
@@ -99,7 +180,7 @@ err:
 }
 
 int open_log_file(const char *path) {
-  return open(path, O_CREAT | O_APPEND | O_WRONLY, 0744);
+  return open(path, O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC, 0644);
 }
 
 /*
@@ -151,93 +232,583 @@ line); ret = write(fd, buf, strlen(buf)); if(ret < 0){
 }
 */
 
-/*
-static int
-write_log(const char *new_path, int fd, const char *data, size_t len)
-{
-    int openfd;
-    flock(fd, LOCK_EX);
 
-    if(write(fd, data, len) < 0){
+static int write_log(const char *data, size_t len) {
+  ssize_t r;
 
-        flock(fd, LOCK_UN);
-        //reopen
-        openfd = open_log_file(new_path);
-        if(openfd < 0){
-            //fail
-            return -1;
-        }
+  while (len > 0) {
+    r = write(log_fd, data, len);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += r;
+    len -= r;
+  }
+  return 1;
+}
+
+int flush_access_log(void) {
+  int ret = 1;
 
-        flock(openfd, LOCK_EX);
-        if(write(openfd, data, len) < 0){
-            flock(openfd, LOCK_UN);
-            // write fail
-            return -1;
+  if (log_buf_len > 0 && log_fd >= 0) {
+    DEBUG("flush access log %d bytes", (int)log_buf_len);
+    // drop the buffer on error, the next flush may succeed
+    ret = write_log(log_buf, log_buf_len);
+  }
+  log_buf_len = 0;
+  log_flush_msec = current_msec;
+  return ret;
+}
+
+void flush_access_log_if_due(void) {
+  if (log_buf_len > 0 && current_msec - log_flush_msec >= log_flush_interval) {
+    flush_access_log();
+  }
+}
+
+int reopen_access_log(void) {
+  int fd;
+
+  if (log_path == NULL || !strcmp(log_path, "-")) {
+    return 0;
+  }
+  flush_access_log();
+  fd = open_log_file(log_path);
+  if (fd < 0) {
+    // keep writing to the old file
+    return -1;
+  }
+  close(log_fd);
+  log_fd = fd;
+  DEBUG("reopen access log %s fd:%d", log_path, log_fd);
+  return 1;
+}
+
+static void clear_log_format(void) {
+  int i;
+
+  for (i = 0; i < log_items_size; i++) {
+    PyMem_Free(log_items[i].str);
+    Py_XDECREF(log_items[i].key);
+  }
+  PyMem_Free(log_items);
+  log_items = NULL;
+  log_items_size = 0;
+}
+
+static PyObject *new_header_key(const char *s, size_t len) {
+  char key[256];
+  char *dest = key;
+  char c;
+
+  if (len + 5 >= sizeof(key)) {
+    return NULL;
+  }
+  if (!((len == 12 && !strncasecmp(s, "content-type", len)) ||
+        (len == 14 && !strncasecmp(s, "content-length", len)))) {
+    memcpy(dest, "HTTP_", 5);
+    dest += 5;
+  }
+  while (len--) {
+    c = *s++;
+    if (c == '-') {
+      *dest++ = '_';
+    } else if (c >= 'a' && c <= 'z') {
+      *dest++ = c - ('a' - 'A');
+    } else {
+      *dest++ = c;
+    }
+  }
+  *dest = '\0';
+  return NATIVE_FROMSTRING(key);
+}
+
+static int add_log_item(log_item_type type, const char *str, size_t len,
+                        PyObject *key) {
+  log_item_t *items, *item;
+
+  items = PyMem_Realloc(log_items, sizeof(log_item_t) * (log_items_size + 1));
+  if (items == NULL) {
+    Py_XDECREF(key);
+    PyErr_NoMemory();
+    return -1;
+  }
+  log_items = items;
+  item = &log_items[log_items_size++];
+  memset(item, 0, sizeof(log_item_t));
+  item->type = type;
+  item->key = key;
+  if (type == LOG_LITERAL) {
+    item->str = PyMem_Malloc(len);
+    if (item->str == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+    memcpy(item->str, str, len);
+    item->len = len;
+  }
+  return 1;
+}
+
+static int add_log_atom(const char *name, size_t len) {
+  PyObject *key;
+  int i;
+
+  if (len > 3 && name[0] == '{' && name[len - 2] == '}' &&
+      name[len - 1] == 'P') {
+    for (i = 0; log_phases[i].name; i++) {
+      if (strlen(log_phases[i].name) == len - 3 &&
+          !strncmp(log_phases[i].name, name + 1, len - 3)) {
+        if (add_log_item(LOG_PHASE, NULL, 0, NULL) < 0) {
+          return -1;
         }
-        flock(openfd, LOCK_UN);
-        return openfd;
+        log_items[log_items_size - 1].len = i;
+        return 1;
+      }
     }
+    PyErr_Format(PyExc_ValueError, "unknown phase %.*s", (int)len, name);
+    return -1;
+  }
+  if (len > 3 && name[0] == '{' && name[len - 2] == '}' &&
+      name[len - 1] == 'i') {
+    key = new_header_key(name + 1, len - 3);
+    if (key == NULL) {
+      PyErr_Format(PyExc_ValueError, "invalid header %.*s", (int)len, name);
+      return -1;
+    }
+    return add_log_item(LOG_ENV, NULL, 0, key);
+  }
+  if (len != 1) {
+    PyErr_Format(PyExc_ValueError, "unknown log atom %.*s", (int)len, name);
+    return -1;
+  }
 
-    flock(fd, LOCK_UN);
-    return fd;
+  switch (*name) {
+    case 'h':
+      return add_log_item(LOG_REMOTE_ADDR, NULL, 0, NULL);
+    case 'l':
+    case 'u':
+      return add_log_item(LOG_DASH, NULL, 0, NULL);
+    case 't':
+      return add_log_item(LOG_TIME, NULL, 0, NULL);
+    case 'r':
+      return add_log_item(LOG_REQUEST_LINE, NULL, 0, NULL);
+    case 'm':
+      return add_log_item(LOG_METHOD, NULL, 0, NULL);
+    case 'U':
+      return add_log_item(LOG_PATH, NULL, 0, NULL);
+    case 'q':
+      return add_log_item(LOG_QUERY, NULL, 0, NULL);
+    case 'H':
+      return add_log_item(LOG_PROTOCOL, NULL, 0, NULL);
+    case 's':
+      return add_log_item(LOG_STATUS, NULL, 0, NULL);
+    case 'b':
+      return add_log_item(LOG_BYTES_DASH, NULL, 0, NULL);
+    case 'B':
+      return add_log_item(LOG_BYTES, NULL, 0, NULL);
+    case 'f':
+      return add_log_item(LOG_ENV, NULL, 0, new_header_key("referer", 7));
+    case 'a':
+      return add_log_item(LOG_ENV, NULL, 0, new_header_key("user-agent", 10));
+    case 'T':
+      return add_log_item(LOG_TIME_SEC, NULL, 0, NULL);
+    case 'M':
+      return add_log_item(LOG_TIME_MSEC, NULL, 0, NULL);
+    case 'D':
+      return add_log_item(LOG_TIME_USEC, NULL, 0, NULL);
+    case 'L':
+      return add_log_item(LOG_TIME_DECIMAL, NULL, 0, NULL);
+    case 'p':
+      return add_log_item(LOG_PID, NULL, 0, NULL);
+    default:
+      PyErr_Format(PyExc_ValueError, "unknown log atom %c", *name);
+      return -1;
+  }
 }
-*/
-/*
-int
-write_access_log(client_t *cli, int log_fd, const char *log_path)
-{
-    char buf[LOG_BUF_SIZE];
-    if(log_fd > 0){
 
-        PyObject *obj;
-        char *method, *path, *version, *referer, *ua;
+/**
+ * compile gunicorn style atoms, both %(h)s and %h forms.
+ * a header is %({user-agent}i)s or %{user-agent}i, a phase is %{app}P.
+ */
+static int compile_log_format(const char *fmt) {
+  const char *p = fmt, *lit = fmt, *end;
+
+  while (*p) {
+    if (*p != '%') {
+      p++;
+      continue;
+    }
+    if (p > lit && add_log_item(LOG_LITERAL, lit, p - lit, NULL) < 0) {
+      return -1;
+    }
+    p++;
+    if (*p == '%') {
+      lit = p++;
+      continue;
+    }
+    if (*p == '(') {
+      end = strchr(p, ')');
+      if (end == NULL || end[1] != 's') {
+        PyErr_SetString(PyExc_ValueError, "unterminated log atom");
+        return -1;
+      }
+      if (add_log_atom(p + 1, end - p - 1) < 0) {
+        return -1;
+      }
+      p = end + 2;
+    } else if (*p == '{') {
+      end = strchr(p, '}');
+      if (end == NULL || (end[1] != 'i' && end[1] != 'P')) {
+        PyErr_SetString(PyExc_ValueError, "unterminated log atom");
+        return -1;
+      }
+      if (add_log_atom(p, end - p + 2) < 0) {
+        return -1;
+      }
+      p = end + 2;
+    } else if (*p) {
+      if (add_log_atom(p, 1) < 0) {
+        return -1;
+      }
+      p++;
+    } else {
+      PyErr_SetString(PyExc_ValueError, "unterminated log atom");
+      return -1;
+    }
+    lit = p;
+  }
+  if (p > lit && add_log_item(LOG_LITERAL, lit, p - lit, NULL) < 0) {
+    return -1;
+  }
+  return 1;
+}
 
-        obj = PyDict_GetItemString(cli->environ, "REQUEST_METHOD");
-        if(obj){
-            method = PyBytes_AS_STRING(obj);
-        }else{
-            method = "-";
-        }
+int set_access_log(const char *path, const char *format,
+                   uintptr_t flush_interval) {
+  int fd = -1;
+  char *new_path = NULL;
 
-        obj = PyDict_GetItemString(cli->environ, "PATH_INFO");
-        if(obj){
-            path = PyBytes_AS_STRING(obj);
-        }else{
-            path = "-";
-        }
+  if (log_fd >= 0) {
+    flush_access_log();
+    close(log_fd);
+    log_fd = -1;
+  }
+  clear_log_format();
+  PyMem_Free(log_path);
+  log_path = NULL;
 
-        obj = PyDict_GetItemString(cli->environ, "SERVER_PROTOCOL");
-        if(obj){
-            version = PyBytes_AS_STRING(obj);
-        }else{
-            version = "-";
-        }
+  if (path == NULL) {
+    return 1;
+  }
 
-        obj = PyDict_GetItemString(cli->environ, "HTTP_USER_AGENT");
-        if(obj){
-            ua = PyBytes_AS_STRING(obj);
-        }else{
-            ua = "-";
-        }
+  if (server_protocol_key == NULL) {
+    server_protocol_key = NATIVE_FROMSTRING("SERVER_PROTOCOL");
+    path_info_key = NATIVE_FROMSTRING("PATH_INFO");
+    query_string_key = NATIVE_FROMSTRING("QUERY_STRING");
+  }
 
-        obj = PyDict_GetItemString(cli->environ, "HTTP_REFERER");
-        if(obj){
-            referer = PyBytes_AS_STRING(obj);
-        }else{
-            referer = "-";
-        }
+  if (compile_log_format(format) < 0) {
+    clear_log_format();
+    return -1;
+  }
 
-        //update
-        cache_time_update();
+  new_path = PyMem_Malloc(strlen(path) + 1);
+  if (new_path == NULL) {
+    clear_log_format();
+    PyErr_NoMemory();
+    return -1;
+  }
+  strcpy(new_path, path);
+
+  if (!strcmp(path, "-")) {
+    fd = dup(STDOUT_FILENO);
+  } else {
+    fd = open_log_file(path);
+  }
+  if (fd < 0) {
+    PyMem_Free(new_path);
+    clear_log_format();
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    return -1;
+  }
+  log_path = new_path;
+  log_fd = fd;
+  log_flush_interval = flush_interval;
+  log_flush_msec = current_msec;
+  snprintf(log_pid, sizeof(log_pid), "<%d>", getpid());
+  return 1;
+}
+
+int is_access_log_enabled(void) { return log_fd >= 0; }
 
-        snprintf(buf, LOG_BUF_SIZE, "%s - - [%s] \"%s %s %s\" %d %d \"%s\"
-\"%s\"\n", cli->remote_addr, http_log_time, method, path, version,
-               cli->status_code,
-               cli->write_bytes,
-               referer,
-               ua);
-        return write_log(log_path, log_fd, buf, strlen(buf));
+static inline void put_bytes(log_line_t *l, const char *s, size_t len) {
+  size_t room = LOG_LINE_SIZE - l->len;
+
+  if (len > room) {
+    // truncate long line
+    len = room;
+  }
+  memcpy(l->buf + l->len, s, len);
+  l->len += len;
+}
+
+static inline void put_str(log_line_t *l, const char *s) {
+  put_bytes(l, s, strlen(s));
+}
+
+static inline void put_dash(log_line_t *l) { put_bytes(l, "-", 1); }
+
+static void put_num(log_line_t *l, uint64_t n) {
+  char buf[24];
+  int len;
+
+  len = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)n);
+  put_bytes(l, buf, len);
+}
+
+/* escape quote, backslash and non printable bytes like apache */
+static void put_escaped(log_line_t *l, const unsigned char *s, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  char buf[4];
+  unsigned char c;
+  size_t i;
+
+  for (i = 0; i < len && l->len < LOG_LINE_SIZE; i++) {
+    c = s[i];
+    if (c == '"' || c == '\\') {
+      buf[0] = '\\';
+      buf[1] = c;
+      put_bytes(l, buf, 2);
+    } else if (c < 0x20 || c >= 0x7f) {
+      buf[0] = '\\';
+      buf[1] = 'x';
+      buf[2] = hex[c >> 4];
+      buf[3] = hex[c & 0xf];
+      put_bytes(l, buf, 4);
+    } else {
+      l->buf[l->len++] = c;
     }
+  }
+}
+
+/* run_raw requests have no environ, log the request target as read */
+static int put_raw(log_line_t *l, request *req, PyObject *key) {
+  RawRequestObject *raw = (RawRequestObject *)req->raw;
+  const char *path, *query, *name, *value;
+  size_t path_len, query_len, value_len;
+  Py_ssize_t name_len;
+
+  if (key == server_protocol_key) {
+    put_str(l, raw->http_minor == 1 ? "HTTP/1.1" : "HTTP/1.0");
+    return 1;
+  }
+  raw_request_target(req->raw, &path, &path_len, &query, &query_len);
+  if (key == path_info_key) {
+    put_escaped(l, (const unsigned char *)path, path_len);
+    return 1;
+  }
+  if (key == query_string_key) {
+    if (query == NULL) {
+      return 0;
+    }
+    put_escaped(l, (const unsigned char *)query, query_len);
+    return 1;
+  }
+#ifdef PY3
+  name = PyUnicode_AsUTF8AndSize(key, &name_len);
+#else
+  name = PyBytes_AS_STRING(key);
+  name_len = PyBytes_GET_SIZE(key);
+#endif
+  if (name == NULL) {
+    PyErr_Clear();
     return 0;
+  }
+  value = raw_request_env_header(req->raw, name, name_len, &value_len);
+  if (value == NULL) {
+    return 0;
+  }
+  put_escaped(l, (const unsigned char *)value, value_len);
+  return 1;
+}
+
+/* environ values are native strings, read them without calling python */
+static int put_env(log_line_t *l, request *req, PyObject *key) {
+  PyObject *v;
+  const char *s;
+  Py_ssize_t len = 0;
+
+  if (req != NULL && req->raw != NULL) {
+    return put_raw(l, req, key);
+  }
+  if (req == NULL || req->environ == NULL ||
+      (v = PyDict_GetItem(req->environ, key)) == NULL) {
+    return 0;
+  }
+  if (PyBytes_Check(v)) {
+    s = PyBytes_AS_STRING(v);
+    len = PyBytes_GET_SIZE(v);
+#ifdef PY3
+  } else if (PyUnicode_Check(v)) {
+    if (PyUnicode_KIND(v) == PyUnicode_1BYTE_KIND) {
+      // latin1, the raw header bytes
+      s = (const char *)PyUnicode_1BYTE_DATA(v);
+      len = PyUnicode_GET_LENGTH(v);
+    } else {
+      s = PyUnicode_AsUTF8AndSize(v, &len);
+      if (s == NULL) {
+        PyErr_Clear();
+        return 0;
+      }
+    }
+#endif
+  } else {
+    return 0;
+  }
+  put_escaped(l, (const unsigned char *)s, len);
+  return 1;
+}
+
+static void put_env_or_dash(log_line_t *l, request *req, PyObject *key) {
+  if (!put_env(l, req, key)) {
+    put_dash(l);
+  }
+}
+
+static void put_request_line(log_line_t *l, request *req) {
+  size_t len;
+
+  if (req == NULL) {
+    put_dash(l);
+    return;
+  }
+  put_str(l, http_method_str(req->method));
+  put_bytes(l, " ", 1);
+  put_env_or_dash(l, req, path_info_key);
+  len = l->len;
+  put_bytes(l, "?", 1);
+  if (!put_env(l, req, query_string_key) || l->len == len + 1) {
+    // no query
+    l->len = len;
+  }
+  put_bytes(l, " ", 1);
+  if (!put_env(l, req, server_protocol_key)) {
+    put_str(l, "HTTP/1.0");
+  }
+}
+
+static void put_phase(log_line_t *l, request *req, const log_phase_t *phase) {
+  uint64_t from, to;
+
+  if (req == NULL) {
+    put_dash(l);
+    return;
+  }
+  from = *(uint64_t *)((char *)&req->timing + phase->from);
+  to = *(uint64_t *)((char *)&req->timing + phase->to);
+  if (from == 0 || to < from) {
+    put_dash(l);
+    return;
+  }
+  put_num(l, to - from);
+}
+
+int write_access_log(client_t *client, request *req, uint64_t delta_usec) {
+  char line[LOG_LINE_SIZE + 1];
+  log_line_t l = {line, 0};
+  log_item_t *item;
+  int i;
+
+  if (log_fd < 0) {
+    return 0;
+  }
+
+  for (i = 0; i < log_items_size; i++) {
+    item = &log_items[i];
+    switch (item->type) {
+      case LOG_LITERAL:
+        put_bytes(&l, item->str, item->len);
+        break;
+      case LOG_REMOTE_ADDR:
+        put_str(&l, client->remote_addr ? client->remote_addr : "-");
+        break;
+      case LOG_DASH:
+        put_dash(&l);
+        break;
+      case LOG_TIME:
+        put_bytes(&l, "[", 1);
+        put_str(&l, (char *)http_log_time);
+        put_bytes(&l, "]", 1);
+        break;
+      case LOG_REQUEST_LINE:
+        put_request_line(&l, req);
+        break;
+      case LOG_METHOD:
+        if (req) {
+          put_str(&l, http_method_str(req->method));
+        } else {
+          put_dash(&l);
+        }
+        break;
+      case LOG_PATH:
+        put_env_or_dash(&l, req, path_info_key);
+        break;
+      case LOG_QUERY:
+        put_env_or_dash(&l, req, query_string_key);
+        break;
+      case LOG_PROTOCOL:
+        put_env_or_dash(&l, req, server_protocol_key);
+        break;
+      case LOG_STATUS:
+        put_num(&l, client->status_code);
+        break;
+      case LOG_BYTES_DASH:
+        if (client->write_bytes == 0) {
+          put_dash(&l);
+          break;
+        }
+        // fall through
+      case LOG_BYTES:
+        put_num(&l, client->write_bytes);
+        break;
+      case LOG_ENV:
+        put_env_or_dash(&l, req, item->key);
+        break;
+      case LOG_TIME_SEC:
+        put_num(&l, delta_usec / 1000000);
+        break;
+      case LOG_TIME_MSEC:
+        put_num(&l, delta_usec / 1000);
+        break;
+      case LOG_TIME_USEC:
+        put_num(&l, delta_usec);
+        break;
+      case LOG_TIME_DECIMAL: {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%llu.%06llu",
+                           (unsigned long long)(delta_usec / 1000000),
+                           (unsigned long long)(delta_usec % 1000000));
+        put_bytes(&l, buf, len);
+        break;
+      }
+      case LOG_PID:
+        put_str(&l, log_pid);
+        break;
+      case LOG_PHASE:
+        put_phase(&l, req, &log_phases[item->len]);
+        break;
+    }
+  }
+  line[l.len++] = '\n';
+
+  if (log_buf_len + l.len > LOG_BUF_SIZE) {
+    flush_access_log();
+  }
+  memcpy(log_buf + log_buf_len, line, l.len);
+  log_buf_len += l.len;
+  return 1;
 }
-*/
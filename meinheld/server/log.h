@@ -2,13 +2,28 @@
 #define LOG_H
 
 #include "client.h"
+#include "request.h"
 #include "time_cache.h"
 
-// int open_log_file(const char *path);
+#define DEFAULT_ACCESS_LOG_FORMAT \
+  "%(h)s %(l)s %(u)s %(t)s \"%(r)s\" %(s)s %(b)s \"%(f)s\" \"%(a)s\""
+
+int open_log_file(const char *path);
 
 // int write_error_log(char *file_name, int line);
 
-// int write_access_log(client_t *cli, int log_fd, const char *log_path);
+int set_access_log(const char *path, const char *format,
+                   uintptr_t flush_interval);
+
+int is_access_log_enabled(void);
+
+int write_access_log(client_t *client, request *req, uint64_t delta_usec);
+
+int flush_access_log(void);
+
+void flush_access_log_if_due(void);
+
+int reopen_access_log(void);
 
 int set_access_logger(PyObject *obj);
 int set_err_logger(PyObject *obj);
@@ -127,6 +127,18 @@ static __inline__ char *as_str(PyObject *obj) {
 #define NATIVE_FROMFORMAT PyBytes_FromFormat
 #endif
 
+/* PEP 590 vectorcall and METH_FASTCALL, the older builds use tuples */
+#if PY_VERSION_HEX >= 0x03080000
+#define HAVE_VECTORCALL 1
+#if PY_VERSION_HEX < 0x03090000
+#define PyObject_Vectorcall _PyObject_Vectorcall
+#define Py_TPFLAGS_HAVE_VECTORCALL _Py_TPFLAGS_HAVE_VECTORCALL
+#endif
+#endif
+#if PY_VERSION_HEX >= 0x03070000
+#define HAVE_FASTCALL 1
+#endif
+
 #if PY_MAJOR_VERSION < 3
 #ifndef Py_REFCNT
 #define Py_REFCNT(ob) (((PyObject *)(ob))->ob_refcnt)
@@ -0,0 +1,279 @@
+#include "microbench.h"
+
+#include "client.h"
+#include "http_request_parser.h"
+#include "request.h"
+#include "response.h"
+#include "stats.h"
+
+static char bench_addr[] = "127.0.0.1";
+
+static uint64_t alloc_cnt = 0;
+static uint64_t alloc_bytes = 0;
+
+#if PY_VERSION_HEX >= 0x03050000
+#define HAVE_ALLOC_HOOK 1
+
+static PyMemAllocatorEx orig_mem, orig_obj;
+
+static void *count_malloc(void *ctx, size_t size) {
+  PyMemAllocatorEx *a = ctx;
+  alloc_cnt++;
+  alloc_bytes += size;
+  return a->malloc(a->ctx, size);
+}
+
+static void *count_calloc(void *ctx, size_t nelem, size_t elsize) {
+  PyMemAllocatorEx *a = ctx;
+  alloc_cnt++;
+  alloc_bytes += nelem * elsize;
+  return a->calloc(a->ctx, nelem, elsize);
+}
+
+static void *count_realloc(void *ctx, void *ptr, size_t size) {
+  PyMemAllocatorEx *a = ctx;
+  alloc_cnt++;
+  alloc_bytes += size;
+  return a->realloc(a->ctx, ptr, size);
+}
+
+static void count_free(void *ctx, void *ptr) {
+  PyMemAllocatorEx *a = ctx;
+  a->free(a->ctx, ptr);
+}
+
+static void hook_domain(PyMemAllocatorDomain domain, PyMemAllocatorEx *orig) {
+  PyMemAllocatorEx hook = {orig, count_malloc, count_calloc, count_realloc,
+                           count_free};
+  PyMem_GetAllocator(domain, orig);
+  PyMem_SetAllocator(domain, &hook);
+}
+#endif
+
+/* count PyMem and PyObject allocations until alloc_end */
+static void alloc_begin(void) {
+  alloc_cnt = 0;
+  alloc_bytes = 0;
+#ifdef HAVE_ALLOC_HOOK
+  hook_domain(PYMEM_DOMAIN_MEM, &orig_mem);
+  hook_domain(PYMEM_DOMAIN_OBJ, &orig_obj);
+#endif
+}
+
+static void alloc_end(void) {
+#ifdef HAVE_ALLOC_HOOK
+  PyMem_SetAllocator(PYMEM_DOMAIN_MEM, &orig_mem);
+  PyMem_SetAllocator(PYMEM_DOMAIN_OBJ, &orig_obj);
+#endif
+}
+
+static uint64_t now_nsec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static PyObject *build_result(uint64_t requests, uint64_t elapsed,
+                              uint64_t bytes) {
+  double n = requests ? (double)requests : 1.0;
+#ifdef HAVE_ALLOC_HOOK
+  return Py_BuildValue("{s:K,s:d,s:d,s:d,s:d}", "requests",
+                       (unsigned long long)requests, "ns_per_request",
+                       elapsed / n, "allocs_per_request", alloc_cnt / n,
+                       "alloc_bytes_per_request", alloc_bytes / n,
+                       "bytes_per_request", bytes / n);
+#else
+  return Py_BuildValue("{s:K,s:d,s:O,s:O,s:d}", "requests",
+                       (unsigned long long)requests, "ns_per_request",
+                       elapsed / n, "allocs_per_request", Py_None,
+                       "alloc_bytes_per_request", Py_None,
+                       "bytes_per_request", bytes / n);
+#endif
+}
+
+static void init_client(client_t *client, int fd) {
+  memset(client, 0, sizeof(client_t));
+  client->fd = fd;
+  client->complete = 1;
+  client->keep_alive = 1;
+  client->remote_addr = bench_addr;
+  client->remote_port = 0;
+  client->request_queue = new_request_queue();
+}
+
+static void free_req(request *req) {
+  Py_CLEAR(req->environ);
+  if (req->path) {
+    free_buffer(req->path);
+    req->path = NULL;
+  }
+  if (req->body) {
+    if (req->body_type == BODY_TYPE_TMPFILE) {
+      fclose(req->body);
+    } else {
+      free_buffer(req->body);
+    }
+    req->body = NULL;
+  }
+  free_request(req);
+}
+
+/* free the parsed requests, return the number of requests */
+static uint64_t drain_requests(client_t *client) {
+  request *req;
+  uint64_t n = 0;
+
+  while ((req = shift_request(client->request_queue)) != NULL) {
+    free_req(req);
+    n++;
+  }
+  client->current_req = NULL;
+  return n;
+}
+
+static void clear_client(client_t *client) {
+  drain_requests(client);
+  if (client->http_parser) {
+    dealloc_parser(client->http_parser);
+  }
+  free_request_queue(client->request_queue);
+}
+
+PyObject *bench_parse(PyObject *data, int iterations) {
+  client_t client;
+  stats_slot_t scratch, *saved = stats;
+  enum http_errno err;
+  const char *buf;
+  Py_ssize_t len;
+  size_t nread;
+  uint64_t start, elapsed, requests = 0;
+  int i;
+
+  if (!PyBytes_Check(data)) {
+    PyErr_SetString(PyExc_TypeError, "data must be bytes");
+    return NULL;
+  }
+  buf = PyBytes_AS_STRING(data);
+  len = PyBytes_GET_SIZE(data);
+
+  init_client(&client, -1);
+  if (init_parser(&client, bench_addr, 0) == -1) {
+    free_request_queue(client.request_queue);
+    return PyErr_NoMemory();
+  }
+  // keep the worker counters clean
+  memset(&scratch, 0, sizeof(scratch));
+  stats = &scratch;
+
+  alloc_begin();
+  start = now_nsec();
+  for (i = 0; i < iterations; i++) {
+    http_parser_init(client.http_parser, HTTP_REQUEST);
+    nread = execute_parse(&client, buf, len);
+    err = HTTP_PARSER_ERRNO(client.http_parser);
+    if (nread != (size_t)len || err != HPE_OK || !parser_finish(&client)) {
+      break;
+    }
+    requests += drain_requests(&client);
+  }
+  elapsed = now_nsec() - start;
+  alloc_end();
+  stats = saved;
+
+  if (i < iterations) {
+    if (!PyErr_Occurred()) {
+      if (err != HPE_OK) {
+        PyErr_Format(PyExc_ValueError, "parse error %s at offset %d",
+                     http_errno_name(err), (int)nread);
+      } else {
+        PyErr_SetString(PyExc_ValueError, "incomplete request");
+      }
+    }
+    clear_client(&client);
+    return NULL;
+  }
+  clear_client(&client);
+  return build_result(requests, elapsed, (uint64_t)len * iterations);
+}
+
+PyObject *bench_response(PyObject *status, PyObject *headers, PyObject *body,
+                         int iterations) {
+  client_t client;
+  stats_slot_t scratch, *saved = stats;
+  PyObject *res;
+  response_status ret = STATUS_OK;
+  uint64_t start, elapsed, bytes = 0;
+  int i, fd;
+
+  fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return PyErr_SetFromErrno(PyExc_IOError);
+  }
+  init_client(&client, fd);
+  if (init_parser(&client, bench_addr, 0) == -1) {
+    free_request_queue(client.request_queue);
+    close(fd);
+    return PyErr_NoMemory();
+  }
+  client.http_parser->http_major = 1;
+  client.http_parser->http_minor = 1;
+  memset(&scratch, 0, sizeof(scratch));
+  stats = &scratch;
+
+  alloc_begin();
+  start = now_nsec();
+  for (i = 0; i < iterations; i++) {
+    client.current_req = new_request();
+    if (client.current_req == NULL) {
+      break;
+    }
+    client.current_req->method = HTTP_GET;
+
+    // what the app does
+    res = PyObject_CallFunctionObjArgs(create_start_response(&client), status,
+                                       headers, NULL);
+    if (res == NULL) {
+      free_req(client.current_req);
+      break;
+    }
+    Py_DECREF(res);
+    Py_INCREF(body);
+    client.response = body;
+
+    ret = response_start(&client);
+    if (ret == STATUS_OK) {
+      ret = close_response(&client);
+    }
+    bytes += client.write_bytes;
+
+    // what clean_client does
+    Py_CLEAR(client.http_status);
+    Py_CLEAR(client.headers);
+    Py_CLEAR(client.response_iter);
+    Py_CLEAR(client.response);
+    free_req(client.current_req);
+    client.current_req = NULL;
+    client.header_done = 0;
+    client.response_closed = 0;
+    client.chunked_response = 0;
+    client.content_length_set = 0;
+    client.content_length = 0;
+    client.write_bytes = 0;
+    if (ret != STATUS_OK) {
+      break;
+    }
+  }
+  elapsed = now_nsec() - start;
+  alloc_end();
+  stats = saved;
+
+  clear_client(&client);
+  close(fd);
+  if (i < iterations) {
+    if (!PyErr_Occurred()) {
+      PyErr_SetString(PyExc_ValueError, "can't write the response");
+    }
+    return NULL;
+  }
+  return build_result((uint64_t)iterations, elapsed, bytes);
+}
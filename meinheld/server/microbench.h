@@ -0,0 +1,19 @@
+#ifndef MICROBENCH_H
+#define MICROBENCH_H
+
+#include "meinheld.h"
+
+/**
+ * Parser and response writer microbenchmarks.
+ *
+ * Both run the real code paths on a detached client_t (the response goes to
+ * /dev/null) and return a dict with ns and PyMem allocations per request.
+ * The server environment must be set up by the caller.
+ */
+
+PyObject *bench_parse(PyObject *data, int iterations);
+
+PyObject *bench_response(PyObject *status, PyObject *headers, PyObject *body,
+                         int iterations);
+
+#endif
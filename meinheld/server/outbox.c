@@ -0,0 +1,559 @@
+#include "outbox.h"
+
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "server.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define OUTBOX_IOV 64
+
+static PyObject *drop_str = NULL;
+static PyObject *close_str = NULL;
+
+static void outbox_write_callback(picoev_loop *loop, int fd, int events,
+                                  void *cb_arg);
+
+PyObject *ws_encode_frame(PyObject *message) {
+  PyObject *payload, *frame;
+  unsigned char *p;
+  Py_ssize_t len, hlen;
+  int opcode, i;
+
+  if (PyUnicode_Check(message)) {
+    payload = PyUnicode_AsUTF8String(message);
+    if (payload == NULL) {
+      return NULL;
+    }
+    opcode = 1;
+  } else if (PyBytes_Check(message)) {
+    Py_INCREF(message);
+    payload = message;
+    opcode = 2;
+  } else {
+    PyErr_SetString(PyExc_TypeError,
+                    "message should be str, unicode or bytes.");
+    return NULL;
+  }
+  len = PyBytes_GET_SIZE(payload);
+  hlen = len < 126 ? 2 : len <= 0xffff ? 4 : 10;
+  frame = PyBytes_FromStringAndSize(NULL, hlen + len);
+  if (frame == NULL) {
+    Py_DECREF(payload);
+    return NULL;
+  }
+  p = (unsigned char *)PyBytes_AS_STRING(frame);
+  p[0] = 0x80 | opcode;  // fin
+  if (hlen == 2) {
+    p[1] = (unsigned char)len;
+  } else if (hlen == 4) {
+    p[1] = 126;
+    p[2] = (len >> 8) & 0xff;
+    p[3] = len & 0xff;
+  } else {
+    p[1] = 127;
+    for (i = 0; i < 8; i++) {
+      p[2 + i] = ((uint64_t)len >> (56 - i * 8)) & 0xff;
+    }
+  }
+  memcpy(p + hlen, PyBytes_AS_STRING(payload), len);
+  Py_DECREF(payload);
+  return frame;
+}
+
+static int outbox_wake(OutboxObject *self) {
+  Py_ssize_t i, n;
+  int ret = 0;
+
+  if (self->waiters == NULL) {
+    return 0;
+  }
+  n = PyList_GET_SIZE(self->waiters);
+  if (n == 0) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    if (green_schedule(PyList_GET_ITEM(self->waiters, i)) == -1) {
+      ret = -1;
+      break;
+    }
+  }
+  PyList_SetSlice(self->waiters, 0, i, NULL);
+  return ret;
+}
+
+static void outbox_drop(OutboxObject *self) {
+  while (self->cnt > 0) {
+    Py_DECREF(self->frames[self->head].frame);
+    self->head = (self->head + 1) % self->size;
+    self->cnt--;
+  }
+  self->pending = 0;
+}
+
+/* stop writing, shutting the connection down too when kill is set */
+static void outbox_shut(OutboxObject *self, int kill) {
+  if (self->fd < 0) {
+    return;
+  }
+  loop_unwatch(self->fd);
+  if (kill) {
+    shutdown(self->fd, SHUT_RDWR);
+  }
+  close(self->fd);
+  self->fd = -1;
+  outbox_drop(self);
+}
+
+/* write out what is queued until it would block, -1 with errno set */
+static int outbox_write(OutboxObject *self) {
+  struct iovec iov[OUTBOX_IOV];
+  struct msghdr msg;
+  out_frame_t *f;
+  Py_ssize_t i, n, len;
+  ssize_t r;
+
+  while (self->cnt > 0) {
+    n = self->cnt < OUTBOX_IOV ? self->cnt : OUTBOX_IOV;
+    for (i = 0; i < n; i++) {
+      f = &self->frames[(self->head + i) % self->size];
+      iov[i].iov_base = PyBytes_AS_STRING(f->frame) + f->off;
+      iov[i].iov_len = PyBytes_GET_SIZE(f->frame) - f->off;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    r = sendmsg(self->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      return -1;
+    }
+    self->pending -= r;
+    while (r > 0) {
+      f = &self->frames[self->head];
+      len = PyBytes_GET_SIZE(f->frame) - f->off;
+      if (r < len) {
+        f->off += r;
+        break;
+      }
+      r -= len;
+      Py_DECREF(f->frame);
+      self->head = (self->head + 1) % self->size;
+      self->cnt--;
+    }
+  }
+  return 0;
+}
+
+/* write and watch the fd while something is left, -1 with an exception
+ * set when the connection is gone */
+static int outbox_flush(OutboxObject *self) {
+  int err;
+
+  if (outbox_write(self) == -1) {
+    err = errno;
+    outbox_shut(self, 0);
+    outbox_wake(self);
+    errno = err;
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+  }
+  if (self->cnt > 0) {
+    // outside the loop the next send writes it
+    loop_watch(self->fd, PICOEV_WRITE, outbox_write_callback, (void *)self);
+  } else {
+    loop_unwatch(self->fd);
+  }
+  if (self->pending <= self->high_watermark) {
+    return outbox_wake(self);
+  }
+  return 0;
+}
+
+static void outbox_write_callback(picoev_loop *loop, int fd, int events,
+                                  void *cb_arg) {
+  OutboxObject *self = (OutboxObject *)cb_arg;
+
+  if ((events & PICOEV_WRITE) != 0 && outbox_flush(self) == -1) {
+    // the peer is gone, the reading side will see it
+    PyErr_Clear();
+  }
+  if (PyErr_Occurred()) {
+    call_error_logger();
+  }
+}
+
+static int outbox_push(OutboxObject *self, PyObject *frame) {
+  out_frame_t *frames;
+  Py_ssize_t i, size;
+
+  if (self->cnt == self->size) {
+    size = self->size ? self->size * 2 : 8;
+    frames = PyMem_Malloc(sizeof(out_frame_t) * size);
+    if (frames == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+    for (i = 0; i < self->cnt; i++) {
+      frames[i] = self->frames[(self->head + i) % self->size];
+    }
+    PyMem_Free(self->frames);
+    self->frames = frames;
+    self->head = 0;
+    self->size = size;
+  }
+  Py_INCREF(frame);
+  i = (self->head + self->cnt) % self->size;
+  self->frames[i].frame = frame;
+  self->frames[i].off = 0;
+  self->cnt++;
+  self->pending += PyBytes_GET_SIZE(frame);
+  // with a backlog the fd is watched already
+  if (self->cnt == 1) {
+    return outbox_flush(self);
+  }
+  return 0;
+}
+
+/* wait until at most limit bytes are queued, outside a greenlet it doesn't
+ * wait */
+static int outbox_wait(OutboxObject *self, Py_ssize_t limit) {
+  PyObject *current, *res;
+  Py_ssize_t i;
+
+  while (self->fd >= 0 && self->pending > limit) {
+    current = green_current();
+    if (current == NULL) {
+      PyErr_Clear();
+      return 0;
+    }
+    if (PyList_Append(self->waiters, current) == -1) {
+      Py_DECREF(current);
+      return -1;
+    }
+    res = green_suspend();
+    if (res == NULL) {
+      i = PySequence_Index(self->waiters, current);
+      if (i >= 0) {
+        PyList_SetSlice(self->waiters, i, i + 1, NULL);
+      }
+      Py_DECREF(current);
+      return -1;
+    }
+    Py_DECREF(res);
+    Py_DECREF(current);
+  }
+  return 0;
+}
+
+static int closed_error(void) {
+  errno = EPIPE;
+  PyErr_SetFromErrno(PyExc_IOError);
+  return -1;
+}
+
+Py_ssize_t outbox_broadcast(PyObject *outboxes, PyObject *frame) {
+  PyObject *seq, *item;
+  OutboxObject *o;
+  Py_ssize_t i, n, sent = 0;
+
+  seq = PySequence_Fast(outboxes, "outboxes must be a sequence");
+  if (seq == NULL) {
+    return -1;
+  }
+  n = PySequence_Fast_GET_SIZE(seq);
+  for (i = 0; i < n; i++) {
+    item = PySequence_Fast_GET_ITEM(seq, i);
+    if (!PyObject_TypeCheck(item, &OutboxType)) {
+      PyErr_SetString(PyExc_TypeError, "must be an Outbox");
+      Py_DECREF(seq);
+      return -1;
+    }
+    o = (OutboxObject *)item;
+    if (o->fd < 0) {
+      continue;
+    }
+    if (o->cnt > 0 && o->pending > o->high_watermark) {
+      // slow consumer
+      if (o->policy == OUTBOX_CLOSE) {
+        outbox_shut(o, 1);
+        if (outbox_wake(o) == -1) {
+          Py_DECREF(seq);
+          return -1;
+        }
+      } else {
+        o->dropped++;
+      }
+      continue;
+    }
+    if (outbox_push(o, frame) == -1) {
+      if (o->fd >= 0) {
+        Py_DECREF(seq);
+        return -1;
+      }
+      // gone, skip it
+      PyErr_Clear();
+      continue;
+    }
+    sent++;
+  }
+  Py_DECREF(seq);
+  return sent;
+}
+
+static PyObject *Outbox_new(PyTypeObject *type, PyObject *args, PyObject *kw) {
+  static char *keywords[] = {"fd", "high_watermark", "policy", NULL};
+  OutboxObject *self;
+  PyObject *policy = NULL;
+  Py_ssize_t hwm = 1 << 20;
+  int fd, pol = OUTBOX_DROP;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "i|nO:Outbox", keywords, &fd,
+                                   &hwm, &policy)) {
+    return NULL;
+  }
+  if (hwm < 0) {
+    PyErr_SetString(PyExc_ValueError, "high_watermark value out of range ");
+    return NULL;
+  }
+  if (policy != NULL) {
+    if (PyObject_RichCompareBool(policy, close_str, Py_EQ) == 1) {
+      pol = OUTBOX_CLOSE;
+    } else if (PyObject_RichCompareBool(policy, drop_str, Py_EQ) != 1) {
+      PyErr_SetString(PyExc_ValueError, "policy must be 'drop' or 'close'");
+      return NULL;
+    }
+  }
+  self = (OutboxObject *)type->tp_alloc(type, 0);
+  if (self == NULL) {
+    return NULL;
+  }
+  self->fd = -1;
+  self->high_watermark = hwm;
+  self->policy = pol;
+  self->waiters = PyList_New(0);
+  if (self->waiters == NULL) {
+    Py_DECREF(self);
+    return NULL;
+  }
+  self->fd = dup(fd);
+  if (self->fd < 0) {
+    PyErr_SetFromErrno(PyExc_IOError);
+    Py_DECREF(self);
+    return NULL;
+  }
+  return (PyObject *)self;
+}
+
+static int Outbox_traverse(OutboxObject *self, visitproc visit, void *arg) {
+  Py_ssize_t i;
+
+  for (i = 0; i < self->cnt; i++) {
+    Py_VISIT(self->frames[(self->head + i) % self->size].frame);
+  }
+  Py_VISIT(self->waiters);
+  return 0;
+}
+
+static int Outbox_clear(OutboxObject *self) {
+  outbox_drop(self);
+  Py_CLEAR(self->waiters);
+  return 0;
+}
+
+static void Outbox_dealloc(OutboxObject *self) {
+  PyObject_GC_UnTrack(self);
+  outbox_shut(self, 0);
+  Outbox_clear(self);
+  PyMem_Free(self->frames);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Outbox_send(OutboxObject *self, PyObject *data) {
+  if (!PyBytes_Check(data)) {
+    PyErr_SetString(PyExc_TypeError, "data must be bytes");
+    return NULL;
+  }
+  if (outbox_wait(self, self->high_watermark) == -1) {
+    return NULL;
+  }
+  if (self->fd < 0) {
+    closed_error();
+    return NULL;
+  }
+  if (PyBytes_GET_SIZE(data) > 0 && outbox_push(self, data) == -1) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/* the timer of a bounded flush, gives up on the peer */
+static PyObject *outbox_expire(PyObject *self, PyObject *unused) {
+  OutboxObject *o = (OutboxObject *)self;
+
+  if (o->fd >= 0) {
+    o->expired = 1;
+    outbox_shut(o, 1);
+    if (outbox_wake(o) == -1) {
+      return NULL;
+    }
+  }
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef expire_def = {"expire", (PyCFunction)outbox_expire,
+                                 METH_NOARGS, NULL};
+
+static PyObject *Outbox_flush(OutboxObject *self, PyObject *args) {
+  PyObject *timeout = Py_None, *expire, *timer = NULL;
+  double d;
+  int ret;
+
+  if (!PyArg_ParseTuple(args, "|O:flush", &timeout)) {
+    return NULL;
+  }
+  if (timeout != Py_None) {
+    d = PyFloat_AsDouble(timeout);
+    if (d == -1 && PyErr_Occurred()) {
+      return NULL;
+    }
+    if (d <= 0 || d > INT_MAX) {
+      PyErr_SetString(PyExc_ValueError, "timeout value out of range ");
+      return NULL;
+    }
+    if (self->fd >= 0 && self->pending > 0) {
+      expire = PyCFunction_New(&expire_def, (PyObject *)self);
+      if (expire == NULL) {
+        return NULL;
+      }
+      timer = green_call_later((int)ceil(d), expire);
+      Py_DECREF(expire);
+      if (timer == NULL) {
+        return NULL;
+      }
+    }
+  }
+  self->expired = 0;
+  ret = outbox_wait(self, 0);
+  if (timer) {
+    green_call_cancel(timer);
+    Py_DECREF(timer);
+  }
+  if (ret == -1) {
+    return NULL;
+  }
+  if (self->expired) {
+    errno = ETIMEDOUT;
+    PyErr_SetFromErrno(PyExc_IOError);
+    return NULL;
+  }
+  if (self->fd < 0) {
+    closed_error();
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *Outbox_close(OutboxObject *self, PyObject *args) {
+  int kill = 0;
+
+  if (!PyArg_ParseTuple(args, "|i:close", &kill)) {
+    return NULL;
+  }
+  outbox_shut(self, kill);
+  if (outbox_wake(self) == -1) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *Outbox_get_closed(OutboxObject *self, void *closure) {
+  return PyBool_FromLong(self->fd < 0);
+}
+
+static PyMethodDef Outbox_methods[] = {
+    {"send", (PyCFunction)Outbox_send, METH_O,
+     "send(frame), waits while more than high_watermark bytes are queued"},
+    {"flush", (PyCFunction)Outbox_flush, METH_VARARGS,
+     "flush(timeout=None), wait until everything is written. When timeout "
+     "sec pass first the queue is dropped and the connection shut down"},
+    {"close", (PyCFunction)Outbox_close, METH_VARARGS,
+     "close(shutdown=False), drops what is queued"},
+    {NULL, NULL}};
+
+static PyMemberDef Outbox_members[] = {
+    {"pending", T_PYSSIZET, offsetof(OutboxObject, pending), READONLY,
+     "bytes queued"},
+    {"dropped", T_ULONGLONG, offsetof(OutboxObject, dropped), READONLY,
+     "frames a broadcast skipped as the client was slow"},
+    {"high_watermark", T_PYSSIZET, offsetof(OutboxObject, high_watermark), 0,
+     "queued bytes that make a slow consumer"},
+    {NULL}};
+
+static PyGetSetDef Outbox_getset[] = {
+    {"closed", (getter)Outbox_get_closed, NULL, "closed or shut down", NULL},
+    {NULL}};
+
+PyTypeObject OutboxType = {
+#ifdef PY3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL) 0, /* ob_size */
+#endif
+        "meinheld.server.Outbox",  /*tp_name*/
+    sizeof(OutboxObject),          /*tp_basicsize*/
+    0,                             /*tp_itemsize*/
+    (destructor)Outbox_dealloc,    /*tp_dealloc*/
+    0,                             /*tp_print*/
+    0,                             /*tp_getattr*/
+    0,                             /*tp_setattr*/
+    0,                             /*tp_compare*/
+    0,                             /*tp_repr*/
+    0,                             /*tp_as_number*/
+    0,                             /*tp_as_sequence*/
+    0,                             /*tp_as_mapping*/
+    0,                             /*tp_hash */
+    0,                             /*tp_call*/
+    0,                             /*tp_str*/
+    0,                             /*tp_getattro*/
+    0,                             /*tp_setattro*/
+    0,                             /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+    "Outbox(fd, high_watermark=1MB, policy='drop')", /* tp_doc */
+    (traverseproc)Outbox_traverse,                   /* tp_traverse */
+    (inquiry)Outbox_clear,                           /* tp_clear */
+    0,              /* tp_richcompare */
+    0,              /* tp_weaklistoffset */
+    0,              /* tp_iter */
+    0,              /* tp_iternext */
+    Outbox_methods, /* tp_methods */
+    Outbox_members, /* tp_members */
+    Outbox_getset,  /* tp_getset */
+    0,              /* tp_base */
+    0,              /* tp_dict */
+    0,              /* tp_descr_get */
+    0,              /* tp_descr_set */
+    0,              /* tp_dictoffset */
+    0,              /* tp_init */
+    0,              /* tp_alloc */
+    Outbox_new,     /* tp_new */
+};
+
+int init_outbox(void) {
+  drop_str = NATIVE_FROMSTRING("drop");
+  close_str = NATIVE_FROMSTRING("close");
+  if (drop_str == NULL || close_str == NULL) {
+    return -1;
+  }
+  return PyType_Ready(&OutboxType);
+}
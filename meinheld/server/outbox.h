@@ -0,0 +1,54 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include "meinheld.h"
+
+/**
+ * Output queue of a websocket connection.
+ *
+ * An Outbox owns a dup of the connection fd, so it can be watched for write
+ * apart from the greenlet reading the socket. A frame is written at once when
+ * nothing is queued, what is left is queued as a reference to the frame
+ * bytes and written with sendmsg when the fd is writable again.
+ *
+ * outbox_broadcast() queues one frame on many outboxes, they all share the
+ * same bytes object. An outbox already holding more than high_watermark
+ * bytes is a slow consumer: the frame is dropped for it, or it is shut down,
+ * depending on its policy. send() of the connection's own greenlet waits
+ * for room instead.
+ */
+
+#define OUTBOX_DROP 0
+#define OUTBOX_CLOSE 1
+
+typedef struct {
+  PyObject *frame;  // bytes, shared with other outboxes
+  Py_ssize_t off;   // written so far
+} out_frame_t;
+
+typedef struct {
+  PyObject_HEAD int fd;  // our dup, -1 once closed
+  out_frame_t *frames;   // a ring
+  Py_ssize_t head;
+  Py_ssize_t cnt;
+  Py_ssize_t size;
+  Py_ssize_t pending;  // bytes queued
+  Py_ssize_t high_watermark;
+  int policy;
+  unsigned long long dropped;  // frames a broadcast skipped
+  PyObject *waiters;           // greenlets waiting for room
+  char expired;                // a flush ran out of time and shut it
+} OutboxObject;
+
+extern PyTypeObject OutboxType;
+
+/* an RFC 6455 server frame of message, text for unicode, binary for bytes */
+PyObject *ws_encode_frame(PyObject *message);
+
+/* queue frame on each outbox of the sequence, returns how many took it or
+ * -1 on error */
+Py_ssize_t outbox_broadcast(PyObject *outboxes, PyObject *frame);
+
+int init_outbox(void);
+
+#endif
@@ -42,6 +42,7 @@ extern "C" {
 #include <stdlib.h>
 #include <string.h>
 
+#include "lagmon.h"
 #include "meinheld.h"
 #include "time_cache.h"
 
@@ -127,7 +128,8 @@ int picoev_destroy_loop(picoev_loop* loop);
 /* internal: updates events to be watched (defined by each backend) */
 int picoev_update_events_internal(picoev_loop* loop, int fd, int events);
 
-/* internal: poll once and call the handlers (defined by each backend) */
+/* internal: poll once and call the handlers (defined by each backend),
+   max_wait in msec */
 int picoev_poll_once_internal(picoev_loop* loop, int max_wait);
 
 /* internal, aligned allocator with address scrambling to avoid cache
@@ -366,6 +368,7 @@ void picoev_handle_timeout_internal(picoev_loop* loop) {
                 picoev_fd* fd = picoev.fds + k;
                 assert(fd->loop_id == loop->loop_id);
                 fd->timeout_idx = PICOEV_TIMEOUT_IDX_UNUSED;
+                lagmon_tick(k);
                 (*fd->callback)(loop, k, PICOEV_TIMEOUT, fd->cb_arg);
               }
             }
@@ -378,13 +381,13 @@ void picoev_handle_timeout_internal(picoev_loop* loop) {
   }
 }
 
-/* loop once */
+/* loop once, waiting at most max_wait_msec for events */
 PICOEV_INLINE
-int picoev_loop_once(picoev_loop* loop, int max_wait) {
-  if (max_wait > loop->timeout.resolution) {
-    max_wait = loop->timeout.resolution;
+int picoev_loop_once_msec(picoev_loop* loop, int max_wait_msec) {
+  if (max_wait_msec > loop->timeout.resolution * 1000) {
+    max_wait_msec = loop->timeout.resolution * 1000;
   }
-  if (unlikely(picoev_poll_once_internal(loop, max_wait) != 0)) {
+  if (unlikely(picoev_poll_once_internal(loop, max_wait_msec) != 0)) {
     return -1;
   }
   loop->now = current_msec / 1000;
@@ -392,6 +395,12 @@ int picoev_loop_once(picoev_loop* loop, int max_wait) {
   return 0;
 }
 
+/* loop once */
+PICOEV_INLINE
+int picoev_loop_once(picoev_loop* loop, int max_wait) {
+  return picoev_loop_once_msec(loop, max_wait * 1000);
+}
+
 #undef PICOEV_INLINE
 
 #ifdef __cplusplus
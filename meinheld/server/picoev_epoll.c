@@ -155,7 +155,7 @@ int picoev_poll_once_internal(picoev_loop* _loop, int max_wait) {
 
   Py_BEGIN_ALLOW_THREADS nevents = epoll_wait(
       loop->epfd, loop->events, sizeof(loop->events) / sizeof(loop->events[0]),
-      max_wait * 1000);
+      max_wait);
   Py_END_ALLOW_THREADS cache_time_update();
 
   if (nevents == -1) {
@@ -166,9 +166,16 @@ int picoev_poll_once_internal(picoev_loop* _loop, int max_wait) {
     picoev_fd* target = picoev.fds + event->data.fd;
     if (loop->loop.loop_id == target->loop_id &&
         likely((target->events & PICOEV_READWRITE) != 0)) {
-      int revents = ((event->events & EPOLLIN) != 0 ? PICOEV_READ : 0) |
-                    ((event->events & EPOLLOUT) != 0 ? PICOEV_WRITE : 0);
+      /* a pipe whose writer went away reports EPOLLHUP alone */
+      int revents =
+          ((event->events & EPOLLIN) != 0 ||
+                   ((event->events & EPOLLHUP) != 0 &&
+                    (target->events & PICOEV_READ) != 0)
+               ? PICOEV_READ
+               : 0) |
+          ((event->events & EPOLLOUT) != 0 ? PICOEV_WRITE : 0);
       if (likely(revents != 0)) {
+        lagmon_tick(event->data.fd);
         (*target->callback)(&loop->loop, event->data.fd, revents,
                             target->cb_arg);
       }
@@ -170,8 +170,8 @@ int picoev_poll_once_internal(picoev_loop* _loop, int max_wait) {
   /* apply pending changes, with last changes stored to loop->changelist */
   cl_off = apply_pending_changes(loop, 0);
 
-  ts.tv_sec = max_wait;
-  ts.tv_nsec = 0;
+  ts.tv_sec = max_wait / 1000;
+  ts.tv_nsec = (max_wait % 1000) * 1000000;
 
   Py_BEGIN_ALLOW_THREADS nevents =
       kevent(loop->kq, loop->changelist, cl_off, loop->events,
@@ -202,6 +202,7 @@ int picoev_poll_once_internal(picoev_loop* _loop, int max_wait) {
           revents = 0;  // suppress compiler warning
           break;
       }
+      lagmon_tick(event->ident);
       (*target->callback)(&loop->loop, event->ident, revents, target->cb_arg);
     }
   }
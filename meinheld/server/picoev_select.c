@@ -143,8 +143,8 @@ int picoev_poll_once_internal(picoev_loop* loop, int max_wait) {
   }
 
   /* select and handle if any */
-  tv.tv_sec = max_wait;
-  tv.tv_usec = 0;
+  tv.tv_sec = max_wait / 1000;
+  tv.tv_usec = (max_wait % 1000) * 1000;
 
   Py_BEGIN_ALLOW_THREADS r =
       select(maxfd + 1, &readfds, &writefds, &errorfds, &tv);
@@ -159,6 +159,7 @@ int picoev_poll_once_internal(picoev_loop* loop, int max_wait) {
         int revents = (PICOEV_FD_ISSET(i, &readfds) ? PICOEV_READ : 0) |
                       (PICOEV_FD_ISSET(i, &writefds) ? PICOEV_WRITE : 0);
         if (revents != 0) {
+          lagmon_tick(i);
           (*target->callback)(loop, i, revents, target->cb_arg);
         }
       }
@@ -0,0 +1,54 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/**
+ * USDT probes (provider "meinheld").
+ *
+ * Built in when sys/sdt.h (systemtap-sdt-dev) is found, a probe is then a
+ * single nop until a tracer attaches. Otherwise they compile to nothing.
+ *
+ *   bpftrace -l 'usdt:/path/to/meinheld/server.*.so:meinheld:*'
+ *
+ * conn__accept(fd, remote_port)
+ * conn__close(fd, status, keep_alive)
+ * request__read(fd, bytes)
+ * request__headers(fd, method)
+ * request__complete(fd, body_length)
+ * request__done(fd, status, bytes, usec)
+ * wsgi__call(fd)
+ * wsgi__return(fd, status)
+ * write__writev(fd, bytes, written)
+ * write__sendfile(fd, bytes, written)
+ * greenlet__suspend(fd)   fd is -1 for sleep
+ * greenlet__resume(fd)    fd is -1 when woken by a timer
+ */
+
+#if defined(__has_include) && !defined(MEINHELD_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SYS_SDT_H 1
+#endif
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(meinheld, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(meinheld, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(meinheld, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(meinheld, name, a, b, c, d)
+#else
+#define PROBE1(name, a) \
+  do {                  \
+  } while (0)
+#define PROBE2(name, a, b) \
+  do {                     \
+  } while (0)
+#define PROBE3(name, a, b, c) \
+  do {                        \
+  } while (0)
+#define PROBE4(name, a, b, c, d) \
+  do {                           \
+  } while (0)
+#endif
+
+#endif
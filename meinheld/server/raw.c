@@ -0,0 +1,649 @@
+#include "raw.h"
+
+#include <sys/mman.h>
+
+#include "http_request_parser.h"
+#include "util.h"
+
+#define RAW_MAXFREELIST 1024
+#define METHOD_CACHE_SIZE 64
+
+int raw_mode = 0;
+
+static RawRequestObject *raw_free_list[RAW_MAXFREELIST];
+static int raw_numfree = 0;
+
+static PyObject *method_cache[METHOD_CACHE_SIZE];
+
+static char empty_body[1] = "";
+
+#ifdef PY3
+#define LATIN1(s, len) PyUnicode_DecodeLatin1((s), (len), NULL)
+#else
+#define LATIN1(s, len) PyBytes_FromStringAndSize((s), (len))
+#endif
+
+PyObject *RawRequest_New(client_t *cli) {
+  RawRequestObject *self;
+
+  if (raw_numfree) {
+    self = raw_free_list[--raw_numfree];
+    _Py_NewReference((PyObject *)self);
+  } else {
+    self = PyObject_NEW(RawRequestObject, &RawRequestType);
+    if (self == NULL) {
+      return NULL;
+    }
+  }
+  memset((char *)self + offsetof(RawRequestObject, cli), 0,
+         sizeof(RawRequestObject) - offsetof(RawRequestObject, cli));
+  self->cli = cli;
+  self->fd = cli->fd;
+  return (PyObject *)self;
+}
+
+static void RawRequest_dealloc(RawRequestObject *self) {
+  Py_CLEAR(self->client);
+  Py_CLEAR(self->path);
+  Py_CLEAR(self->query);
+  Py_CLEAR(self->headers);
+  if (self->url) {
+    free_buffer(self->url);
+  }
+  if (self->head) {
+    free_buffer(self->head);
+  }
+  PyMem_Free(self->fields);
+  if (self->map) {
+    munmap(self->map, self->map_len);
+  }
+  if (self->body) {
+    if (self->body_type == BODY_TYPE_TMPFILE) {
+      fclose(self->body);
+    } else {
+      free_buffer(self->body);
+    }
+  }
+  if (raw_numfree < RAW_MAXFREELIST) {
+    raw_free_list[raw_numfree++] = self;
+  } else {
+    PyObject_DEL(self);
+  }
+}
+
+void raw_list_clear(void) {
+  int i;
+
+  while (raw_numfree) {
+    PyObject_DEL(raw_free_list[--raw_numfree]);
+  }
+  for (i = 0; i < METHOD_CACHE_SIZE; i++) {
+    Py_CLEAR(method_cache[i]);
+  }
+}
+
+buffer_result raw_request_field(PyObject *o, const char *buf, size_t len,
+                                int cont) {
+  RawRequestObject *self = (RawRequestObject *)o;
+  raw_field_t *f;
+  uint32_t size;
+
+  if (self->head == NULL) {
+    self->head = new_buffer(1024, 0);
+    if (self->head == NULL || self->head->buf == NULL) {
+      return MEMORY_ERROR;
+    }
+  }
+  if (!cont || self->nfields == 0) {
+    if (self->nfields >= LIMIT_REQUEST_FIELDS) {
+      return LIMIT_OVER;
+    }
+    if (self->nfields == self->fields_size) {
+      size = self->fields_size ? self->fields_size * 2 : 16;
+      f = PyMem_Realloc(self->fields, sizeof(raw_field_t) * size);
+      if (f == NULL) {
+        return MEMORY_ERROR;
+      }
+      self->fields = f;
+      self->fields_size = size;
+    }
+    f = &self->fields[self->nfields++];
+    f->name = self->head->len;
+    f->name_len = 0;
+    f->value = self->head->len;
+    f->value_len = 0;
+  }
+  f = &self->fields[self->nfields - 1];
+  if (f->name_len + len > LIMIT_REQUEST_FIELD_SIZE) {
+    return LIMIT_OVER;
+  }
+  if (write2buf(self->head, buf, len) != WRITE_OK) {
+    return MEMORY_ERROR;
+  }
+  f->name_len += len;
+  f->value = self->head->len;
+  return WRITE_OK;
+}
+
+buffer_result raw_request_value(PyObject *o, const char *buf, size_t len) {
+  RawRequestObject *self = (RawRequestObject *)o;
+  raw_field_t *f;
+
+  if (self->nfields == 0) {
+    return MEMORY_ERROR;
+  }
+  f = &self->fields[self->nfields - 1];
+  if (f->value_len + len > LIMIT_REQUEST_FIELD_SIZE) {
+    return LIMIT_OVER;
+  }
+  if (write2buf(self->head, buf, len) != WRITE_OK) {
+    return MEMORY_ERROR;
+  }
+  f->value_len += len;
+  return WRITE_OK;
+}
+
+const char *raw_request_header(PyObject *o, const char *name, size_t name_len,
+                               size_t *value_len) {
+  RawRequestObject *self = (RawRequestObject *)o;
+  raw_field_t *f;
+  uint32_t i;
+
+  for (i = 0; i < self->nfields; i++) {
+    f = &self->fields[i];
+    if (f->name_len == name_len &&
+        !strncasecmp(self->head->buf + f->name, name, name_len)) {
+      *value_len = f->value_len;
+      return self->head->buf + f->value;
+    }
+  }
+  return NULL;
+}
+
+const char *raw_request_env_header(PyObject *o, const char *key,
+                                   size_t key_len, size_t *value_len) {
+  RawRequestObject *self = (RawRequestObject *)o;
+  raw_field_t *f;
+  const char *name;
+  uint32_t i, j;
+  int c;
+
+  if (key_len <= 5 || strncmp(key, "HTTP_", 5)) {
+    return NULL;
+  }
+  key += 5;
+  key_len -= 5;
+  for (i = 0; i < self->nfields; i++) {
+    f = &self->fields[i];
+    if (f->name_len != key_len) {
+      continue;
+    }
+    name = self->head->buf + f->name;
+    for (j = 0; j < key_len; j++) {
+      c = name[j] == '-' ? '_' : toupper((unsigned char)name[j]);
+      if (c != key[j]) {
+        break;
+      }
+    }
+    if (j == key_len) {
+      *value_len = f->value_len;
+      return self->head->buf + f->value;
+    }
+  }
+  return NULL;
+}
+
+void raw_request_target(PyObject *o, const char **path, size_t *path_len,
+                        const char **query, size_t *query_len) {
+  RawRequestObject *self = (RawRequestObject *)o;
+  const char *s, *end, *q;
+
+  *query = NULL;
+  *query_len = 0;
+  if (self->url == NULL) {
+    *path = "";
+    *path_len = 0;
+    return;
+  }
+  s = self->url->buf;
+  end = s + self->url->len;
+  q = s + request_path_len(s, self->url->len);
+  *path = s;
+  *path_len = q - s;
+  if (q < end && *q == '?') {
+    s = ++q;
+    while (q < end && *q != '#') {
+      q++;
+    }
+    *query = s;
+    *query_len = q - s;
+  }
+}
+
+void raw_request_take_body(PyObject *o, request *req) {
+  RawRequestObject *self = (RawRequestObject *)o;
+
+  self->body = req->body;
+  self->body_type = req->body_type;
+  req->body = NULL;
+}
+
+void raw_request_detach(PyObject *o) {
+  RawRequestObject *self = (RawRequestObject *)o;
+
+  self->cli = NULL;
+}
+
+static int get_body(RawRequestObject *self, char **buf, size_t *len) {
+  struct stat info;
+  FILE *tmp;
+  int fd;
+
+  *buf = empty_body;
+  *len = 0;
+  if (self->body == NULL) {
+    return 1;
+  }
+  if (self->body_type != BODY_TYPE_TMPFILE) {
+    *buf = ((buffer_t *)self->body)->buf;
+    *len = ((buffer_t *)self->body)->len;
+    return 1;
+  }
+  if (self->map == NULL) {
+    tmp = (FILE *)self->body;
+    fflush(tmp);
+    fd = fileno(tmp);
+    if (fstat(fd, &info) == -1) {
+      PyErr_SetFromErrno(PyExc_IOError);
+      return -1;
+    }
+    if (info.st_size == 0) {
+      return 1;
+    }
+    self->map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (self->map == MAP_FAILED) {
+      self->map = NULL;
+      PyErr_SetFromErrno(PyExc_IOError);
+      return -1;
+    }
+    self->map_len = info.st_size;
+  }
+  *buf = self->map;
+  *len = self->map_len;
+  return 1;
+}
+
+static int RawRequest_getbuffer(RawRequestObject *self, Py_buffer *view,
+                                int flags) {
+  char *buf;
+  size_t len;
+
+  if (get_body(self, &buf, &len) == -1) {
+    view->obj = NULL;
+    return -1;
+  }
+  return PyBuffer_FillInfo(view, (PyObject *)self, buf, len, 1, flags);
+}
+
+static PyObject *RawRequest_get_method(RawRequestObject *self, void *closure) {
+  PyObject *o;
+
+  if (self->method >= 0 && self->method < METHOD_CACHE_SIZE) {
+    o = method_cache[self->method];
+    if (o == NULL) {
+      o = NATIVE_FROMSTRING(http_method_str(self->method));
+      method_cache[self->method] = o;
+    }
+    Py_XINCREF(o);
+    return o;
+  }
+  return NATIVE_FROMSTRING(http_method_str(self->method));
+}
+
+static PyObject *RawRequest_get_path(RawRequestObject *self, void *closure) {
+  const char *path, *query;
+  size_t path_len, query_len;
+  char *buf;
+
+  if (self->path == NULL) {
+    raw_request_target((PyObject *)self, &path, &path_len, &query, &query_len);
+    buf = PyMem_Malloc(path_len + 1);
+    if (buf == NULL) {
+      return PyErr_NoMemory();
+    }
+    // the same bytes the router matched
+    memcpy(buf, path, path_len);
+    self->path = LATIN1(buf, decode_path(buf, path_len));
+    PyMem_Free(buf);
+    if (self->path == NULL) {
+      return NULL;
+    }
+  }
+  Py_INCREF(self->path);
+  return self->path;
+}
+
+static PyObject *RawRequest_get_query(RawRequestObject *self, void *closure) {
+  const char *path, *query;
+  size_t path_len, query_len;
+
+  if (self->query == NULL) {
+    raw_request_target((PyObject *)self, &path, &path_len, &query, &query_len);
+    self->query = LATIN1(query ? query : "", query_len);
+    if (self->query == NULL) {
+      return NULL;
+    }
+  }
+  Py_INCREF(self->query);
+  return self->query;
+}
+
+static PyObject *RawRequest_get_version(RawRequestObject *self,
+                                        void *closure) {
+  return NATIVE_FROMSTRING(self->http_minor == 1 ? "HTTP/1.1" : "HTTP/1.0");
+}
+
+/* header name in lower case */
+static PyObject *field_name(RawRequestObject *self, raw_field_t *f) {
+  char temp[LIMIT_REQUEST_FIELD_SIZE];
+  uint32_t i;
+
+  for (i = 0; i < f->name_len; i++) {
+    temp[i] = tolower((unsigned char)self->head->buf[f->name + i]);
+  }
+  return LATIN1(temp, f->name_len);
+}
+
+static PyObject *RawRequest_get_headers(RawRequestObject *self,
+                                        void *closure) {
+  PyObject *dict, *name, *value, *prev, *joined;
+  raw_field_t *f;
+  uint32_t i;
+  int ret;
+
+  if (self->headers != NULL) {
+    Py_INCREF(self->headers);
+    return self->headers;
+  }
+  dict = PyDict_New();
+  if (dict == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < self->nfields; i++) {
+    f = &self->fields[i];
+    name = field_name(self, f);
+    if (name == NULL) {
+      goto error;
+    }
+    value = LATIN1(self->head->buf + f->value, f->value_len);
+    if (value == NULL) {
+      Py_DECREF(name);
+      goto error;
+    }
+    prev = PyDict_GetItem(dict, name);
+    if (prev != NULL) {
+      // repeated header, join with ", " like the environ
+#ifdef PY3
+      joined = PyUnicode_FromFormat("%U, %U", prev, value);
+#else
+      joined = PyBytes_FromFormat("%s, %s", PyBytes_AS_STRING(prev),
+                                  PyBytes_AS_STRING(value));
+#endif
+      Py_DECREF(value);
+      value = joined;
+      if (value == NULL) {
+        Py_DECREF(name);
+        goto error;
+      }
+    }
+    ret = PyDict_SetItem(dict, name, value);
+    Py_DECREF(name);
+    Py_DECREF(value);
+    if (ret == -1) {
+      goto error;
+    }
+  }
+  self->headers = dict;
+  Py_INCREF(dict);
+  return dict;
+error:
+  Py_DECREF(dict);
+  return NULL;
+}
+
+static PyObject *RawRequest_get_body(RawRequestObject *self, void *closure) {
+  return PyMemoryView_FromObject((PyObject *)self);
+}
+
+static PyObject *RawRequest_get_fileno(RawRequestObject *self, void *closure) {
+  return PyLong_FromLong(self->fd);
+}
+
+static PyObject *RawRequest_get_remote_addr(RawRequestObject *self,
+                                            void *closure) {
+  if (self->cli == NULL || self->cli->remote_addr == NULL) {
+    Py_RETURN_NONE;
+  }
+  return NATIVE_FROMSTRING(self->cli->remote_addr);
+}
+
+static PyObject *RawRequest_get_remote_port(RawRequestObject *self,
+                                            void *closure) {
+  if (self->cli == NULL) {
+    Py_RETURN_NONE;
+  }
+  return PyLong_FromLong(self->cli->remote_port);
+}
+
+static PyObject *RawRequest_get_keep_alive(RawRequestObject *self,
+                                           void *closure) {
+  return PyBool_FromLong(self->keep_alive);
+}
+
+static PyObject *RawRequest_header(RawRequestObject *self, PyObject *args) {
+  PyObject *name, *def = Py_None;
+  const char *s, *value;
+  Py_ssize_t len;
+  size_t value_len;
+
+  if (!PyArg_ParseTuple(args, "O|O:header", &name, &def)) {
+    return NULL;
+  }
+#ifdef PY3
+  if (!PyUnicode_Check(name)) {
+    PyErr_SetString(PyExc_TypeError, "header name must be a str");
+    return NULL;
+  }
+  s = PyUnicode_AsUTF8AndSize(name, &len);
+  if (s == NULL) {
+    return NULL;
+  }
+#else
+  if (PyBytes_AsStringAndSize(name, (char **)&s, &len) == -1) {
+    return NULL;
+  }
+#endif
+  value = raw_request_header((PyObject *)self, s, len, &value_len);
+  if (value == NULL) {
+    Py_INCREF(def);
+    return def;
+  }
+  return LATIN1(value, value_len);
+}
+
+static PyMethodDef RawRequest_methods[] = {
+    {"header", (PyCFunction)RawRequest_header, METH_VARARGS,
+     "header(name, default=None) value of a header, names are case "
+     "insensitive"},
+    {NULL, NULL}};
+
+static PyGetSetDef RawRequest_getset[] = {
+    {"method", (getter)RawRequest_get_method, NULL, "request method", NULL},
+    {"path", (getter)RawRequest_get_path, NULL, "decoded request path", NULL},
+    {"query", (getter)RawRequest_get_query, NULL, "query string", NULL},
+    {"version", (getter)RawRequest_get_version, NULL, "HTTP version", NULL},
+    {"headers", (getter)RawRequest_get_headers, NULL,
+     "dict of lower case header names", NULL},
+    {"body", (getter)RawRequest_get_body, NULL, "memoryview of the body",
+     NULL},
+    {"fileno", (getter)RawRequest_get_fileno, NULL, "client socket fd", NULL},
+    {"remote_addr", (getter)RawRequest_get_remote_addr, NULL, "client address",
+     NULL},
+    {"remote_port", (getter)RawRequest_get_remote_port, NULL, "client port",
+     NULL},
+    {"keep_alive", (getter)RawRequest_get_keep_alive, NULL,
+     "connection is kept after the response", NULL},
+    {NULL}};
+
+static PyBufferProcs RawRequest_as_buffer = {
+    .bf_getbuffer = (getbufferproc)RawRequest_getbuffer,
+    .bf_releasebuffer = NULL,
+};
+
+PyTypeObject RawRequestType = {
+#ifdef PY3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL) 0, /* ob_size */
+#endif
+        "meinheld.server.Request",   /*tp_name*/
+    sizeof(RawRequestObject),        /*tp_basicsize*/
+    0,                               /*tp_itemsize*/
+    (destructor)RawRequest_dealloc,  /*tp_dealloc*/
+    0,                               /*tp_print*/
+    0,                               /*tp_getattr*/
+    0,                               /*tp_setattr*/
+    0,                               /*tp_compare*/
+    0,                               /*tp_repr*/
+    0,                               /*tp_as_number*/
+    0,                               /*tp_as_sequence*/
+    0,                               /*tp_as_mapping*/
+    0,                               /*tp_hash */
+    0,                               /*tp_call*/
+    0,                               /*tp_str*/
+    0,                               /*tp_getattro*/
+    0,                               /*tp_setattro*/
+    &RawRequest_as_buffer,           /*tp_as_buffer*/
+#ifdef PY3
+    Py_TPFLAGS_DEFAULT, /*tp_flags*/
+#else
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+#endif
+    "run_raw request",  /* tp_doc */
+    0,                  /* tp_traverse */
+    0,                  /* tp_clear */
+    0,                  /* tp_richcompare */
+    0,                  /* tp_weaklistoffset */
+    0,                  /* tp_iter */
+    0,                  /* tp_iternext */
+    RawRequest_methods, /* tp_methods */
+    0,                  /* tp_members */
+    RawRequest_getset,  /* tp_getset */
+    0,                  /* tp_base */
+    0,                  /* tp_dict */
+    0,                  /* tp_descr_get */
+    0,                  /* tp_descr_set */
+    0,                  /* tp_dictoffset */
+    0,                  /* tp_init */
+    0,                  /* tp_alloc */
+    0,                  /* tp_new */
+};
+
+static PyObject *RawResponse_new(PyTypeObject *type, PyObject *args,
+                                 PyObject *kw) {
+  static char *keywords[] = {"body", "status", "headers", NULL};
+  PyObject *body = NULL, *headers = Py_None;
+  RawResponseObject *self;
+  int status = 200;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|SiO:Response", keywords, &body,
+                                   &status, &headers)) {
+    return NULL;
+  }
+  if (status < 100 || status > 999) {
+    PyErr_SetString(PyExc_ValueError, "status code is invalid");
+    return NULL;
+  }
+  if (headers != Py_None && !PyList_Check(headers) && !PyTuple_Check(headers)) {
+    PyErr_SetString(PyExc_TypeError, "response headers must be a list");
+    return NULL;
+  }
+  self = (RawResponseObject *)type->tp_alloc(type, 0);
+  if (self == NULL) {
+    return NULL;
+  }
+  if (body == NULL) {
+    body = PyBytes_FromStringAndSize("", 0);
+    if (body == NULL) {
+      Py_DECREF(self);
+      return NULL;
+    }
+  } else {
+    Py_INCREF(body);
+  }
+  self->status = status;
+  self->body = body;
+  Py_INCREF(headers);
+  self->headers = headers;
+  return (PyObject *)self;
+}
+
+static void RawResponse_dealloc(RawResponseObject *self) {
+  Py_XDECREF(self->headers);
+  Py_XDECREF(self->body);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyMemberDef RawResponse_members[] = {
+    {"status", T_INT, offsetof(RawResponseObject, status), READONLY,
+     "status code"},
+    {"headers", T_OBJECT, offsetof(RawResponseObject, headers), READONLY,
+     "list of (name, value)"},
+    {"body", T_OBJECT, offsetof(RawResponseObject, body), READONLY, "body"},
+    {NULL}};
+
+PyTypeObject RawResponseType = {
+#ifdef PY3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL) 0, /* ob_size */
+#endif
+        "meinheld.server.Response",  /*tp_name*/
+    sizeof(RawResponseObject),       /*tp_basicsize*/
+    0,                               /*tp_itemsize*/
+    (destructor)RawResponse_dealloc, /*tp_dealloc*/
+    0,                               /*tp_print*/
+    0,                               /*tp_getattr*/
+    0,                               /*tp_setattr*/
+    0,                               /*tp_compare*/
+    0,                               /*tp_repr*/
+    0,                               /*tp_as_number*/
+    0,                               /*tp_as_sequence*/
+    0,                               /*tp_as_mapping*/
+    0,                               /*tp_hash */
+    0,                               /*tp_call*/
+    0,                               /*tp_str*/
+    0,                               /*tp_getattro*/
+    0,                               /*tp_setattro*/
+    0,                               /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,              /*tp_flags*/
+    "Response(body=b'', status=200, headers=None) run_raw response. "
+    "Content-Length is set from the body", /* tp_doc */
+    0,                                     /* tp_traverse */
+    0,                                     /* tp_clear */
+    0,                                     /* tp_richcompare */
+    0,                                     /* tp_weaklistoffset */
+    0,                                     /* tp_iter */
+    0,                                     /* tp_iternext */
+    0,                                     /* tp_methods */
+    RawResponse_members,                   /* tp_members */
+    0,                                     /* tp_getset */
+    0,                                     /* tp_base */
+    0,                                     /* tp_dict */
+    0,                                     /* tp_descr_get */
+    0,                                     /* tp_descr_set */
+    0,                                     /* tp_dictoffset */
+    0,                                     /* tp_init */
+    0,                                     /* tp_alloc */
+    RawResponse_new,                       /* tp_new */
+};
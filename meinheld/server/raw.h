@@ -0,0 +1,95 @@
+#ifndef RAW_H
+#define RAW_H
+
+#include "buffer.h"
+#include "client.h"
+#include "meinheld.h"
+#include "request.h"
+
+/**
+ * run_raw() request and response objects.
+ *
+ * In raw mode the parser does not build an environ. The request line and
+ * the header names and values are appended as they are read to buffers of
+ * a RawRequestObject, Python strings are only made when the handler asks
+ * for them. The handler returns a RawResponseObject that response_start_raw
+ * writes with a single writev.
+ */
+
+typedef struct {
+  uint32_t name;  // offsets in head
+  uint32_t name_len;
+  uint32_t value;
+  uint32_t value_len;
+} raw_field_t;
+
+typedef struct {
+  PyObject_HEAD client_t *cli;  // NULL after the response
+  PyObject *client;             // ClientObject
+  int fd;
+  int method;
+  uint8_t http_minor;
+  uint8_t keep_alive;
+
+  buffer_t *url;   // request target
+  buffer_t *head;  // header names and values
+  raw_field_t *fields;
+  uint32_t nfields;
+  uint32_t fields_size;
+
+  void *body;
+  request_body_type body_type;
+  char *map;  // mmap of a tmpfile body
+  size_t map_len;
+
+  // made on first access
+  PyObject *path;
+  PyObject *query;
+  PyObject *headers;
+} RawRequestObject;
+
+typedef struct {
+  PyObject_HEAD int status;
+  PyObject *headers;  // sequence of (name, value) or None
+  PyObject *body;     // bytes
+} RawResponseObject;
+
+extern PyTypeObject RawRequestType;
+extern PyTypeObject RawResponseType;
+
+// run_raw, requests are handed to the handler as RawRequestObject
+extern int raw_mode;
+
+PyObject *RawRequest_New(client_t *cli);
+
+#define CheckRawRequest(o) (Py_TYPE(o) == &RawRequestType)
+#define CheckRawResponse(o) (Py_TYPE(o) == &RawResponseType)
+
+/* append to the current header name, a new one unless cont */
+buffer_result raw_request_field(PyObject *o, const char *buf, size_t len,
+                                int cont);
+
+/* append to the value of the last header name */
+buffer_result raw_request_value(PyObject *o, const char *buf, size_t len);
+
+/* header value by case-insensitive name, NULL if missing */
+const char *raw_request_header(PyObject *o, const char *name, size_t name_len,
+                               size_t *value_len);
+
+/* header value by its environ key (HTTP_X_ID), NULL if missing */
+const char *raw_request_env_header(PyObject *o, const char *key,
+                                   size_t key_len, size_t *value_len);
+
+/* split the request target at '?', path is not decoded */
+void raw_request_target(PyObject *o, const char **path, size_t *path_len,
+                        const char **query, size_t *query_len);
+
+/* take over the body of req */
+void raw_request_take_body(PyObject *o, request *req);
+
+/* forget the client, the connection may be reused */
+void raw_request_detach(PyObject *o);
+
+void raw_list_clear(void);
+
+#endif
@@ -91,6 +91,9 @@ request *shift_request(request_queue *q) {
   temp_req = req;
   req = req->next;
   q->head = req;
+  if (req == NULL) {
+    q->tail = NULL;
+  }
   q->size--;
   return temp_req;
 }
@@ -103,9 +106,63 @@ request *new_request(void) {
 }
 
 void free_request(request *req) {
+  Py_CLEAR(req->raw);
+  Py_CLEAR(req->app);
   Py_XDECREF(req->path);
   Py_XDECREF(req->field);
   Py_XDECREF(req->value);
   dealloc_request(req);
   // PyMem_Free(req);
 }
+
+static PyTypeObject RequestTimingType;
+
+static PyStructSequence_Field request_timing_fields[] = {
+    {"accept", "connection accepted"},
+    {"first_byte", "request started"},
+    {"headers_complete", "headers parsed"},
+    {"message_complete", "body read"},
+    {"app_start", "wsgi app called"},
+    {"app_end", "wsgi app returned"},
+    {"first_write", "response started"},
+    {"last_write", "response closed"},
+    {NULL, NULL}};
+
+static PyStructSequence_Desc request_timing_desc = {
+    "meinheld.server.RequestTiming",
+    "request phase timestamps, usec since the epoch. 0 if not reached",
+    request_timing_fields, sizeof(req_timing_t) / sizeof(uint64_t)};
+
+int init_request_timing_type(void) {
+  if (RequestTimingType.tp_name != NULL) {
+    return 0;
+  }
+#ifdef PY3
+  return PyStructSequence_InitType2(&RequestTimingType, &request_timing_desc);
+#else
+  PyStructSequence_InitType(&RequestTimingType, &request_timing_desc);
+  return 0;
+#endif
+}
+
+PyTypeObject *get_request_timing_type(void) { return &RequestTimingType; }
+
+PyObject *new_request_timing(req_timing_t *timing) {
+  PyObject *o, *v;
+  uint64_t *t = (uint64_t *)timing;
+  int i;
+
+  o = PyStructSequence_New(&RequestTimingType);
+  if (o == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < request_timing_desc.n_in_sequence; i++) {
+    v = PyLong_FromUnsignedLongLong(t[i]);
+    if (v == NULL) {
+      Py_DECREF(o);
+      return NULL;
+    }
+    PyStructSequence_SET_ITEM(o, i, v);
+  }
+  return o;
+}
@@ -23,12 +23,26 @@ typedef enum {
   VALUE,
 } field_type;
 
+// wall clock usec of each request phase, 0 if not reached
+typedef struct {
+  uint64_t accept;            // connection accepted
+  uint64_t first_byte;        // request started
+  uint64_t headers_complete;  // headers parsed
+  uint64_t message_complete;  // body read
+  uint64_t app_start;         // wsgi app called
+  uint64_t app_end;           // wsgi app returned
+  uint64_t first_write;       // response started
+  uint64_t last_write;        // response closed
+} req_timing_t;
+
 typedef struct {
   buffer_t *path;
   uint32_t num_headers;
   field_type last_header_element;
 
   PyObject *environ;
+  PyObject *raw;  // run_raw request, environ is NULL
+  PyObject *app;  // routed callable or Response, NULL is the app
   void *next;
 
   int method;
@@ -41,6 +55,7 @@ typedef struct {
   PyObject *field;
   PyObject *value;
   uintptr_t start_msec;
+  req_timing_t timing;
 } request;
 
 typedef struct {
@@ -67,4 +82,10 @@ void request_list_fill(void);
 
 void request_list_clear(void);
 
+int init_request_timing_type(void);
+
+PyTypeObject *get_request_timing_type(void);
+
+PyObject *new_request_timing(req_timing_t *timing);
+
 #endif
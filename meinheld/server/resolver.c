@@ -0,0 +1,1034 @@
+#include "resolver.h"
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <math.h>
+#include <strings.h>
+#ifdef linux
+#include <sys/syscall.h>
+#endif
+
+#include "server.h"
+#include "util.h"
+
+#define DNS_PORT 53
+#define DNS_MAX_SERVERS 3
+#define DNS_MAX_SEARCH 6
+#define DNS_MAX_NAME 255
+#define DNS_BUFFER_SIZE 4096
+#define DNS_CACHE_SIZE 1024
+#define DNS_RELOAD_MSEC 5000
+#define DNS_ID_POOL 256
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+#define DNS_RCODE_NXDOMAIN 3
+
+#define WOULD_BLOCK(e) ((e) == EAGAIN || (e) == EWOULDBLOCK)
+
+enum { QUERY_PENDING = 0, QUERY_DONE, QUERY_FAILED };
+
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t len;
+} nameserver_t;
+
+typedef struct {
+  int qtype;
+  int family;
+  int state;
+  int cached;  // answered from the cache
+  uint16_t id;
+  uint32_t ttl;
+  PyObject *addrs;  // [str], empty for a negative answer
+} query_t;
+
+static char conf_path[PATH_MAX] = "/etc/resolv.conf";
+static char hosts_path[PATH_MAX] = "/etc/hosts";
+
+static nameserver_t servers[DNS_MAX_SERVERS];
+static int server_cnt = 0;
+static int fixed_servers = 0;  // given by resolver_configure
+static char *search[DNS_MAX_SEARCH];
+static int search_cnt = 0;
+static int ndots = 1;
+static int query_timeout = 5;  // sec
+static int attempts = 2;
+
+static int loaded = 0;
+static uintptr_t checked_msec = 0;
+static time_t conf_mtime = 0;
+static time_t hosts_mtime = 0;
+
+static PyObject *hosts = NULL;  // {name: [(family, addr)]}
+static PyObject *cache = NULL;  // {(name, qtype): (expire msec, [addr])}
+
+static PyObject *gaierror = NULL;
+static PyObject *system_getaddrinfo = NULL;
+
+static uint16_t id_pool[DNS_ID_POOL];
+static int id_left = 0;
+static uint32_t id_seed = 0;
+
+static inline uint16_t get16(const uint8_t *p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int read_random(void *buf, size_t len) {
+  ssize_t n;
+  int fd;
+
+#if defined(linux) && defined(SYS_getrandom)
+  n = syscall(SYS_getrandom, buf, len, 0);
+  if (n == (ssize_t)len) {
+    return 0;
+  }
+#endif
+  fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  n = read(fd, buf, len);
+  close(fd);
+  return n == (ssize_t)len ? 0 : -1;
+}
+
+/* query ids are unpredictable, an off-path spoofer has to guess them */
+static uint16_t next_id(void) {
+  if (id_left == 0 && read_random(id_pool, sizeof(id_pool)) == 0) {
+    id_left = DNS_ID_POOL;
+  }
+  if (id_left > 0) {
+    return id_pool[--id_left];
+  }
+  // no entropy source (chroot without /dev), xorshift
+  if (id_seed == 0) {
+    id_seed = (uint32_t)get_current_usec() ^ ((uint32_t)getpid() << 16) ^ 1;
+  }
+  id_seed ^= id_seed << 13;
+  id_seed ^= id_seed >> 17;
+  id_seed ^= id_seed << 5;
+  return (uint16_t)id_seed;
+}
+
+static double monotonic(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int is_numeric_host(const char *host) {
+  struct in6_addr addr;
+
+  return inet_pton(AF_INET, host, &addr) == 1 ||
+         inet_pton(AF_INET6, host, &addr) == 1 || strchr(host, '%') != NULL;
+}
+
+static int parse_server(const char *host, int port, nameserver_t *ns) {
+  struct sockaddr_in *in = (struct sockaddr_in *)&ns->addr;
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&ns->addr;
+
+  memset(ns, 0, sizeof(nameserver_t));
+  if (inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    ns->len = sizeof(struct sockaddr_in);
+    return 0;
+  }
+  if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port);
+    ns->len = sizeof(struct sockaddr_in6);
+    return 0;
+  }
+  return -1;
+}
+
+static void clear_search(void) {
+  int i;
+
+  for (i = 0; i < search_cnt; i++) {
+    PyMem_Free(search[i]);
+  }
+  search_cnt = 0;
+}
+
+static void add_search(const char *domain) {
+  size_t len = strlen(domain);
+
+  if (search_cnt >= DNS_MAX_SEARCH || len == 0 || len >= DNS_MAX_NAME) {
+    return;
+  }
+  search[search_cnt] = PyMem_Malloc(len + 1);
+  if (search[search_cnt] != NULL) {
+    memcpy(search[search_cnt], domain, len + 1);
+    search_cnt++;
+  }
+}
+
+static void load_conf(void) {
+  FILE *fp;
+  char line[1024], *tok, *save;
+
+  clear_search();
+  ndots = 1;
+  query_timeout = 5;
+  attempts = 2;
+  if (!fixed_servers) {
+    server_cnt = 0;
+  }
+
+  fp = fopen(conf_path, "r");
+  while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+    tok = strtok_r(line, " \t\r\n", &save);
+    if (tok == NULL || tok[0] == '#' || tok[0] == ';') {
+      continue;
+    }
+    if (strcmp(tok, "nameserver") == 0) {
+      tok = strtok_r(NULL, " \t\r\n", &save);
+      if (tok != NULL && !fixed_servers && server_cnt < DNS_MAX_SERVERS &&
+          parse_server(tok, DNS_PORT, &servers[server_cnt]) == 0) {
+        server_cnt++;
+      }
+    } else if (strcmp(tok, "search") == 0 || strcmp(tok, "domain") == 0) {
+      // the last one wins
+      clear_search();
+      while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        add_search(tok);
+      }
+    } else if (strcmp(tok, "options") == 0) {
+      while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        if (strncmp(tok, "ndots:", 6) == 0) {
+          ndots = atoi(tok + 6);
+        } else if (strncmp(tok, "timeout:", 8) == 0) {
+          query_timeout = atoi(tok + 8);
+        } else if (strncmp(tok, "attempts:", 9) == 0) {
+          attempts = atoi(tok + 9);
+        }
+      }
+    }
+  }
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  ndots = ndots < 0 ? 0 : ndots > 15 ? 15 : ndots;
+  query_timeout =
+      query_timeout < 1 ? 1 : query_timeout > 30 ? 30 : query_timeout;
+  attempts = attempts < 1 ? 1 : attempts > 5 ? 5 : attempts;
+  if (server_cnt == 0) {
+    parse_server("127.0.0.1", DNS_PORT, &servers[0]);
+    server_cnt = 1;
+  }
+}
+
+static void lower(char *s) {
+  for (; *s; s++) {
+    if (*s >= 'A' && *s <= 'Z') {
+      *s += 'a' - 'A';
+    }
+  }
+}
+
+static int add_host(PyObject *dict, char *name, int family, const char *addr) {
+  PyObject *list, *item;
+  int ret;
+
+  lower(name);
+  list = PyDict_GetItemString(dict, name);
+  if (list == NULL) {
+    list = PyList_New(0);
+    if (list == NULL || PyDict_SetItemString(dict, name, list) == -1) {
+      Py_XDECREF(list);
+      return -1;
+    }
+    Py_DECREF(list);
+  }
+  item = Py_BuildValue("(is)", family, addr);
+  if (item == NULL) {
+    return -1;
+  }
+  ret = PyList_Append(list, item);
+  Py_DECREF(item);
+  return ret;
+}
+
+static int load_hosts(void) {
+  FILE *fp;
+  PyObject *dict;
+  char line[1024], *tok, *save, *addr, *p;
+  struct in6_addr buf;
+  int family;
+
+  dict = PyDict_New();
+  if (dict == NULL) {
+    return -1;
+  }
+  fp = fopen(hosts_path, "r");
+  while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+    p = strchr(line, '#');
+    if (p != NULL) {
+      *p = '\0';
+    }
+    addr = strtok_r(line, " \t\r\n", &save);
+    if (addr == NULL) {
+      continue;
+    }
+    if (inet_pton(AF_INET, addr, &buf) == 1) {
+      family = AF_INET;
+    } else if (inet_pton(AF_INET6, addr, &buf) == 1) {
+      family = AF_INET6;
+    } else {
+      continue;
+    }
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+      if (add_host(dict, tok, family, addr) == -1) {
+        fclose(fp);
+        Py_DECREF(dict);
+        return -1;
+      }
+    }
+  }
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  Py_XDECREF(hosts);
+  hosts = dict;
+  return 0;
+}
+
+static time_t file_mtime(const char *path) {
+  struct stat st;
+
+  if (stat(path, &st) == -1) {
+    return 0;
+  }
+  return st.st_mtime;
+}
+
+static void check_reload(void) {
+  uintptr_t now = get_current_msec();
+  time_t mtime;
+
+  if (loaded && now - checked_msec < DNS_RELOAD_MSEC) {
+    return;
+  }
+  checked_msec = now;
+  mtime = file_mtime(conf_path);
+  if (!loaded || mtime != conf_mtime) {
+    conf_mtime = mtime;
+    load_conf();
+    if (cache != NULL) {
+      PyDict_Clear(cache);
+    }
+  }
+  mtime = file_mtime(hosts_path);
+  if (!loaded || mtime != hosts_mtime) {
+    hosts_mtime = mtime;
+    if (load_hosts() == -1) {
+      // keep the old table
+      PyErr_Clear();
+    }
+  }
+  loaded = 1;
+}
+
+static PyObject *cache_get(PyObject *key) {
+  PyObject *entry;
+  unsigned long long expire;
+
+  entry = PyDict_GetItem(cache, key);
+  if (entry == NULL) {
+    return NULL;
+  }
+  expire = PyLong_AsUnsignedLongLong(PyTuple_GET_ITEM(entry, 0));
+  if (expire > get_current_msec()) {
+    return PyTuple_GET_ITEM(entry, 1);
+  }
+  PyDict_DelItem(cache, key);
+  return NULL;
+}
+
+static void cache_put(PyObject *key, PyObject *addrs, uint32_t ttl) {
+  PyObject *entry, *k, *v;
+  Py_ssize_t pos = 0;
+  unsigned long long now = get_current_msec();
+
+  if (ttl == 0) {
+    return;
+  }
+  if (PyDict_Size(cache) >= DNS_CACHE_SIZE) {
+    entry = PyList_New(0);
+    while (entry && PyDict_Next(cache, &pos, &k, &v)) {
+      if (PyLong_AsUnsignedLongLong(PyTuple_GET_ITEM(v, 0)) <= now) {
+        PyList_Append(entry, k);
+      }
+    }
+    for (pos = 0; entry && pos < PyList_GET_SIZE(entry); pos++) {
+      PyDict_DelItem(cache, PyList_GET_ITEM(entry, pos));
+    }
+    Py_XDECREF(entry);
+    if (PyDict_Size(cache) >= DNS_CACHE_SIZE) {
+      PyDict_Clear(cache);
+    }
+  }
+  entry = Py_BuildValue("(KO)", now + (unsigned long long)ttl * 1000, addrs);
+  if (entry == NULL || PyDict_SetItem(cache, key, entry) == -1) {
+    PyErr_Clear();
+  }
+  Py_XDECREF(entry);
+}
+
+static int build_query(uint8_t *buf, size_t size, uint16_t id,
+                       const char *name, int qtype) {
+  const char *label, *dot;
+  size_t len, off = 12;
+
+  if (size < 12 + DNS_MAX_NAME + 5) {
+    return -1;
+  }
+  memset(buf, 0, 12);
+  buf[0] = id >> 8;
+  buf[1] = id & 0xff;
+  buf[2] = 0x01;  // RD
+  buf[5] = 1;     // QDCOUNT
+  for (label = name; *label; label = dot + 1) {
+    dot = strchr(label, '.');
+    if (dot == NULL) {
+      dot = label + strlen(label);
+    }
+    len = dot - label;
+    if (len == 0 || len > 63 || off + len + 1 > 12 + DNS_MAX_NAME) {
+      return -1;
+    }
+    buf[off++] = (uint8_t)len;
+    memcpy(buf + off, label, len);
+    off += len;
+    if (*dot == '\0') {
+      break;
+    }
+  }
+  buf[off++] = 0;
+  buf[off++] = qtype >> 8;
+  buf[off++] = qtype & 0xff;
+  buf[off++] = 0;
+  buf[off++] = DNS_CLASS_IN;
+  return (int)off;
+}
+
+static int skip_name(const uint8_t *p, size_t len, size_t *off) {
+  uint8_t c;
+
+  while (*off < len) {
+    c = p[*off];
+    if (c == 0) {
+      (*off)++;
+      return 0;
+    }
+    if ((c & 0xc0) == 0xc0) {
+      *off += 2;
+      return *off <= len ? 0 : -1;
+    }
+    if (c & 0xc0) {
+      return -1;
+    }
+    *off += c + 1;
+  }
+  return -1;
+}
+
+/* does the question echo the name that was asked, case insensitive */
+static int match_name(const uint8_t *p, size_t len, size_t *off,
+                      const char *name) {
+  const char *label = name;
+  size_t n;
+  uint8_t c;
+
+  while (*off < len) {
+    c = p[*off];
+    if (c == 0) {
+      (*off)++;
+      return *label == '\0' ? 0 : -1;
+    }
+    // a question is never compressed
+    if ((c & 0xc0) || *off + 1 + c > len) {
+      return -1;
+    }
+    n = strcspn(label, ".");
+    if (n != c || strncasecmp(label, (const char *)p + *off + 1, n) != 0) {
+      return -1;
+    }
+    label += n;
+    if (*label == '.') {
+      label++;
+    }
+    *off += c + 1;
+  }
+  return -1;
+}
+
+/* TTL for a negative answer, from the SOA in the authority section */
+static uint32_t negative_ttl(const uint8_t *p, size_t len, size_t off,
+                             int count) {
+  size_t rdata;
+  uint32_t ttl, minimum;
+  uint16_t rdlen;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (skip_name(p, len, &off) == -1 || off + 10 > len) {
+      return 0;
+    }
+    ttl = get32(p + off + 4);
+    rdlen = get16(p + off + 8);
+    rdata = off + 10;
+    if (get16(p + off) == DNS_TYPE_SOA) {
+      // mname, rname, serial, refresh, retry, expire, minimum
+      if (skip_name(p, len, &rdata) == -1 || skip_name(p, len, &rdata) == -1 ||
+          rdata + 20 > off + 10 + rdlen || rdata + 20 > len) {
+        return 0;
+      }
+      minimum = get32(p + rdata + 16);
+      return ttl < minimum ? ttl : minimum;
+    }
+    off += 10 + rdlen;
+  }
+  return 0;
+}
+
+/**
+ * fill the query the packet answers, a malformed one or one that doesn't
+ * echo our id, name and type is dropped.
+ */
+static void parse_response(const uint8_t *p, size_t len, const char *name,
+                           query_t *queries, int nq) {
+  query_t *q = NULL;
+  PyObject *addrs, *s;
+  size_t off = 12;
+  uint16_t flags, qdcount, ancount, rdlen, type;
+  uint32_t ttl, min_ttl = UINT32_MAX;
+  char addr[INET6_ADDRSTRLEN];
+  int i, rcode;
+
+  if (len < 12) {
+    return;
+  }
+  for (i = 0; i < nq; i++) {
+    if (queries[i].state == QUERY_PENDING && queries[i].id == get16(p)) {
+      q = &queries[i];
+    }
+  }
+  flags = get16(p + 2);
+  qdcount = get16(p + 4);
+  ancount = get16(p + 6);
+  if (q == NULL || !(flags & 0x8000) || qdcount != 1) {
+    return;
+  }
+  if (match_name(p, len, &off, name) == -1 || off + 4 > len ||
+      get16(p + off) != q->qtype || get16(p + off + 2) != DNS_CLASS_IN) {
+    return;
+  }
+  off += 4;
+  rcode = flags & 0xf;
+  if (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN) {
+    // SERVFAIL, REFUSED, ... ask the next server
+    q->state = QUERY_FAILED;
+    return;
+  }
+
+  addrs = PyList_New(0);
+  if (addrs == NULL) {
+    PyErr_Clear();
+    return;
+  }
+  for (i = 0; i < ancount; i++) {
+    if (skip_name(p, len, &off) == -1 || off + 10 > len) {
+      Py_DECREF(addrs);
+      return;
+    }
+    type = get16(p + off);
+    ttl = get32(p + off + 4);
+    rdlen = get16(p + off + 8);
+    off += 10;
+    if (off + rdlen > len) {
+      Py_DECREF(addrs);
+      return;
+    }
+    if (get16(p + off - 8) == DNS_CLASS_IN &&
+        (type == q->qtype || type == DNS_TYPE_CNAME)) {
+      if (ttl < min_ttl) {
+        min_ttl = ttl;
+      }
+      if ((type == DNS_TYPE_A && rdlen == 4) ||
+          (type == DNS_TYPE_AAAA && rdlen == 16)) {
+        inet_ntop(q->family, p + off, addr, sizeof(addr));
+        s = NATIVE_FROMSTRING(addr);
+        if (s == NULL || PyList_Append(addrs, s) == -1) {
+          PyErr_Clear();
+        }
+        Py_XDECREF(s);
+      }
+    }
+    off += rdlen;
+  }
+  if (PyList_GET_SIZE(addrs) == 0) {
+    min_ttl = negative_ttl(p, len, off, get16(p + 8));
+  }
+  q->addrs = addrs;
+  q->ttl = min_ttl == UINT32_MAX ? 0 : min_ttl;
+  q->state = QUERY_DONE;
+}
+
+static int count_pending(query_t *queries, int nq) {
+  int i, n = 0;
+
+  for (i = 0; i < nq; i++) {
+    if (queries[i].state == QUERY_PENDING) {
+      n++;
+    }
+  }
+  return n;
+}
+
+/* ask one server, 0 when every query is done */
+static int ask_server(nameserver_t *ns, const char *name, query_t *queries,
+                      int nq) {
+  uint8_t buf[DNS_BUFFER_SIZE];
+  double deadline, left;
+  ssize_t n;
+  int fd, i, len;
+
+  fd = socket(ns->addr.ss_family, SOCK_DGRAM, 0);
+  if (fd == -1) {
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+  }
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+      fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+      connect(fd, (struct sockaddr *)&ns->addr, ns->len) == -1) {
+    close(fd);
+    return 1;
+  }
+  for (i = 0; i < nq; i++) {
+    if (queries[i].state == QUERY_DONE) {
+      continue;
+    }
+    queries[i].state = QUERY_PENDING;
+    do {
+      queries[i].id = next_id();
+    } while (i > 0 && queries[i].id == queries[i - 1].id);
+    len = build_query(buf, sizeof(buf), queries[i].id, name, queries[i].qtype);
+    if (len < 0 || send(fd, buf, len, 0) != len) {
+      queries[i].state = QUERY_FAILED;
+    }
+  }
+
+  deadline = monotonic() + query_timeout;
+  while (count_pending(queries, nq) > 0) {
+    n = recv(fd, buf, sizeof(buf), 0);
+    if (n > 0) {
+      parse_response(buf, n, name, queries, nq);
+      continue;
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && !WOULD_BLOCK(errno)) {
+      // ECONNREFUSED, nothing listens there
+      break;
+    }
+    left = deadline - monotonic();
+    if (left <= 0) {
+      break;
+    }
+    if (green_wait_msec(fd, PICOEV_READ, (int)ceil(left * 1000)) == -1) {
+      if (!PyErr_ExceptionMatches(timeout_error)) {
+        green_cancel(fd);
+        close(fd);
+        return -1;
+      }
+      PyErr_Clear();
+    }
+  }
+  close(fd);
+  for (i = 0; i < nq; i++) {
+    if (queries[i].state != QUERY_DONE) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* 0 all answered, 1 some got no answer, -1 error */
+static int run_queries(const char *name, query_t *queries, int nq) {
+  int attempt, i, ret;
+
+  for (attempt = 0; attempt < attempts; attempt++) {
+    for (i = 0; i < server_cnt; i++) {
+      ret = ask_server(&servers[i], name, queries, nq);
+      if (ret <= 0) {
+        return ret;
+      }
+    }
+  }
+  return 1;
+}
+
+static void clear_queries(query_t *queries, int nq) {
+  int i;
+
+  for (i = 0; i < nq; i++) {
+    Py_CLEAR(queries[i].addrs);
+  }
+}
+
+/* resolve one fully qualified name, appends (family, addr) to result */
+static int lookup(const char *name, query_t *queries, int nq,
+                  PyObject *result, int *answered) {
+  PyObject *key, *addrs, *item;
+  Py_ssize_t j;
+  int i, ret = 0, pending = 0;
+
+  *answered = 1;
+  for (i = 0; i < nq; i++) {
+    queries[i].state = QUERY_FAILED;
+    queries[i].cached = 0;
+    key = Py_BuildValue("(si)", name, queries[i].qtype);
+    if (key == NULL) {
+      return -1;
+    }
+    addrs = cache_get(key);
+    Py_DECREF(key);
+    if (addrs != NULL) {
+      Py_INCREF(addrs);
+      queries[i].addrs = addrs;
+      queries[i].state = QUERY_DONE;
+      queries[i].cached = 1;
+    } else {
+      pending++;
+    }
+  }
+  if (pending > 0) {
+    ret = run_queries(name, queries, nq);
+    if (ret == -1) {
+      clear_queries(queries, nq);
+      return -1;
+    }
+  }
+  for (i = 0; i < nq; i++) {
+    if (queries[i].state != QUERY_DONE) {
+      *answered = 0;
+      continue;
+    }
+    if (!queries[i].cached) {
+      key = Py_BuildValue("(si)", name, queries[i].qtype);
+      if (key != NULL) {
+        cache_put(key, queries[i].addrs, queries[i].ttl);
+        Py_DECREF(key);
+      }
+      PyErr_Clear();
+    }
+    for (j = 0; j < PyList_GET_SIZE(queries[i].addrs); j++) {
+      item = Py_BuildValue("(iO)", queries[i].family,
+                           PyList_GET_ITEM(queries[i].addrs, j));
+      if (item == NULL || PyList_Append(result, item) == -1) {
+        Py_XDECREF(item);
+        clear_queries(queries, nq);
+        return -1;
+      }
+      Py_DECREF(item);
+    }
+  }
+  clear_queries(queries, nq);
+  return 0;
+}
+
+static int from_hosts(const char *name, int family, PyObject *result) {
+  PyObject *list, *item;
+  Py_ssize_t i;
+  int pass, f;
+
+  list = PyDict_GetItemString(hosts, name);
+  if (list == NULL) {
+    return 0;
+  }
+  // IPv4 first, the listeners mostly bind 0.0.0.0
+  for (pass = 0; pass < 2; pass++) {
+    f = pass == 0 ? AF_INET : AF_INET6;
+    if (family != AF_UNSPEC && family != f) {
+      continue;
+    }
+    for (i = 0; i < PyList_GET_SIZE(list); i++) {
+      item = PyList_GET_ITEM(list, i);
+      if (PyLong_AsLong(PyTuple_GET_ITEM(item, 0)) == f &&
+          PyList_Append(result, item) == -1) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+static int is_localhost(const char *name) {
+  size_t len = strlen(name);
+
+  return strcmp(name, "localhost") == 0 ||
+         (len > 10 && strcmp(name + len - 10, ".localhost") == 0);
+}
+
+static PyObject *set_gaierror(int code, const char *msg) {
+  PyObject *v;
+
+  v = Py_BuildValue("(is)", code, msg);
+  if (v != NULL) {
+    PyErr_SetObject(gaierror, v);
+    Py_DECREF(v);
+  }
+  return NULL;
+}
+
+/* [(family, addr)] for name, IPv4 first */
+static PyObject *resolve(const char *host, int family) {
+  PyObject *result;
+  query_t queries[2];
+  char name[DNS_MAX_NAME + 1], fqdn[DNS_MAX_NAME + 1];
+  size_t len;
+  int nq = 0, i, dots = 0, absolute = 0, answered, all_answered = 1;
+
+  len = strlen(host);
+  if (len == 0 || len > DNS_MAX_NAME) {
+    return set_gaierror(EAI_NONAME, "Name or service not known");
+  }
+  memcpy(name, host, len + 1);
+  lower(name);
+  if (name[len - 1] == '.') {
+    name[--len] = '\0';
+    absolute = 1;
+  }
+  for (i = 0; name[i]; i++) {
+    dots += name[i] == '.';
+  }
+
+  result = PyList_New(0);
+  if (result == NULL) {
+    return NULL;
+  }
+  check_reload();
+  if (hosts != NULL && from_hosts(name, family, result) == -1) {
+    goto error;
+  }
+  if (PyList_GET_SIZE(result) > 0) {
+    return result;
+  }
+  if (is_localhost(name)) {
+    Py_DECREF(result);
+    return Py_BuildValue("[(is)]", family == AF_INET6 ? AF_INET6 : AF_INET,
+                         family == AF_INET6 ? "::1" : "127.0.0.1");
+  }
+
+  memset(queries, 0, sizeof(queries));
+  if (family != AF_INET6) {
+    queries[nq].qtype = DNS_TYPE_A;
+    queries[nq++].family = AF_INET;
+  }
+  if (family != AF_INET) {
+    queries[nq].qtype = DNS_TYPE_AAAA;
+    queries[nq++].family = AF_INET6;
+  }
+
+  // as given first when it has enough dots, then with each search domain
+  if (absolute || dots >= ndots) {
+    if (lookup(name, queries, nq, result, &answered) == -1) {
+      goto error;
+    }
+    all_answered &= answered;
+  }
+  for (i = 0; !absolute && i < search_cnt && PyList_GET_SIZE(result) == 0;
+       i++) {
+    if (len + strlen(search[i]) + 1 > DNS_MAX_NAME) {
+      continue;
+    }
+    snprintf(fqdn, sizeof(fqdn), "%s.%s", name, search[i]);
+    if (lookup(fqdn, queries, nq, result, &answered) == -1) {
+      goto error;
+    }
+    all_answered &= answered;
+  }
+  if (!absolute && dots < ndots && PyList_GET_SIZE(result) == 0) {
+    if (lookup(name, queries, nq, result, &answered) == -1) {
+      goto error;
+    }
+    all_answered &= answered;
+  }
+  if (PyList_GET_SIZE(result) == 0) {
+    Py_DECREF(result);
+    if (!all_answered) {
+      return set_gaierror(EAI_AGAIN, "Temporary failure in name resolution");
+    }
+    return set_gaierror(EAI_NONAME, "Name or service not known");
+  }
+  return result;
+
+error:
+  Py_DECREF(result);
+  return NULL;
+}
+
+static int init_resolver(void) {
+  PyObject *m;
+
+  if (cache != NULL) {
+    return 0;
+  }
+  m = PyImport_ImportModule("_socket");
+  if (m == NULL) {
+    return -1;
+  }
+  gaierror = PyObject_GetAttrString(m, "gaierror");
+  system_getaddrinfo = PyObject_GetAttrString(m, "getaddrinfo");
+  Py_DECREF(m);
+  if (gaierror == NULL || system_getaddrinfo == NULL) {
+    Py_CLEAR(gaierror);
+    Py_CLEAR(system_getaddrinfo);
+    return -1;
+  }
+  cache = PyDict_New();
+  return cache == NULL ? -1 : 0;
+}
+
+int resolver_configure(const char *conf, const char *hosts_file,
+                       PyObject *nameservers) {
+  PyObject *seq, *item;
+  nameserver_t ns[DNS_MAX_SERVERS];
+  Py_ssize_t i, n = 0;
+  char *host;
+  int port;
+
+  if (init_resolver() == -1) {
+    return -1;
+  }
+  if ((conf && strlen(conf) >= PATH_MAX) ||
+      (hosts_file && strlen(hosts_file) >= PATH_MAX)) {
+    PyErr_SetString(PyExc_ValueError, "path too long");
+    return -1;
+  }
+  if (nameservers != NULL) {
+    seq = PySequence_Fast(nameservers, "nameservers must be a list");
+    if (seq == NULL) {
+      return -1;
+    }
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (n == 0 || n > DNS_MAX_SERVERS) {
+      Py_DECREF(seq);
+      PyErr_SetString(PyExc_ValueError, "nameservers value out of range ");
+      return -1;
+    }
+    for (i = 0; i < n; i++) {
+      item = PySequence_Fast_GET_ITEM(seq, i);
+      port = DNS_PORT;
+      if (PyTuple_Check(item)) {
+        if (!PyArg_ParseTuple(item, "si", &host, &port)) {
+          Py_DECREF(seq);
+          return -1;
+        }
+      } else if (!PyArg_Parse(item, "s", &host)) {
+        Py_DECREF(seq);
+        return -1;
+      }
+      if (port <= 0 || port > 65535 || parse_server(host, port, &ns[i]) == -1) {
+        Py_DECREF(seq);
+        PyErr_Format(PyExc_ValueError, "invalid nameserver %s", host);
+        return -1;
+      }
+    }
+    Py_DECREF(seq);
+  }
+
+  strcpy(conf_path, conf ? conf : "/etc/resolv.conf");
+  strcpy(hosts_path, hosts_file ? hosts_file : "/etc/hosts");
+  fixed_servers = n > 0;
+  server_cnt = (int)n;
+  memcpy(servers, ns, sizeof(nameserver_t) * n);
+  loaded = 0;
+  PyDict_Clear(cache);
+  return 0;
+}
+
+PyObject *resolver_getaddrinfo(PyObject *host, PyObject *port, int family,
+                               int type, int proto, int flags) {
+  PyObject *name = NULL, *waiter, *addrs = NULL, *result = NULL, *res, *item;
+  Py_ssize_t i;
+
+  if (init_resolver() == -1) {
+    return NULL;
+  }
+  if (host == Py_None || (flags & AI_NUMERICHOST) ||
+      (family != AF_UNSPEC && family != AF_INET && family != AF_INET6)) {
+    goto system;
+  }
+  if (PyUnicode_Check(host)) {
+    name = PyUnicode_AsUTF8String(host);
+    if (name == NULL) {
+      return NULL;
+    }
+    if (!is_numeric_host(PyBytes_AS_STRING(name))) {
+      Py_DECREF(name);
+      name = PyUnicode_AsEncodedString(host, "idna", NULL);
+      if (name == NULL) {
+        return NULL;
+      }
+    }
+  } else if (PyBytes_Check(host)) {
+    name = host;
+    Py_INCREF(name);
+  } else {
+    goto system;
+  }
+  if (is_numeric_host(PyBytes_AS_STRING(name))) {
+    goto system;
+  }
+  waiter = green_current();
+  if (waiter == NULL) {
+    // not on a greenlet, nothing else to run meanwhile
+    PyErr_Clear();
+    goto system;
+  }
+  Py_DECREF(waiter);
+
+  addrs = resolve(PyBytes_AS_STRING(name), family);
+  Py_DECREF(name);
+  if (addrs == NULL) {
+    return NULL;
+  }
+  result = PyList_New(0);
+  for (i = 0; result && i < PyList_GET_SIZE(addrs); i++) {
+    // numeric, only the service and the tuples are left to do
+    item = PyList_GET_ITEM(addrs, i);
+    res = PyObject_CallFunction(system_getaddrinfo, "OOiiii",
+                                PyTuple_GET_ITEM(item, 1), port,
+                                (int)PyLong_AsLong(PyTuple_GET_ITEM(item, 0)),
+                                type, proto, flags | AI_NUMERICHOST);
+    if (res == NULL || PyList_SetSlice(result, PY_SSIZE_T_MAX, PY_SSIZE_T_MAX,
+                                       res) == -1) {
+      Py_XDECREF(res);
+      Py_CLEAR(result);
+      break;
+    }
+    Py_DECREF(res);
+  }
+  Py_DECREF(addrs);
+  return result;
+
+system:
+  Py_XDECREF(name);
+  return PyObject_CallFunction(system_getaddrinfo, "OOiiii", host, port,
+                               family, type, proto, flags);
+}
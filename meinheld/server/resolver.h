@@ -0,0 +1,31 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include "meinheld.h"
+
+/**
+ * Green DNS resolver.
+ *
+ * Names are looked up in the hosts file first, then queried over UDP (A and
+ * AAAA at once) from the nameservers of resolv.conf, honouring its search,
+ * ndots, timeout and attempts options. The query socket is waited on through
+ * the loop, so only the calling greenlet blocks. Answers are cached for their
+ * TTL, a negative answer for the SOA minimum. Both files are read again when
+ * they change.
+ *
+ * Outside a greenlet, and for numeric hosts, the system getaddrinfo is used.
+ */
+
+/* reset the configuration and the cache. NULL paths keep the defaults,
+ * nameservers (a list of "addr" or ("addr", port)) replace the ones of
+ * resolv.conf when not NULL */
+int resolver_configure(const char *conf, const char *hosts,
+                       PyObject *nameservers);
+
+/* socket.getaddrinfo() */
+PyObject *resolver_getaddrinfo(PyObject *host, PyObject *port, int family,
+                               int type, int proto, int flags);
+
+int is_numeric_host(const char *host);
+
+#endif
@@ -2,7 +2,11 @@
 
 #include "log.h"
 #include "meinheld.h"
+#include "probes.h"
+#include "raw.h"
+#include "stats.h"
 #include "util.h"
+#include "zerocopy.h"
 
 #define CRLF "\r\n"
 #define DELIM ": "
@@ -15,6 +19,10 @@
   "HTTP/1.0 503 Service Unavailable\r\nContent-Type: " \
   "text/html\r\nServer: " SERVER "\r\n\r\n"
 
+#define H_MSG_503_RETRY                                \
+  "HTTP/1.0 503 Service Unavailable\r\nContent-Type: " \
+  "text/html\r\nServer: " SERVER "\r\nRetry-After: %d\r\n\r\n"
+
 #define H_MSG_400                                                          \
   "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\nServer: " SERVER \
   "\r\n\r\n"
@@ -48,6 +56,10 @@
       "<html><head><title>Service Unavailable</title></head><body><p>Service " \
       "Unavailable.</p></body></html>"
 
+#define B_MSG_503                                                           \
+  "<html><head><title>Service Unavailable</title></head><body><p>Service " \
+  "Unavailable.</p></body></html>"
+
 #define MSG_400                                                    \
   H_MSG_400                                                        \
       "<html><head><title>Bad Request</title></head><body><p>Bad " \
@@ -75,6 +87,7 @@
       "Failed</title></head><body><p>Expectation Failed.</p></body></html>"
 
 ResponseObject *start_response = NULL;
+static PyObject *close_key = NULL;  // interned "close"
 
 static PyObject *wsgi_to_bytes(PyObject *value) {
   PyObject *result = NULL;
@@ -148,6 +161,7 @@ static int blocking_write(client_t *client, char *data, size_t len) {
         data += (int)r;
         len -= r;
         client->write_bytes += r;
+        stats->bytes_out += r;
     }
   }
   return 1;
@@ -204,6 +218,27 @@ void send_error_page(client_t *client) {
   client->response_closed = 1;
 }
 
+void send_retry_after_page(client_t *client, int retry_after) {
+  char buf[sizeof(H_MSG_503_RETRY) + sizeof(B_MSG_503) + 16];
+  int hlen;
+
+  shutdown(client->fd, SHUT_RD);
+  if (client->header_done || client->response_closed) {
+    return;
+  }
+
+  DEBUG("send_retry_after_page retry_after %d client %p", retry_after, client);
+
+  hlen = snprintf(buf, sizeof(buf), H_MSG_503_RETRY, retry_after);
+  memcpy(buf + hlen, B_MSG_503, sizeof(B_MSG_503) - 1);
+  blocking_write(client, buf, hlen + sizeof(B_MSG_503) - 1);
+  client->write_bytes -= hlen;
+
+  client->keep_alive = 0;
+  client->header_done = 1;
+  client->response_closed = 1;
+}
+
 static write_bucket *new_write_bucket(int fd, int cnt) {
   write_bucket *bucket;
   iovec_t *iov;
@@ -265,73 +300,236 @@ static void add_header(write_bucket *bucket, char *key, size_t keylen,
   set2bucket(bucket, CRLF, 2);
 }
 
-#ifdef DEVELOP
-static void writev_log(write_bucket *data) {
-  int i = 0;
-  char *c;
+#define OUTQ_IOV 64  // iovecs gathered from the queue per writev
+
+int write_timeout = 300;
+int output_high_watermark = 1024 * 64;
+int output_low_watermark = 1024 * 16;
+int min_send_rate = 0;
+int min_send_rate_grace = 5;
+
+static void queue_bucket(client_t *client, write_bucket *bucket) {
+  bucket->next = NULL;
+  if (client->bucket_tail) {
+    ((write_bucket *)client->bucket_tail)->next = bucket;
+  } else {
+    client->bucket = bucket;
+  }
+  client->bucket_tail = bucket;
+  client->queued += bucket->total;
+}
+
+/* free a written bucket, the kernel may still read what went zerocopy */
+static void drop_bucket(client_t *client, write_bucket *bucket) {
+  if (bucket->zc) {
+    zerocopy_hold(client->zc, bucket->zc_id, bucket->temp1, bucket->chunk_data);
+    bucket->temp1 = bucket->chunk_data = NULL;
+  }
+  free_write_bucket(bucket);
+}
+
+void free_output_queue(client_t *client) {
+  write_bucket *bucket = client->bucket, *next;
+
+  while (bucket) {
+    next = bucket->next;
+    drop_bucket(client, bucket);
+    bucket = next;
+  }
+  client->bucket = client->bucket_tail = NULL;
+  client->queued = 0;
+}
+
+/* drop w written bytes from the head of the queue, zc if a zerocopy send
+ * wrote them */
+static void consume_queue(client_t *client, size_t w, int zc) {
+  write_bucket *bucket;
+  uint32_t i;
+
+  client->queued -= w;
+  while (w > 0 && (bucket = client->bucket) != NULL) {
+    if (zc) {
+      bucket->zc = 1;
+      bucket->zc_id = ((zc_sock_t *)client->zc)->next_id - 1;
+    }
+    if (w >= bucket->total) {
+      w -= bucket->total;
+      client->bucket = bucket->next;
+      drop_bucket(client, bucket);
+      continue;
+    }
+    bucket->total -= w;
+    for (i = 0; i < bucket->iov_cnt; i++) {
+      if (w < bucket->iov[i].iov_len) {
+        bucket->iov[i].iov_base = (char *)bucket->iov[i].iov_base + w;
+        bucket->iov[i].iov_len -= w;
+        break;
+      }
+      w -= bucket->iov[i].iov_len;
+      bucket->iov[i].iov_len = 0;
+    }
+    break;
+  }
+  if (client->bucket == NULL) {
+    client->bucket_tail = NULL;
+  }
+}
+
+static void mark_blocked(client_t *client) {
+  client->wait_usec = get_current_usec();
+  if (client->blocked_usec == 0) {
+    client->blocked_usec = client->wait_usec;
+    client->blocked_sent = client->sent_bytes;
+  }
+}
+
+/**
+ * gather the head of the queue into iov. A body iovec of zerocopy_threshold
+ * bytes or more is sent alone, the return is 1 then.
+ */
+static int gather_queue(client_t *client, iovec_t *iov, int *cnt) {
+  write_bucket *bucket;
   size_t len;
-  for (; i < data->iov_cnt; i++) {
-    c = data->iov[i].iov_base;
-    len = data->iov[i].iov_len;
-    printf("%.*s", (int)len, c);
+  uint32_t i;
+
+  *cnt = 0;
+  for (bucket = client->bucket; bucket; bucket = bucket->next) {
+    for (i = 0; i < bucket->iov_cnt; i++) {
+      len = bucket->iov[i].iov_len;
+      if (len == 0) {
+        continue;
+      }
+      // the kernel TLS sendmsg takes no MSG_ZEROCOPY
+      if (zerocopy_threshold > 0 && !client->tls &&
+          len >= (size_t)zerocopy_threshold) {
+        if (*cnt == 0) {
+          iov[(*cnt)++] = bucket->iov[i];
+          return 1;
+        }
+        return 0;
+      }
+      iov[(*cnt)++] = bucket->iov[i];
+      if (*cnt == OUTQ_IOV) {
+        return 0;
+      }
+    }
   }
+  return 0;
 }
-#endif
 
-static response_status writev_bucket(write_bucket *data) {
-  size_t w;
-  int i = 0;
-  Py_BEGIN_ALLOW_THREADS
-#ifdef DEVELOP
-      BDEBUG("\nwritev_bucket fd:%d", data->fd);
-  printf("\x1B[34m");
-  writev_log(data);
-  printf("\x1B[0m\n");
-#endif
-  w = writev(data->fd, data->iov, data->iov_cnt);
-  BDEBUG("writev fd:%d ret:%d total_size:%d", data->fd, (int)w, data->total);
-  Py_END_ALLOW_THREADS if (w == -1) {
-    // error
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      BDEBUG("try again later");
-      return STATUS_SUSPEND;
+/* write the queue until it is empty or the socket is full */
+static response_status flush_queue(client_t *client) {
+  write_bucket *bucket;
+  iovec_t iov[OUTQ_IOV], *v;
+  int cnt, zc;
+  ssize_t w;
+
+  while ((bucket = client->bucket) != NULL) {
+    zc = 0;
+    if (bucket->next == NULL && zerocopy_threshold == 0) {
+      v = bucket->iov;
+      cnt = bucket->iov_cnt;
+    } else {
+      v = iov;
+      if (gather_queue(client, iov, &cnt)) {
+        if (client->zc == NULL) {
+          client->zc = zerocopy_open(client->fd);
+        }
+        zc = client->zc != NULL;
+      }
+    }
+    Py_BEGIN_ALLOW_THREADS if (zc) {
+      w = zerocopy_send(client->zc, v, cnt, &zc);
     } else {
-      // ERROR
+      w = writev(client->fd, v, cnt);
+    }
+    Py_END_ALLOW_THREADS PROBE3(write__writev, client->fd, client->queued, w);
+    BDEBUG("writev fd:%d ret:%d queued:%d", client->fd, (int)w,
+           (int)client->queued);
+    if (w == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        BDEBUG("try again later");
+        mark_blocked(client);
+        return STATUS_SUSPEND;
+      }
       PyErr_SetFromErrno(PyExc_IOError);
-      /* write_error_log(__FILE__, __LINE__); */
       call_error_logger();
+      client->keep_alive = 0;
       return STATUS_ERROR;
     }
+    stats->bytes_out += w;
+    client->sent_bytes += w;
+    consume_queue(client, w, zc);
   }
-  if (w == 0) {
-    data->sended = 1;
+  return STATUS_OK;
+}
+
+/**
+ * write bucket after what is already queued, the queue keeps what is left.
+ * STATUS_SUSPEND tells the caller to stop producing until the queue drained,
+ * the bucket is queued either way.
+ */
+static response_status send_bucket(client_t *client, write_bucket *bucket) {
+  response_status ret;
+
+  if (bucket->total == 0) {
+    free_write_bucket(bucket);
     return STATUS_OK;
-  } else {
-    if (data->total > w) {
-      for (; i < data->iov_cnt; i++) {
-        if (w > data->iov[i].iov_len) {
-          // already write
-          w -= data->iov[i].iov_len;
-          data->iov[i].iov_len = 0;
-        } else {
-          data->iov[i].iov_base += w;
-          data->iov[i].iov_len = data->iov[i].iov_len - w;
-          break;
-        }
-      }
-      data->total = data->total - w;
-      BDEBUG("writev_bucket write %d progress %d/%d", (int)w, data->total,
-             data->total_size);
-      // resume
-      // again later
-      return writev_bucket(data);
+  }
+  queue_bucket(client, bucket);
+  if (client->bucket == bucket) {
+    ret = flush_queue(client);
+    if (ret != STATUS_SUSPEND) {
+      return ret;
     }
-    data->sended = 1;
   }
-  data->sended = 1;
+  if (client->queued > (uint64_t)output_high_watermark) {
+    return STATUS_SUSPEND;
+  }
   return STATUS_OK;
 }
 
+static int send_too_slow(client_t *client, uint64_t now) {
+  uint64_t elapsed;
+
+  if (min_send_rate == 0 || client->blocked_usec == 0) {
+    return 0;
+  }
+  elapsed = now - client->blocked_usec;
+  if (elapsed == 0 || elapsed < (uint64_t)min_send_rate_grace * 1000000) {
+    return 0;
+  }
+  return (client->sent_bytes - client->blocked_sent) * 1000000 / elapsed <
+         (uint64_t)min_send_rate;
+}
+
+int write_wait_timeout(void) {
+  if (min_send_rate > 0 && (write_timeout == 0 || write_timeout > 1)) {
+    // look at the send rate every sec
+    return 1;
+  }
+  return write_timeout;
+}
+
+int response_expired(client_t *client) {
+  uint64_t now;
+
+  if (min_send_rate == 0) {
+    return 1;
+  }
+  now = get_current_usec();
+  // picoev timeouts are in whole sec, allow one early
+  if (write_timeout > 0 &&
+      now + 1000000 >= client->wait_usec + (uint64_t)write_timeout * 1000000) {
+    return 1;
+  }
+  if (client->wait_source) {
+    // a slow source is not the client's fault
+    return 0;
+  }
+  return send_too_slow(client, now);
+}
+
 static int set_file_content_length(client_t *client, write_bucket *bucket) {
   struct stat info;
   int in_fd, ret = 0;
@@ -349,6 +547,11 @@ static int set_file_content_length(client_t *client, write_bucket *bucket) {
     call_error_logger();
     return -1;
   }
+  if (filewrap->stream) {
+    // the body runs until the source ends
+    client->keep_alive = 0;
+    return 1;
+  }
   if (fstat(in_fd, &info) == -1) {
     PyErr_SetFromErrno(PyExc_IOError);
     return -1;
@@ -564,8 +767,8 @@ static PyObject *get_chunk_data(size_t datalen) {
   return PyBytes_FromStringAndSize(lendata, (Py_ssize_t)i);
 }
 
-static void set_first_body_data(client_t *client, char *data, size_t datalen) {
-  write_bucket *bucket = client->bucket;
+static void set_first_body_data(client_t *client, write_bucket *bucket,
+                                char *data, size_t datalen) {
   if (data) {
     if (client->chunked_response) {
       char *lendata = NULL;
@@ -593,11 +796,13 @@ static int is_no_body(client_t *client) {
          || client->status_code == 304;  // Not Modified
 }
 
-static response_status write_headers(client_t *client, char *data,
-                                     size_t datalen, char is_file) {
+static response_status write_headers(client_t *client, PyObject *item,
+                                     char is_file) {
   write_bucket *bucket = 0;
   uint32_t hlen = 0;
   PyObject *headers = NULL, *templist = NULL;
+  char *data = item ? PyBytes_AS_STRING(item) : NULL;
+  size_t datalen = item ? PyBytes_GET_SIZE(item) : 0;
   response_status ret;
 
   DEBUG("header write? %d", client->header_done);
@@ -624,6 +829,10 @@ static response_status write_headers(client_t *client, char *data,
     goto error;
   }
   bucket->temp1 = templist;
+  // the first body item may stay queued
+  if (item && PyList_Append(templist, item) == -1) {
+    goto error;
+  }
 
   if (add_status_line(bucket, client) == -1) {
     goto error;
@@ -660,19 +869,18 @@ static response_status write_headers(client_t *client, char *data,
   set2bucket(bucket, CRLF, 2);
 
   // write body
-  client->bucket = bucket;
-  set_first_body_data(client, data, datalen);
-
-  ret = writev_bucket(bucket);
-  if (ret != STATUS_SUSPEND) {
-    client->header_done = 1;
-    if (ret == STATUS_OK && data) {
-      client->write_bytes += datalen;
-    }
-    // clear
-    free_write_bucket(bucket);
-    client->bucket = NULL;
+  set_first_body_data(client, bucket, data, datalen);
+
+  if (client->current_req && client->current_req->timing.first_write == 0) {
+    client->current_req->timing.first_write = get_current_usec();
   }
+  client->header_done = 1;
+  client->write_bytes += datalen;
+  if (data && client->content_length_set &&
+      client->content_length <= client->write_bytes) {
+    client->body_done = 1;
+  }
+  ret = send_bucket(client, bucket);
 
   Py_DECREF(headers);
   return ret;
@@ -684,7 +892,6 @@ error:
   Py_XDECREF(headers);
   if (bucket) {
     free_write_bucket(bucket);
-    client->bucket = NULL;
   }
   return STATUS_ERROR;
 }
@@ -706,7 +913,8 @@ static int write_sendfile(int out_fd, int in_fd, int offset, size_t count) {
       size = info.st_size - lseek(in_fd, 0, SEEK_CUR);
   }*/
   Py_BEGIN_ALLOW_THREADS res = sendfile(out_fd, in_fd, NULL, size);
-  Py_END_ALLOW_THREADS return res;
+  Py_END_ALLOW_THREADS PROBE3(write__sendfile, out_fd, size, res);
+  return res;
 #elif defined(__FreeBSD__)
   off_t len;
   Py_BEGIN_ALLOW_THREADS res =
@@ -731,32 +939,134 @@ static int write_sendfile(int out_fd, int in_fd, int offset, size_t count) {
 #endif
 }
 
+/* the close method of o, NULL without an exception if there is none */
+static PyObject *lookup_close(PyObject *o) {
+  PyObject *close;
+
+  // lists and bytes are the common responses, skip the failing lookup
+  if (PyList_CheckExact(o) || PyTuple_CheckExact(o) || PyBytes_CheckExact(o) ||
+      CheckRawResponse(o)) {
+    return NULL;
+  }
+  close = PyObject_GetAttr(o, close_key);
+  if (close == NULL && PyErr_ExceptionMatches(PyExc_AttributeError)) {
+    PyErr_Clear();
+  }
+  return close;
+}
+
 response_status close_response(client_t *client) {
+  if (client->current_req && client->current_req->timing.last_write == 0) {
+    client->current_req->timing.last_write = get_current_usec();
+  }
   if (!client->response_closed) {
     // send all response
     // closing reponse object
-    if (client->response && PyObject_HasAttrString(client->response, "close")) {
-      PyObject *close = NULL;
-      PyObject *args = NULL;
-      PyObject *data = NULL;
+    PyObject *close = NULL;
+    PyObject *data = NULL;
 
-      close = PyObject_GetAttrString(client->response, "close");
-
-      args = PyTuple_New(0);
-      data = PyEval_CallObject(close, args);
+    if (client->response && (close = lookup_close(client->response)) != NULL) {
+#ifdef HAVE_VECTORCALL
+      data = PyObject_Vectorcall(close, NULL, 0, NULL);
+#else
+      data = PyObject_CallObject(close, NULL);
+#endif
       DEBUG("call response object close");
-      Py_DECREF(args);
       Py_XDECREF(data);
       Py_DECREF(close);
       client->response_closed = 1;
       if (PyErr_Occurred()) {
         return STATUS_ERROR;
       }
+    } else if (PyErr_Occurred()) {
+      return STATUS_ERROR;
     }
   }
   return STATUS_OK;
 }
 
+#ifdef linux
+#define SPLICE_CHUNK 65536
+
+/**
+ * move the body from a pipe or a socket to the client through the pipe of
+ * filewrap. STATUS_SUSPEND with wait_source set waits for the source,
+ * without it for the client.
+ */
+static response_status process_splice(client_t *client,
+                                      FileWrapperObject *filewrap,
+                                      int in_fd) {
+  size_t want;
+  ssize_t n;
+
+  client->wait_source = 0;
+  if (filewrap->pipe[0] == -1 &&
+      pipe2(filewrap->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+    PyErr_SetFromErrno(PyExc_IOError);
+    call_error_logger();
+    client->keep_alive = 0;
+    return STATUS_ERROR;
+  }
+
+  for (;;) {
+    if (filewrap->piped == 0) {
+      want = SPLICE_CHUNK;
+      if (client->content_length_set) {
+        if (client->write_bytes >= client->content_length) {
+          break;
+        }
+        if (client->content_length - client->write_bytes < want) {
+          want = client->content_length - client->write_bytes;
+        }
+      }
+      Py_BEGIN_ALLOW_THREADS n = splice(in_fd, NULL, filewrap->pipe[1], NULL,
+                                        want,
+                                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      Py_END_ALLOW_THREADS if (n == 0) {
+        if (client->content_length_set) {
+          RDEBUG("splice source ended early fd:%d", client->fd);
+          goto error;
+        }
+        break;
+      }
+      if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          DEBUG("process_splice wait source fd:%d", in_fd);
+          client->source_fd = in_fd;
+          client->wait_source = 1;
+          client->wait_usec = get_current_usec();
+          return STATUS_SUSPEND;
+        }
+        goto error;
+      }
+      filewrap->piped = n;
+    }
+    Py_BEGIN_ALLOW_THREADS n =
+        splice(filewrap->pipe[0], NULL, client->fd, NULL, filewrap->piped,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    Py_END_ALLOW_THREADS PROBE3(write__sendfile, client->fd, filewrap->piped,
+                                n);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        DEBUG("process_splice EAGAIN");
+        mark_blocked(client);
+        return STATUS_SUSPEND;
+      }
+      goto error;
+    }
+    filewrap->piped -= n;
+    client->write_bytes += n;
+    client->sent_bytes += n;
+    stats->bytes_out += n;
+  }
+  return close_response(client);
+error:
+  client->keep_alive = 0;
+  client->status_code = 500;
+  return STATUS_ERROR;
+}
+#endif
+
 static response_status process_sendfile(client_t *client) {
   PyObject *filelike = NULL;
   FileWrapperObject *filewrap = NULL;
@@ -765,11 +1075,20 @@ static response_status process_sendfile(client_t *client) {
   filewrap = (FileWrapperObject *)client->response;
   filelike = filewrap->filelike;
 
+  if (client->bucket) {
+    // the headers go first
+    return STATUS_SUSPEND;
+  }
   in_fd = PyObject_AsFileDescriptor(filelike);
   if (in_fd == -1) {
     PyErr_Clear();
     return STATUS_OK;
   }
+#ifdef linux
+  if (filewrap->stream) {
+    return process_splice(client, filewrap, in_fd);
+  }
+#endif
 
   while (client->content_length > client->write_bytes) {
     ret = write_sendfile(client->fd, in_fd, client->write_bytes,
@@ -782,6 +1101,7 @@ static response_status process_sendfile(client_t *client) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) { /* try again later */
           // next
           DEBUG("process_sendfile EAGAIN %d", ret);
+          mark_blocked(client);
           return STATUS_SUSPEND;
         } else { /* fatal error */
           client->keep_alive = 0;
@@ -792,6 +1112,8 @@ static response_status process_sendfile(client_t *client) {
         }
       default:
         client->write_bytes += ret;
+        client->sent_bytes += ret;
+        stats->bytes_out += ret;
     }
   }
   // all send
@@ -810,7 +1132,7 @@ static response_status process_write(client_t *client) {
   DEBUG("process_write start");
   iterator = client->response_iter;
   if (iterator != NULL) {
-    while ((item = PyIter_Next(iterator))) {
+    while (!client->body_done && (item = PyIter_Next(iterator))) {
       if (PyBytes_Check(item)) {
         // TODO CHECK
         PyBytes_AsStringAndSize(item, &buf, &buflen);
@@ -842,25 +1164,22 @@ static response_status process_write(client_t *client) {
           set2bucket(bucket, buf, buflen);
         }
         bucket->temp1 = item;
-        ret = writev_bucket(bucket);
-        if (ret != STATUS_OK) {
-          client->bucket = bucket;
-          /* Py_DECREF(item); */
+        ret = send_bucket(client, bucket);
+        if (ret == STATUS_ERROR) {
           return ret;
         }
-
-        free_write_bucket(bucket);
         // mark
         client->write_bytes += buflen;
         // check write_bytes/content_length
-        if (client->content_length_set) {
-          if (client->content_length <= client->write_bytes) {
-            // all done
-            /* Py_DECREF(item); */
-            break;
-          }
+        if (client->content_length_set &&
+            client->content_length <= client->write_bytes) {
+          // all done
+          client->body_done = 1;
+        }
+        if (ret == STATUS_SUSPEND) {
+          // above the high watermark, go on from process_body
+          return ret;
         }
-        /* Py_DECREF(item); */
       } else {
         PyErr_SetString(PyExc_TypeError, "response item must be a byte string");
         Py_DECREF(item);
@@ -876,18 +1195,26 @@ static response_status process_write(client_t *client) {
     if (PyErr_Occurred()) {
       return STATUS_ERROR;
     }
-    if (client->chunked_response) {
-      DEBUG("write last chunk");
-      // last packet
-      bucket = new_write_bucket(client->fd, 3);
-      if (bucket == NULL) {
-        /* write_error_log(__FILE__, __LINE__); */
-        call_error_logger();
-        return STATUS_ERROR;
+    if (!client->body_done) {
+      client->body_done = 1;
+      if (client->chunked_response) {
+        DEBUG("write last chunk");
+        // last packet
+        bucket = new_write_bucket(client->fd, 3);
+        if (bucket == NULL) {
+          /* write_error_log(__FILE__, __LINE__); */
+          call_error_logger();
+          return STATUS_ERROR;
+        }
+        set_last_chunked_data(bucket);
+        if (send_bucket(client, bucket) == STATUS_ERROR) {
+          return STATUS_ERROR;
+        }
       }
-      set_last_chunked_data(bucket);
-      writev_bucket(bucket);
-      free_write_bucket(bucket);
+    }
+    if (client->bucket) {
+      // the rest goes out from process_body
+      return STATUS_SUSPEND;
     }
     return close_response(client);
   }
@@ -896,24 +1223,23 @@ static response_status process_write(client_t *client) {
 
 response_status process_body(client_t *client) {
   response_status ret;
-  write_bucket *bucket;
-  if (client->bucket) {
-    bucket = (write_bucket *)client->bucket;
-    // retry send
-    ret = writev_bucket(bucket);
 
-    if (ret == STATUS_OK) {
-      client->write_bytes += bucket->total_size;
-      free_write_bucket(bucket);
-      client->bucket = NULL;
-    } else if (ret == STATUS_ERROR) {
-      free_write_bucket(bucket);
-      client->bucket = NULL;
-      return ret;
-    } else {
-      //
-      return ret;
+  if (client->bucket && flush_queue(client) == STATUS_ERROR) {
+    return STATUS_ERROR;
+  }
+  if (send_too_slow(client, get_current_usec())) {
+    RDEBUG("cut slow client fd:%d", client->fd);
+    client->keep_alive = 0;
+    stats->slow_writes++;
+    return STATUS_ERROR;
+  }
+  if (client->bucket) {
+    if (client->body_done ||
+        client->queued > (uint64_t)output_low_watermark) {
+      return STATUS_SUSPEND;
     }
+  } else if (client->body_done) {
+    return close_response(client);
   }
 
   if (CheckFileWrapper(client->response)) {
@@ -940,15 +1266,21 @@ static response_status start_response_file(client_t *client) {
     DEBUG("can't get fd");
     return STATUS_ERROR;
   }
-  ret = write_headers(client, NULL, 0, 1);
-  if (!client->content_length_set) {
-    if (fstat(in_fd, &info) == -1) {
-      PyErr_SetFromErrno(PyExc_IOError);
-      /* write_error_log(__FILE__, __LINE__);  */
-      call_error_logger();
-      return STATUS_ERROR;
-    }
-
+  if (fstat(in_fd, &info) == -1) {
+    PyErr_SetFromErrno(PyExc_IOError);
+    /* write_error_log(__FILE__, __LINE__);  */
+    call_error_logger();
+    return STATUS_ERROR;
+  }
+#ifdef linux
+  if (S_ISFIFO(info.st_mode) || S_ISSOCK(info.st_mode)) {
+    // subprocess output or an upstream socket, splice it
+    filewrap->stream = 1;
+    fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL) | O_NONBLOCK);
+  }
+#endif
+  ret = write_headers(client, NULL, 1);
+  if (!client->content_length_set && !filewrap->stream) {
     size = info.st_size;
     client->content_length_set = 1;
     client->content_length = size;
@@ -959,8 +1291,6 @@ static response_status start_response_file(client_t *client) {
 static response_status start_response_write(client_t *client) {
   PyObject *iterator;
   PyObject *item;
-  char *buf;
-  Py_ssize_t buflen;
   response_status ret;
 
   iterator = PyObject_GetIter(client->response);
@@ -975,20 +1305,14 @@ static response_status start_response_write(client_t *client) {
   DEBUG("client %p", client);
   if (item != NULL && PyBytes_Check(item)) {
     // write string only
-    buf = PyBytes_AS_STRING(item);
-    buflen = PyBytes_GET_SIZE(item);
-
-    /* DEBUG("status_code %d body:%.*s", client->status_code, (int)buflen, buf);
-     */
-    ret = write_headers(client, buf, buflen, 0);
-    // TODO when ret == STATUS_SUSPEND keep item
+    ret = write_headers(client, item, 0);
     Py_DECREF(item);
     return ret;
   } else {
     if (item == NULL && !PyErr_Occurred()) {
       // Stop Iteration
       RDEBUG("WARN iter item == NULL");
-      return write_headers(client, NULL, 0, 0);
+      return write_headers(client, NULL, 0);
     } else {
       PyErr_SetString(PyExc_TypeError, "response item must be a string");
       Py_XDECREF(item);
@@ -1005,7 +1329,12 @@ static response_status start_response_write(client_t *client) {
 response_status response_start(client_t *client) {
   response_status ret;
   if (client->status_code == 304) {
-    return write_headers(client, NULL, 0, 0);
+    client->body_done = 1;
+    ret = write_headers(client, NULL, 0);
+    if (ret == STATUS_OK && client->bucket) {
+      ret = STATUS_SUSPEND;
+    }
+    return ret;
   }
 
   if (CheckFileWrapper(client->response)) {
@@ -1028,8 +1357,219 @@ response_status response_start(client_t *client) {
   return ret;
 }
 
+static const char *reason_phrase(int status) {
+  switch (status) {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 409: return "Conflict";
+    case 410: return "Gone";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 415: return "Unsupported Media Type";
+    case 422: return "Unprocessable Entity";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "";
+  }
+}
+
+static int add_raw_header(buffer_t *b, PyObject *header) {
+  PyObject *name = NULL, *value = NULL;
+  char *n, *v;
+  Py_ssize_t nlen, vlen;
+  int ret = -1;
+
+  if (!PyTuple_Check(header) || PyTuple_GET_SIZE(header) != 2) {
+    PyErr_SetString(PyExc_TypeError,
+                    "response headers must be (name, value) tuples");
+    return -1;
+  }
+  name = wsgi_to_bytes(PyTuple_GET_ITEM(header, 0));
+  if (name == NULL) {
+    goto end;
+  }
+  value = wsgi_to_bytes(PyTuple_GET_ITEM(header, 1));
+  if (value == NULL) {
+    goto end;
+  }
+  n = PyBytes_AS_STRING(name);
+  nlen = PyBytes_GET_SIZE(name);
+  v = PyBytes_AS_STRING(value);
+  vlen = PyBytes_GET_SIZE(value);
+  if (memchr(n, ':', nlen) || memchr(n, '\n', nlen) || memchr(v, '\n', vlen)) {
+    PyErr_Format(PyExc_ValueError, "invalid response header '%s'", n);
+    goto end;
+  }
+  // set by the server
+  if ((nlen == 6 && !strncasecmp(n, "Server", 6)) ||
+      (nlen == 4 && !strncasecmp(n, "Date", 4)) ||
+      (nlen == 14 && !strncasecmp(n, "Content-Length", 14)) ||
+      (nlen == 10 && !strncasecmp(n, "Connection", 10))) {
+    ret = 1;
+    goto end;
+  }
+  if (write2buf(b, n, nlen) != WRITE_OK || write2buf(b, DELIM, 2) != WRITE_OK ||
+      write2buf(b, v, vlen) != WRITE_OK || write2buf(b, CRLF, 2) != WRITE_OK) {
+    goto end;
+  }
+  ret = 1;
+end:
+  Py_XDECREF(name);
+  Py_XDECREF(value);
+  return ret;
+}
+
+/* status line and headers of a run_raw Response */
+static PyObject *raw_response_head(client_t *client, RawResponseObject *r) {
+  PyObject *headers = NULL;
+  buffer_t *b;
+  char line[128];
+  Py_ssize_t i, n;
+  int len;
+
+  b = new_buffer(512, 0);
+  if (b == NULL || b->buf == NULL) {
+    return PyErr_NoMemory();
+  }
+  len = snprintf(line, sizeof(line),
+                 "HTTP/1.%d %d %s\r\nServer: " SERVER "\r\nDate: ",
+                 client->http_parser->http_minor == 1 ? 1 : 0, r->status,
+                 reason_phrase(r->status));
+  if (write2buf(b, line, len) != WRITE_OK ||
+      write2buf(b, (char *)http_time, 29) != WRITE_OK ||
+      write2buf(b, CRLF, 2) != WRITE_OK) {
+    goto error;
+  }
+  if (r->headers != Py_None) {
+    headers = PySequence_Fast(r->headers, "response headers must be a list");
+    if (headers == NULL) {
+      goto error;
+    }
+    n = PySequence_Fast_GET_SIZE(headers);
+    for (i = 0; i < n; i++) {
+      if (add_raw_header(b, PySequence_Fast_GET_ITEM(headers, i)) == -1) {
+        goto error;
+      }
+    }
+    Py_CLEAR(headers);
+  }
+  if (r->status >= 200 && r->status != 204 && r->status != 304) {
+    len = snprintf(line, sizeof(line), "Content-Length: %zd\r\n",
+                   PyBytes_GET_SIZE(r->body));
+    if (write2buf(b, line, len) != WRITE_OK) {
+      goto error;
+    }
+  }
+  if (client->keep_alive == 1) {
+    len = snprintf(line, sizeof(line), "Connection: Keep-Alive\r\n\r\n");
+  } else {
+    len = snprintf(line, sizeof(line), "Connection: close\r\n\r\n");
+  }
+  if (write2buf(b, line, len) != WRITE_OK) {
+    goto error;
+  }
+  return getPyString(b);
+error:
+  Py_XDECREF(headers);
+  free_buffer(b);
+  return NULL;
+}
+
+/* write a run_raw Response, the head and the body go in one writev */
+response_status response_start_raw(client_t *client) {
+  RawResponseObject *r;
+  write_bucket *bucket;
+  PyObject *head;
+  Py_ssize_t body_len;
+  response_status ret;
+
+  if (!CheckRawResponse(client->response)) {
+    PyErr_Format(PyExc_TypeError, "handler must return a Response, not %.200s",
+                 Py_TYPE(client->response)->tp_name);
+    return STATUS_ERROR;
+  }
+  r = (RawResponseObject *)client->response;
+  client->status_code = r->status;
+  client->content_length_set = 1;
+  client->content_length = body_len = PyBytes_GET_SIZE(r->body);
+
+  head = raw_response_head(client, r);
+  if (head == NULL) {
+    return STATUS_ERROR;
+  }
+  bucket = new_write_bucket(client->fd, 2);
+  if (bucket == NULL) {
+    Py_DECREF(head);
+    PyErr_NoMemory();
+    return STATUS_ERROR;
+  }
+  bucket->temp1 = head;
+  set2bucket(bucket, PyBytes_AS_STRING(head), PyBytes_GET_SIZE(head));
+  if (is_no_body(client)) {
+    body_len = 0;
+  } else if (body_len > 0) {
+    Py_INCREF(r->body);
+    bucket->chunk_data = r->body;
+    set2bucket(bucket, PyBytes_AS_STRING(r->body), body_len);
+  }
+
+  if (client->current_req && client->current_req->timing.first_write == 0) {
+    client->current_req->timing.first_write = get_current_usec();
+  }
+  client->header_done = 1;
+  client->write_bytes = body_len;
+  client->body_done = 1;
+  ret = send_bucket(client, bucket);
+  if (ret == STATUS_OK && client->bucket) {
+    // process_body writes the rest
+    ret = STATUS_SUSPEND;
+  }
+  if (ret == STATUS_OK) {
+    client->response_closed = 1;
+  }
+  return ret;
+}
+
+#ifdef HAVE_VECTORCALL
+static PyObject *ResponseObject_vectorcall(PyObject *obj, PyObject *const *args,
+                                           size_t nargsf, PyObject *kwnames);
+#endif
+
 void setup_start_response(void) {
   start_response = PyObject_NEW(ResponseObject, &ResponseObjectType);
+#ifdef HAVE_VECTORCALL
+  if (start_response != NULL) {
+    start_response->vectorcall = ResponseObject_vectorcall;
+  }
+#endif
+  if (close_key == NULL) {
+#ifdef PY3
+    close_key = PyUnicode_InternFromString("close");
+#else
+    close_key = PyString_InternFromString("close");
+#endif
+  }
 }
 
 void clear_start_response(void) { Py_CLEAR(start_response); }
@@ -1073,28 +1613,14 @@ error:
   return NULL;
 }
 
-static PyObject *ResponseObject_call(PyObject *obj, PyObject *args,
-                                     PyObject *kw) {
-  PyObject *status = NULL, *headers = NULL, *exc_info = NULL, *bytes = NULL;
+static PyObject *start_response_call(ResponseObject *self, PyObject *status,
+                                     PyObject *headers, PyObject *exc_info) {
+  PyObject *bytes = NULL;
   char *status_code = NULL;
   char *status_line = NULL;
   int bytelen = 0, int_code;
-  ResponseObject *self = NULL;
   char *buf = NULL;
 
-  self = (ResponseObject *)obj;
-#ifdef PY3
-  if (!PyArg_ParseTuple(args, "UO|O:start_response", &status, &headers,
-                        &exc_info)) {
-    return NULL;
-  }
-#else
-  if (!PyArg_ParseTuple(args, "SO|O:start_response", &status, &headers,
-                        &exc_info)) {
-    return NULL;
-  }
-#endif
-
   if (self->cli->headers != NULL && exc_info && exc_info != Py_None) {
     // Re-raise original exception if headers sent
 
@@ -1193,6 +1719,47 @@ static PyObject *ResponseObject_call(PyObject *obj, PyObject *args,
   Py_RETURN_NONE;
 }
 
+static PyObject *ResponseObject_call(PyObject *obj, PyObject *args,
+                                     PyObject *kw) {
+  PyObject *status = NULL, *headers = NULL, *exc_info = NULL;
+  static char *keywords[] = {"status", "headers", "exc_info", NULL};
+
+#ifdef PY3
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "UO|O:start_response", keywords,
+                                   &status, &headers, &exc_info)) {
+    return NULL;
+  }
+#else
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "SO|O:start_response", keywords,
+                                   &status, &headers, &exc_info)) {
+    return NULL;
+  }
+#endif
+  return start_response_call((ResponseObject *)obj, status, headers, exc_info);
+}
+
+#ifdef HAVE_VECTORCALL
+/* the app calls start_response without building an args tuple */
+static PyObject *ResponseObject_vectorcall(PyObject *obj, PyObject *const *args,
+                                           size_t nargsf, PyObject *kwnames) {
+  static const char *const keywords[] = {"status", "headers", "exc_info"};
+  PyObject *argv[3];
+
+  if (unpack_fastcall("start_response", args, PyVectorcall_NARGS(nargsf),
+                      kwnames, keywords, 2, 3, argv) == -1) {
+    return NULL;
+  }
+  if (!PyUnicode_Check(argv[0])) {
+    PyErr_Format(PyExc_TypeError,
+                 "start_response() argument 1 must be str, not %.50s",
+                 Py_TYPE(argv[0])->tp_name);
+    return NULL;
+  }
+  return start_response_call((ResponseObject *)obj, argv[0], argv[1],
+                             argv[2]);
+}
+#endif
+
 static PyObject *FileWrapperObject_new(PyObject *self, PyObject *filelike,
                                        size_t blksize) {
   FileWrapperObject *f;
@@ -1203,6 +1770,9 @@ static PyObject *FileWrapperObject_new(PyObject *self, PyObject *filelike,
 
   f->filelike = filelike;
   Py_INCREF(f->filelike);
+  f->stream = 0;
+  f->pipe[0] = f->pipe[1] = -1;
+  f->piped = 0;
   GDEBUG("alloc FileWrapperObject %p", f);
   return (PyObject *)f;
 }
@@ -1221,6 +1791,10 @@ static PyObject *FileWrapperObject_iter(PyObject *o) {
 
 static void FileWrapperObject_dealloc(FileWrapperObject *self) {
   GDEBUG("dealloc FileWrapperObject %p", self);
+  if (self->pipe[0] != -1) {
+    close(self->pipe[0]);
+    close(self->pipe[1]);
+  }
   Py_XDECREF(self->filelike);
   PyObject_DEL(self);
 }
@@ -1230,12 +1804,14 @@ static PyObject *FileWrapperObject_close(FileWrapperObject *self,
   PyObject *method = NULL;
   PyObject *result = NULL;
 
-  method = PyObject_GetAttrString(self->filelike, "close");
+  method = PyObject_GetAttr(self->filelike, close_key);
 
   if (method) {
-    result = PyEval_CallObject(method, (PyObject *)NULL);
+    result = PyObject_CallObject(method, (PyObject *)NULL);
     if (!result) PyErr_Clear();
     Py_DECREF(method);
+  } else {
+    PyErr_Clear();
   }
 
   Py_XDECREF(result);
@@ -1287,7 +1863,11 @@ PyTypeObject ResponseObjectType = {
     sizeof(ResponseObject),             /*tp_basicsize*/
     0,                                  /*tp_itemsize*/
     (destructor)ResponseObject_dealloc, /*tp_dealloc*/
-    0,                                  /*tp_print*/
+#ifdef HAVE_VECTORCALL
+    offsetof(ResponseObject, vectorcall), /*tp_vectorcall_offset*/
+#else
+    0, /*tp_print*/
+#endif
     0,                                  /*tp_getattr*/
     0,                                  /*tp_setattr*/
     0,                                  /*tp_compare*/
@@ -1302,7 +1882,11 @@ PyTypeObject ResponseObjectType = {
     0,                      /*tp_getattro*/
     0,                      /*tp_setattro*/
     0,                      /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT,     /*tp_flags*/
+#ifdef HAVE_VECTORCALL
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL, /*tp_flags*/
+#else
+    Py_TPFLAGS_DEFAULT, /*tp_flags*/
+#endif
     "wsgi start_response ", /* tp_doc */
     0,                      /* tp_traverse */
     0,                      /* tp_clear */
@@ -7,25 +7,57 @@
 
 typedef struct iovec iovec_t;
 
-typedef struct {
+typedef struct _write_bucket {
   int fd;
   iovec_t *iov;
   uint32_t iov_cnt;
   uint32_t iov_size;
   uint32_t total;
   uint32_t total_size;
-  uint8_t sended;
-  PyObject *temp1;       // keep origin pointer
-  PyObject *chunk_data;  // keep chunk_data origin pointer
+  PyObject *temp1;             // keep origin pointer
+  PyObject *chunk_data;        // keep chunk_data origin pointer
+  struct _write_bucket *next;  // output queue link
+  uint8_t zc;                  // written by a zerocopy send
+  uint32_t zc_id;              // the last such send
 } write_bucket;
 
+/**
+ * Output queue.
+ *
+ * What the socket doesn't take at once is kept on the client as a chain of
+ * write_buckets, each holding a reference to its body item, and written in
+ * order with one writev when the socket is writable again. The response
+ * stops pulling body items while more than output_high_watermark bytes are
+ * queued and goes on once the queue drained to output_low_watermark.
+ *
+ * A response is cut when the client takes nothing for write_timeout sec. With
+ * min_send_rate set it is also cut after min_send_rate_grace sec if it sent
+ * less than min_send_rate bytes per sec on average since it first had to
+ * wait, the client is checked every sec while the socket is full.
+ */
+extern int write_timeout;  // sec, 0 disables
+extern int output_high_watermark;
+extern int output_low_watermark;
+extern int min_send_rate;        // bytes per sec, 0 disables
+extern int min_send_rate_grace;  // sec
+
 typedef struct {
   PyObject_HEAD client_t *cli;
+#ifdef HAVE_VECTORCALL
+  vectorcallfunc vectorcall;
+#endif
 } ResponseObject;
 
+/**
+ * A file_wrapper over a pipe or a socket is moved to the client with splice
+ * through a pipe of its own, without Content-Length the body ends with the
+ * source and the connection is closed.
+ */
 typedef struct {
   PyObject_HEAD PyObject *filelike;
-
+  uint8_t stream;  // the fd is a pipe or a socket
+  int pipe[2];     // splice buffer, -1 until used
+  size_t piped;    // bytes in the pipe
 } FileWrapperObject;
 
 typedef enum { STATUS_OK = 0, STATUS_SUSPEND, STATUS_ERROR } response_status;
@@ -42,14 +74,27 @@ int CheckFileWrapper(PyObject *obj);
 
 response_status response_start(client_t *client);
 
+response_status response_start_raw(client_t *client);
+
 response_status process_body(client_t *client);
 
 response_status close_response(client_t *client);
 
+/* drop what is left in the output queue */
+void free_output_queue(client_t *client);
+
+/* the timeout of a wait for the socket to take more */
+int write_wait_timeout(void);
+
+/* the wait timed out and the response must be cut */
+int response_expired(client_t *client);
+
 void setup_start_response(void);
 
 void clear_start_response(void);
 
 void send_error_page(client_t *client);
 
+void send_retry_after_page(client_t *client, int retry_after);
+
 #endif
@@ -0,0 +1,262 @@
+#include "router.h"
+
+#include "http_parser.h"
+#include "raw.h"
+
+typedef struct route_s {
+  uint64_t methods;  // 0 is any
+  PyObject *target;
+  struct route_s *next;
+} route_t;
+
+typedef struct rnode_s {
+  char *label;
+  size_t len;
+  struct rnode_s *children;
+  struct rnode_s *next;  // sibling
+  route_t *exact;
+  route_t *prefix;
+  // 405 for the methods not in exact/prefix, NULL if one accepts any
+  PyObject *exact_reject;
+  PyObject *prefix_reject;
+} rnode_t;
+
+int route_cnt = 0;
+
+static rnode_t *root = NULL;
+
+static rnode_t *new_node(const char *label, size_t len) {
+  rnode_t *node;
+
+  node = PyMem_Malloc(sizeof(rnode_t));
+  if (node == NULL) {
+    return NULL;
+  }
+  memset(node, 0, sizeof(rnode_t));
+  if (len > 0) {
+    node->label = PyMem_Malloc(len);
+    if (node->label == NULL) {
+      PyMem_Free(node);
+      return NULL;
+    }
+    memcpy(node->label, label, len);
+  }
+  node->len = len;
+  return node;
+}
+
+static void free_routes(route_t *r) {
+  route_t *next;
+
+  while (r) {
+    next = r->next;
+    Py_DECREF(r->target);
+    PyMem_Free(r);
+    r = next;
+  }
+}
+
+static void free_node(rnode_t *node) {
+  rnode_t *child, *next;
+
+  for (child = node->children; child; child = next) {
+    next = child->next;
+    free_node(child);
+  }
+  free_routes(node->exact);
+  free_routes(node->prefix);
+  Py_XDECREF(node->exact_reject);
+  Py_XDECREF(node->prefix_reject);
+  PyMem_Free(node->label);
+  PyMem_Free(node);
+}
+
+/* cut the label of *link after len bytes */
+static rnode_t *split_node(rnode_t **link, size_t len) {
+  rnode_t *node = *link, *head;
+  char *tail;
+
+  head = new_node(node->label, len);
+  if (head == NULL) {
+    return NULL;
+  }
+  tail = PyMem_Malloc(node->len - len);
+  if (tail == NULL) {
+    free_node(head);
+    return NULL;
+  }
+  memcpy(tail, node->label + len, node->len - len);
+  PyMem_Free(node->label);
+  node->label = tail;
+  node->len -= len;
+
+  head->next = node->next;
+  node->next = NULL;
+  head->children = node;
+  *link = head;
+  return head;
+}
+
+/* the node for path, made if missing */
+static rnode_t *get_node(const char *path, size_t len) {
+  rnode_t *node, **link;
+  size_t i, n;
+
+  if (root == NULL) {
+    root = new_node(NULL, 0);
+    if (root == NULL) {
+      return NULL;
+    }
+  }
+  node = root;
+  while (len > 0) {
+    for (link = &node->children; *link; link = &(*link)->next) {
+      if ((*link)->label[0] == path[0]) {
+        break;
+      }
+    }
+    if (*link == NULL) {
+      *link = new_node(path, len);
+      return *link;
+    }
+    n = (*link)->len < len ? (*link)->len : len;
+    for (i = 1; i < n && (*link)->label[i] == path[i]; i++)
+      ;
+    if (i < (*link)->len && split_node(link, i) == NULL) {
+      return NULL;
+    }
+    node = *link;
+    path += i;
+    len -= i;
+  }
+  return node;
+}
+
+static PyObject *new_reject(route_t *routes) {
+  PyObject *allow = NULL, *body = NULL, *res = NULL;
+  uint64_t methods = 0;
+  char buf[256];
+  size_t len = 0, n;
+  int m;
+
+  for (; routes; routes = routes->next) {
+    if (routes->methods == 0) {
+      return NULL;
+    }
+    methods |= routes->methods;
+  }
+  for (m = 0; m <= HTTP_PURGE; m++) {
+    if (methods & ROUTE_METHOD_BIT(m)) {
+      n = strlen(http_method_str(m));
+      if (len + n + 2 > sizeof(buf)) {
+        break;
+      }
+      if (len > 0) {
+        memcpy(buf + len, ", ", 2);
+        len += 2;
+      }
+      memcpy(buf + len, http_method_str(m), n);
+      len += n;
+    }
+  }
+  allow = Py_BuildValue("[(sN)]", "Allow", NATIVE_FROMSTRINGANDSIZE(buf, len));
+  body = PyBytes_FromString("Method Not Allowed");
+  if (allow && body) {
+    res = PyObject_CallFunction((PyObject *)&RawResponseType, "OiO", body, 405,
+                                allow);
+  }
+  Py_XDECREF(allow);
+  Py_XDECREF(body);
+  return res;
+}
+
+int add_route(const char *path, size_t len, int prefix, uint64_t methods,
+              PyObject *target) {
+  rnode_t *node;
+  route_t *route, **link;
+  PyObject *reject, **link_reject;
+
+  node = get_node(path, len);
+  if (node == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  route = PyMem_Malloc(sizeof(route_t));
+  if (route == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  if (methods & ROUTE_METHOD_BIT(HTTP_GET)) {
+    methods |= ROUTE_METHOD_BIT(HTTP_HEAD);
+  }
+  route->methods = methods;
+  route->target = target;
+  route->next = NULL;
+  Py_INCREF(target);
+
+  for (link = prefix ? &node->prefix : &node->exact; *link;
+       link = &(*link)->next)
+    ;
+  *link = route;
+  route_cnt++;
+
+  reject = new_reject(prefix ? node->prefix : node->exact);
+  if (reject == NULL && PyErr_Occurred()) {
+    // take the route back, the node keeps its old 405 response
+    *link = NULL;
+    route_cnt--;
+    Py_DECREF(target);
+    PyMem_Free(route);
+    return -1;
+  }
+  link_reject = prefix ? &node->prefix_reject : &node->exact_reject;
+  Py_XDECREF(*link_reject);
+  *link_reject = reject;
+  return 1;
+}
+
+void clear_routes(void) {
+  if (root != NULL) {
+    free_node(root);
+    root = NULL;
+  }
+  route_cnt = 0;
+}
+
+PyObject *match_route(int method, const char *path, size_t len) {
+  rnode_t *node = root, *child;
+  route_t *routes = NULL, *r;
+  PyObject *reject = NULL;
+
+  if (node == NULL) {
+    return NULL;
+  }
+  while (len > 0) {
+    for (child = node->children; child; child = child->next) {
+      if (child->label[0] == path[0]) {
+        break;
+      }
+    }
+    if (child == NULL || child->len > len ||
+        memcmp(child->label, path, child->len) != 0) {
+      break;
+    }
+    node = child;
+    path += child->len;
+    len -= child->len;
+    if (node->prefix) {
+      routes = node->prefix;
+      reject = node->prefix_reject;
+    }
+  }
+  if (len == 0 && node->exact) {
+    routes = node->exact;
+    reject = node->exact_reject;
+  }
+  for (r = routes; r; r = r->next) {
+    if (r->methods == 0 || (r->methods & ROUTE_METHOD_BIT(method))) {
+      return r->target;
+    }
+  }
+  return reject;
+}
@@ -0,0 +1,35 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include "meinheld.h"
+
+/**
+ * Native routing table.
+ *
+ * Routes are kept in a radix tree keyed by the request path, percent-decoded
+ * once (the query string is not part of it). A route matches the path
+ * exactly or, when added as a prefix, every path starting with those bytes.
+ * The most specific node wins: an exact match before a prefix one, a longer
+ * prefix before a shorter one. Its routes are tried in the order they were
+ * added and the first one accepting the method is taken; if none does, the
+ * request is answered with 405 and an Allow header.
+ *
+ * A target is either a callable that replaces the app for the request or a
+ * Response that is written from C. The lookup is done as soon as the request
+ * line is read, so requests answered from C never get an environ.
+ */
+
+#define ROUTE_METHOD_BIT(m) ((uint64_t)1 << (m))
+
+extern int route_cnt;
+
+/* add a route, GET implies HEAD. methods 0 is any method */
+int add_route(const char *path, size_t len, int prefix, uint64_t methods,
+              PyObject *target);
+
+void clear_routes(void);
+
+/* target for the request (borrowed), NULL to call the app */
+PyObject *match_route(int method, const char *path, size_t len);
+
+#endif
@@ -11,14 +11,30 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 
+#include "admin.h"
+#include "capture.h"
 #include "client.h"
+#include "codel.h"
+#include "greensocket.h"
+#include "greensync.h"
 #include "heapq.h"
 #include "http_request_parser.h"
 #include "input.h"
+#include "lagmon.h"
 #include "log.h"
+#include "microbench.h"
+#include "outbox.h"
+#include "probes.h"
+#include "raw.h"
+#include "resolver.h"
 #include "response.h"
+#include "router.h"
+#include "stats.h"
+#include "threadpool.h"
 #include "timer.h"
+#include "tls.h"
 #include "util.h"
+#include "zerocopy.h"
 
 #ifdef WITH_GREENLET
 #include "greensupport.h"
@@ -29,6 +45,11 @@
 
 #define READ_BUF_SIZE 1024 * 64
 
+// resume accepting when every counter drops below this percentage of its limit
+#define ADMISSION_RESUME_PERCENT 90
+
+#define CODEL_INTERVAL_MSEC 100
+
 typedef struct {
   TimerObject **q;
   uint32_t size;
@@ -43,6 +64,8 @@ static PyObject *listen_socks = NULL;  // listen socket
 static volatile sig_atomic_t loop_done;
 static volatile sig_atomic_t call_shutdown = 0;
 static volatile sig_atomic_t catch_signal = 0;
+static volatile sig_atomic_t reopen_signal = 0;
+static PyOS_sighandler_t prev_sigusr1 = SIG_DFL;
 
 static picoev_loop *main_loop = NULL;  // main loop
 static heapq_t *g_timers;
@@ -68,6 +91,32 @@ static char *unix_sock_name = NULL;
 static int backlog = 1024 * 4;  // backlog size
 static int max_fd = 1024 * 4;   // picoev max_fd
 
+static int notsent_lowat = 0;  // TCP_NOTSENT_LOWAT of clients, 0 is unset
+
+/* admission control (0 means unlimited) */
+static int max_connections = 0;       // max open client connections
+static int max_inflight = 0;          // max running wsgi calls
+static int max_suspended = 0;         // max suspended greenlets
+static int overload_retry_after = 0;  // reply 503 with Retry-After if > 0
+
+static int connection_cnt = 0;
+static int inflight_cnt = 0;
+static int suspended_cnt = 0;
+
+static uint8_t accept_paused = 0;
+static uint8_t accept_closed = 0;
+static uintptr_t paused_start_msec = 0;
+static uint64_t paused_msec = 0;
+static uint64_t pause_cnt = 0;
+static uint64_t shed_cnt = 0;
+
+/* greenlet pool (size 0 means a new greenlet per request) */
+static int greenlet_pool_size = 0;     // max parked greenlets
+static int greenlet_max_requests = 0;  // requests per greenlet, 0 unlimited
+
+/* queue delay shedding (target 0 means disable) */
+static codel_t codel = {0, CODEL_INTERVAL_MSEC * 1000};
+
 // greenlet hub switch value
 static PyObject *hub_switch_value;
 PyObject *current_client;
@@ -81,10 +130,33 @@ static PyObject *wsgi_input_terminated_key = NULL;  // wsgi.input_terminated key
 static PyObject *status_code_key = NULL;            // STATUS_CODE
 static PyObject *bytes_sent_key = NULL;             // SEND_BYTES
 static PyObject *request_time_key = NULL;           // REQUEST_TIME
+static PyObject *request_timing_key = NULL;         // REQUEST_TIMING
 static PyObject *local_time_key = NULL;             // LOCAL_TIME
 static PyObject *empty_string = NULL;               //""
 
+#ifdef WITH_GREENLET
 static PyObject *app_handler_func = NULL;
+static PyObject *pool_worker_func = NULL;
+static PyObject *pool_hub = NULL;     // greenlet running the loop
+static PyObject **pool_idle = NULL;   // parked workers
+static int pool_idle_cnt = 0;
+static client_t *pool_ready_head = NULL;  // requests waiting for a worker
+static client_t *pool_ready_tail = NULL;
+static PyObject **green_ready = NULL;  // waiters to resume, a ring
+static int green_ready_head = 0;
+static int green_ready_cnt = 0;
+static int green_ready_max = 0;
+
+typedef struct {
+  int fd;
+  uintptr_t msec;
+} green_deadline_t;
+
+// green_wait_msec waits, picoev only times out on whole seconds
+static green_deadline_t *green_deadlines = NULL;
+static int green_deadline_cnt = 0;
+static int green_deadline_max = 0;
+#endif
 
 /* gunicorn */
 static time_t watchdog_lasttime;
@@ -100,25 +172,42 @@ static int client_numfree = 0;
 
 static void read_callback(picoev_loop *loop, int fd, int events, void *cb_arg);
 
-#ifndef WITH_GREENLET
 static void write_callback(picoev_loop *loop, int fd, int events, void *cb_arg);
-#endif
+
+static void watch_write(client_t *client, ClientObject *pyclient);
 
 static void kill_callback(picoev_loop *loop, int fd, int events, void *cb_arg);
 
+static void accept_callback(picoev_loop *loop, int fd, int events,
+                            void *cb_arg);
+
 static void trampoline_callback(picoev_loop *loop, int fd, int events,
                                 void *cb_arg);
 
+#ifdef WITH_GREENLET
+static void write_wait_callback(picoev_loop *loop, int fd, int events,
+                                void *cb_arg);
+#endif
+
 static PyObject *internal_schedule_call(int seconds, PyObject *cb,
                                         PyObject *args, PyObject *kwargs,
                                         PyObject *greenlet);
 
+#ifdef WITH_GREENLET
+static void green_drain(void);
+static void green_clear(void);
+static int deadline_wait(int wait_msec);
+static void fire_deadlines(void);
+#endif
+
 static int prepare_call_wsgi(client_t *client);
 
 static void call_wsgi_handler(client_t *client);
 
 static int check_status_code(client_t *client);
 
+static void check_admission(void);
+
 static pending_queue_t *init_pendings(void) {
   pending_queue_t *pendings = NULL;
 
@@ -266,25 +355,73 @@ static void set_log_value(client_t *client, PyObject *environ,
   }
 }
 
+static void set_timing_value(request *req, PyObject *environ) {
+  PyObject *timing;
+
+  timing = new_request_timing(&req->timing);
+  if (timing) {
+    PyDict_SetItem(environ, request_timing_key, timing);
+    Py_DECREF(timing);
+  } else {
+    PyErr_Clear();
+  }
+}
+
 static void clean_client(client_t *client) {
   PyObject *environ = NULL;
   uintptr_t end, delta_msec = 0;
 
   request *req = client->current_req;
+  // nothing to log after a keep-alive timeout or a failed TLS handshake
+  int quiet = client->status_code == 408 || client->ssl != NULL;
+
+  if (client->header_done || is_write_access_log || is_access_log_enabled()) {
+    cache_time_update();
+  }
+
+  if (client->header_done) {
+    // a response was written
+    uint64_t usec = 0;
+    if (req && req->timing.first_byte > 0 &&
+        current_usec >= req->timing.first_byte) {
+      usec = current_usec - req->timing.first_byte;
+      stats_add_latency(usec);
+    }
+    stats->requests++;
+    stats_add_status(client->status_code);
+    PROBE4(request__done, client->fd, client->status_code, client->write_bytes,
+           usec);
+  }
+
+  if (is_access_log_enabled() && (req || !quiet)) {
+    uint64_t delta_usec = 0;
+    if (req && req->timing.first_byte > 0 &&
+        current_usec > req->timing.first_byte) {
+      delta_usec = current_usec - req->timing.first_byte;
+    }
+    write_access_log(client, req, delta_usec);
+  }
 
   if (is_write_access_log) {
     DEBUG("write access log");
-    cache_time_update();
     if (req) {
       environ = req->environ;
+      if (environ == NULL) {
+        // run_raw
+        environ = new_environ(client);
+      } else {
+        Py_INCREF(environ);
+      }
       end = current_msec;
       if (req->start_msec > 0) {
         delta_msec = end - req->start_msec;
       }
       set_log_value(client, environ, delta_msec);
+      set_timing_value(req, environ);
       call_access_logger(environ);
+      Py_DECREF(environ);
     } else {
-      if (client->status_code != 408) {
+      if (!quiet) {
         environ = new_environ(client);
         set_log_value(client, environ, delta_msec);
         call_access_logger(environ);
@@ -297,6 +434,11 @@ static void clean_client(client_t *client) {
   Py_CLEAR(client->response_iter);
   Py_CLEAR(client->response);
 
+  if (client->inflight) {
+    client->inflight = 0;
+    inflight_cnt--;
+  }
+
   if (req == NULL) {
     goto init;
   }
@@ -307,6 +449,10 @@ static void clean_client(client_t *client) {
     /* DEBUG("CLEAR environ"); */
     Py_CLEAR(req->environ);
   }
+  if (req->raw) {
+    raw_request_detach(req->raw);
+    Py_CLEAR(req->raw);
+  }
   if (req->body) {
     if (req->body_type == BODY_TYPE_TMPFILE) {
       fclose(req->body);
@@ -318,6 +464,21 @@ static void clean_client(client_t *client) {
   free_request(req);
 
 init:
+  if (client->bucket) {
+    // the response was cut
+    client->keep_alive = 0;
+    free_output_queue(client);
+  }
+  if (client->wait_source) {
+    if (picoev_is_active(main_loop, client->source_fd) &&
+        !picoev_del(main_loop, client->source_fd)) {
+      activecnt--;
+    }
+    client->wait_source = 0;
+  }
+  client->body_done = 0;
+  client->sent_bytes = 0;
+  client->blocked_usec = 0;
   client->current_req = NULL;
   client->header_done = 0;
   client->response_closed = 0;
@@ -336,6 +497,7 @@ static void close_client(client_t *client) {
   }
   DEBUG("start close client:%p fd:%d status_code %d", client, client->fd,
         client->status_code);
+  PROBE3(conn__close, client->fd, client->status_code, client->keep_alive);
 
   if (picoev_is_active(main_loop, client->fd)) {
     if (!picoev_del(main_loop, client->fd)) {
@@ -349,6 +511,7 @@ static void close_client(client_t *client) {
 
   DEBUG("remain http pipeline size :%d", client->request_queue->size);
   if (client->request_queue->size > 0) {
+    stats->pipelined++;
     if (check_status_code(client) > 0) {
       // process pipeline
       if (prepare_call_wsgi(client) > 0) {
@@ -365,13 +528,30 @@ static void close_client(client_t *client) {
 
   free_request_queue(client->request_queue);
   if (!client->keep_alive) {
-    close(client->fd);
+    capture_close(client->capture_id);
+    tls_close(client);
+    if (client->tls) {
+      tls_shutdown(client);
+    }
+    if (client->zc) {
+      zerocopy_close(client->zc);
+    } else {
+      close(client->fd);
+    }
+    connection_cnt--;
+    stats->active = connection_cnt;
     BDEBUG("close client:%p fd:%d", client, client->fd);
   } else {
     BDEBUG("keep alive client:%p fd:%d", client, client->fd);
+    stats->keepalive_reuse++;
     new_client =
         new_client_t(client->fd, client->remote_addr, client->remote_port);
     new_client->keep_alive = 1;
+    new_client->accept_usec = client->accept_usec;
+    new_client->capture_id = client->capture_id;
+    new_client->so_keepalive = client->so_keepalive;
+    new_client->zc = client->zc;
+    new_client->tls = client->tls;
     init_parser(new_client, server_name, server_port);
     ret = picoev_add(main_loop, new_client->fd, PICOEV_READ, keep_alive_timeout,
                      read_callback, (void *)new_client);
@@ -381,6 +561,7 @@ static void close_client(client_t *client) {
   }
   // clear old client
   dealloc_client(client);
+  check_admission();
 }
 
 static void init_main_loop(void) {
@@ -408,6 +589,8 @@ static inline void kill_server(int timeout) {
   if (main_loop == NULL) {
     return;
   }
+  accept_closed = 1;
+  admin_drain();
 
   iter = PyObject_GetIter(listen_socks);
   if (PyErr_Occurred()) {
@@ -425,7 +608,8 @@ static inline void kill_server(int timeout) {
 #endif
 
       // stop accepting
-      if (!picoev_del(main_loop, listen_sock)) {
+      if (picoev_is_active(main_loop, listen_sock) &&
+          !picoev_del(main_loop, listen_sock)) {
         activecnt--;
         DEBUG("activecnt:%d", activecnt);
       }
@@ -451,12 +635,127 @@ static inline void kill_server(int timeout) {
   Py_DECREF(iter);
 }
 
+static void set_accepting(int on) {
+  int listen_sock = 0, ret;
+  PyObject *iter = NULL, *item;
+
+  iter = PyObject_GetIter(listen_socks);
+  if (PyErr_Occurred()) {
+    call_error_logger();
+    return;
+  }
+
+  while ((item = PyIter_Next(iter))) {
+#ifdef PY3
+    if (PyLong_Check(item)) {
+      listen_sock = (int)PyLong_AsLong(item);
+#else
+    if (PyInt_Check(item)) {
+      listen_sock = (int)PyInt_AsLong(item);
+#endif
+      if (on) {
+        ret = picoev_add(main_loop, listen_sock, PICOEV_READ,
+                         ACCEPT_TIMEOUT_SECS, accept_callback, NULL);
+        if (ret == 0) {
+          activecnt++;
+        }
+      } else if (picoev_is_active(main_loop, listen_sock) &&
+                 !picoev_del(main_loop, listen_sock)) {
+        activecnt--;
+      }
+    }
+    Py_DECREF(item);
+  }
+  Py_DECREF(iter);
+}
+
+static inline int over_limit(int cnt, int limit) {
+  return limit > 0 && cnt >= limit;
+}
+
+static inline int under_resume_mark(int cnt, int limit) {
+  return limit <= 0 || cnt * 100 < limit * ADMISSION_RESUME_PERCENT;
+}
+
+static inline int is_overloaded(void) {
+  return over_limit(connection_cnt, max_connections) ||
+         over_limit(inflight_cnt, max_inflight) ||
+         over_limit(suspended_cnt, max_suspended);
+}
+
+/* pause accepting while any limit is reached, resume with hysteresis */
+static void check_admission(void) {
+  if (main_loop == NULL || accept_closed) {
+    return;
+  }
+
+  if (!accept_paused) {
+    if (is_overloaded()) {
+      RDEBUG("pause accepting conn:%d inflight:%d suspended:%d",
+             connection_cnt, inflight_cnt, suspended_cnt);
+      set_accepting(0);
+      accept_paused = 1;
+      paused_start_msec = current_msec;
+      pause_cnt++;
+    }
+  } else if (under_resume_mark(connection_cnt, max_connections) &&
+             under_resume_mark(inflight_cnt, max_inflight) &&
+             under_resume_mark(suspended_cnt, max_suspended)) {
+    RDEBUG("resume accepting conn:%d inflight:%d suspended:%d", connection_cnt,
+           inflight_cnt, suspended_cnt);
+    accept_paused = 0;
+    paused_msec += current_msec - paused_start_msec;
+    set_accepting(1);
+  }
+}
+
+static inline int should_shed_request(request *req) {
+  uint64_t now, sojourn = 0;
+
+  if (overload_retry_after > 0 &&
+      (over_limit(inflight_cnt, max_inflight) ||
+       over_limit(suspended_cnt, max_suspended))) {
+    return 1;
+  }
+  if (codel.target_usec > 0 && req->timing.message_complete > 0) {
+    // time from read completion to dispatch
+    now = get_current_usec();
+    if (now > req->timing.message_complete) {
+      sojourn = now - req->timing.message_complete;
+    }
+    if (codel_should_drop(&codel, sojourn, now)) {
+      stats->codel_drops++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* publish the loop gauges to the stats slot */
+static inline void sync_stats(void) {
+  stats->inflight = inflight_cnt;
+  stats->suspended = suspended_cnt;
+  stats->paused = accept_paused;
+}
+
 static inline void set_current_request(client_t *client) {
   request *req;
   req = shift_request(client->request_queue);
   client->current_req = req;
 }
 
+/* what the app is called with, the environ or the run_raw Request */
+static inline PyObject *request_arg(request *req) {
+  return req->raw ? req->raw : req->environ;
+}
+
+static inline ClientObject *request_client(request *req) {
+  if (req->raw) {
+    return (ClientObject *)((RawRequestObject *)req->raw)->client;
+  }
+  return (ClientObject *)PyDict_GetItem(req->environ, client_key);
+}
+
 static void set_bad_request_code(client_t *client, int status_code) {
   request *req;
   req = client->request_queue->tail;
@@ -480,23 +779,29 @@ static int check_status_code(client_t *client) {
   return 1;
 }
 
-static PyObject *app_handler(PyObject *self, PyObject *args) {
+static PyObject *app_handler(PyObject *self, PyObject *env) {
   int ret, active;
-  PyObject *wsgi_args = NULL, *start = NULL, *current = NULL, *parent = NULL,
-           *res = NULL;
-  PyObject *env = NULL;
+  PyObject *start = NULL, *current = NULL, *parent = NULL, *res = NULL;
+  PyObject *app;
+#ifdef HAVE_VECTORCALL
+  PyObject *wsgi_args[2];
+#else
+  PyObject *wsgi_args = NULL;
+#endif
   ClientObject *pyclient;
   client_t *client;
   request *req;
   response_status status;
 
-  if (!PyArg_ParseTuple(args, "O:app_handler", &env)) {
-    return NULL;
+  if (raw_mode) {
+    pyclient = (ClientObject *)((RawRequestObject *)env)->client;
+  } else {
+    pyclient = (ClientObject *)PyDict_GetItem(env, client_key);
   }
-  pyclient = (ClientObject *)PyDict_GetItem(env, client_key);
   client = pyclient->client;
 
   req = client->current_req;
+  app = req->app ? req->app : wsgi_app;
   start = create_start_response(client);
 
   if (!start) {
@@ -504,9 +809,25 @@ static PyObject *app_handler(PyObject *self, PyObject *args) {
   }
 
   DEBUG("call wsgi app");
-  wsgi_args = PyTuple_Pack(2, env, start);
-  res = PyObject_CallObject(wsgi_app, wsgi_args);
+  req->timing.app_start = get_current_usec();
+#ifdef HAVE_VECTORCALL
+  wsgi_args[0] = env;
+  wsgi_args[1] = start;
+  // run_raw handlers only take the request
+  res = PyObject_Vectorcall(app, wsgi_args, raw_mode ? 1 : 2, NULL);
+#else
+  if (raw_mode) {
+    wsgi_args = PyTuple_Pack(1, env);
+  } else {
+    wsgi_args = PyTuple_Pack(2, env, start);
+  }
+  res = PyObject_CallObject(app, wsgi_args);
   Py_DECREF(wsgi_args);
+#endif
+  if (client->current_req == req) {
+    req->timing.app_end = get_current_usec();
+  }
+  PROBE2(wsgi__return, client->fd, client->status_code);
   DEBUG("called wsgi app");
 
   // check response & PyErr_Occurred
@@ -527,7 +848,11 @@ static PyObject *app_handler(PyObject *self, PyObject *args) {
     close_client(client);
     Py_RETURN_NONE;
   }
-  status = response_start(client);
+  if (raw_mode) {
+    status = response_start_raw(client);
+  } else {
+    status = response_start(client);
+  }
 
 #ifdef WITH_GREENLET
   while (status != STATUS_OK) {
@@ -535,10 +860,28 @@ static PyObject *app_handler(PyObject *self, PyObject *args) {
       // Internal Server Error
       req->bad_request_code = 500;
       goto error;
+    } else if (client->body_done) {
+      // only the output queue is left, the hub writes it out and this
+      // greenlet is free for the next request
+      if (close_response(client) == STATUS_ERROR) {
+        call_error_logger();
+      }
+      watch_write(client, pyclient);
+      Py_RETURN_NONE;
     } else {
-      active = picoev_is_active(main_loop, client->fd);
-      ret = picoev_add(main_loop, client->fd, PICOEV_WRITE, 300,
-                       trampoline_callback, (void *)pyclient);
+      int wait_fd, wait_events;
+
+      if (client->wait_source) {
+        // a spliced body waits for its source instead
+        wait_fd = client->source_fd;
+        wait_events = PICOEV_READ;
+      } else {
+        wait_fd = client->fd;
+        wait_events = PICOEV_WRITE;
+      }
+      active = picoev_is_active(main_loop, wait_fd);
+      ret = picoev_add(main_loop, wait_fd, wait_events, write_wait_timeout(),
+                       write_wait_callback, (void *)pyclient);
       if ((ret == 0 && !active)) {
         activecnt++;
       }
@@ -548,8 +891,16 @@ static PyObject *app_handler(PyObject *self, PyObject *args) {
       parent = greenlet_getparent(current);
 
       /* Py_INCREF(hub_switch_value); */
+      PROBE1(greenlet__suspend, client->fd);
       res = greenlet_switch(parent, hub_switch_value, NULL);
-      Py_XDECREF(res);
+      if (res == NULL) {
+        // the wait expired, cut the response
+        PyErr_Clear();
+        client->keep_alive = 0;
+        stats->slow_writes++;
+        break;
+      }
+      Py_DECREF(res);
 
       // try again after event switch
       status = process_body(client);
@@ -570,12 +921,8 @@ static PyObject *app_handler(PyObject *self, PyObject *args) {
     case STATUS_SUSPEND:
       // continue
       // set callback
-      active = picoev_is_active(main_loop, client->fd);
-      ret = picoev_add(main_loop, client->fd, PICOEV_WRITE, 300, write_callback,
-                       (void *)pyclient);
-      if ((ret == 0 && !active)) {
-        activecnt++;
-      }
+      watch_write(client, pyclient);
+      break;
     default:
       // send OK
       close_client(client);
@@ -596,8 +943,9 @@ error:
   Py_RETURN_NONE;
 }
 
+#ifdef WITH_GREENLET
 static PyMethodDef app_handler_def = {"_app_handler", (PyCFunction)app_handler,
-                                      METH_VARARGS, 0};
+                                      METH_O, 0};
 
 static PyObject *get_app_handler(void) {
   if (app_handler_func == NULL) {
@@ -608,7 +956,6 @@ static PyObject *get_app_handler(void) {
   return app_handler_func;
 }
 
-#ifdef WITH_GREENLET
 static void resume_greenlet(PyObject *greenlet) {
   PyObject *res = NULL;
   PyObject *err_type, *err_val, *err_tb;
@@ -647,6 +994,7 @@ static void resume_wsgi_handler(ClientObject *pyclient) {
   start_response->cli = client;
 
   current_client = (PyObject *)pyclient;
+  PROBE1(greenlet__resume, client->fd);
   if (PyErr_Occurred()) {
     PyErr_Fetch(&err_type, &err_val, &err_tb);
     PyErr_Clear();
@@ -663,18 +1011,246 @@ static void resume_wsgi_handler(ClientObject *pyclient) {
 }
 #endif
 
+#ifdef WITH_GREENLET
+/**
+ * greenlet pool
+ *
+ * A worker greenlet runs app_handler for a request and then, instead of
+ * dying, takes the next request from the ready queue or parks itself in
+ * pool_idle and switches back to the hub until pool_dispatch resumes it with
+ * the next environ. Requests are only handed to a worker from the hub, when
+ * call_wsgi_handler runs in another greenlet (close_client of a pipelined
+ * request) the client is queued and picked up by the worker that just
+ * finished, or by the hub on the next loop iteration.
+ */
+
+static int in_hub(void) {
+  PyObject *current = greenlet_getcurrent();
+  Py_DECREF(current);
+  return current == pool_hub;
+}
+
+static void pool_push_ready(client_t *client) {
+  client->pool_next = NULL;
+  if (pool_ready_tail) {
+    pool_ready_tail->pool_next = client;
+  } else {
+    pool_ready_head = client;
+  }
+  pool_ready_tail = client;
+}
+
+static client_t *pool_shift_ready(void) {
+  client_t *client = pool_ready_head;
+
+  if (client) {
+    pool_ready_head = client->pool_next;
+    if (pool_ready_head == NULL) {
+      pool_ready_tail = NULL;
+    }
+    client->pool_next = NULL;
+  }
+  return client;
+}
+
+/* bind the client to worker and return its environ */
+static PyObject *pool_bind(client_t *client, PyObject *worker) {
+  PyObject *env = request_arg(client->current_req);
+  ClientObject *pyclient;
+
+  pyclient = request_client(client->current_req);
+  current_client = (PyObject *)pyclient;
+  Py_INCREF(worker);
+  Py_XDECREF(pyclient->greenlet);
+  pyclient->greenlet = worker;
+  Py_INCREF(env);
+  return env;
+}
+
+/* run one request in a fresh context, the worker is reused */
+static void pool_run(PyObject *worker, PyObject *env) {
+  PyObject *res;
+#if PY_VERSION_HEX >= 0x03070000
+  PyObject *ctx = PyContext_New();
+
+  if (ctx == NULL || PyContext_Enter(ctx) == -1) {
+    Py_XDECREF(ctx);
+    call_error_logger();
+    ctx = NULL;
+  }
+#endif
+  res = app_handler(NULL, env);
+  if (res == NULL) {
+    call_error_logger();
+  }
+  Py_XDECREF(res);
+#if PY_VERSION_HEX >= 0x03070000
+  if (ctx != NULL) {
+    if (PyContext_Exit(ctx) == -1) {
+      call_error_logger();
+    }
+    Py_DECREF(ctx);
+  }
+#endif
+  clear_greenlet_dict(worker);
+}
+
+static PyObject *pool_worker(PyObject *self, PyObject *env) {
+  PyObject *current, *parent, *res;
+  client_t *client;
+  int served = 0;
+
+  // borrowed, a parked worker is only owned by pool_idle
+  current = greenlet_getcurrent();
+  Py_DECREF(current);
+  Py_INCREF(env);
+  while (1) {
+    pool_run(current, env);
+    Py_DECREF(env);
+    served++;
+
+    if (!loop_done ||
+        (greenlet_max_requests > 0 && served >= greenlet_max_requests)) {
+      break;
+    }
+    client = pool_shift_ready();
+    if (client) {
+      stats->pool_hits++;
+      env = pool_bind(client, current);
+      continue;
+    }
+    if (pool_idle_cnt >= greenlet_pool_size) {
+      break;
+    }
+
+    // park
+    Py_INCREF(current);
+    pool_idle[pool_idle_cnt++] = current;
+    stats->pool_idle = pool_idle_cnt;
+    parent = greenlet_getparent(current);
+    res = greenlet_switch(parent, hub_switch_value, NULL);
+    if (res == NULL) {
+      // killed by pool_trim
+      if (PyErr_ExceptionMatches(greenlet_exit)) {
+        PyErr_Clear();
+      } else {
+        call_error_logger();
+      }
+      break;
+    }
+    env = res;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef pool_worker_def = {"_pool_worker", (PyCFunction)pool_worker,
+                                      METH_O, 0};
+
+static void pool_dispatch(client_t *client) {
+  PyObject *worker, *env, *args, *res;
+
+  if (!in_hub()) {
+    pool_push_ready(client);
+    return;
+  }
+  if (pool_idle_cnt > 0) {
+    worker = pool_idle[--pool_idle_cnt];
+    stats->pool_idle = pool_idle_cnt;
+    stats->pool_hits++;
+  } else {
+    if (pool_worker_func == NULL) {
+      pool_worker_func =
+          PyCFunction_NewEx(&pool_worker_def, (PyObject *)NULL, NULL);
+    }
+    worker = pool_worker_func ? greenlet_new(pool_worker_func, NULL) : NULL;
+    if (worker == NULL) {
+      call_error_logger();
+      client->keep_alive = 0;
+      client->status_code = 500;
+      send_error_page(client);
+      close_client(client);
+      return;
+    }
+    stats->pool_misses++;
+  }
+  env = pool_bind(client, worker);
+  args = PyTuple_Pack(1, env);
+  Py_DECREF(env);
+  if (args != NULL) {
+    res = greenlet_switch(worker, args, NULL);
+    Py_DECREF(args);
+    Py_XDECREF(res);
+  }
+  Py_DECREF(worker);
+  if (PyErr_Occurred()) {
+    call_error_logger();
+  }
+}
+
+/* hand queued requests to workers, called by the hub */
+static void pool_drain(void) {
+  client_t *client;
+
+  while (pool_ready_head != NULL && loop_done) {
+    client = pool_shift_ready();
+    pool_dispatch(client);
+  }
+}
+
+/* kill parked workers until at most size are left */
+static void pool_trim(int size) {
+  PyObject *worker;
+
+  while (pool_idle_cnt > size) {
+    worker = pool_idle[--pool_idle_cnt];
+    stats->pool_idle = pool_idle_cnt;
+    Py_DECREF(worker);
+  }
+}
+
+static int pool_resize(int size) {
+  PyObject **idle;
+
+  pool_trim(size);
+  if (size == 0) {
+    PyMem_Free(pool_idle);
+    pool_idle = NULL;
+    return 1;
+  }
+  idle = PyMem_Realloc(pool_idle, sizeof(PyObject *) * size);
+  if (idle == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  pool_idle = idle;
+  return 1;
+}
+#endif
+
 static void call_wsgi_handler(client_t *client) {
-  PyObject *handler, *greenlet, *args, *res;
+#ifdef WITH_GREENLET
+  PyObject *handler, *greenlet, *args;
+#endif
+  PyObject *res;
   ClientObject *pyclient;
   request *req = NULL;
 
-  handler = get_app_handler();
   req = client->current_req;
-  current_client = PyDict_GetItem(req->environ, client_key);
-  pyclient = (ClientObject *)current_client;
+  pyclient = request_client(req);
+  current_client = (PyObject *)pyclient;
+
+  client->inflight = 1;
+  inflight_cnt++;
+  check_admission();
+  PROBE1(wsgi__call, client->fd);
 
-  args = PyTuple_Pack(1, req->environ);
 #ifdef WITH_GREENLET
+  if (greenlet_pool_size > 0 && pool_hub != NULL) {
+    pool_dispatch(client);
+    return;
+  }
+  handler = get_app_handler();
+  args = PyTuple_Pack(1, request_arg(req));
   // new greenlet
   greenlet = greenlet_new(handler, NULL);
   // set_greenlet
@@ -687,8 +1263,7 @@ static void call_wsgi_handler(client_t *client) {
   Py_DECREF(greenlet);
 #else
   pyclient->greenlet = NULL;
-  res = PyObject_CallObject(handler, args);
-  Py_DECREF(args);
+  res = app_handler(NULL, request_arg(req));
 #endif
   Py_XDECREF(res);
 }
@@ -697,7 +1272,6 @@ static void call_wsgi_handler(client_t *client) {
 static void timeout_error_callback(picoev_loop *loop, int fd, int events,
                                    void *cb_arg) {
   ClientObject *pyclient = (ClientObject *)(cb_arg);
-  client_t *client = pyclient->client;
 
   if ((events & PICOEV_TIMEOUT) != 0) {
     DEBUG("timeout_error_callback pyclient:%p client:%p fd:%d", pyclient,
@@ -707,9 +1281,9 @@ static void timeout_error_callback(picoev_loop *loop, int fd, int events,
       DEBUG("activecnt:%d", activecnt);
     }
     pyclient->suspended = 0;
+    suspended_cnt--;
     /* pyclient->resumed = 1; */
     PyErr_SetString(timeout_error, "timeout");
-    set_so_keepalive(client->fd, 0);
     resume_wsgi_handler(pyclient);
   }
 }
@@ -732,10 +1306,10 @@ static void timeout_callback(picoev_loop *loop, int fd, int events,
       }
       // resume
       pyclient->suspended = 0;
+      suspended_cnt--;
       /* pyclient->resumed = 1; */
       PyErr_SetFromErrno(PyExc_IOError);
       DEBUG("closed");
-      set_so_keepalive(client->fd, 0);
       resume_wsgi_handler(pyclient);
     }
   }
@@ -770,12 +1344,25 @@ static void trampoline_callback(picoev_loop *loop, int fd, int events,
     resume_wsgi_handler(pyclient);
   } else if (greenlet_check(o)) {
     YDEBUG("resume_greenlet");
+    PROBE1(greenlet__resume, fd);
     resume_greenlet(o);
   }
 }
+
+/* app_handler waits for the socket to take more of the response */
+static void write_wait_callback(picoev_loop *loop, int fd, int events,
+                                void *cb_arg) {
+  ClientObject *pyclient = (ClientObject *)cb_arg;
+
+  if ((events & PICOEV_TIMEOUT) != 0 && !response_expired(pyclient->client)) {
+    // still sending fast enough
+    picoev_set_timeout(loop, fd, write_wait_timeout());
+    return;
+  }
+  trampoline_callback(loop, fd, events, cb_arg);
+}
 #endif
 
-#ifndef WITH_GREENLET
 static void write_callback(picoev_loop *loop, int fd, int events,
                            void *cb_arg) {
   ClientObject *pyclient = (ClientObject *)cb_arg;
@@ -786,37 +1373,100 @@ static void write_callback(picoev_loop *loop, int fd, int events,
   if ((events & PICOEV_TIMEOUT) != 0) {
     DEBUG("** write_callback timeout **");
 
+    if (!response_expired(client)) {
+      picoev_set_timeout(loop, fd, write_wait_timeout());
+      return;
+    }
     // timeout
     client->keep_alive = 0;
+    stats->slow_writes++;
     close_client(client);
 
   } else if ((events & PICOEV_WRITE) != 0) {
     ret = process_body(client);
     DEBUG("process_body ret %d", ret);
-    if (ret != 0) {
+    if (ret == STATUS_SUSPEND && client->wait_source) {
+      watch_write(client, pyclient);
+    } else if (ret == STATUS_SUSPEND) {
+      // made progress, wait again
+      picoev_set_timeout(loop, fd, write_wait_timeout());
+    } else {
       // ok or die
       close_client(client);
     }
   }
 }
-#endif
 
-static int check_http_expect(client_t *client) {
-  PyObject *c = NULL;
-  char *val = NULL;
-  int ret;
-  request *req = client->current_req;
+/* the source of a spliced response can be read, write again */
+static void source_callback(picoev_loop *loop, int fd, int events,
+                            void *cb_arg) {
+  ClientObject *pyclient = (ClientObject *)cb_arg;
+  client_t *client = pyclient->client;
+
+  if (!picoev_del(loop, fd)) {
+    activecnt--;
+  }
+  client->wait_source = 0;
+  current_client = (PyObject *)pyclient;
+  if ((events & PICOEV_TIMEOUT) != 0) {
+    RDEBUG("** source_callback timeout **");
+    client->keep_alive = 0;
+    stats->slow_writes++;
+    close_client(client);
+    return;
+  }
+  watch_write(client, pyclient);
+}
+
+/* write the rest of the response from the hub */
+static void watch_write(client_t *client, ClientObject *pyclient) {
+  int ret, active;
+
+  if (client->wait_source) {
+    // the client waits while the source has nothing
+    if (picoev_is_active(main_loop, client->fd) &&
+        !picoev_del(main_loop, client->fd)) {
+      activecnt--;
+    }
+    ret = picoev_add(main_loop, client->source_fd, PICOEV_READ, write_timeout,
+                     source_callback, (void *)pyclient);
+    if (ret == 0) {
+      activecnt++;
+    }
+    return;
+  }
+  active = picoev_is_active(main_loop, client->fd);
+  ret = picoev_add(main_loop, client->fd, PICOEV_WRITE, write_wait_timeout(),
+                   write_callback, (void *)pyclient);
+  if ((ret == 0 && !active)) {
+    activecnt++;
+  }
+}
+
+static int check_http_expect(client_t *client) {
+  PyObject *c = NULL;
+  const char *val = NULL;
+  size_t len = 0;
+  int ret;
+  request *req = client->current_req;
 
   if (client->http_parser->http_minor == 1) {
     /// TODO CHECK
-    c = PyDict_GetItemString(req->environ, "HTTP_EXPECT");
-    if (c) {
+    if (req->raw) {
+      val = raw_request_header(req->raw, "Expect", 6, &len);
+    } else {
+      c = PyDict_GetItemString(req->environ, "HTTP_EXPECT");
+      if (c) {
 #ifdef PY3
-      val = PyUnicode_AsUTF8(c);
+        val = PyUnicode_AsUTF8AndSize(c, (Py_ssize_t *)&len);
 #else
-      val = PyBytes_AS_STRING(c);
+        val = PyBytes_AS_STRING(c);
+        len = PyBytes_GET_SIZE(c);
 #endif
-      if (!strncasecmp(val, "100-continue", 12)) {
+      }
+    }
+    if (val) {
+      if (len >= 12 && !strncasecmp(val, "100-continue", 12)) {
         ret = write(client->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
         if (ret < 0) {
           // fail
@@ -829,6 +1479,7 @@ static int check_http_expect(client_t *client) {
           close_client(client);
           return -1;
         }
+        stats->bytes_out += ret;
       } else {
         // 417
         client->keep_alive = 0;
@@ -950,6 +1601,27 @@ setting_keepalive(client_t *client)
 }
 */
 
+/* write a Response from the routing table, the app is not called */
+static int send_route_response(client_t *client) {
+  request *req = client->current_req;
+  response_status status;
+
+  client->response = req->app;
+  Py_INCREF(client->response);
+  status = response_start_raw(client);
+  if (status == STATUS_SUSPEND) {
+    watch_write(client, request_client(req));
+    return -1;
+  }
+  if (status == STATUS_ERROR) {
+    call_error_logger();
+    client->status_code = 500;
+    send_error_page(client);
+  }
+  close_client(client);
+  return -1;
+}
+
 static int prepare_call_wsgi(client_t *client) {
   request *req = NULL;
 
@@ -957,21 +1629,44 @@ static int prepare_call_wsgi(client_t *client) {
 
   req = client->current_req;
 
+  if (unlikely(should_shed_request(req))) {
+    // overloaded, reject before calling wsgi app
+    shed_cnt++;
+    stats->shed++;
+    client->status_code = 503;
+    if (overload_retry_after > 0) {
+      send_retry_after_page(client, overload_retry_after);
+    } else {
+      send_error_page(client);
+    }
+    close_client(client);
+    return -1;
+  }
+
+  if (req->app && CheckRawResponse(req->app)) {
+    return send_route_response(client);
+  }
+
   // check Expect
   if (check_http_expect(client) < 0) {
     return -1;
   }
 
-  if (req->body_type == BODY_TYPE_TMPFILE) {
-    if (set_input_file(client) == -1) {
-      return -1;
-    }
+  if (req->raw) {
+    raw_request_take_body(req->raw, req);
   } else {
-    if (set_input_object(client) == -1) {
-      return -1;
+    if (req->body_type == BODY_TYPE_TMPFILE) {
+      if (set_input_file(client) == -1) {
+        return -1;
+      }
+    } else {
+      if (set_input_object(client) == -1) {
+        return -1;
+      }
     }
+    PyDict_SetItem((PyObject *)req->environ, wsgi_input_terminated_key,
+                   Py_True);
   }
-  PyDict_SetItem((PyObject *)req->environ, wsgi_input_terminated_key, Py_True);
 
   if (!is_keep_alive) {
     client->keep_alive = 0;
@@ -1044,7 +1739,7 @@ static int parse_new_protocol(request *req, char *buf, ssize_t readed,
   char *val = NULL;
 
   env = req->environ;
-  c = PyDict_GetItemString(env, "HTTP_UPGRADE");
+  c = env ? PyDict_GetItemString(env, "HTTP_UPGRADE") : NULL;
   if (c) {
 #ifdef PY3
     c = PyUnicode_AsLatin1String(c);
@@ -1071,6 +1766,7 @@ static int parse_http_request(int fd, client_t *client, char *buf, ssize_t r) {
 
   BDEBUG("fd:%d \n%.*s", fd, (int)r, buf);
   nread = execute_parse(client, buf, r);
+  capture_data(client->capture_id, buf, r);
   BDEBUG("read request fd %d readed %d nread %d", fd, (int)r, nread);
 
   req = client->current_req;
@@ -1115,7 +1811,8 @@ static int read_request(picoev_loop *loop, int fd, client_t *client,
       } else {
         // Fatal error
         client->keep_alive = 0;
-        if (errno == ECONNRESET) {
+        // kernel TLS fails reads at an alert record, close_notify too
+        if (errno == ECONNRESET || (errno == EIO && client->tls)) {
           client->header_done = 1;
           client->response_closed = 1;
         } else {
@@ -1126,6 +1823,8 @@ static int read_request(picoev_loop *loop, int fd, client_t *client,
         return set_read_error(client, 500);
       }
     default:
+      stats->bytes_in += r;
+      PROBE2(request__read, client->fd, r);
       if (call_time_update) {
         cache_time_update();
       }
@@ -1133,6 +1832,39 @@ static int read_request(picoev_loop *loop, int fd, client_t *client,
   }
 }
 
+/* drive the TLS handshake, read_callback takes over once it is done */
+static void tls_callback(picoev_loop *loop, int fd, int events, void *cb_arg) {
+  client_t *client = (client_t *)(cb_arg);
+  int ret, want = 0;
+
+  if ((events & PICOEV_TIMEOUT) != 0) {
+    RDEBUG("** tls handshake timeout fd:%d", fd);
+    ret = -1;
+  } else {
+    ret = tls_handshake(client, &want);
+  }
+  switch (ret) {
+    case 0:
+      picoev_set_events(loop, fd, want);
+      break;
+    case 1:
+      if (!picoev_del(loop, fd)) {
+        activecnt--;
+      }
+      ret = picoev_add(loop, fd, PICOEV_READ, keep_alive_timeout, read_callback,
+                       (void *)client);
+      if (ret == 0) {
+        activecnt++;
+      }
+      // the request may be in already
+      read_callback(loop, fd, PICOEV_READ, (void *)client);
+      break;
+    default:
+      client->keep_alive = 0;
+      close_client(client);
+  }
+}
+
 static void read_callback(picoev_loop *loop, int fd, int events, void *cb_arg) {
   client_t *client = (client_t *)(cb_arg);
   int finish = 0;
@@ -1192,13 +1924,33 @@ static void accept_callback(picoev_loop *loop, int fd, int events,
           loop_done = 0;
           return;
         }
+        if (notsent_lowat > 0) {
+          set_notsent_lowat(client_fd, notsent_lowat);
+        }
         remote_addr = inet_ntoa(client_addr.sin_addr);
         remote_port = ntohs(client_addr.sin_port);
         client = new_client_t(client_fd, remote_addr, remote_port);
+        client->accept_usec = get_current_usec();
+        client->capture_id = capture_open();
+        PROBE2(conn__accept, client_fd, remote_port);
         init_parser(client, server_name, server_port);
-
-        finish = read_request(loop, fd, client, 1);
-        if (finish == 1) {
+        connection_cnt++;
+        stats->accepted++;
+        stats->active = connection_cnt;
+
+        // kernel TLS is TCP only, unix sockets stay plain
+        if (tls_enabled && client_addr.sin_family != AF_UNIX) {
+          if (tls_open(client) == -1) {
+            client->keep_alive = 0;
+            close_client(client);
+          } else {
+            ret = picoev_add(loop, client_fd, PICOEV_READ, READ_TIMEOUT_SECS,
+                             tls_callback, (void *)client);
+            if (ret == 0) {
+              activecnt++;
+            }
+          }
+        } else if ((finish = read_request(loop, fd, client, 1)) == 1) {
           if (check_status_code(client) > 0) {
             // current request ok
             if (prepare_call_wsgi(client) > 0) {
@@ -1212,6 +1964,10 @@ static void accept_callback(picoev_loop *loop, int fd, int events,
             activecnt++;
           }
         }
+        check_admission();
+        if (accept_paused) {
+          break;
+        }
       } else {
         if (errno != EAGAIN && errno != EWOULDBLOCK) {
           PyErr_SetFromErrno(PyExc_IOError);
@@ -1245,6 +2001,7 @@ static void setup_server_env(void) {
   status_code_key = NATIVE_FROMSTRING("STATUS_CODE");
   bytes_sent_key = NATIVE_FROMSTRING("SEND_BYTES");
   request_time_key = NATIVE_FROMSTRING("REQUEST_TIME");
+  request_timing_key = NATIVE_FROMSTRING("REQUEST_TIMING");
   local_time_key = NATIVE_FROMSTRING("LOCAL_TIME");
   empty_string = NATIVE_FROMSTRING("");
 }
@@ -1260,6 +2017,7 @@ static void clear_server_env(void) {
   request_list_clear();
   buffer_list_clear();
   InputObject_list_clear();
+  raw_list_clear();
 
   Py_DECREF(client_key);
   Py_DECREF(wsgi_input_key);
@@ -1267,6 +2025,7 @@ static void clear_server_env(void) {
   Py_DECREF(status_code_key);
   Py_DECREF(bytes_sent_key);
   Py_DECREF(request_time_key);
+  Py_DECREF(request_timing_key);
   Py_DECREF(local_time_key);
   Py_DECREF(empty_string);
 }
@@ -1460,7 +2219,8 @@ static PyObject *meinheld_listen(PyObject *self, PyObject *args,
   PyObject *o = NULL;
   PyObject *sock_fd = NULL;
   char *path;
-  int ret, len;
+  Py_ssize_t len;
+  int ret;
 
   static char *kwlist[] = {"address", "socket_fd", 0};
 
@@ -1484,10 +2244,11 @@ static PyObject *meinheld_listen(PyObject *self, PyObject *args,
     ret = inet_listen();
   } else if (PyBytes_Check(o)) {
     // unix domain
-    if (!PyArg_Parse(o, "s#", &path, &len)) {
+    // "s#" needs PY_SSIZE_T_CLEAN from Python 3.10 on
+    if (PyBytes_AsStringAndSize(o, &path, &len) == -1) {
       return NULL;
     }
-    ret = unix_listen(path, len);
+    ret = unix_listen(path, (int)len);
   } else {
     PyErr_SetString(PyExc_TypeError, "args tuple or string(path)");
     return NULL;
@@ -1509,6 +2270,16 @@ static void sigint_cb(int signum) {
 
 static void sigpipe_cb(int signum) { DEBUG("call SIGPIPE"); }
 
+static void sigusr1_cb(int signum) {
+  DEBUG("call SIGUSR1");
+  reopen_signal = 1;
+  // chain to the python level handler (e.g. gunicorn reopen_files)
+  if (prev_sigusr1 != SIG_DFL && prev_sigusr1 != SIG_IGN &&
+      prev_sigusr1 != SIG_ERR && prev_sigusr1 != sigusr1_cb) {
+    prev_sigusr1(signum);
+  }
+}
+
 static PyObject *meinheld_access_log(PyObject *self, PyObject *args) {
   PyObject *o = NULL;
   PyObject *func = NULL;
@@ -1537,6 +2308,191 @@ static PyObject *meinheld_access_log(PyObject *self, PyObject *args) {
   Py_RETURN_NONE;
 }
 
+static PyObject *meinheld_set_access_log(PyObject *self, PyObject *args,
+                                         PyObject *kwargs) {
+  PyObject *path = NULL;
+  char *format = DEFAULT_ACCESS_LOG_FORMAT;
+  int flush_interval = 1000;
+  static char *keywords[] = {"path", "format", "flush_interval", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|si:set_access_log",
+                                   keywords, &path, &format, &flush_interval)) {
+    return NULL;
+  }
+  if (flush_interval < 0) {
+    PyErr_SetString(PyExc_ValueError, "flush_interval value out of range ");
+    return NULL;
+  }
+  if (path == Py_None) {
+    set_access_log(NULL, NULL, 0);
+    Py_RETURN_NONE;
+  }
+#ifdef PY3
+  if (!PyUnicode_Check(path)) {
+    PyErr_SetString(PyExc_TypeError, "path must be str or None");
+    return NULL;
+  }
+  if (set_access_log(PyUnicode_AsUTF8(path), format, flush_interval) < 0) {
+#else
+  if (!PyBytes_Check(path)) {
+    PyErr_SetString(PyExc_TypeError, "path must be str or None");
+    return NULL;
+  }
+  if (set_access_log(PyBytes_AS_STRING(path), format, flush_interval) < 0) {
+#endif
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *meinheld_set_capture(PyObject *self, PyObject *args,
+                                      PyObject *kwargs) {
+  PyObject *path = NULL;
+  long long max_bytes = 0;
+  static char *keywords[] = {"path", "max_bytes", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|L:set_capture", keywords,
+                                   &path, &max_bytes)) {
+    return NULL;
+  }
+  if (max_bytes < 0) {
+    PyErr_SetString(PyExc_ValueError, "max_bytes value out of range ");
+    return NULL;
+  }
+  if (path == Py_None) {
+    set_capture(NULL, 0);
+    Py_RETURN_NONE;
+  }
+#ifdef PY3
+  if (!PyUnicode_Check(path)) {
+    PyErr_SetString(PyExc_TypeError, "path must be str or None");
+    return NULL;
+  }
+  if (set_capture(PyUnicode_AsUTF8(path), (uint64_t)max_bytes) < 0) {
+#else
+  if (!PyBytes_Check(path)) {
+    PyErr_SetString(PyExc_TypeError, "path must be str or None");
+    return NULL;
+  }
+  if (set_capture(PyBytes_AS_STRING(path), (uint64_t)max_bytes) < 0) {
+#endif
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static const char *native_string(PyObject *o, Py_ssize_t *len) {
+#ifdef PY3
+  if (PyUnicode_Check(o)) {
+    return PyUnicode_AsUTF8AndSize(o, len);
+  }
+#else
+  if (PyBytes_Check(o)) {
+    *len = PyBytes_GET_SIZE(o);
+    return PyBytes_AS_STRING(o);
+  }
+#endif
+  PyErr_SetString(PyExc_TypeError, "must be str");
+  return NULL;
+}
+
+static int parse_methods(PyObject *methods, uint64_t *mask) {
+  PyObject *seq;
+  const char *name;
+  Py_ssize_t i, len;
+  int m;
+
+  *mask = 0;
+  if (methods == Py_None) {
+    return 1;
+  }
+  seq = PySequence_Fast(methods, "methods must be a sequence of str");
+  if (seq == NULL) {
+    return -1;
+  }
+  for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+    name = native_string(PySequence_Fast_GET_ITEM(seq, i), &len);
+    if (name == NULL) {
+      Py_DECREF(seq);
+      return -1;
+    }
+    for (m = 0; m <= HTTP_PURGE; m++) {
+      if (!strcmp(name, http_method_str(m))) {
+        break;
+      }
+    }
+    if (m > HTTP_PURGE) {
+      PyErr_Format(PyExc_ValueError, "unknown method %s", name);
+      Py_DECREF(seq);
+      return -1;
+    }
+    *mask |= ROUTE_METHOD_BIT(m);
+  }
+  Py_DECREF(seq);
+  if (*mask == 0) {
+    PyErr_SetString(PyExc_ValueError, "methods must not be empty");
+    return -1;
+  }
+  return 1;
+}
+
+static PyObject *meinheld_add_route(PyObject *self, PyObject *args,
+                                    PyObject *kwargs) {
+  PyObject *path = NULL, *target = NULL, *methods = Py_None;
+  const char *s;
+  Py_ssize_t len;
+  uint64_t mask;
+  int prefix = 0;
+  static char *keywords[] = {"path", "target", "methods", "prefix", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|Oi:add_route", keywords,
+                                   &path, &target, &methods, &prefix)) {
+    return NULL;
+  }
+  s = native_string(path, &len);
+  if (s == NULL) {
+    return NULL;
+  }
+  if (len == 0 || s[0] != '/') {
+    PyErr_SetString(PyExc_ValueError, "path must start with '/'");
+    return NULL;
+  }
+  if (!CheckRawResponse(target) && !PyCallable_Check(target)) {
+    PyErr_SetString(PyExc_TypeError, "target must be callable or a Response");
+    return NULL;
+  }
+  if (parse_methods(methods, &mask) < 0) {
+    return NULL;
+  }
+  if (add_route(s, len, prefix, mask, target) < 0) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *meinheld_clear_routes(PyObject *self, PyObject *args) {
+  clear_routes();
+  Py_RETURN_NONE;
+}
+
+static PyObject *meinheld_is_capture_enabled(PyObject *self, PyObject *args) {
+  return PyBool_FromLong(is_capture_enabled());
+}
+
+static PyObject *meinheld_flush_access_log(PyObject *self, PyObject *args) {
+  if (flush_access_log() < 0) {
+    return PyErr_SetFromErrno(PyExc_IOError);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *meinheld_reopen_access_log(PyObject *self, PyObject *args) {
+  if (reopen_access_log() < 0) {
+    return PyErr_SetFromErrno(PyExc_IOError);
+  }
+  Py_RETURN_NONE;
+}
+
 static PyObject *meinheld_error_log(PyObject *self, PyObject *args) {
   PyObject *o = NULL;
   PyObject *func = NULL;
@@ -1585,8 +2541,11 @@ static inline int fire_pendings(void) {
     timer = *(pendings->q + --pendings->size);
     DEBUG("start timer:%p activecnt:%d", timer, activecnt);
     fire_timer(timer);
+    if (!timer->detached) {
+      timer->detached = 1;
+      activecnt--;
+    }
     Py_DECREF(timer);
-    activecnt--;
 
     DEBUG("fin timer:%p activecnt:%d", timer, activecnt);
     if (PyErr_Occurred()) {
@@ -1613,9 +2572,11 @@ static inline int fire_timers(void) {
       // call
       timer = heappop(q);
       fire_timer(timer);
-
+      if (!timer->detached) {
+        timer->detached = 1;
+        activecnt--;
+      }
       Py_DECREF(timer);
-      activecnt--;
       DEBUG("fin timer:%p activecnt:%d", timer, activecnt);
 
       if (PyErr_Occurred()) {
@@ -1699,44 +2660,76 @@ static int close_all_sockets(void) {
   return 1;
 }
 
-static PyObject *meinheld_run_loop(PyObject *self, PyObject *args,
-                                   PyObject *kwds) {
+static PyObject *run_loop(PyObject *app, int silent) {
   PyObject *watchdog_result;
-  int silent = 0;
   int interrupted = 0;
 
-  static char *kwlist[] = {"app", "silent", 0};
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i:run", kwlist, &wsgi_app,
-                                   &silent)) {
-    return NULL;
-  }
-
   if (listen_socks == NULL) {
     PyErr_Format(PyExc_TypeError, "not found listen socket");
     return NULL;
   }
 
+  wsgi_app = app;
   Py_INCREF(wsgi_app);
   setup_server_env();
 
   init_main_loop();
   loop_done = 1;
 
+  connection_cnt = 0;
+  inflight_cnt = 0;
+  suspended_cnt = 0;
+  accept_paused = 0;
+  accept_closed = 0;
+  codel_reset(&codel);
+  if (stats_attach() == -1) {
+    RDEBUG("no free stats slot, count locally");
+  }
+
   PyOS_setsig(SIGPIPE, sigpipe_cb);
   PyOS_setsig(SIGINT, sigint_cb);
   PyOS_setsig(SIGTERM, sigint_cb);
+  if (is_access_log_enabled()) {
+    prev_sigusr1 = PyOS_setsig(SIGUSR1, sigusr1_cb);
+  }
 
   if (listen_all_sockets() < 0) {
     // FATAL Error
+    stats_detach();
     return NULL;
   }
+  admin_start(main_loop);
+#ifdef WITH_GREENLET
+  pool_hub = greenlet_getcurrent();
+#endif
+  if (lagmon_start() == -1) {
+    PyErr_SetString(PyExc_RuntimeError, "can't start loop stall watchdog");
+    call_error_logger();
+  }
 
   /* loop */
   while (likely(loop_done == 1 && activecnt > 0)) {
     /* DEBUG("before activecnt:%d", activecnt); */
     fire_pendings();
+#ifdef WITH_GREENLET
+    green_drain();
+    pool_drain();
+#endif
     fire_timers();
+    lagmon_wait();
+#ifdef WITH_GREENLET
+    /* don't sleep on the poll while someone is ready to run */
+    picoev_loop_once_msec(
+        main_loop,
+        deadline_wait(green_ready_cnt || g_pendings->size ? 0 : 10000));
+#else
     picoev_loop_once(main_loop, 10);
+#endif
+    lagmon_tick(-1);
+    zerocopy_drain();
+#ifdef WITH_GREENLET
+    fire_deadlines();
+#endif
     if (unlikely(catch_signal != 0)) {
       if (catch_signal == SIGINT) {
         interrupted = 1;
@@ -1744,6 +2737,16 @@ static PyObject *meinheld_run_loop(PyObject *self, PyObject *args,
       catch_signal = 0;
       kill_server(0);
     }
+    if (unlikely(reopen_signal != 0)) {
+      reopen_signal = 0;
+      if (reopen_access_log() < 0) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        call_error_logger();
+      }
+    }
+    flush_access_log_if_due();
+    flush_capture_if_due();
+    sync_stats();
     if (watch_loop && watchdog_lasttime != main_loop->now) {
       watchdog_lasttime = main_loop->now;
       if (tempfile_fd) {
@@ -1764,6 +2767,24 @@ static PyObject *meinheld_run_loop(PyObject *self, PyObject *args,
   Py_DECREF(wsgi_app);
   Py_CLEAR(watchdog);
 
+  lagmon_stop();
+  thread_pool_stop(main_loop);
+  zerocopy_stop();
+#ifdef WITH_GREENLET
+  pool_trim(0);
+  Py_CLEAR(pool_hub);
+  pool_ready_head = pool_ready_tail = NULL;
+  green_clear();
+#endif
+  admin_stop(main_loop);
+  sync_stats();
+  stats_detach();
+  flush_access_log();
+  flush_capture();
+  if (is_access_log_enabled()) {
+    PyOS_setsig(SIGUSR1, prev_sigusr1);
+  }
+
   current_client = NULL;
   picoev_destroy_loop(main_loop);
   picoev_deinit();
@@ -1786,6 +2807,40 @@ static PyObject *meinheld_run_loop(PyObject *self, PyObject *args,
   Py_RETURN_NONE;
 }
 
+static PyObject *meinheld_run_loop(PyObject *self, PyObject *args,
+                                   PyObject *kwds) {
+  PyObject *app = NULL;
+  int silent = 0;
+
+  static char *kwlist[] = {"app", "silent", 0};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i:run", kwlist, &app,
+                                   &silent)) {
+    return NULL;
+  }
+  raw_mode = 0;
+  return run_loop(app, silent);
+}
+
+static PyObject *meinheld_run_raw(PyObject *self, PyObject *args,
+                                  PyObject *kwds) {
+  PyObject *handler = NULL, *res;
+  int silent = 0;
+
+  static char *kwlist[] = {"handler", "silent", 0};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i:run_raw", kwlist,
+                                   &handler, &silent)) {
+    return NULL;
+  }
+  if (!PyCallable_Check(handler)) {
+    PyErr_SetString(PyExc_TypeError, "handler must be callable");
+    return NULL;
+  }
+  raw_mode = 1;
+  res = run_loop(handler, silent);
+  raw_mode = 0;
+  return res;
+}
+
 PyObject *meinheld_set_keepalive(PyObject *self, PyObject *args) {
   int on;
   if (!PyArg_ParseTuple(args, "i", &on)) return NULL;
@@ -1836,43 +2891,437 @@ PyObject *meinheld_get_picoev_max_fd(PyObject *self, PyObject *args) {
   return Py_BuildValue("i", max_fd);
 }
 
-PyObject *meinheld_set_max_content_length(PyObject *self, PyObject *args) {
+PyObject *meinheld_set_write_timeout(PyObject *self, PyObject *args) {
   int temp;
   if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
-  if (temp <= 0) {
-    PyErr_SetString(PyExc_ValueError, "max_content_length value out of range ");
+  if (temp < 0) {
+    PyErr_SetString(PyExc_ValueError, "write_timeout value out of range ");
     return NULL;
   }
-  max_content_length = temp;
+  write_timeout = temp;
   Py_RETURN_NONE;
 }
 
-PyObject *meinheld_get_max_content_length(PyObject *self, PyObject *args) {
-  return Py_BuildValue("i", max_content_length);
+PyObject *meinheld_get_write_timeout(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", write_timeout);
 }
 
-PyObject *meinheld_set_client_body_buffer_size(PyObject *self, PyObject *args) {
-  int temp;
-  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
-  if (temp <= 0) {
-    PyErr_SetString(PyExc_ValueError,
-                    "client_body_buffer_size value out of range ");
+PyObject *meinheld_set_min_send_rate(PyObject *self, PyObject *args) {
+  int rate, grace = 5;
+  if (!PyArg_ParseTuple(args, "i|i", &rate, &grace)) return NULL;
+  if (rate < 0 || grace < 0) {
+    PyErr_SetString(PyExc_ValueError, "min_send_rate value out of range ");
     return NULL;
   }
-  client_body_buffer_size = temp;
+  min_send_rate = rate;
+  min_send_rate_grace = grace;
   Py_RETURN_NONE;
 }
 
-PyObject *meinheld_get_client_body_buffer_size(PyObject *self, PyObject *args) {
-  return Py_BuildValue("i", client_body_buffer_size);
+PyObject *meinheld_get_min_send_rate(PyObject *self, PyObject *args) {
+  return Py_BuildValue("(ii)", min_send_rate, min_send_rate_grace);
 }
 
-PyObject *meinheld_set_listen_socket(PyObject *self, PyObject *args) {
-  PyObject *temp;
-  if (!PyArg_ParseTuple(args, "O:listen_socket", &temp)) {
+PyObject *meinheld_set_output_watermarks(PyObject *self, PyObject *args) {
+  int high, low;
+  if (!PyArg_ParseTuple(args, "ii", &high, &low)) return NULL;
+  if (high <= 0 || low < 0 || low > high) {
+    PyErr_SetString(PyExc_ValueError, "output watermark value out of range ");
     return NULL;
   }
-  return set_listen_socket(temp);
+  output_high_watermark = high;
+  output_low_watermark = low;
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_output_watermarks(PyObject *self, PyObject *args) {
+  return Py_BuildValue("(ii)", output_high_watermark, output_low_watermark);
+}
+
+PyObject *meinheld_set_notsent_lowat(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp < 0) {
+    PyErr_SetString(PyExc_ValueError, "notsent_lowat value out of range ");
+    return NULL;
+  }
+  notsent_lowat = temp;
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_notsent_lowat(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", notsent_lowat);
+}
+
+PyObject *meinheld_set_zerocopy_threshold(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  // below a page the completion costs more than the copy
+  if (temp < 0 || (temp > 0 && temp < 4096)) {
+    PyErr_SetString(PyExc_ValueError, "zerocopy_threshold value out of range ");
+    return NULL;
+  }
+  zerocopy_threshold = temp;
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_zerocopy_threshold(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", zerocopy_threshold);
+}
+
+PyObject *meinheld_set_max_content_length(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp <= 0) {
+    PyErr_SetString(PyExc_ValueError, "max_content_length value out of range ");
+    return NULL;
+  }
+  max_content_length = temp;
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_max_content_length(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", max_content_length);
+}
+
+PyObject *meinheld_set_client_body_buffer_size(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp <= 0) {
+    PyErr_SetString(PyExc_ValueError,
+                    "client_body_buffer_size value out of range ");
+    return NULL;
+  }
+  client_body_buffer_size = temp;
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_client_body_buffer_size(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", client_body_buffer_size);
+}
+
+PyObject *meinheld_set_max_connections(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp < 0) {
+    PyErr_SetString(PyExc_ValueError, "max_connections value out of range ");
+    return NULL;
+  }
+  max_connections = temp;
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_max_connections(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", max_connections);
+}
+
+PyObject *meinheld_set_max_inflight(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp < 0) {
+    PyErr_SetString(PyExc_ValueError, "max_inflight value out of range ");
+    return NULL;
+  }
+  max_inflight = temp;
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_max_inflight(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", max_inflight);
+}
+
+PyObject *meinheld_set_greenlet_pool_size(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp < 0) {
+    PyErr_SetString(PyExc_ValueError, "greenlet_pool_size value out of range ");
+    return NULL;
+  }
+#ifdef WITH_GREENLET
+  if (pool_resize(temp) == -1) {
+    return NULL;
+  }
+#endif
+  greenlet_pool_size = temp;
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_greenlet_pool_size(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", greenlet_pool_size);
+}
+
+PyObject *meinheld_set_greenlet_max_requests(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp < 0) {
+    PyErr_SetString(PyExc_ValueError,
+                    "greenlet_max_requests value out of range ");
+    return NULL;
+  }
+  greenlet_max_requests = temp;
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_greenlet_max_requests(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", greenlet_max_requests);
+}
+
+PyObject *meinheld_set_max_suspended(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp < 0) {
+    PyErr_SetString(PyExc_ValueError, "max_suspended value out of range ");
+    return NULL;
+  }
+  max_suspended = temp;
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_max_suspended(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", max_suspended);
+}
+
+PyObject *meinheld_set_overload_retry_after(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp < 0) {
+    PyErr_SetString(PyExc_ValueError, "overload_retry_after value out of range ");
+    return NULL;
+  }
+  overload_retry_after = temp;
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_overload_retry_after(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", overload_retry_after);
+}
+
+PyObject *meinheld_get_overload_stats(PyObject *self, PyObject *args) {
+  uint64_t total_paused_msec = paused_msec;
+
+  if (accept_paused) {
+    total_paused_msec += current_msec - paused_start_msec;
+  }
+  return Py_BuildValue(
+      "{s:i,s:i,s:i,s:O,s:K,s:K,s:K,s:O,s:K}", "connections", connection_cnt,
+      "inflight", inflight_cnt, "suspended", suspended_cnt, "paused",
+      accept_paused ? Py_True : Py_False, "pause_count",
+      (unsigned long long)pause_cnt, "paused_msec",
+      (unsigned long long)total_paused_msec, "shed_requests",
+      (unsigned long long)shed_cnt, "codel_dropping",
+      codel.dropping ? Py_True : Py_False, "codel_drops",
+      (unsigned long long)codel.drop_cnt);
+}
+
+PyObject *meinheld_set_codel_target(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp < 0) {
+    PyErr_SetString(PyExc_ValueError, "codel target value out of range ");
+    return NULL;
+  }
+  codel.target_usec = (uint64_t)temp * 1000;
+  codel_reset(&codel);
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_codel_target(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", (int)(codel.target_usec / 1000));
+}
+
+PyObject *meinheld_set_codel_interval(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp <= 0) {
+    PyErr_SetString(PyExc_ValueError, "codel interval value out of range ");
+    return NULL;
+  }
+  codel.interval_usec = (uint64_t)temp * 1000;
+  codel_reset(&codel);
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_codel_interval(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", (int)(codel.interval_usec / 1000));
+}
+
+static PyObject *meinheld_bench_parse(PyObject *self, PyObject *args) {
+  PyObject *data, *res;
+  int iterations = 1000;
+
+  if (!PyArg_ParseTuple(args, "O|i:_bench_parse", &data, &iterations)) {
+    return NULL;
+  }
+  if (iterations <= 0) {
+    PyErr_SetString(PyExc_ValueError, "iterations value out of range ");
+    return NULL;
+  }
+  if (main_loop != NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "server is running");
+    return NULL;
+  }
+  setup_server_env();
+  res = bench_parse(data, iterations);
+  clear_server_env();
+  return res;
+}
+
+static PyObject *meinheld_bench_response(PyObject *self, PyObject *args) {
+  PyObject *status, *headers, *body, *res;
+  int iterations = 1000;
+
+  if (!PyArg_ParseTuple(args, "OOO|i:_bench_response", &status, &headers,
+                        &body, &iterations)) {
+    return NULL;
+  }
+  if (iterations <= 0) {
+    PyErr_SetString(PyExc_ValueError, "iterations value out of range ");
+    return NULL;
+  }
+  if (main_loop != NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "server is running");
+    return NULL;
+  }
+  setup_server_env();
+  res = bench_response(status, headers, body, iterations);
+  clear_server_env();
+  return res;
+}
+
+PyObject *meinheld_set_loop_stall_threshold(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (lagmon_set_threshold(temp) == -1) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_loop_stall_threshold(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", lagmon_get_threshold());
+}
+
+PyObject *meinheld_set_stats(PyObject *self, PyObject *args,
+                             PyObject *kwargs) {
+  char *path = NULL;
+  int slots = 64;
+  static char *keywords[] = {"path", "slots", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zi:set_stats", keywords,
+                                   &path, &slots)) {
+    return NULL;
+  }
+  if (slots <= 0) {
+    PyErr_SetString(PyExc_ValueError, "slots value out of range ");
+    return NULL;
+  }
+  if (stats_open(path, slots) == -1) {
+    if (path) {
+      PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    } else {
+      PyErr_SetFromErrno(PyExc_IOError);
+    }
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_set_tls(PyObject *self, PyObject *args, PyObject *kwargs) {
+  char *certfile = NULL, *keyfile = NULL, *ciphers = NULL;
+  int session_cache = 1024;
+  static char *keywords[] = {"certfile", "keyfile", "ciphers", "session_cache",
+                             NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "z|zzi:set_tls", keywords,
+                                   &certfile, &keyfile, &ciphers,
+                                   &session_cache)) {
+    return NULL;
+  }
+  if (session_cache < 0) {
+    PyErr_SetString(PyExc_ValueError, "session_cache value out of range ");
+    return NULL;
+  }
+  if (certfile == NULL) {
+    tls_enabled = 0;
+    Py_RETURN_NONE;
+  }
+  if (tls_setup(certfile, keyfile, ciphers, session_cache) == -1) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_tls(PyObject *self, PyObject *args) {
+  return PyBool_FromLong(tls_enabled);
+}
+
+PyObject *meinheld_get_stats(PyObject *self, PyObject *args,
+                             PyObject *kwargs) {
+  char *path = NULL;
+  int per_worker = 0;
+  static char *keywords[] = {"path", "per_worker", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zi:get_stats", keywords,
+                                   &path, &per_worker)) {
+    return NULL;
+  }
+  return stats_get(path, per_worker);
+}
+
+PyObject *meinheld_get_request_timing(PyObject *self, PyObject *args) {
+  client_t *client;
+
+  if (current_client == NULL) {
+    Py_RETURN_NONE;
+  }
+  client = ((ClientObject *)current_client)->client;
+  if (client == NULL || client->current_req == NULL) {
+    Py_RETURN_NONE;
+  }
+  return new_request_timing(&client->current_req->timing);
+}
+
+PyObject *meinheld_set_admin_listen(PyObject *self, PyObject *args) {
+  PyObject *o;
+  char *host, *path;
+  int port, ret;
+
+  if (!PyArg_ParseTuple(args, "O:set_admin_listen", &o)) {
+    return NULL;
+  }
+  admin_stop(main_loop);
+  if (o == Py_None) {
+    Py_RETURN_NONE;
+  } else if (PyTuple_Check(o)) {
+    if (!PyArg_ParseTuple(o, "si:set_admin_listen", &host, &port)) {
+      return NULL;
+    }
+    ret = admin_listen_inet(host, port);
+  } else if (PyBytes_Check(o) || PyUnicode_Check(o)) {
+    // unix domain
+    if (!PyArg_Parse(o, "s:set_admin_listen", &path)) {
+      return NULL;
+    }
+    ret = admin_listen_unix(path);
+  } else {
+    PyErr_SetString(PyExc_TypeError, "args tuple or string(path)");
+    return NULL;
+  }
+  if (ret < 0) {
+    return NULL;
+  }
+  if (main_loop != NULL) {
+    admin_start(main_loop);
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_set_listen_socket(PyObject *self, PyObject *args) {
+  PyObject *temp;
+  if (!PyArg_ParseTuple(args, "O:listen_socket", &temp)) {
+    return NULL;
+  }
+  return set_listen_socket(temp);
 }
 
 PyObject *meinheld_set_fastwatchdog(PyObject *self, PyObject *args) {
@@ -1932,16 +3381,13 @@ meinheld_set_process_name(PyObject *self, PyObject *args)
     Py_RETURN_NONE;
 }*/
 
-PyObject *meinheld_suspend_client(PyObject *self, PyObject *args) {
+static PyObject *suspend_client(PyObject *temp, int timeout) {
 #ifdef WITH_GREENLET
-  PyObject *temp = NULL, *parent = NULL, *res = NULL;
+  PyObject *parent = NULL, *res = NULL;
   ClientObject *pyclient;
   client_t *client;
-  int timeout = 0, ret = 0, active = 0;
+  int ret = 0, active = 0;
 
-  if (!PyArg_ParseTuple(args, "O|i:_suspend_client", &temp, &timeout)) {
-    return NULL;
-  }
   if (timeout < 0) {
     PyErr_SetString(PyExc_ValueError, "timeout value out of range ");
     return NULL;
@@ -1971,9 +3417,15 @@ PyObject *meinheld_suspend_client(PyObject *self, PyObject *args) {
 
   if (client && !(pyclient->suspended)) {
     pyclient->suspended = 1;
+    suspended_cnt++;
+    check_admission();
     parent = greenlet_getparent(pyclient->greenlet);
 
-    set_so_keepalive(client->fd, 1);
+    if (!client->so_keepalive) {
+      // left on for the connection, a resume doesn't need a syscall
+      set_so_keepalive(client->fd, 1);
+      client->so_keepalive = 1;
+    }
     BDEBUG("meinheld_suspend_client pyclient:%p client:%p fd:%d", pyclient,
            client, client->fd);
     BDEBUG("meinheld_suspend_client active ? %d",
@@ -1990,6 +3442,7 @@ PyObject *meinheld_suspend_client(PyObject *self, PyObject *args) {
       activecnt++;
     }
     /* Py_INCREF(hub_switch_value); */
+    PROBE1(greenlet__suspend, client->fd);
     res = greenlet_switch(parent, hub_switch_value, NULL);
     return res;
   } else {
@@ -2002,12 +3455,37 @@ PyObject *meinheld_suspend_client(PyObject *self, PyObject *args) {
 #endif
 }
 
+#ifdef HAVE_FASTCALL
+PyObject *meinheld_suspend_client(PyObject *self, PyObject *const *args,
+                                  Py_ssize_t nargs) {
+  static const char *const keywords[] = {"client", "timeout"};
+  PyObject *argv[2];
+  int timeout = 0;
+
+  if (unpack_fastcall("_suspend_client", args, nargs, NULL, keywords, 1, 2,
+                      argv) == -1 ||
+      (argv[1] && unpack_int(argv[1], &timeout) == -1)) {
+    return NULL;
+  }
+  return suspend_client(argv[0], timeout);
+}
+#else
+PyObject *meinheld_suspend_client(PyObject *self, PyObject *args) {
+  PyObject *temp = NULL;
+  int timeout = 0;
+
+  if (!PyArg_ParseTuple(args, "O|i:_suspend_client", &temp, &timeout)) {
+    return NULL;
+  }
+  return suspend_client(temp, timeout);
+}
+#endif
+
 PyObject *meinheld_resume_client(PyObject *self, PyObject *args) {
 #ifdef WITH_GREENLET
-  PyObject *temp, *switch_args, *switch_kwargs;
+  PyObject *temp, *switch_args = NULL, *switch_kwargs = NULL;
   ClientObject *pyclient;
   client_t *client;
-  int ret, active;
 
   if (!PyArg_ParseTuple(args, "O|OO:_resume_client", &temp, &switch_args,
                         &switch_kwargs)) {
@@ -2035,7 +3513,6 @@ PyObject *meinheld_resume_client(PyObject *self, PyObject *args) {
   }
 
   if (pyclient->client && pyclient->suspended) {
-    set_so_keepalive(pyclient->client->fd, 0);
     pyclient->args = switch_args;
     Py_XINCREF(pyclient->args);
 
@@ -2043,89 +3520,334 @@ PyObject *meinheld_resume_client(PyObject *self, PyObject *args) {
     Py_XINCREF(pyclient->kwargs);
 
     pyclient->suspended = 0;
+    suspended_cnt--;
+    check_admission();
     /* pyclient->resumed = 1; */
     DEBUG("meinheld_resume_client pyclient:%p client:%p fd:%d", pyclient,
           pyclient->client, pyclient->client->fd);
     DEBUG("meinheld_resume_client active ? %d",
           picoev_is_active(main_loop, pyclient->client->fd));
-    // clear event
-    active = picoev_is_active(main_loop, client->fd);
-    ret = picoev_add(main_loop, client->fd, PICOEV_WRITE, 0,
-                     trampoline_callback, (void *)pyclient);
-    if ((ret == 0 && !active)) {
-      activecnt++;
+    // drop the timeout watch, it has no events so no epoll_ctl is made
+    if (picoev_is_active(main_loop, client->fd) &&
+        !picoev_del(main_loop, client->fd)) {
+      activecnt--;
+    }
+    if (green_schedule((PyObject *)pyclient) == -1) {
+      return NULL;
     }
   } else {
     PyErr_SetString(PyExc_IOError, "already resumed");
     return NULL;
   }
-  Py_RETURN_NONE;
+  Py_RETURN_NONE;
+#else
+  NO_GREENLET_ERROR;
+#endif
+}
+
+PyObject *meinheld_cancel_wait(PyObject *self, PyObject *args) {
+#ifdef WITH_GREENLET
+  int fd;
+  if (!PyArg_ParseTuple(args, "i:cancel_event", &fd)) {
+    return NULL;
+  }
+
+  if (fd < 0) {
+    PyErr_SetString(PyExc_ValueError, "fileno value out of range ");
+    return NULL;
+  }
+  green_cancel(fd);
+  Py_RETURN_NONE;
+#else
+  NO_GREENLET_ERROR;
+#endif
+}
+
+void green_cancel(int fd) {
+  if (main_loop != NULL && picoev_is_active(main_loop, fd)) {
+    if (!picoev_del(main_loop, fd)) {
+      activecnt--;
+      DEBUG("activecnt:%d", activecnt);
+    }
+  }
+}
+
+static PyObject *trampoline_event(int fd, int event, int timeout);
+
+static PyObject *trampoline(int fd, PyObject *read, PyObject *write,
+                            int timeout) {
+  int event;
+
+  if (fd < 0) {
+    PyErr_SetString(PyExc_ValueError, "fileno value out of range ");
+    return NULL;
+  }
+
+  if (timeout < 0) {
+    PyErr_SetString(PyExc_ValueError, "timeout value out of range ");
+    return NULL;
+  }
+
+  if (PyObject_IsTrue(read) && PyObject_IsTrue(write)) {
+    event = PICOEV_READWRITE;
+  } else if (PyObject_IsTrue(read)) {
+    event = PICOEV_READ;
+  } else if (PyObject_IsTrue(write)) {
+    event = PICOEV_WRITE;
+  } else {
+    event = PICOEV_TIMEOUT;
+    if (timeout <= 0) {
+      PyErr_SetString(PyExc_ValueError, "timeout value out of range ");
+      return NULL;
+    }
+  }
+  return trampoline_event(fd, event, timeout);
+}
+
+int green_wait(int fd, int event, int timeout) {
+  PyObject *res;
+
+  res = trampoline_event(fd, event, timeout);
+  if (res == NULL) {
+    return -1;
+  }
+  Py_DECREF(res);
+  return 0;
+}
+
+#ifdef WITH_GREENLET
+static void remove_deadline(int fd) {
+  int i;
+
+  for (i = 0; i < green_deadline_cnt; i++) {
+    if (green_deadlines[i].fd == fd) {
+      green_deadlines[i] = green_deadlines[--green_deadline_cnt];
+      return;
+    }
+  }
+}
+
+/* the poll wait, cut to the nearest deadline */
+static int deadline_wait(int wait_msec) {
+  uintptr_t now = get_current_msec();
+  int i, left;
+
+  for (i = 0; i < green_deadline_cnt; i++) {
+    left = green_deadlines[i].msec > now ? green_deadlines[i].msec - now : 0;
+    if (left < wait_msec) {
+      wait_msec = left;
+    }
+  }
+  return wait_msec;
+}
+
+/* time out the waits whose deadline passed, like picoev does */
+static void fire_deadlines(void) {
+  uintptr_t now = get_current_msec();
+  picoev_fd *target;
+  int i, fd;
+
+  for (i = 0; i < green_deadline_cnt; i++) {
+    if (green_deadlines[i].msec > now) {
+      continue;
+    }
+    fd = green_deadlines[i].fd;
+    green_deadlines[i] = green_deadlines[--green_deadline_cnt];
+    if (picoev_is_active(main_loop, fd)) {
+      target = picoev.fds + fd;
+      picoev_set_timeout(main_loop, fd, 0);
+      (*target->callback)(main_loop, fd, PICOEV_TIMEOUT, target->cb_arg);
+    }
+    // the callback may have changed the list
+    i = -1;
+  }
+}
+#endif
+
+int green_wait_msec(int fd, int event, int msec) {
+#ifdef WITH_GREENLET
+  green_deadline_t *d;
+  int ret, max;
+
+  if (green_deadline_cnt == green_deadline_max) {
+    max = green_deadline_max ? green_deadline_max * 2 : 16;
+    d = PyMem_Realloc(green_deadlines, sizeof(green_deadline_t) * max);
+    if (d == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+    green_deadlines = d;
+    green_deadline_max = max;
+  }
+  green_deadlines[green_deadline_cnt].fd = fd;
+  green_deadlines[green_deadline_cnt].msec = get_current_msec() + msec;
+  green_deadline_cnt++;
+  // the picoev timeout is a backstop, fire_deadlines comes first
+  ret = green_wait(fd, event, msec / 1000 + 2);
+  remove_deadline(fd);
+  return ret;
+#else
+  return green_wait(fd, event, msec / 1000 + 1);
+#endif
+}
+
+PyObject *green_current(void) {
+#ifdef WITH_GREENLET
+  PyObject *current;
+  ClientObject *pyclient = (ClientObject *)current_client;
+
+  current = greenlet_getcurrent();
+  Py_DECREF(current);
+  if (pyclient != NULL && pyclient->greenlet == current) {
+    Py_INCREF(pyclient);
+    return (PyObject *)pyclient;
+  }
+  if (greenlet_getparent(current) == NULL) {
+    PyErr_SetString(PyExc_IOError, "call from same greenlet");
+    return NULL;
+  }
+  Py_INCREF(current);
+  return current;
 #else
   NO_GREENLET_ERROR;
 #endif
 }
 
-PyObject *meinheld_cancel_wait(PyObject *self, PyObject *args) {
+PyObject *green_suspend(void) {
 #ifdef WITH_GREENLET
-  int fd;
-  if (!PyArg_ParseTuple(args, "i:cancel_event", &fd)) {
+  PyObject *current, *parent;
+
+  current = greenlet_getcurrent();
+  parent = greenlet_getparent(current);
+  Py_DECREF(current);
+  if (parent == NULL) {
+    PyErr_SetString(PyExc_IOError, "call from same greenlet");
     return NULL;
   }
+  PROBE1(greenlet__suspend, -1);
+  return greenlet_switch(parent, hub_switch_value, NULL);
+#else
+  NO_GREENLET_ERROR;
+#endif
+}
 
-  if (fd < 0) {
-    PyErr_SetString(PyExc_ValueError, "fileno value out of range ");
-    return NULL;
+void green_resume(PyObject *waiter) {
+#ifdef WITH_GREENLET
+  if (CheckClientObject(waiter)) {
+    resume_wsgi_handler((ClientObject *)waiter);
+  } else if (greenlet_check(waiter) && !greenlet_dead(waiter)) {
+    PROBE1(greenlet__resume, -1);
+    resume_greenlet(waiter);
   }
-  if (picoev_is_active(main_loop, fd)) {
-    if (!picoev_del(main_loop, fd)) {
-      activecnt--;
-      DEBUG("activecnt:%d", activecnt);
+#endif
+}
+
+void loop_hold(int n) { activecnt += n; }
+
+int green_schedule(PyObject *waiter) {
+#ifdef WITH_GREENLET
+  PyObject **q;
+  int i, max;
+
+  if (green_ready_cnt == green_ready_max) {
+    max = green_ready_max ? green_ready_max * 2 : 64;
+    q = PyMem_Malloc(sizeof(PyObject *) * max);
+    if (q == NULL) {
+      PyErr_NoMemory();
+      return -1;
     }
-  }
-  Py_RETURN_NONE;
+    for (i = 0; i < green_ready_cnt; i++) {
+      q[i] = green_ready[(green_ready_head + i) % green_ready_max];
+    }
+    PyMem_Free(green_ready);
+    green_ready = q;
+    green_ready_head = 0;
+    green_ready_max = max;
+  }
+  Py_INCREF(waiter);
+  green_ready[(green_ready_head + green_ready_cnt) % green_ready_max] = waiter;
+  green_ready_cnt++;
+  activecnt++;
+  return 0;
 #else
-  NO_GREENLET_ERROR;
+  PyErr_SetString(PyExc_NotImplementedError, "greenlet is not installed");
+  return -1;
 #endif
 }
 
-static PyObject *meinheld_trampoline(PyObject *self, PyObject *args,
-                                     PyObject *kwargs) {
 #ifdef WITH_GREENLET
-  PyObject *current = NULL, *parent = NULL, *res = NULL;
-  ClientObject *pyclient;
-  int fd, event, timeout = 0, ret, active;
-  PyObject *read = Py_None, *write = Py_None;
+/* resume the waiters scheduled before this turn, the ones they schedule
+ * wait for the next */
+static void green_drain(void) {
+  PyObject *waiter;
+  int cnt = green_ready_cnt;
+
+  while (cnt-- > 0 && green_ready_cnt > 0 && loop_done) {
+    waiter = green_ready[green_ready_head];
+    green_ready_head = (green_ready_head + 1) % green_ready_max;
+    green_ready_cnt--;
+    activecnt--;
+    green_resume(waiter);
+    Py_DECREF(waiter);
+  }
+}
 
-  static char *keywords[] = {"fileno", "read", "write", "timeout", NULL};
+/* the loop is gone, let go of the waiters it didn't get to */
+static void green_clear(void) {
+  PyObject *waiter;
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|OOi:trampoline", keywords,
-                                   &fd, &read, &write, &timeout)) {
-    return NULL;
+  green_deadline_cnt = 0;
+  while (green_ready_cnt > 0) {
+    waiter = green_ready[green_ready_head];
+    green_ready_head = (green_ready_head + 1) % green_ready_max;
+    green_ready_cnt--;
+    activecnt--;
+    Py_DECREF(waiter);
   }
+  green_ready_head = 0;
+}
+#endif
 
-  if (fd < 0) {
-    PyErr_SetString(PyExc_ValueError, "fileno value out of range ");
-    return NULL;
+int loop_watch(int fd, int events, picoev_handler *callback, void *cb_arg) {
+  if (main_loop == NULL || !PICOEV_IS_INITED_AND_FD_IN_RANGE(fd)) {
+    return -1;
   }
+  if (picoev_is_active(main_loop, fd)) {
+    return 0;
+  }
+  if (picoev_add(main_loop, fd, events, 0, callback, cb_arg) != 0) {
+    return -1;
+  }
+  activecnt++;
+  return 0;
+}
 
-  if (timeout < 0) {
-    PyErr_SetString(PyExc_ValueError, "timeout value out of range ");
-    return NULL;
+void loop_unwatch(int fd) {
+  if (main_loop != NULL && PICOEV_IS_INITED_AND_FD_IN_RANGE(fd) &&
+      picoev_is_active(main_loop, fd) && !picoev_del(main_loop, fd)) {
+    activecnt--;
   }
+}
 
-  if (PyObject_IsTrue(read) && PyObject_IsTrue(write)) {
-    event = PICOEV_READWRITE;
-  } else if (PyObject_IsTrue(read)) {
-    event = PICOEV_READ;
-  } else if (PyObject_IsTrue(write)) {
-    event = PICOEV_WRITE;
-  } else {
-    event = PICOEV_TIMEOUT;
-    if (timeout <= 0) {
-      PyErr_SetString(PyExc_ValueError, "timeout value out of range ");
-      return NULL;
-    }
+PyObject *green_call_later(int seconds, PyObject *callback) {
+  return internal_schedule_call(seconds, callback, NULL, NULL, NULL);
+}
+
+void green_call_cancel(PyObject *timer) {
+  TimerObject *t = (TimerObject *)timer;
+
+  t->called = 1;
+  if (!t->detached) {
+    t->detached = 1;
+    activecnt--;
   }
+}
+
+static PyObject *trampoline_event(int fd, int event, int timeout) {
+#ifdef WITH_GREENLET
+  PyObject *current = NULL, *parent = NULL, *res = NULL;
+  ClientObject *pyclient;
+  int ret, active;
 
   /*
   if (current_client == NULL) {
@@ -2154,6 +3876,7 @@ static PyObject *meinheld_trampoline(PyObject *self, PyObject *args,
            event, current, parent, pyclient);
 
     /* Py_INCREF(hub_switch_value); */
+    PROBE1(greenlet__suspend, fd);
     res = greenlet_switch(parent, hub_switch_value, NULL);
     return res;
   } else {
@@ -2173,6 +3896,7 @@ static PyObject *meinheld_trampoline(PyObject *self, PyObject *args,
     YDEBUG("trampoline fd:%d event:%d current:%p parent:%p cb_arg:%p", fd,
            event, current, parent, current);
     /* Py_INCREF(hub_switch_value); */
+    PROBE1(greenlet__suspend, fd);
     res = greenlet_switch(parent, hub_switch_value, NULL);
     return res;
   }
@@ -2181,6 +3905,38 @@ static PyObject *meinheld_trampoline(PyObject *self, PyObject *args,
 #endif
 }
 
+#ifdef HAVE_FASTCALL
+static PyObject *meinheld_trampoline(PyObject *self, PyObject *const *args,
+                                     Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const keywords[] = {"fileno", "read", "write", "timeout"};
+  PyObject *argv[4];
+  int fd, timeout = 0;
+
+  if (unpack_fastcall("trampoline", args, nargs, kwnames, keywords, 1, 4,
+                      argv) == -1 ||
+      unpack_int(argv[0], &fd) == -1 ||
+      (argv[3] && unpack_int(argv[3], &timeout) == -1)) {
+    return NULL;
+  }
+  return trampoline(fd, argv[1] ? argv[1] : Py_None,
+                    argv[2] ? argv[2] : Py_None, timeout);
+}
+#else
+static PyObject *meinheld_trampoline(PyObject *self, PyObject *args,
+                                     PyObject *kwargs) {
+  PyObject *read = Py_None, *write = Py_None;
+  int fd, timeout = 0;
+
+  static char *keywords[] = {"fileno", "read", "write", "timeout", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|OOi:trampoline", keywords,
+                                   &fd, &read, &write, &timeout)) {
+    return NULL;
+  }
+  return trampoline(fd, read, write, timeout);
+}
+#endif
+
 static PyObject *meinheld_spawn(PyObject *self, PyObject *args,
                                 PyObject *kwargs) {
 #ifdef WITH_GREENLET
@@ -2230,6 +3986,7 @@ static PyObject *meinheld_sleep(PyObject *self, PyObject *args,
   DEBUG("sleep sec:%d", sec);
   res = internal_schedule_call(sec, NULL, NULL, NULL, current);
   Py_XDECREF(res);
+  PROBE1(greenlet__suspend, -1);
   res = greenlet_switch(parent, hub_switch_value, NULL);
   Py_XDECREF(res);
 
@@ -2240,6 +3997,121 @@ static PyObject *meinheld_sleep(PyObject *self, PyObject *args,
 #endif
 }
 
+static PyObject *meinheld_run_in_thread(PyObject *self, PyObject *args,
+                                        PyObject *kwargs) {
+#ifdef WITH_GREENLET
+  PyObject *func, *func_args, *res;
+
+  if (PyTuple_GET_SIZE(args) < 1) {
+    PyErr_SetString(PyExc_TypeError,
+                    "run_in_thread() missing required argument 'func'");
+    return NULL;
+  }
+  func = PyTuple_GET_ITEM(args, 0);
+  if (!PyCallable_Check(func)) {
+    PyErr_SetString(PyExc_TypeError, "func must be callable");
+    return NULL;
+  }
+  func_args = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+  if (func_args == NULL) {
+    return NULL;
+  }
+  res = thread_pool_call(main_loop, func, func_args, kwargs);
+  Py_DECREF(func_args);
+  return res;
+#else
+  NO_GREENLET_ERROR;
+#endif
+}
+
+static PyObject *meinheld_ws_frame(PyObject *self, PyObject *message) {
+  return ws_encode_frame(message);
+}
+
+static PyObject *meinheld_broadcast(PyObject *self, PyObject *args) {
+  PyObject *outboxes, *message, *frame;
+  Py_ssize_t sent;
+
+  if (!PyArg_ParseTuple(args, "OO:broadcast", &outboxes, &message)) {
+    return NULL;
+  }
+  frame = ws_encode_frame(message);
+  if (frame == NULL) {
+    return NULL;
+  }
+  sent = outbox_broadcast(outboxes, frame);
+  Py_DECREF(frame);
+  if (sent == -1) {
+    return NULL;
+  }
+  return PyLong_FromSsize_t(sent);
+}
+
+static PyObject *meinheld_getaddrinfo(PyObject *self, PyObject *args,
+                                      PyObject *kwargs) {
+  PyObject *host, *port;
+  int family = 0, type = 0, proto = 0, flags = 0;
+  static char *keywords[] = {"host",  "port",  "family", "type",
+                             "proto", "flags", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|iiii:getaddrinfo",
+                                   keywords, &host, &port, &family, &type,
+                                   &proto, &flags)) {
+    return NULL;
+  }
+  return resolver_getaddrinfo(host, port, family, type, proto, flags);
+}
+
+static PyObject *meinheld_set_resolver(PyObject *self, PyObject *args,
+                                       PyObject *kwargs) {
+  char *conf = NULL, *hosts = NULL;
+  PyObject *nameservers = Py_None;
+  static char *keywords[] = {"resolv_conf", "hosts", "nameservers", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zzO:set_resolver",
+                                   keywords, &conf, &hosts, &nameservers)) {
+    return NULL;
+  }
+  if (resolver_configure(conf, hosts,
+                         nameservers == Py_None ? NULL : nameservers) == -1) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_set_thread_pool_size(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp <= 0) {
+    PyErr_SetString(PyExc_ValueError, "thread_pool_size value out of range ");
+    return NULL;
+  }
+  thread_pool_size = temp;
+  if (thread_pool_resize() == -1) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_thread_pool_size(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", thread_pool_size);
+}
+
+PyObject *meinheld_set_thread_queue_limit(PyObject *self, PyObject *args) {
+  int temp;
+  if (!PyArg_ParseTuple(args, "i", &temp)) return NULL;
+  if (temp < 0) {
+    PyErr_SetString(PyExc_ValueError, "thread_queue_limit value out of range ");
+    return NULL;
+  }
+  thread_queue_limit = temp;
+  Py_RETURN_NONE;
+}
+
+PyObject *meinheld_get_thread_queue_limit(PyObject *self, PyObject *args) {
+  return Py_BuildValue("i", thread_queue_limit);
+}
+
 PyObject *meinheld_get_ident(PyObject *self, PyObject *args) {
 #ifdef WITH_GREENLET
   return greenlet_getcurrent();
@@ -2282,21 +4154,9 @@ static PyObject *internal_schedule_call(int seconds, PyObject *cb,
   return (PyObject *)timer;
 }
 
-static PyObject *meinheld_schedule_call(PyObject *self, PyObject *args,
-                                        PyObject *kwargs) {
-  long seconds = 0, ret;
-  Py_ssize_t size;
-  PyObject *sec = NULL, *cb = NULL, *cbargs = NULL, *timer;
-
-  size = PyTuple_GET_SIZE(args);
-  DEBUG("args size %d", (int)size);
-
-  if (size < 2) {
-    PyErr_SetString(PyExc_TypeError, "schedule_call takes exactly 2 argument");
-    return NULL;
-  }
-  sec = PyTuple_GET_ITEM(args, 0);
-  cb = PyTuple_GET_ITEM(args, 1);
+/* seconds of schedule_call(seconds, cb), -1 on error */
+static long schedule_seconds(PyObject *sec, PyObject *cb) {
+  long ret;
 
 #ifdef PY3
   if (!PyLong_Check(sec)) {
@@ -2304,31 +4164,100 @@ static PyObject *meinheld_schedule_call(PyObject *self, PyObject *args,
   if (!PyInt_Check(sec)) {
 #endif
     PyErr_SetString(PyExc_TypeError, "must be integer");
-    return NULL;
+    return -1;
   }
   if (!PyCallable_Check(cb)) {
     PyErr_SetString(PyExc_TypeError, "must be callable");
-    return NULL;
+    return -1;
   }
 
   ret = PyLong_AsLong(sec);
   if (PyErr_Occurred()) {
-    return NULL;
+    return -1;
   }
   if (ret < 0) {
     PyErr_SetString(PyExc_TypeError, "seconds value out of range");
+    return -1;
+  }
+  return ret;
+}
+
+#ifdef HAVE_FASTCALL
+static PyObject *meinheld_schedule_call(PyObject *self, PyObject *const *args,
+                                        Py_ssize_t nargs, PyObject *kwnames) {
+  long seconds;
+  Py_ssize_t i, nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+  PyObject *cbargs = NULL, *kwargs = NULL, *timer = NULL;
+
+  if (nargs < 2) {
+    PyErr_SetString(PyExc_TypeError, "schedule_call takes exactly 2 argument");
+    return NULL;
+  }
+  seconds = schedule_seconds(args[0], args[1]);
+  if (seconds == -1) {
+    return NULL;
+  }
+
+  // the timer keeps its own args and kwargs, no slice of a call tuple
+  if (nargs > 2) {
+    cbargs = PyTuple_New(nargs - 2);
+    if (cbargs == NULL) {
+      return NULL;
+    }
+    for (i = 2; i < nargs; i++) {
+      Py_INCREF(args[i]);
+      PyTuple_SET_ITEM(cbargs, i - 2, args[i]);
+    }
+  }
+  if (nkw > 0) {
+    kwargs = PyDict_New();
+    if (kwargs == NULL) {
+      goto error;
+    }
+    for (i = 0; i < nkw; i++) {
+      if (PyDict_SetItem(kwargs, PyTuple_GET_ITEM(kwnames, i),
+                         args[nargs + i]) == -1) {
+        goto error;
+      }
+    }
+  }
+
+  timer = internal_schedule_call(seconds, args[1], cbargs, kwargs, NULL);
+error:
+  Py_XDECREF(cbargs);
+  Py_XDECREF(kwargs);
+  return timer;
+}
+#else
+static PyObject *meinheld_schedule_call(PyObject *self, PyObject *args,
+                                        PyObject *kwargs) {
+  long seconds = 0;
+  Py_ssize_t size;
+  PyObject *cbargs = NULL, *timer;
+
+  size = PyTuple_GET_SIZE(args);
+  DEBUG("args size %d", (int)size);
+
+  if (size < 2) {
+    PyErr_SetString(PyExc_TypeError, "schedule_call takes exactly 2 argument");
+    return NULL;
+  }
+  seconds =
+      schedule_seconds(PyTuple_GET_ITEM(args, 0), PyTuple_GET_ITEM(args, 1));
+  if (seconds == -1) {
     return NULL;
   }
-  seconds = ret;
 
   if (size > 2) {
     cbargs = PyTuple_GetSlice(args, 2, size);
   }
 
-  timer = internal_schedule_call(seconds, cb, cbargs, kwargs, NULL);
+  timer = internal_schedule_call(seconds, PyTuple_GET_ITEM(args, 1), cbargs,
+                                 kwargs, NULL);
   Py_XDECREF(cbargs);
   return timer;
 }
+#endif
 
 static PyMethodDef ServerMethods[] = {
     {"listen", (PyCFunction)meinheld_listen, METH_VARARGS | METH_KEYWORDS,
@@ -2337,6 +4266,27 @@ static PyMethodDef ServerMethods[] = {
      "set access logger function."},
     {"set_error_logger", meinheld_error_log, METH_VARARGS,
      "set error logger function."},
+    {"set_access_log", (PyCFunction)meinheld_set_access_log,
+     METH_VARARGS | METH_KEYWORDS,
+     "write access log to path (\"-\" is stdout) with gunicorn style format. "
+     "None to disable"},
+    {"set_capture", (PyCFunction)meinheld_set_capture,
+     METH_VARARGS | METH_KEYWORDS,
+     "record raw request bytes per connection to path for bench/replay.py, "
+     "stop after max_bytes (0 is unlimited). None to disable"},
+    {"is_capture_enabled", meinheld_is_capture_enabled, METH_NOARGS,
+     "return True while capturing"},
+    {"add_route", (PyCFunction)meinheld_add_route,
+     METH_VARARGS | METH_KEYWORDS,
+     "route path (every path starting with it if prefix) to a callable "
+     "instead of the app or to a Response written without calling python. "
+     "methods limits the route, others get 405"},
+    {"clear_routes", meinheld_clear_routes, METH_NOARGS,
+     "remove every route"},
+    {"flush_access_log", meinheld_flush_access_log, METH_VARARGS,
+     "write buffered access log"},
+    {"reopen_access_log", meinheld_reopen_access_log, METH_VARARGS,
+     "reopen access log file. also done on SIGUSR1"},
 
     {"set_keepalive", meinheld_set_keepalive, METH_VARARGS,
      "set keep-alive support. value set timeout sec. default 0. (disable "
@@ -2362,6 +4312,98 @@ static PyMethodDef ServerMethods[] = {
     {"get_picoev_max_fd", meinheld_get_picoev_max_fd, METH_VARARGS,
      "return picoev max fd size"},
 
+    // output queue
+    {"set_write_timeout", meinheld_set_write_timeout, METH_VARARGS,
+     "cut a response when the client takes nothing for sec. default 300"},
+    {"get_write_timeout", meinheld_get_write_timeout, METH_VARARGS,
+     "return write timeout sec"},
+    {"set_min_send_rate", meinheld_set_min_send_rate, METH_VARARGS,
+     "set_min_send_rate(rate, grace=5): cut a blocked response sending less "
+     "than rate bytes per sec after grace sec. default 0 (disable)"},
+    {"get_min_send_rate", meinheld_get_min_send_rate, METH_VARARGS,
+     "return (rate, grace) of the min send rate"},
+    {"set_output_watermarks", meinheld_set_output_watermarks, METH_VARARGS,
+     "set_output_watermarks(high, low): stop pulling the response body while "
+     "more than high bytes are queued, go on at low. default (65536, 16384)"},
+    {"get_output_watermarks", meinheld_get_output_watermarks, METH_VARARGS,
+     "return (high, low) output watermarks"},
+    {"set_notsent_lowat", meinheld_set_notsent_lowat, METH_VARARGS,
+     "set TCP_NOTSENT_LOWAT of client sockets. default 0 (system default)"},
+    {"get_notsent_lowat", meinheld_get_notsent_lowat, METH_VARARGS,
+     "return TCP_NOTSENT_LOWAT of client sockets"},
+    {"set_zerocopy_threshold", meinheld_set_zerocopy_threshold, METH_VARARGS,
+     "send response body chunks of at least this many bytes with "
+     "MSG_ZEROCOPY. default 0 (disabled)"},
+    {"get_zerocopy_threshold", meinheld_get_zerocopy_threshold, METH_VARARGS,
+     "return the zerocopy send threshold"},
+
+    // admission control
+    {"set_max_connections", meinheld_set_max_connections, METH_VARARGS,
+     "set max client connections. pause accepting when reached. default 0 "
+     "(unlimited)"},
+    {"get_max_connections", meinheld_get_max_connections, METH_VARARGS,
+     "return max client connections"},
+    {"set_max_inflight", meinheld_set_max_inflight, METH_VARARGS,
+     "set max running wsgi calls. pause accepting when reached. default 0 "
+     "(unlimited)"},
+    {"get_max_inflight", meinheld_get_max_inflight, METH_VARARGS,
+     "return max running wsgi calls"},
+    {"set_greenlet_pool_size", meinheld_set_greenlet_pool_size, METH_VARARGS,
+     "keep up to size finished greenlets and reuse them for the next "
+     "requests. default 0 (a new greenlet per request)"},
+    {"get_greenlet_pool_size", meinheld_get_greenlet_pool_size, METH_VARARGS,
+     "return greenlet pool size"},
+    {"set_greenlet_max_requests", meinheld_set_greenlet_max_requests,
+     METH_VARARGS,
+     "retire a pooled greenlet after it has run this many requests. default 0 "
+     "(unlimited)"},
+    {"get_greenlet_max_requests", meinheld_get_greenlet_max_requests,
+     METH_VARARGS, "return requests per pooled greenlet"},
+    {"set_max_suspended", meinheld_set_max_suspended, METH_VARARGS,
+     "set max suspended greenlets. pause accepting when reached. default 0 "
+     "(unlimited)"},
+    {"get_max_suspended", meinheld_get_max_suspended, METH_VARARGS,
+     "return max suspended greenlets"},
+    {"set_overload_retry_after", meinheld_set_overload_retry_after,
+     METH_VARARGS,
+     "reply 503 with Retry-After sec while overloaded. default 0 (disable)"},
+    {"get_overload_retry_after", meinheld_get_overload_retry_after,
+     METH_VARARGS, "return Retry-After sec of overload response"},
+    {"get_overload_stats", meinheld_get_overload_stats, METH_VARARGS,
+     "return admission control counters"},
+    {"set_codel_target", meinheld_set_codel_target, METH_VARARGS,
+     "set target queue delay msec. reply 503 while the delay stays above it. "
+     "default 0 (disable)"},
+    {"get_codel_target", meinheld_get_codel_target, METH_VARARGS,
+     "return target queue delay msec"},
+    {"set_codel_interval", meinheld_set_codel_interval, METH_VARARGS,
+     "set queue delay interval msec. default 100"},
+    {"get_codel_interval", meinheld_get_codel_interval, METH_VARARGS,
+     "return queue delay interval msec"},
+    {"set_loop_stall_threshold", meinheld_set_loop_stall_threshold,
+     METH_VARARGS,
+     "set msec a callback may block the loop. longer runs count as stalls "
+     "and log the stack. default 0 (disable)"},
+    {"get_loop_stall_threshold", meinheld_get_loop_stall_threshold,
+     METH_VARARGS, "return loop stall threshold msec"},
+    {"set_stats", (PyCFunction)meinheld_set_stats,
+     METH_VARARGS | METH_KEYWORDS,
+     "share stats between workers. call before fork (path=None) or give a "
+     "stats file path"},
+    {"set_tls", (PyCFunction)meinheld_set_tls, METH_VARARGS | METH_KEYWORDS,
+     "set_tls(certfile, keyfile=None, ciphers=None, session_cache=1024): "
+     "serve HTTPS, the kernel encrypts once the handshake is done. call "
+     "before fork to share sessions between workers. None disables"},
+    {"get_tls", meinheld_get_tls, METH_VARARGS, "return True if HTTPS is on"},
+    {"get_stats", (PyCFunction)meinheld_get_stats,
+     METH_VARARGS | METH_KEYWORDS,
+     "return request counters and latency histogram of all workers"},
+    {"get_request_timing", meinheld_get_request_timing, METH_VARARGS,
+     "return the phase timestamps (usec) of the current request"},
+    {"set_admin_listen", meinheld_set_admin_listen, METH_VARARGS,
+     "serve /metrics and /healthz on (host, port) or unix socket path. "
+     "None to disable"},
+
     /* {"set_process_name", meinheld_set_process_name, METH_VARARGS, "set
        process name"}, */
     {"stop", (PyCFunction)meinheld_stop, METH_VARARGS | METH_KEYWORDS,
@@ -2369,8 +4411,13 @@ static PyMethodDef ServerMethods[] = {
     {"shutdown", (PyCFunction)meinheld_stop, METH_VARARGS | METH_KEYWORDS,
      "stop main loop "},
 
+#ifdef HAVE_FASTCALL
+    {"schedule_call", (PyCFunction)(void (*)(void))meinheld_schedule_call,
+     METH_FASTCALL | METH_KEYWORDS, ""},
+#else
     {"schedule_call", (PyCFunction)meinheld_schedule_call,
      METH_VARARGS | METH_KEYWORDS, ""},
+#endif
     {"spawn", (PyCFunction)meinheld_spawn, METH_VARARGS | METH_KEYWORDS, ""},
     {"sleep", (PyCFunction)meinheld_sleep, METH_VARARGS | METH_KEYWORDS, ""},
 
@@ -2382,14 +4429,61 @@ static PyMethodDef ServerMethods[] = {
      "set watchdog"},
     {"run", (PyCFunction)meinheld_run_loop, METH_VARARGS | METH_KEYWORDS,
      "set wsgi app, run the main loop"},
+    {"run_raw", (PyCFunction)meinheld_run_raw, METH_VARARGS | METH_KEYWORDS,
+     "run the main loop without WSGI. handler(Request) returns a Response"},
     // greenlet and continuation
-    {"_suspend_client", meinheld_suspend_client, METH_VARARGS, "resume client"},
+#ifdef HAVE_FASTCALL
+    {"_suspend_client", (PyCFunction)(void (*)(void))meinheld_suspend_client,
+     METH_FASTCALL, "suspend client"},
+#else
+    {"_suspend_client", meinheld_suspend_client, METH_VARARGS,
+     "suspend client"},
+#endif
     {"_resume_client", meinheld_resume_client, METH_VARARGS, "resume client"},
     // io
     {"cancel_wait", meinheld_cancel_wait, METH_VARARGS, "cancel wait"},
+#ifdef HAVE_FASTCALL
+    {"trampoline", (PyCFunction)(void (*)(void))meinheld_trampoline,
+     METH_FASTCALL | METH_KEYWORDS, "trampoline"},
+#else
     {"trampoline", (PyCFunction)meinheld_trampoline,
      METH_VARARGS | METH_KEYWORDS, "trampoline"},
+#endif
     {"get_ident", meinheld_get_ident, METH_VARARGS, "return thread ident id"},
+    // blocking calls
+    {"run_in_thread", (PyCFunction)meinheld_run_in_thread,
+     METH_VARARGS | METH_KEYWORDS,
+     "run func(*args, **kwargs) on the thread pool and wait for the result "
+     "without blocking the loop"},
+    {"set_thread_pool_size", meinheld_set_thread_pool_size, METH_VARARGS,
+     "set run_in_thread worker threads. default 4"},
+    {"get_thread_pool_size", meinheld_get_thread_pool_size, METH_VARARGS,
+     "return run_in_thread worker threads"},
+    {"set_thread_queue_limit", meinheld_set_thread_queue_limit, METH_VARARGS,
+     "set max run_in_thread calls waiting for a worker, IOError beyond it. "
+     "default 0 (unlimited)"},
+    {"get_thread_queue_limit", meinheld_get_thread_queue_limit, METH_VARARGS,
+     "return max run_in_thread calls waiting for a worker"},
+    // websocket
+    {"ws_frame", meinheld_ws_frame, METH_O,
+     "return message as a websocket frame, text for str and binary for bytes"},
+    {"broadcast", meinheld_broadcast, METH_VARARGS,
+     "broadcast(outboxes, message), frame message once and queue it on every "
+     "Outbox, skipping slow ones. returns how many took it"},
+    // dns
+    {"getaddrinfo", (PyCFunction)meinheld_getaddrinfo,
+     METH_VARARGS | METH_KEYWORDS,
+     "socket.getaddrinfo that resolves names without blocking the loop"},
+    {"set_resolver", (PyCFunction)meinheld_set_resolver,
+     METH_VARARGS | METH_KEYWORDS,
+     "set the resolv.conf and hosts files of getaddrinfo and optionally "
+     "the nameservers as a list of addr or (addr, port). clears the cache"},
+    // microbenchmarks
+    {"_bench_parse", meinheld_bench_parse, METH_VARARGS,
+     "parse request bytes n times, return ns and allocations per request"},
+    {"_bench_response", meinheld_bench_response, METH_VARARGS,
+     "write a response n times to /dev/null, return ns and allocations per "
+     "request"},
 
     {NULL, NULL, 0, NULL} /* Sentinel */
 };
@@ -2438,6 +4532,49 @@ PyMODINIT_FUNC initserver(void)
     INITERROR;
   }
 
+  if (PyType_Ready(&RawRequestType) < 0) {
+    INITERROR;
+  }
+  Py_INCREF(&RawRequestType);
+  PyModule_AddObject(m, "Request", (PyObject *)&RawRequestType);
+
+  if (PyType_Ready(&RawResponseType) < 0) {
+    INITERROR;
+  }
+  Py_INCREF(&RawResponseType);
+  PyModule_AddObject(m, "Response", (PyObject *)&RawResponseType);
+
+  if (init_greensocket() < 0) {
+    INITERROR;
+  }
+  Py_INCREF(&GreenSocketType);
+  PyModule_AddObject(m, "GreenSocket", (PyObject *)&GreenSocketType);
+
+  if (init_greensync() < 0) {
+    INITERROR;
+  }
+  Py_INCREF(&EventType);
+  PyModule_AddObject(m, "Event", (PyObject *)&EventType);
+  Py_INCREF(&LockType);
+  PyModule_AddObject(m, "Lock", (PyObject *)&LockType);
+  Py_INCREF(&SemaphoreType);
+  PyModule_AddObject(m, "Semaphore", (PyObject *)&SemaphoreType);
+  Py_INCREF(&QueueType);
+  PyModule_AddObject(m, "Queue", (PyObject *)&QueueType);
+
+  if (init_outbox() < 0) {
+    INITERROR;
+  }
+  Py_INCREF(&OutboxType);
+  PyModule_AddObject(m, "Outbox", (PyObject *)&OutboxType);
+
+  if (init_request_timing_type() < 0) {
+    INITERROR;
+  }
+  Py_INCREF(get_request_timing_type());
+  PyModule_AddObject(m, "RequestTiming",
+                     (PyObject *)get_request_timing_type());
+
   timeout_error =
       PyErr_NewException("meinheld.server.timeout", PyExc_IOError, NULL);
   if (timeout_error == NULL) {
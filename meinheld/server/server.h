@@ -11,4 +11,42 @@ extern int client_body_buffer_size;  // client_body_buffer_size
 extern PyObject* current_client;
 extern PyObject* timeout_error;
 
+/* switch to the hub until fd is ready or timeout seconds (0 is no timeout)
+ * passed, -1 with an exception set */
+int green_wait(int fd, int event, int timeout);
+
+/* green_wait with a timeout in msec, picoev alone rounds it to seconds */
+int green_wait_msec(int fd, int event, int msec);
+
+/* drop a wait left registered for fd, before closing it */
+void green_cancel(int fd);
+
+/* the greenlet (or the WSGI client) to pass to green_resume, a new
+ * reference. NULL with an exception set when called from the hub */
+PyObject* green_current(void);
+
+/* switch to the hub until green_resume, returns the switch result */
+PyObject* green_suspend(void);
+
+void green_resume(PyObject* waiter);
+
+/* keep the loop running while n more waits are pending outside picoev */
+void loop_hold(int n);
+
+/* watch fd with callback while the loop runs, it keeps the loop running.
+ * -1 outside of run() */
+int loop_watch(int fd, int events, picoev_handler* callback, void* cb_arg);
+
+void loop_unwatch(int fd);
+
+/* resume the waiter from the loop on its next turn, in the order scheduled.
+ * No fd is involved, the loop only skips its poll timeout. -1 on error */
+int green_schedule(PyObject* waiter);
+
+/* call callback() after seconds from the timer heap, returns the timer */
+PyObject* green_call_later(int seconds, PyObject* callback);
+
+/* cancel a green_call_later timer, it stops keeping the loop running */
+void green_call_cancel(PyObject* timer);
+
 #endif
@@ -0,0 +1,601 @@
+#include "stats.h"
+
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+static stats_slot_t local_slot;
+static stats_header_t *region = NULL;
+static size_t region_size = 0;
+// the slot released by stats_detach, taken back by the same process
+static stats_slot_t *own_slot = NULL;
+static int32_t own_pid = 0;
+
+stats_slot_t *stats = &local_slot;
+
+const uint64_t stats_stall_upper[STATS_STALL_BUCKETS - 1] = {
+    10000, 50000, 100000, 250000, 500000, 1000000, 5000000};
+
+static inline size_t calc_region_size(int nslots) {
+  return sizeof(stats_header_t) + (size_t)nslots * sizeof(stats_slot_t);
+}
+
+static inline stats_slot_t *get_slot(stats_header_t *h, int i) {
+  return (stats_slot_t *)((char *)h + h->header_size) + i;
+}
+
+static void init_header(stats_header_t *h, int nslots) {
+  h->magic = STATS_MAGIC;
+  h->version = STATS_VERSION;
+  h->header_size = sizeof(stats_header_t);
+  h->slot_size = sizeof(stats_slot_t);
+  h->nslots = nslots;
+  h->sub_bits = STATS_SUB_BITS;
+  h->max_bits = STATS_MAX_BITS;
+  h->buckets = STATS_BUCKETS;
+}
+
+static int check_header(stats_header_t *h, size_t size) {
+  if (size < sizeof(stats_header_t) || h->magic != STATS_MAGIC ||
+      h->version != STATS_VERSION ||
+      h->header_size != sizeof(stats_header_t) ||
+      h->slot_size != sizeof(stats_slot_t) || h->nslots == 0 ||
+      h->buckets != STATS_BUCKETS ||
+      size < calc_region_size(h->nslots)) {
+    return -1;
+  }
+  return 0;
+}
+
+static int open_stats_file(const char *path, int nslots) {
+  int fd;
+  struct stat st;
+  size_t size = calc_region_size(nslots);
+  void *p;
+
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+  // other workers may be creating the same file
+  if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1) {
+    goto error;
+  }
+  if (st.st_size == 0) {
+    if (ftruncate(fd, size) == -1) {
+      goto error;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      goto error;
+    }
+    init_header((stats_header_t *)p, nslots);
+  } else {
+    // reuse the layout of the existing file
+    size = (size_t)st.st_size;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      goto error;
+    }
+    if (check_header((stats_header_t *)p, size) == -1) {
+      munmap(p, size);
+      errno = EINVAL;
+      goto error;
+    }
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+  region = (stats_header_t *)p;
+  region_size = size;
+  return 0;
+error:
+  {
+    int err = errno;
+    close(fd);
+    errno = err;
+  }
+  return -1;
+}
+
+/**
+ * Map the shared stats region. With path == NULL an anonymous shared mapping
+ * is used, it must be opened before forking workers. Otherwise the file is
+ * created (or reused) so unrelated processes can read it.
+ */
+int stats_open(const char *path, int nslots) {
+  void *p;
+  size_t size;
+
+  if (nslots <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  stats_close();
+
+  if (path) {
+    return open_stats_file(path, nslots);
+  }
+  size = calc_region_size(nslots);
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+           0);
+  if (p == MAP_FAILED) {
+    return -1;
+  }
+  init_header((stats_header_t *)p, nslots);
+  region = (stats_header_t *)p;
+  region_size = size;
+  return 0;
+}
+
+void stats_close(void) {
+  if (region) {
+    munmap(region, region_size);
+    region = NULL;
+    region_size = 0;
+  }
+  own_slot = NULL;
+  stats = &local_slot;
+}
+
+static void claim_slot(stats_slot_t *slot) {
+  size_t off = offsetof(stats_slot_t, reserved);
+  memset((char *)slot + off, 0, sizeof(stats_slot_t) - off);
+  slot->started = (uint64_t)time(NULL);
+  stats = slot;
+}
+
+/**
+ * Claim a slot for the current process. A slot owned by this pid is reused,
+ * then a free one, then one left behind by a dead worker.
+ */
+int stats_attach(void) {
+  int32_t pid = (int32_t)getpid();
+  int32_t owner;
+  stats_slot_t *slot;
+  uint32_t i;
+
+  if (region == NULL) {
+    stats = &local_slot;
+    return 0;
+  }
+
+  for (i = 0; i < region->nslots; i++) {
+    slot = get_slot(region, i);
+    if (slot->pid == pid) {
+      stats = slot;
+      stats->active = 0;
+      return 0;
+    }
+  }
+  // keep counting where the last run() of this process stopped
+  if (own_slot && own_pid == pid &&
+      __sync_bool_compare_and_swap(&own_slot->pid, 0, pid)) {
+    stats = own_slot;
+    stats->active = 0;
+    return 0;
+  }
+  for (i = 0; i < region->nslots; i++) {
+    slot = get_slot(region, i);
+    if (slot->pid == 0 && __sync_bool_compare_and_swap(&slot->pid, 0, pid)) {
+      claim_slot(slot);
+      return 0;
+    }
+  }
+  for (i = 0; i < region->nslots; i++) {
+    slot = get_slot(region, i);
+    owner = slot->pid;
+    if (owner != 0 && kill(owner, 0) == -1 && errno == ESRCH &&
+        __sync_bool_compare_and_swap(&slot->pid, owner, pid)) {
+      claim_slot(slot);
+      return 0;
+    }
+  }
+  // no room, count locally
+  stats = &local_slot;
+  errno = ENOSPC;
+  return -1;
+}
+
+/* release the slot so an exited worker no longer shows up */
+void stats_detach(void) {
+  int32_t pid = (int32_t)getpid();
+
+  if (stats != &local_slot &&
+      __sync_bool_compare_and_swap(&stats->pid, pid, 0)) {
+    own_slot = stats;
+    own_pid = pid;
+  }
+  stats = &local_slot;
+}
+
+int stats_bucket_index(uint64_t value) {
+  int msb, shift;
+
+  if (value < (2 << STATS_SUB_BITS)) {
+    return (int)value;
+  }
+  msb = 63 - __builtin_clzll(value);
+  if (msb > STATS_MAX_BITS) {
+    return STATS_BUCKETS - 1;
+  }
+  shift = msb - STATS_SUB_BITS;
+  return ((shift + 1) << STATS_SUB_BITS) + (int)(value >> shift) -
+         (1 << STATS_SUB_BITS);
+}
+
+/* highest value that falls into the bucket */
+uint64_t stats_bucket_upper(int index) {
+  int shift;
+  uint64_t mantissa;
+
+  if (index < (2 << STATS_SUB_BITS)) {
+    return (uint64_t)index;
+  }
+  shift = (index >> STATS_SUB_BITS) - 1;
+  mantissa = (index & ((1 << STATS_SUB_BITS) - 1)) + (1 << STATS_SUB_BITS);
+  return ((mantissa + 1) << shift) - 1;
+}
+
+static void sum_slot(stats_slot_t *dst, const stats_slot_t *src) {
+  int i;
+
+  dst->accepted += src->accepted;
+  dst->active += src->active;
+  dst->inflight += src->inflight;
+  dst->suspended += src->suspended;
+  dst->paused += src->paused;
+  dst->requests += src->requests;
+  dst->keepalive_reuse += src->keepalive_reuse;
+  dst->pipelined += src->pipelined;
+  dst->bytes_in += src->bytes_in;
+  dst->bytes_out += src->bytes_out;
+  dst->shed += src->shed;
+  dst->codel_drops += src->codel_drops;
+  dst->pool_hits += src->pool_hits;
+  dst->pool_misses += src->pool_misses;
+  dst->pool_idle += src->pool_idle;
+  dst->thread_jobs += src->thread_jobs;
+  dst->thread_queued += src->thread_queued;
+  dst->thread_running += src->thread_running;
+  dst->thread_rejected += src->thread_rejected;
+  dst->slow_writes += src->slow_writes;
+  dst->zerocopy_sends += src->zerocopy_sends;
+  dst->zerocopy_copied += src->zerocopy_copied;
+  dst->tls_handshakes += src->tls_handshakes;
+  dst->tls_resumed += src->tls_resumed;
+  dst->tls_failed += src->tls_failed;
+  dst->loop_iterations += src->loop_iterations;
+  dst->loop_busy += src->loop_busy;
+  if (src->loop_lag_max > dst->loop_lag_max) {
+    dst->loop_lag_max = src->loop_lag_max;
+  }
+  dst->stall_count += src->stall_count;
+  dst->stall_sum += src->stall_sum;
+  for (i = 0; i < STATS_STALL_BUCKETS; i++) {
+    dst->stall[i] += src->stall[i];
+  }
+  for (i = 0; i < STATS_STATUS_CLASSES; i++) {
+    dst->status[i] += src->status[i];
+  }
+  dst->latency_count += src->latency_count;
+  dst->latency_sum += src->latency_sum;
+  if (src->latency_max > dst->latency_max) {
+    dst->latency_max = src->latency_max;
+  }
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    dst->latency[i] += src->latency[i];
+  }
+}
+
+/**
+ * A slot is live while its owner runs. Slots of workers that died without
+ * releasing them are skipped, and freed when the region is writable.
+ */
+static int live_slot(stats_header_t *h, stats_slot_t *slot) {
+  int32_t owner = slot->pid;
+
+  if (owner == 0) {
+    return 0;
+  }
+  if (kill(owner, 0) == -1 && errno == ESRCH) {
+    if (h == region) {
+      __sync_bool_compare_and_swap(&slot->pid, owner, 0);
+    }
+    return 0;
+  }
+  return 1;
+}
+
+static uint32_t sum_region(stats_header_t *h, stats_slot_t *total) {
+  stats_slot_t *slot;
+  uint32_t i, workers = 0;
+
+  memset(total, 0, sizeof(stats_slot_t));
+  for (i = 0; i < h->nslots; i++) {
+    slot = get_slot(h, i);
+    if (!live_slot(h, slot)) {
+      continue;
+    }
+    sum_slot(total, slot);
+    workers++;
+  }
+  return workers;
+}
+
+/* sum up all workers, return the number of workers */
+uint32_t stats_sum(stats_slot_t *total) {
+  if (region == NULL) {
+    memcpy(total, &local_slot, sizeof(stats_slot_t));
+    return 1;
+  }
+  return sum_region(region, total);
+}
+
+static uint64_t value_at_quantile(const stats_slot_t *s, double q) {
+  uint64_t rank, seen = 0, upper;
+  int i;
+
+  if (s->latency_count == 0) {
+    return 0;
+  }
+  rank = (uint64_t)(q * s->latency_count + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    seen += s->latency[i];
+    if (seen >= rank) {
+      upper = stats_bucket_upper(i);
+      return upper < s->latency_max ? upper : s->latency_max;
+    }
+  }
+  return s->latency_max;
+}
+
+static int set_item(PyObject *dict, const char *key, PyObject *value) {
+  int ret;
+
+  if (value == NULL) {
+    return -1;
+  }
+  ret = PyDict_SetItemString(dict, key, value);
+  Py_DECREF(value);
+  return ret;
+}
+
+static int set_num(PyObject *dict, const char *key, uint64_t value) {
+  return set_item(dict, key, PyLong_FromUnsignedLongLong(value));
+}
+
+static PyObject *build_latency(const stats_slot_t *s) {
+  PyObject *dict, *buckets, *bucket;
+  int i;
+
+  dict = PyDict_New();
+  if (dict == NULL) {
+    return NULL;
+  }
+  buckets = PyList_New(0);
+  if (buckets == NULL) {
+    goto error;
+  }
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    if (s->latency[i] == 0) {
+      continue;
+    }
+    bucket = Py_BuildValue("(KK)", (unsigned long long)stats_bucket_upper(i),
+                           (unsigned long long)s->latency[i]);
+    if (bucket == NULL || PyList_Append(buckets, bucket) == -1) {
+      Py_XDECREF(bucket);
+      Py_DECREF(buckets);
+      goto error;
+    }
+    Py_DECREF(bucket);
+  }
+  if (set_item(dict, "buckets", buckets) == -1 ||
+      set_num(dict, "count", s->latency_count) == -1 ||
+      set_num(dict, "sum_usec", s->latency_sum) == -1 ||
+      set_num(dict, "max_usec", s->latency_max) == -1 ||
+      set_num(dict, "p50", value_at_quantile(s, 0.5)) == -1 ||
+      set_num(dict, "p90", value_at_quantile(s, 0.9)) == -1 ||
+      set_num(dict, "p99", value_at_quantile(s, 0.99)) == -1 ||
+      set_num(dict, "p999", value_at_quantile(s, 0.999)) == -1) {
+    goto error;
+  }
+  return dict;
+error:
+  Py_DECREF(dict);
+  return NULL;
+}
+
+static PyObject *build_loop(const stats_slot_t *s) {
+  PyObject *dict, *buckets, *bucket;
+  int i;
+
+  dict = PyDict_New();
+  if (dict == NULL) {
+    return NULL;
+  }
+  buckets = PyList_New(STATS_STALL_BUCKETS);
+  if (buckets == NULL) {
+    goto error;
+  }
+  // (upper usec, count), upper is None for the last bucket
+  for (i = 0; i < STATS_STALL_BUCKETS; i++) {
+    if (i < STATS_STALL_BUCKETS - 1) {
+      bucket = Py_BuildValue("(KK)", (unsigned long long)stats_stall_upper[i],
+                             (unsigned long long)s->stall[i]);
+    } else {
+      bucket = Py_BuildValue("(OK)", Py_None, (unsigned long long)s->stall[i]);
+    }
+    if (bucket == NULL) {
+      Py_DECREF(buckets);
+      goto error;
+    }
+    PyList_SET_ITEM(buckets, i, bucket);
+  }
+  if (set_num(dict, "iterations", s->loop_iterations) == -1 ||
+      set_num(dict, "busy_usec", s->loop_busy) == -1 ||
+      set_num(dict, "lag_max_usec", s->loop_lag_max) == -1 ||
+      set_num(dict, "stalls", s->stall_count) == -1 ||
+      set_num(dict, "stall_sum_usec", s->stall_sum) == -1 ||
+      set_item(dict, "stall_buckets", buckets) == -1) {
+    goto error;
+  }
+  return dict;
+error:
+  Py_DECREF(dict);
+  return NULL;
+}
+
+static PyObject *build_stats(const stats_slot_t *s) {
+  PyObject *dict, *status;
+
+  dict = PyDict_New();
+  if (dict == NULL) {
+    return NULL;
+  }
+  status = Py_BuildValue(
+      "{s:K,s:K,s:K,s:K,s:K,s:K}", "1xx",
+      (unsigned long long)s->status[STATS_STATUS_1XX], "2xx",
+      (unsigned long long)s->status[STATS_STATUS_2XX], "3xx",
+      (unsigned long long)s->status[STATS_STATUS_3XX], "4xx",
+      (unsigned long long)s->status[STATS_STATUS_4XX], "5xx",
+      (unsigned long long)s->status[STATS_STATUS_5XX], "other",
+      (unsigned long long)s->status[STATS_STATUS_OTHER]);
+  if (set_num(dict, "accepted", s->accepted) == -1 ||
+      set_num(dict, "active", s->active) == -1 ||
+      set_num(dict, "inflight", s->inflight) == -1 ||
+      set_num(dict, "suspended", s->suspended) == -1 ||
+      set_num(dict, "paused", s->paused) == -1 ||
+      set_num(dict, "requests", s->requests) == -1 ||
+      set_num(dict, "keepalive_reuse", s->keepalive_reuse) == -1 ||
+      set_num(dict, "pipelined", s->pipelined) == -1 ||
+      set_num(dict, "bytes_in", s->bytes_in) == -1 ||
+      set_num(dict, "bytes_out", s->bytes_out) == -1 ||
+      set_num(dict, "shed", s->shed) == -1 ||
+      set_num(dict, "codel_drops", s->codel_drops) == -1 ||
+      set_num(dict, "pool_hits", s->pool_hits) == -1 ||
+      set_num(dict, "pool_misses", s->pool_misses) == -1 ||
+      set_num(dict, "pool_idle", s->pool_idle) == -1 ||
+      set_num(dict, "thread_jobs", s->thread_jobs) == -1 ||
+      set_num(dict, "thread_queued", s->thread_queued) == -1 ||
+      set_num(dict, "thread_running", s->thread_running) == -1 ||
+      set_num(dict, "thread_rejected", s->thread_rejected) == -1 ||
+      set_num(dict, "slow_writes", s->slow_writes) == -1 ||
+      set_num(dict, "zerocopy_sends", s->zerocopy_sends) == -1 ||
+      set_num(dict, "zerocopy_copied", s->zerocopy_copied) == -1 ||
+      set_num(dict, "tls_handshakes", s->tls_handshakes) == -1 ||
+      set_num(dict, "tls_resumed", s->tls_resumed) == -1 ||
+      set_num(dict, "tls_failed", s->tls_failed) == -1 ||
+      set_item(dict, "status", status) == -1 ||
+      set_item(dict, "latency", build_latency(s)) == -1 ||
+      set_item(dict, "loop", build_loop(s)) == -1) {
+    Py_DECREF(dict);
+    return NULL;
+  }
+  return dict;
+}
+
+static PyObject *collect(stats_header_t *h, int per_worker) {
+  stats_slot_t total, *slot;
+  PyObject *result, *item;
+  uint32_t i, workers;
+
+  if (per_worker) {
+    result = PyList_New(0);
+    if (result == NULL) {
+      return NULL;
+    }
+    for (i = 0; i < h->nslots; i++) {
+      slot = get_slot(h, i);
+      if (!live_slot(h, slot)) {
+        continue;
+      }
+      item = build_stats(slot);
+      if (item == NULL || set_num(item, "pid", (uint64_t)slot->pid) == -1 ||
+          set_num(item, "started", slot->started) == -1 ||
+          PyList_Append(result, item) == -1) {
+        Py_XDECREF(item);
+        Py_DECREF(result);
+        return NULL;
+      }
+      Py_DECREF(item);
+    }
+    return result;
+  }
+
+  workers = sum_region(h, &total);
+  result = build_stats(&total);
+  if (result && set_num(result, "workers", workers) == -1) {
+    Py_CLEAR(result);
+  }
+  return result;
+}
+
+static PyObject *collect_local(int per_worker) {
+  PyObject *result, *item;
+
+  result = build_stats(&local_slot);
+  if (result == NULL) {
+    return NULL;
+  }
+  if (!per_worker) {
+    if (set_num(result, "workers", 1) == -1) {
+      Py_CLEAR(result);
+    }
+    return result;
+  }
+  item = result;
+  if (set_num(item, "pid", (uint64_t)getpid()) == -1) {
+    Py_DECREF(item);
+    return NULL;
+  }
+  return Py_BuildValue("[N]", item);
+}
+
+/**
+ * Return the stats as a dict (or a list of per worker dicts).
+ * With path the stats file written by other processes is read.
+ */
+PyObject *stats_get(const char *path, int per_worker) {
+  int fd;
+  struct stat st;
+  void *p;
+  PyObject *result;
+
+  if (path == NULL) {
+    if (region == NULL) {
+      return collect_local(per_worker);
+    }
+    return collect(region, per_worker);
+  }
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    if (fd != -1) {
+      close(fd);
+    }
+    return NULL;
+  }
+  if (st.st_size < (off_t)sizeof(stats_header_t)) {
+    close(fd);
+    PyErr_SetString(PyExc_ValueError, "invalid stats file");
+    return NULL;
+  }
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    return NULL;
+  }
+  if (check_header((stats_header_t *)p, st.st_size) == -1) {
+    munmap(p, st.st_size);
+    PyErr_SetString(PyExc_ValueError, "invalid stats file");
+    return NULL;
+  }
+  result = collect((stats_header_t *)p, per_worker);
+  munmap(p, st.st_size);
+  return result;
+}
@@ -0,0 +1,149 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "meinheld.h"
+
+#define STATS_MAGIC 0x4d485354  // "MHST"
+#define STATS_VERSION 7
+
+/**
+ * Latency histogram layout (HDR style).
+ *
+ * Values below 2^(SUB_BITS + 1) usec get their own bucket, every power of two
+ * above that is split into 2^SUB_BITS linear sub buckets, so the relative
+ * error stays under 1 / 2^SUB_BITS (6.25%). Values above 2^(MAX_BITS + 1) - 1
+ * usec (about 19 hours) are clamped into the last bucket.
+ */
+#define STATS_SUB_BITS 4
+#define STATS_MAX_BITS 35
+#define STATS_BUCKETS \
+  ((STATS_MAX_BITS - STATS_SUB_BITS + 2) * (1 << STATS_SUB_BITS))
+
+/**
+ * Loop stall buckets, upper bounds in usec. The last bucket is unbounded.
+ */
+#define STATS_STALL_BUCKETS 8
+extern const uint64_t stats_stall_upper[STATS_STALL_BUCKETS - 1];
+
+enum {
+  STATS_STATUS_OTHER = 0,
+  STATS_STATUS_1XX,
+  STATS_STATUS_2XX,
+  STATS_STATUS_3XX,
+  STATS_STATUS_4XX,
+  STATS_STATUS_5XX,
+  STATS_STATUS_CLASSES
+};
+
+/**
+ * Per worker counters.
+ *
+ * Only the owning process writes its slot, readers in other processes may see
+ * a slightly stale view but every field is an aligned 64 bit word.
+ */
+typedef struct {
+  volatile int32_t pid;  // owner, 0 if the slot is free
+  int32_t reserved;
+  uint64_t started;          // unix time the slot was claimed
+  uint64_t accepted;         // accepted connections
+  uint64_t active;           // open connections
+  uint64_t inflight;         // running wsgi calls
+  uint64_t suspended;        // suspended greenlets
+  uint64_t paused;           // 1 while accepting is paused
+  uint64_t requests;         // finished requests
+  uint64_t keepalive_reuse;  // connections kept open for another request
+  uint64_t pipelined;        // requests served from the pipeline queue
+  uint64_t bytes_in;         // bytes read from client sockets
+  uint64_t bytes_out;        // bytes written to client sockets
+  uint64_t shed;             // requests rejected by admission control
+  uint64_t codel_drops;      // requests dropped by queue delay
+  uint64_t pool_hits;        // requests run on a pooled greenlet
+  uint64_t pool_misses;      // greenlets created for the pool
+  uint64_t pool_idle;        // parked pool greenlets
+  uint64_t thread_jobs;      // finished run_in_thread calls
+  uint64_t thread_queued;    // calls waiting for a pool thread
+  uint64_t thread_running;   // calls running on a pool thread
+  uint64_t thread_rejected;  // calls refused by the queue limit
+  uint64_t slow_writes;      // responses cut by the write timeout or rate
+  uint64_t zerocopy_sends;   // MSG_ZEROCOPY sends
+  uint64_t zerocopy_copied;  // sockets the kernel copied zerocopy sends on
+  uint64_t tls_handshakes;   // TLS connections handed to the kernel
+  uint64_t tls_resumed;      // of those, resumed sessions
+  uint64_t tls_failed;       // handshakes that failed or got no kernel TLS
+  uint64_t loop_iterations;  // polls done while the lag monitor runs
+  uint64_t loop_busy;        // usec spent running callbacks
+  uint64_t loop_lag_max;     // usec, longest run between two polls
+  uint64_t stall_count;      // callbacks over the stall threshold
+  uint64_t stall_sum;        // usec
+  uint64_t stall[STATS_STALL_BUCKETS];
+  uint64_t status[STATS_STATUS_CLASSES];
+  uint64_t latency_count;
+  uint64_t latency_sum;  // usec
+  uint64_t latency_max;  // usec
+  uint64_t latency[STATS_BUCKETS];
+} stats_slot_t;
+
+/**
+ * Shared region header. A sidecar can map the stats file read only and walk
+ * nslots slots of slot_size bytes each after the header.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t slot_size;
+  uint32_t nslots;
+  uint32_t sub_bits;
+  uint32_t max_bits;
+  uint32_t buckets;
+} stats_header_t;
+
+// current process slot, never NULL
+extern stats_slot_t *stats;
+
+int stats_open(const char *path, int nslots);
+
+void stats_close(void);
+
+int stats_attach(void);
+
+void stats_detach(void);
+
+int stats_bucket_index(uint64_t value);
+
+uint64_t stats_bucket_upper(int index);
+
+uint32_t stats_sum(stats_slot_t *total);
+
+PyObject *stats_get(const char *path, int per_worker);
+
+static inline void stats_add_latency(uint64_t usec) {
+  stats->latency[stats_bucket_index(usec)]++;
+  stats->latency_count++;
+  stats->latency_sum += usec;
+  if (usec > stats->latency_max) {
+    stats->latency_max = usec;
+  }
+}
+
+static inline void stats_add_stall(uint64_t usec) {
+  int i;
+  for (i = 0; i < STATS_STALL_BUCKETS - 1; i++) {
+    if (usec <= stats_stall_upper[i]) {
+      break;
+    }
+  }
+  stats->stall[i]++;
+  stats->stall_count++;
+  stats->stall_sum += usec;
+}
+
+static inline void stats_add_status(int status_code) {
+  int cls = status_code / 100;
+  if (cls < STATS_STATUS_1XX || cls > STATS_STATUS_5XX) {
+    cls = STATS_STATUS_OTHER;
+  }
+  stats->status[cls]++;
+}
+
+#endif
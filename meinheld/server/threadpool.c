@@ -0,0 +1,411 @@
+#include "threadpool.h"
+
+#include <pthread.h>
+#ifdef linux
+#include <sys/eventfd.h>
+#endif
+
+#include "server.h"
+#include "stats.h"
+
+enum {
+  JOB_QUEUED = 0,
+  JOB_RUNNING,
+  JOB_DONE,       // on the done list
+  JOB_DELIVERED,  // the waiter was resumed
+  JOB_DROPPED,    // the pool stopped first
+};
+
+/**
+ * A job belongs to the calling greenlet, which frees it once it is resumed.
+ * If the caller leaves early (an exception thrown into the greenlet) while a
+ * worker still has the job, it is marked abandoned and the pool frees it.
+ */
+typedef struct job_s {
+  PyObject *func;
+  PyObject *args;
+  PyObject *kwargs;
+  PyObject *waiter;  // greenlet or ClientObject to resume
+  PyObject *result;
+  PyObject *err_type;
+  PyObject *err_val;
+  PyObject *err_tb;
+  int state;  // guarded by pool_lock until JOB_DONE is seen by the loop
+  int abandoned;
+  struct job_s *next;
+} job_t;
+
+int thread_pool_size = 4;
+int thread_queue_limit = 0;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *threads = NULL;
+static int nthreads = 0;
+static int pool_running = 0;
+
+// guarded by pool_lock
+static job_t *pending_head = NULL, *pending_tail = NULL;
+static job_t *done_head = NULL, *done_tail = NULL;
+static int queued = 0;
+
+// loop thread only
+static int outstanding = 0;  // jobs keeping the loop alive
+
+// eventfd uses the same fd for both ends
+static int notify_fd[2] = {-1, -1};
+
+static void free_job(job_t *job) {
+  Py_XDECREF(job->func);
+  Py_XDECREF(job->args);
+  Py_XDECREF(job->kwargs);
+  Py_XDECREF(job->waiter);
+  Py_XDECREF(job->result);
+  Py_XDECREF(job->err_type);
+  Py_XDECREF(job->err_val);
+  Py_XDECREF(job->err_tb);
+  PyMem_Free(job);
+}
+
+static void release_job(void) {
+  outstanding--;
+  loop_hold(-1);
+}
+
+/* called with pool_lock held */
+static void notify_loop(void) {
+#ifdef linux
+  uint64_t one = 1;
+  if (write(notify_fd[1], &one, sizeof(one))) {
+  }
+#else
+  char c = 0;
+  if (write(notify_fd[1], &c, 1)) {
+  }
+#endif
+}
+
+static void *worker_main(void *arg) {
+  PyGILState_STATE gstate;
+  PyThreadState *tstate;
+  job_t *job;
+  PyObject *res;
+
+  // one thread state for the life of the worker
+  gstate = PyGILState_Ensure();
+  tstate = PyEval_SaveThread();
+
+  pthread_mutex_lock(&pool_lock);
+  while (1) {
+    while (pool_running && pending_head == NULL) {
+      pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+    if (!pool_running) {
+      break;
+    }
+    job = pending_head;
+    pending_head = job->next;
+    if (pending_head == NULL) {
+      pending_tail = NULL;
+    }
+    job->next = NULL;
+    job->state = JOB_RUNNING;
+    queued--;
+    stats->thread_queued--;
+    stats->thread_running++;
+    pthread_mutex_unlock(&pool_lock);
+
+    PyEval_RestoreThread(tstate);
+    res = PyObject_Call(job->func, job->args, job->kwargs);
+    if (res == NULL) {
+      PyErr_Fetch(&job->err_type, &job->err_val, &job->err_tb);
+    }
+    job->result = res;
+    tstate = PyEval_SaveThread();
+
+    pthread_mutex_lock(&pool_lock);
+    job->state = JOB_DONE;
+    stats->thread_running--;
+    if (done_head == NULL) {
+      done_head = job;
+      // the loop takes the whole list, one wakeup is enough
+      notify_loop();
+    } else {
+      done_tail->next = job;
+    }
+    done_tail = job;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  PyEval_RestoreThread(tstate);
+  PyGILState_Release(gstate);
+  return NULL;
+}
+
+static void done_callback(picoev_loop *loop, int fd, int events,
+                          void *cb_arg) {
+  job_t *job, *next;
+  PyObject *waiter;
+  char buf[64];
+
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+  pthread_mutex_lock(&pool_lock);
+  job = done_head;
+  done_head = done_tail = NULL;
+  pthread_mutex_unlock(&pool_lock);
+
+  for (; job != NULL; job = next) {
+    next = job->next;
+    job->next = NULL;
+    stats->thread_jobs++;
+    release_job();
+    if (job->abandoned) {
+      free_job(job);
+      continue;
+    }
+    job->state = JOB_DELIVERED;
+    // the caller frees the job before the switch comes back
+    waiter = job->waiter;
+    Py_INCREF(waiter);
+    green_resume(waiter);
+    Py_DECREF(waiter);
+  }
+}
+
+static int open_notify(void) {
+#ifdef linux
+  notify_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (notify_fd[0] == -1) {
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+  }
+  notify_fd[1] = notify_fd[0];
+#else
+  int i;
+
+  if (pipe(notify_fd) == -1) {
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+  }
+  for (i = 0; i < 2; i++) {
+    if (fcntl(notify_fd[i], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(notify_fd[i], F_SETFD, FD_CLOEXEC) == -1) {
+      PyErr_SetFromErrno(PyExc_IOError);
+      close(notify_fd[0]);
+      close(notify_fd[1]);
+      notify_fd[0] = notify_fd[1] = -1;
+      return -1;
+    }
+  }
+#endif
+  return 0;
+}
+
+static void close_notify(void) {
+  if (notify_fd[1] != notify_fd[0]) {
+    close(notify_fd[1]);
+  }
+  close(notify_fd[0]);
+  notify_fd[0] = notify_fd[1] = -1;
+}
+
+int thread_pool_resize(void) {
+  pthread_t *new_threads;
+
+  if (!pool_running || nthreads >= thread_pool_size) {
+    return 0;
+  }
+  new_threads = PyMem_Realloc(threads, sizeof(pthread_t) * thread_pool_size);
+  if (new_threads == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  threads = new_threads;
+  while (nthreads < thread_pool_size) {
+    if (pthread_create(&threads[nthreads], NULL, worker_main, NULL) != 0) {
+      PyErr_SetString(PyExc_RuntimeError, "can't start thread pool worker");
+      return -1;
+    }
+    nthreads++;
+  }
+  return 0;
+}
+
+static int start_pool(picoev_loop *loop) {
+#if PY_VERSION_HEX < 0x03070000
+  PyEval_InitThreads();
+#endif
+  if (open_notify() == -1) {
+    return -1;
+  }
+  if (picoev_add(loop, notify_fd[0], PICOEV_READ, 0, done_callback, NULL) ==
+      -1) {
+    PyErr_SetString(PyExc_IOError, "can't watch thread pool fd");
+    close_notify();
+    return -1;
+  }
+  pool_running = 1;
+  if (thread_pool_resize() == -1 && nthreads == 0) {
+    thread_pool_stop(loop);
+    return -1;
+  }
+  PyErr_Clear();
+  return 0;
+}
+
+static void unlink_pending(job_t *job) {
+  job_t **link;
+
+  for (link = &pending_head; *link != job; link = &(*link)->next)
+    ;
+  *link = job->next;
+  if (pending_tail == job) {
+    pending_tail = NULL;
+    for (job = pending_head; job != NULL; job = job->next) {
+      pending_tail = job;
+    }
+  }
+}
+
+/* the caller leaves before the job was delivered */
+static void cancel_job(job_t *job) {
+  pthread_mutex_lock(&pool_lock);
+  switch (job->state) {
+    case JOB_QUEUED:
+      unlink_pending(job);
+      queued--;
+      stats->thread_queued--;
+      pthread_mutex_unlock(&pool_lock);
+      release_job();
+      break;
+    case JOB_RUNNING:
+    case JOB_DONE:
+      job->abandoned = 1;
+      pthread_mutex_unlock(&pool_lock);
+      return;
+    default:
+      pthread_mutex_unlock(&pool_lock);
+      break;
+  }
+  free_job(job);
+}
+
+PyObject *thread_pool_call(picoev_loop *loop, PyObject *func, PyObject *args,
+                           PyObject *kwargs) {
+  job_t *job;
+  PyObject *waiter, *res;
+
+  waiter = green_current();
+  if (waiter == NULL) {
+    return NULL;
+  }
+  if (!pool_running && start_pool(loop) == -1) {
+    Py_DECREF(waiter);
+    return NULL;
+  }
+  if (thread_queue_limit > 0 && queued >= thread_queue_limit) {
+    Py_DECREF(waiter);
+    stats->thread_rejected++;
+    PyErr_SetString(PyExc_IOError, "thread pool queue full");
+    return NULL;
+  }
+  job = PyMem_Malloc(sizeof(job_t));
+  if (job == NULL) {
+    Py_DECREF(waiter);
+    return PyErr_NoMemory();
+  }
+  memset(job, 0, sizeof(job_t));
+  Py_INCREF(func);
+  Py_INCREF(args);
+  Py_XINCREF(kwargs);
+  job->func = func;
+  job->args = args;
+  job->kwargs = kwargs;
+  job->waiter = waiter;
+  job->state = JOB_QUEUED;
+
+  pthread_mutex_lock(&pool_lock);
+  if (pending_tail == NULL) {
+    pending_head = job;
+  } else {
+    pending_tail->next = job;
+  }
+  pending_tail = job;
+  queued++;
+  stats->thread_queued++;
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+  outstanding++;
+  loop_hold(1);
+
+  while (job->state != JOB_DELIVERED && job->state != JOB_DROPPED) {
+    res = green_suspend();
+    if (res == NULL) {
+      cancel_job(job);
+      return NULL;
+    }
+    Py_DECREF(res);
+  }
+  if (job->state == JOB_DROPPED) {
+    free_job(job);
+    PyErr_SetString(PyExc_IOError, "thread pool stopped");
+    return NULL;
+  }
+  res = job->result;
+  job->result = NULL;
+  if (res == NULL) {
+    PyErr_Restore(job->err_type, job->err_val, job->err_tb);
+    job->err_type = job->err_val = job->err_tb = NULL;
+  }
+  free_job(job);
+  return res;
+}
+
+static void drop_jobs(job_t *job) {
+  job_t *next;
+
+  for (; job != NULL; job = next) {
+    next = job->next;
+    job->next = NULL;
+    if (job->abandoned) {
+      free_job(job);
+    } else {
+      // the waiter may never run again, it frees the job if it does
+      job->state = JOB_DROPPED;
+    }
+  }
+}
+
+void thread_pool_stop(picoev_loop *loop) {
+  int i;
+
+  if (notify_fd[0] == -1) {
+    return;
+  }
+  pthread_mutex_lock(&pool_lock);
+  pool_running = 0;
+  pthread_cond_broadcast(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+  // running jobs need the GIL to finish
+  Py_BEGIN_ALLOW_THREADS for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  Py_END_ALLOW_THREADS PyMem_Free(threads);
+  threads = NULL;
+  nthreads = 0;
+
+  if (picoev_is_active(loop, notify_fd[0])) {
+    picoev_del(loop, notify_fd[0]);
+  }
+  close_notify();
+  drop_jobs(pending_head);
+  drop_jobs(done_head);
+  pending_head = pending_tail = NULL;
+  done_head = done_tail = NULL;
+  queued = 0;
+  stats->thread_queued = 0;
+  stats->thread_running = 0;
+  loop_hold(-outstanding);
+  outstanding = 0;
+}
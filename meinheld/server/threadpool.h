@@ -0,0 +1,28 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "meinheld.h"
+#include "picoev.h"
+
+/**
+ * Native thread pool for blocking calls.
+ *
+ * thread_pool_call() queues func(*args, **kwargs) for the worker threads and
+ * suspends the calling greenlet. A worker runs the call holding the GIL (the
+ * loop gives it up while polling and blocking calls give it up as usual),
+ * puts the job on the done list and signals an eventfd (a pipe off linux)
+ * watched by the loop, which resumes the waiting greenlets in order.
+ */
+
+extern int thread_pool_size;
+extern int thread_queue_limit;  // 0 is unlimited
+
+/* grow the running pool to thread_pool_size */
+int thread_pool_resize(void);
+
+PyObject *thread_pool_call(picoev_loop *loop, PyObject *func, PyObject *args,
+                           PyObject *kwargs);
+
+void thread_pool_stop(picoev_loop *loop);
+
+#endif
@@ -12,6 +12,7 @@ static uintptr_t slot;
 // static uint32_t         time_lock = 1;
 
 volatile uintptr_t current_msec;
+volatile uint64_t current_usec;
 volatile cache_time_t *_cached_time;
 volatile char *err_log_time;
 volatile char *http_time;
@@ -51,6 +52,7 @@ void cache_time_update(void) {
   msec = tv.tv_usec / 1000;
 
   current_msec = (uintptr_t)sec * 1000 + msec;
+  current_usec = (uint64_t)sec * 1000000 + tv.tv_usec;
 
   tp = &cached_time[slot];
 
@@ -1,6 +1,8 @@
 #include "timer.h"
 
 #include "greensupport.h"
+#include "lagmon.h"
+#include "probes.h"
 #include "time_cache.h"
 
 int is_active_timer(TimerObject *timer) { return timer && !timer->called; }
@@ -39,6 +41,7 @@ TimerObject *TimerObject_new(long seconds, PyObject *callback, PyObject *args,
   }
   self->kwargs = kwargs;
   self->called = 0;
+  self->detached = 0;
   self->greenlet = greenlet;
   PyObject_GC_Track(self);
   GDEBUG("self:%p", self);
@@ -50,16 +53,23 @@ void fire_timer(TimerObject *timer) {
 
   if (!timer->called) {
     timer->called = 1;
+    lagmon_tick(-1);
     if (timer->greenlet) {
       DEBUG("call have greenlet timer:%p", timer);
+      PROBE1(greenlet__resume, -1);
       res = greenlet_switch(timer->greenlet, timer->args, timer->kwargs);
       if (greenlet_dead(timer->greenlet)) {
         Py_DECREF(timer->greenlet);
       }
     } else {
       DEBUG("call timer:%p", timer);
-      res = PyEval_CallObjectWithKeywords(timer->callback, timer->args,
-                                          timer->kwargs);
+#ifdef HAVE_VECTORCALL
+      if (timer->args == NULL && timer->kwargs == NULL) {
+        res = PyObject_Vectorcall(timer->callback, NULL, 0, NULL);
+      } else
+#endif
+        res = PyEval_CallObjectWithKeywords(timer->callback, timer->args,
+                                            timer->kwargs);
     }
     Py_XDECREF(res);
     DEBUG("called timer %p", timer);
@@ -9,6 +9,7 @@ typedef struct {
   PyObject *callback;
   time_t seconds;
   char called;
+  char detached; /* no longer keeps the loop running */
   PyObject *greenlet;
 } TimerObject;
 
@@ -0,0 +1,373 @@
+#include "tls.h"
+
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "picoev.h"
+#include "stats.h"
+
+#ifdef WITH_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#if defined(linux) && defined(SSL_OP_ENABLE_KTLS)
+#define HAVE_KTLS 1
+#include <linux/tls.h>
+#endif
+#endif
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+int tls_enabled = 0;
+
+#ifdef HAVE_KTLS
+
+// what the kernel can encrypt and decrypt
+#define TLS_CIPHERS                                             \
+  "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+  "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+#define TLS13_CIPHERS "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"
+
+#define TLS_SESSION_MAX 2048  // DER bytes of a cached session
+
+typedef struct {
+  uint32_t id_len;
+  uint32_t der_len;
+  uint64_t expires;  // sec since the epoch
+  unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+  unsigned char der[TLS_SESSION_MAX];
+} tls_cache_slot_t;
+
+/* a session goes to the slot its id hashes to, the last one wins */
+typedef struct {
+  volatile uint32_t lock;
+  uint32_t nslots;
+  tls_cache_slot_t slots[];
+} tls_cache_t;
+
+static SSL_CTX *ctx = NULL;
+static tls_cache_t *cache = NULL;
+static size_t cache_size_bytes = 0;
+
+static void cache_lock(void) {
+  while (__sync_lock_test_and_set(&cache->lock, 1)) {
+    sched_yield();
+  }
+}
+
+static void cache_unlock(void) { __sync_lock_release(&cache->lock); }
+
+static tls_cache_slot_t *cache_slot(const unsigned char *id,
+                                    unsigned int len) {
+  uint32_t h = 2166136261u;
+  unsigned int i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ id[i]) * 16777619u;
+  }
+  return &cache->slots[h % cache->nslots];
+}
+
+static int new_session(SSL *ssl, SSL_SESSION *sess) {
+  unsigned char der[TLS_SESSION_MAX], *p = der;
+  const unsigned char *id;
+  unsigned int id_len;
+  tls_cache_slot_t *slot;
+  int len;
+
+  id = SSL_SESSION_get_id(sess, &id_len);
+  len = i2d_SSL_SESSION(sess, NULL);
+  if (id_len == 0 || len <= 0 || len > TLS_SESSION_MAX) {
+    return 0;
+  }
+  i2d_SSL_SESSION(sess, &p);
+  slot = cache_slot(id, id_len);
+  cache_lock();
+  slot->id_len = id_len;
+  memcpy(slot->id, id, id_len);
+  slot->der_len = len;
+  memcpy(slot->der, der, len);
+  slot->expires = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+  cache_unlock();
+  // not kept
+  return 0;
+}
+
+static SSL_SESSION *get_session(SSL *ssl, const unsigned char *id, int id_len,
+                                int *copy) {
+  unsigned char der[TLS_SESSION_MAX];
+  const unsigned char *p = der;
+  tls_cache_slot_t *slot;
+  uint32_t len = 0;
+
+  *copy = 0;
+  if (id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+    return NULL;
+  }
+  slot = cache_slot(id, id_len);
+  cache_lock();
+  if (slot->id_len == (uint32_t)id_len && !memcmp(slot->id, id, id_len) &&
+      slot->expires > (uint64_t)time(NULL)) {
+    len = slot->der_len;
+    memcpy(der, slot->der, len);
+  }
+  cache_unlock();
+  if (len == 0) {
+    return NULL;
+  }
+  return d2i_SSL_SESSION(NULL, &p, len);
+}
+
+static void remove_session(SSL_CTX *c, SSL_SESSION *sess) {
+  const unsigned char *id;
+  unsigned int id_len;
+  tls_cache_slot_t *slot;
+
+  id = SSL_SESSION_get_id(sess, &id_len);
+  if (id_len == 0) {
+    return;
+  }
+  slot = cache_slot(id, id_len);
+  cache_lock();
+  if (slot->id_len == id_len && !memcmp(slot->id, id, id_len)) {
+    slot->id_len = 0;
+  }
+  cache_unlock();
+}
+
+static int open_cache(int nslots) {
+  size_t size;
+  void *p;
+
+  size = sizeof(tls_cache_t) + sizeof(tls_cache_slot_t) * nslots;
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+           0);
+  if (p == MAP_FAILED) {
+    return -1;
+  }
+  if (cache) {
+    munmap(cache, cache_size_bytes);
+  }
+  cache = (tls_cache_t *)p;
+  cache_size_bytes = size;
+  cache->nslots = nslots;
+  return 0;
+}
+
+/* can the kernel take over a TLS connection at all */
+static int probe_ktls(void) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int l, c = -1, a = -1, ret = -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  l = socket(AF_INET, SOCK_STREAM, 0);
+  if (l == -1) {
+    return -1;
+  }
+  if (bind(l, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+      listen(l, 1) == 0 &&
+      getsockname(l, (struct sockaddr *)&addr, &len) == 0 &&
+      (c = socket(AF_INET, SOCK_STREAM, 0)) != -1 &&
+      connect(c, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+      (a = accept(l, NULL, NULL)) != -1) {
+    ret = setsockopt(a, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+  }
+  if (a != -1) {
+    close(a);
+  }
+  if (c != -1) {
+    close(c);
+  }
+  close(l);
+  return ret;
+}
+
+static void set_ssl_error(const char *what) {
+  char buf[256];
+  unsigned long e = ERR_peek_last_error();
+
+  if (e) {
+    ERR_error_string_n(e, buf, sizeof(buf));
+    PyErr_Format(PyExc_IOError, "%s: %s", what, buf);
+  } else {
+    PyErr_Format(PyExc_IOError, "%s: unknown error", what);
+  }
+  ERR_clear_error();
+}
+
+int tls_setup(const char *certfile, const char *keyfile, const char *ciphers,
+              int cache_size) {
+  SSL_CTX *c;
+
+  c = SSL_CTX_new(TLS_server_method());
+  if (c == NULL) {
+    set_ssl_error("SSL_CTX_new");
+    return -1;
+  }
+  SSL_CTX_set_min_proto_version(c, TLS1_2_VERSION);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+  // TLS 1.3 records are received in the kernel from OpenSSL 3.2 on
+  SSL_CTX_set_max_proto_version(c, TLS1_2_VERSION);
+#endif
+  SSL_CTX_set_options(c, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                             SSL_OP_CIPHER_SERVER_PREFERENCE);
+  if (!SSL_CTX_set_cipher_list(c, ciphers ? ciphers : TLS_CIPHERS) ||
+      !SSL_CTX_set_ciphersuites(c, TLS13_CIPHERS)) {
+    set_ssl_error("ciphers");
+    goto error;
+  }
+  if (SSL_CTX_use_certificate_chain_file(c, certfile) != 1) {
+    set_ssl_error(certfile);
+    goto error;
+  }
+  if (SSL_CTX_use_PrivateKey_file(c, keyfile ? keyfile : certfile,
+                                  SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(c) != 1) {
+    set_ssl_error(keyfile ? keyfile : certfile);
+    goto error;
+  }
+  if (probe_ktls() == -1) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "kernel TLS is not available (modprobe tls)");
+    goto error;
+  }
+
+  SSL_CTX_set_session_id_context(c, (const unsigned char *)"meinheld", 8);
+  if (cache_size > 0) {
+    if (open_cache(cache_size) == -1) {
+      PyErr_SetFromErrno(PyExc_IOError);
+      goto error;
+    }
+    SSL_CTX_set_session_cache_mode(
+        c, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(c, new_session);
+    SSL_CTX_sess_set_get_cb(c, get_session);
+    SSL_CTX_sess_set_remove_cb(c, remove_session);
+  } else {
+    SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_OFF);
+  }
+
+  if (ctx) {
+    SSL_CTX_free(ctx);
+  }
+  ctx = c;
+  tls_enabled = 1;
+  return 0;
+error:
+  SSL_CTX_free(c);
+  return -1;
+}
+
+int tls_open(client_t *client) {
+  SSL *ssl;
+
+  ssl = SSL_new(ctx);
+  if (ssl == NULL) {
+    ERR_clear_error();
+    return -1;
+  }
+  if (SSL_set_fd(ssl, client->fd) != 1) {
+    ERR_clear_error();
+    SSL_free(ssl);
+    return -1;
+  }
+  SSL_set_accept_state(ssl);
+  client->ssl = ssl;
+  return 0;
+}
+
+int tls_handshake(client_t *client, int *events) {
+  SSL *ssl = (SSL *)client->ssl;
+  int ret;
+
+  ERR_clear_error();
+  ret = SSL_do_handshake(ssl);
+  if (ret == 1) {
+    if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+        !BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+      RDEBUG("no kernel TLS for %s fd:%d", SSL_get_cipher_name(ssl),
+             client->fd);
+      stats->tls_failed++;
+      return -1;
+    }
+    stats->tls_handshakes++;
+    if (SSL_session_reused(ssl)) {
+      stats->tls_resumed++;
+    }
+    // the kernel has the keys, read and write go straight to the socket
+    tls_close(client);
+    client->tls = 1;
+    return 1;
+  }
+  switch (SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+      *events = PICOEV_READ;
+      return 0;
+    case SSL_ERROR_WANT_WRITE:
+      *events = PICOEV_WRITE;
+      return 0;
+    default:
+      DEBUG("tls handshake failed fd:%d", client->fd);
+      ERR_clear_error();
+      stats->tls_failed++;
+      return -1;
+  }
+}
+
+void tls_close(client_t *client) {
+  if (client->ssl) {
+    SSL_free((SSL *)client->ssl);
+    client->ssl = NULL;
+  }
+}
+
+void tls_shutdown(client_t *client) {
+  char alert[2] = {1, 0};  // warning, close_notify
+  char control[CMSG_SPACE(sizeof(unsigned char))];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct iovec iov;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = alert;
+  iov.iov_len = sizeof(alert);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_TLS;
+  cm->cmsg_type = TLS_SET_RECORD_TYPE;
+  cm->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+  *CMSG_DATA(cm) = 21;  // alert
+  // best effort, the socket may be full or gone
+  sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+#else
+
+int tls_setup(const char *certfile, const char *keyfile, const char *ciphers,
+              int cache_size) {
+  PyErr_SetString(
+      PyExc_NotImplementedError,
+      "built without kernel TLS (MEINHELD_TLS=1, OpenSSL 3 on Linux)");
+  return -1;
+}
+
+int tls_open(client_t *client) { return -1; }
+
+int tls_handshake(client_t *client, int *events) { return -1; }
+
+void tls_close(client_t *client) {}
+
+void tls_shutdown(client_t *client) {}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include "client.h"
+#include "meinheld.h"
+
+/**
+ * HTTPS termination with kernel TLS.
+ *
+ * OpenSSL runs the handshake of an accepted socket from the loop. Once it is
+ * done the record keys are handed to the kernel (TCP_ULP "tls") for both
+ * directions and the SSL is freed, the socket then carries plain HTTP for
+ * read, writev, sendfile and splice. A connection whose cipher the kernel
+ * can't take is closed, the ciphers are limited to AES-GCM for that, and to
+ * TLS 1.2 where OpenSSL can't receive TLS 1.3 in the kernel.
+ *
+ * Sessions are cached in an anonymous shared mapping and the ticket keys
+ * live in the SSL_CTX, calling set_tls before forking lets all workers resume
+ * each other's sessions.
+ */
+
+extern int tls_enabled;
+
+/* load the certificate, -1 with a Python exception */
+int tls_setup(const char *certfile, const char *keyfile, const char *ciphers,
+              int cache_size);
+
+/* start the handshake of an accepted socket, -1 on error */
+int tls_open(client_t *client);
+
+/**
+ * go on with the handshake, 1 when done and the kernel took over, 0 to wait
+ * for *events, -1 if it failed.
+ */
+int tls_handshake(client_t *client, int *events);
+
+/* drop the handshake state */
+void tls_close(client_t *client);
+
+/**
+ * send close_notify before the socket is closed, clients that see the
+ * connection end without it drop the session instead of resuming it.
+ */
+void tls_shutdown(client_t *client);
+
+#endif
@@ -18,6 +18,15 @@ int set_so_keepalive(int fd, int flag) {
   return setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(flag));
 }
 
+/* wake writers only once less than bytes are unsent, 0 is the default */
+int set_notsent_lowat(int fd, int bytes) {
+#ifdef TCP_NOTSENT_LOWAT
+  return setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes));
+#else
+  return 0;
+#endif
+}
+
 int setup_sock(int fd) {
   int r;
   int on = 1;
@@ -98,3 +107,80 @@ uintptr_t get_current_msec() {
 
   return (uintptr_t)sec * 1000 + msec;
 }
+
+uint64_t get_current_usec() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+#ifdef HAVE_FASTCALL
+int unpack_fastcall(const char *fname, PyObject *const *args, Py_ssize_t nargs,
+                    PyObject *kwnames, const char *const *keywords,
+                    Py_ssize_t min, Py_ssize_t max, PyObject **out) {
+  Py_ssize_t i, j, nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+  PyObject *name;
+
+  if (nargs > max) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s() takes at most %zd arguments (%zd given)", fname, max,
+                 nargs + nkw);
+    return -1;
+  }
+  for (i = 0; i < max; i++) {
+    out[i] = i < nargs ? args[i] : NULL;
+  }
+  for (i = 0; i < nkw; i++) {
+    name = PyTuple_GET_ITEM(kwnames, i);
+    for (j = 0; j < max; j++) {
+      if (PyUnicode_CompareWithASCIIString(name, keywords[j]) == 0) {
+        break;
+      }
+    }
+    if (j == max) {
+      PyErr_Format(PyExc_TypeError,
+                   "%s() got an unexpected keyword argument '%U'", fname,
+                   name);
+      return -1;
+    }
+    if (out[j] != NULL) {
+      PyErr_Format(PyExc_TypeError,
+                   "argument for %s() given by name ('%s') and position (%zd)",
+                   fname, keywords[j], j + 1);
+      return -1;
+    }
+    out[j] = args[nargs + i];
+  }
+  for (i = 0; i < min; i++) {
+    if (out[i] == NULL) {
+      PyErr_Format(PyExc_TypeError,
+                   "%s() missing required argument '%s' (pos %zd)", fname,
+                   keywords[i], i + 1);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int unpack_int(PyObject *o, int *out) {
+  long v;
+
+  if (PyFloat_Check(o)) {
+    PyErr_SetString(PyExc_TypeError, "integer argument expected, got float");
+    return -1;
+  }
+  v = PyLong_AsLong(o);
+  if (v == -1 && PyErr_Occurred()) {
+    return -1;
+  }
+  if (v > INT_MAX || v < INT_MIN) {
+    PyErr_SetString(PyExc_OverflowError,
+                    "signed integer is out of range for int");
+    return -1;
+  }
+  *out = (int)v;
+  return 0;
+}
+#endif
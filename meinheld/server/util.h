@@ -14,6 +14,24 @@ int disable_cork(client_t *client);
 
 int set_so_keepalive(int fd, int flag);
 
+int set_notsent_lowat(int fd, int bytes);
+
 uintptr_t get_current_msec(void);
 
+uint64_t get_current_usec(void);
+
+#ifdef HAVE_FASTCALL
+/**
+ * Unpack METH_FASTCALL / vectorcall arguments into out (borrowed, NULL when
+ * not given) by position or by keyword name. keywords has max entries, the
+ * first min are required. Sets TypeError and returns -1 on a bad call.
+ */
+int unpack_fastcall(const char *fname, PyObject *const *args, Py_ssize_t nargs,
+                    PyObject *kwnames, const char *const *keywords,
+                    Py_ssize_t min, Py_ssize_t max, PyObject **out);
+
+/* a PyArg "i" conversion of an unpacked argument */
+int unpack_int(PyObject *o, int *out);
+#endif
+
 #endif
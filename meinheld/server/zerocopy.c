@@ -0,0 +1,244 @@
+#include "zerocopy.h"
+
+#if defined(linux) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define HAVE_ZEROCOPY 1
+#include <linux/errqueue.h>
+#endif
+
+#include "response.h"
+#include "stats.h"
+#include "util.h"
+
+int zerocopy_threshold = 0;
+
+static zc_sock_t *zc_pending = NULL;
+
+static void zc_release_all(zc_sock_t *zc) {
+  int i;
+
+  for (i = 0; i < zc->hold_cnt; i++) {
+    Py_XDECREF(zc->holds[i].o1);
+    Py_XDECREF(zc->holds[i].o2);
+  }
+  zc->hold_cnt = 0;
+}
+
+static void zc_free(zc_sock_t *zc) {
+  zc_release_all(zc);
+  PyMem_Free(zc->holds);
+  PyMem_Free(zc);
+}
+
+static void zc_list(zc_sock_t *zc) {
+  if (!zc->listed) {
+    zc->listed = 1;
+    zc->next = zc_pending;
+    zc_pending = zc;
+  }
+}
+
+static void zc_unlist(zc_sock_t *zc) {
+  zc_sock_t **p = &zc_pending;
+
+  while (*p) {
+    if (*p == zc) {
+      *p = zc->next;
+      break;
+    }
+    p = &(*p)->next;
+  }
+  zc->next = NULL;
+  zc->listed = 0;
+}
+
+#define ZC_DONE(zc, id) ((int32_t)((id) - (zc)->completed) < 0)
+
+/* release the holds of completed sends */
+static void zc_release(zc_sock_t *zc) {
+  int i, n = 0;
+
+  for (i = 0; i < zc->hold_cnt; i++) {
+    if (ZC_DONE(zc, zc->holds[i].id)) {
+      Py_XDECREF(zc->holds[i].o1);
+      Py_XDECREF(zc->holds[i].o2);
+    } else {
+      zc->holds[n++] = zc->holds[i];
+    }
+  }
+  zc->hold_cnt = n;
+}
+
+#ifdef HAVE_ZEROCOPY
+/* TCP completes the sends in order, a notification covers all up to hi */
+static void zc_read_errqueue(zc_sock_t *zc) {
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct sock_extended_err *serr;
+  char control[128];
+
+  while (zc->completed != zc->next_id) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      return;
+    }
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+      serr = (struct sock_extended_err *)CMSG_DATA(cm);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !zc->off) {
+        // nothing to gain on this route
+        DEBUG("zerocopy copied fd:%d", zc->fd);
+        zc->off = 1;
+        stats->zerocopy_copied++;
+      }
+      if (!ZC_DONE(zc, serr->ee_data)) {
+        zc->completed = serr->ee_data + 1;
+      }
+    }
+  }
+}
+#else
+static void zc_read_errqueue(zc_sock_t *zc) {}
+#endif
+
+zc_sock_t *zerocopy_open(int fd) {
+  zc_sock_t *zc;
+  int on = 1;
+
+  zc = PyMem_Malloc(sizeof(zc_sock_t));
+  if (zc == NULL) {
+    return NULL;
+  }
+  memset(zc, 0, sizeof(zc_sock_t));
+  zc->fd = fd;
+#ifdef HAVE_ZEROCOPY
+  if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == -1) {
+    zc->off = 1;
+  }
+#else
+  (void)on;
+  zc->off = 1;
+#endif
+  return zc;
+}
+
+ssize_t zerocopy_send(zc_sock_t *zc, struct iovec *iov, int cnt, int *used) {
+#ifdef HAVE_ZEROCOPY
+  struct msghdr msg;
+  ssize_t w;
+
+  if (!zc->off) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+    w = sendmsg(zc->fd, &msg, MSG_ZEROCOPY);
+    if (w > 0) {
+      *used = 1;
+      zc->next_id++;
+      stats->zerocopy_sends++;
+      zc_list(zc);
+      return w;
+    }
+    // ENOBUFS is the optmem limit, copy this one
+    if (w == 0 || errno != ENOBUFS) {
+      *used = 0;
+      return w;
+    }
+  }
+#endif
+  *used = 0;
+  return writev(zc->fd, iov, cnt);
+}
+
+void zerocopy_hold(zc_sock_t *zc, uint32_t id, PyObject *o1, PyObject *o2) {
+  zc_hold_t *holds;
+  int size;
+
+  if (ZC_DONE(zc, id)) {
+    Py_XDECREF(o1);
+    Py_XDECREF(o2);
+    return;
+  }
+  if (zc->hold_cnt == zc->hold_size) {
+    size = zc->hold_size ? zc->hold_size * 2 : 8;
+    holds = PyMem_Realloc(zc->holds, sizeof(zc_hold_t) * size);
+    if (holds == NULL) {
+      // leak them rather than free pages the kernel still reads
+      return;
+    }
+    zc->holds = holds;
+    zc->hold_size = size;
+  }
+  zc->holds[zc->hold_cnt].id = id;
+  zc->holds[zc->hold_cnt].o1 = o1;
+  zc->holds[zc->hold_cnt].o2 = o2;
+  zc->hold_cnt++;
+}
+
+void zerocopy_close(zc_sock_t *zc) {
+  zc_read_errqueue(zc);
+  zc_release(zc);
+  if (zc->completed != zc->next_id) {
+    zc->closing = 1;
+    zc->deadline =
+        get_current_usec() + (uint64_t)(write_timeout ? write_timeout : 300) *
+                                 1000000;
+    return;
+  }
+  if (zc->listed) {
+    zc_unlist(zc);
+  }
+  close(zc->fd);
+  zc_free(zc);
+}
+
+void zerocopy_drain(void) {
+  zc_sock_t *zc = zc_pending, *next;
+  uint64_t now = 0;
+
+  while (zc) {
+    next = zc->next;
+    zc_read_errqueue(zc);
+    zc_release(zc);
+    if (zc->closing) {
+      if (zc->completed != zc->next_id) {
+        if (now == 0) {
+          now = get_current_usec();
+        }
+        if (now < zc->deadline) {
+          zc = next;
+          continue;
+        }
+        RDEBUG("zerocopy completion timeout fd:%d", zc->fd);
+      }
+      zc_unlist(zc);
+      close(zc->fd);
+      zc_free(zc);
+    } else if (zc->completed == zc->next_id) {
+      zc_unlist(zc);
+    }
+    zc = next;
+  }
+}
+
+void zerocopy_stop(void) {
+  zc_sock_t *zc;
+
+  while ((zc = zc_pending) != NULL) {
+    zc_unlist(zc);
+    if (zc->closing) {
+      close(zc->fd);
+      zc_free(zc);
+    } else {
+      // the client still owns it
+      zc_release_all(zc);
+    }
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include "meinheld.h"
+
+#include <sys/uio.h>
+
+/**
+ * MSG_ZEROCOPY sends of large response bodies.
+ *
+ * A zerocopy send pins the pages of the body instead of copying them, they
+ * must not change until the kernel reports the send completed on the
+ * socket's error queue. The bytes objects written that way are held here with
+ * the id of their send and released by the completion. Sockets with sends
+ * in flight are drained on every turn of the loop.
+ *
+ * The kernel copies anyway when it can't do better (loopback, no scatter
+ * gather), the completion tells so and the socket goes back to plain writes.
+ * A socket closed while sends are pending is only closed once they
+ * completed, or write_timeout sec later.
+ */
+
+typedef struct {
+  uint32_t id;  // the send that wrote the objects last
+  PyObject *o1;
+  PyObject *o2;
+} zc_hold_t;
+
+typedef struct _zc_sock {
+  int fd;
+  uint8_t off;      // SO_ZEROCOPY refused or the kernel copied
+  uint8_t closing;  // close fd once the sends completed
+  uint8_t listed;   // on the pending list, sends in flight
+  uint32_t next_id;
+  uint32_t completed;  // sends below are done
+  uint64_t deadline;  // usec, a closing socket gives up then
+  zc_hold_t *holds;
+  int hold_cnt;
+  int hold_size;
+  struct _zc_sock *next;  // pending list
+} zc_sock_t;
+
+extern int zerocopy_threshold;  // bytes, 0 disables
+
+/* the zerocopy state of a client socket, NULL on memory error */
+zc_sock_t *zerocopy_open(int fd);
+
+/* send iov, *used is set if it went zerocopy as send zc->next_id - 1 */
+ssize_t zerocopy_send(zc_sock_t *zc, struct iovec *iov, int cnt, int *used);
+
+/* keep o1 and o2 (stolen, may be NULL) until send id completed */
+void zerocopy_hold(zc_sock_t *zc, uint32_t id, PyObject *o1, PyObject *o2);
+
+/* close the socket now or once its sends completed */
+void zerocopy_close(zc_sock_t *zc);
+
+/* read the completions of the pending sockets */
+void zerocopy_drain(void);
+
+/* close pending sockets and drop what they hold, the loop stopped */
+void zerocopy_stop(void);
+
+#endif
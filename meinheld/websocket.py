@@ -14,7 +14,6 @@ else:
     from itertools import cycle
     from itertools import imap as map
     from itertools import izip as zip
-import random
 import socket
 
 try:
@@ -119,6 +118,7 @@ class WebSocketMiddleware(object):
             if result and response != -1:
                 ws = environ.pop('wsgi.websocket')
                 ws._send_closing_frame(True)
+                ws._close()
                 client = environ[CLIENT_KEY]
                 client.set_closed(1)
 
@@ -194,6 +194,7 @@ class WebSocketWSGI(object):
         self.handler(ws)
         # Make sure we send the closing frame
         ws._send_closing_frame(True)
+        ws._close()
         # use this undocumented feature of eventlet.wsgi to ensure that it
         # doesn't barf on the fact that we didn't call start_response
         return [""]
@@ -230,7 +231,15 @@ class WebSocket(object):
     environ
         The full WSGI environment for this request.
 
+    Frames are written through a :class:`meinheld.server.Outbox`, so
+    :meth:`send` and :func:`broadcast` never interleave. A client holding
+    more than ``high_watermark`` unsent bytes is slow: :func:`broadcast`
+    drops frames for it, or disconnects it when ``slow_policy`` is
+    ``"close"``.
     """
+    high_watermark = 1 << 20
+    slow_policy = "drop"
+
     def __init__(self, sock, environ, version=76):
         """
         :param socket: The eventlet socket
@@ -247,7 +256,8 @@ class WebSocket(object):
         self.websocket_closed = False
         self._buf = b""
         self._msgs = collections.deque()
-        #self._sendlock = semaphore.Semaphore()
+        self._out = server.Outbox(sock.fileno(), self.high_watermark,
+                                  self.slow_policy)
 
     def _pack_message(self, message):
         """Pack the message inside ``00`` and ``FF``
@@ -255,42 +265,9 @@ class WebSocket(object):
         As per the dataframing section (5.3) for the websocket spec
         """
         if self.version in (13,):
-            # payload
-            opcode = 2
-            if isinstance(message, unicode):  # text
-                opcode = 1
-                payload = message.encode('utf-8')
-            else:
-                payload = message
-            if not isinstance(payload, bytes):
-                raise TypeError("message should be str, unicode or bytes.")
-
-            # header(fin,maskflag,opcode,length)
-            fin = 0x80  #0x80:fin, 0:continuation
-            mask = 0  #0:unmasked, 0x80:masked
-            length = len(payload)
-            if length < 126:
-                header = struct.pack(">BB", fin|opcode, mask|length)
-            elif 126 <= length <= 0xffff:
-                header = struct.pack(">BBH", fin|opcode, mask|126, length)
-            elif 0xffff < length <= 0xffffffffffffffff:
-                header = struct.pack(">BBQ", fin|opcode, mask|127, length)
-            else:
-                #TODO: partial packet
-                raise ValueError("Can't send over 64bit length. (partial packet are not supported)") 
-
-            # maskdata, masked-payload
-            maskdata = b''
-            if mask:
-                maskdata = struct.pack(">I", random.randint(0,0xffffffff))
-                masklist = cycle(ord(x) for x in maskdata)
-                payload = b''.join(chr(ord(d)^m) for d,m in zip(payload, masklist))
-
-            packed = header + maskdata + payload
+            return server.ws_frame(message)
         else:
-            raise ValueError("Unknown WebSocket protocol version.") 
-
-        return packed
+            raise ValueError("Unknown WebSocket protocol version.")
 
     def _parse_messages(self):
         """ Parses for messages in the buffer *buf*.  It is assumed that
@@ -353,7 +330,6 @@ class WebSocket(object):
                                                     map(ord, data),
                                                     cycle(map(ord, maskdata))
                                                     ))
-            print(opcode, length, data[:16])
             if opcode == 0:  #continuation
                 if is_text:
                     msg += data.decode('utf-8')
@@ -386,14 +362,9 @@ class WebSocket(object):
         convertable to a string; unicode objects should be encodable
         as utf-8."""
         packed = self._pack_message(message)
-        # if two greenthreads are trying to send at the same time
-        # on the same socket, sendlock prevents interleaving and corruption
-        
-        #self._sendlock.acquire()
-        #try:
-        return self.socket.sendall(packed)
-        #finally:
-        #    self._sendlock.release()
+        # queued whole, so two greenthreads sending at the same time
+        # can't interleave their frames
+        return self._out.send(packed)
 
     def wait(self):
         """Waits for and deserializes messages. Returns a single
@@ -411,6 +382,15 @@ class WebSocket(object):
             self._msgs.extend(msgs)
         return self._msgs.popleft()
 
+    def _close(self):
+        """Writes out what is queued and releases the output queue. A
+        client that takes nothing for write_timeout sec is cut off."""
+        try:
+            self._out.flush(server.get_write_timeout() or None)
+        except IOError:
+            pass
+        self._out.close()
+
     def _send_closing_frame(self, ignore_send_errors=False):
         """Sends the closing frame to the client, if required."""
         if self.version == 76 and not self.websocket_closed:
@@ -427,6 +407,16 @@ class WebSocket(object):
         """Forcibly close the websocket; generally it is preferable to
         return from the handler method."""
         self._send_closing_frame()
+        self._out.close()
         self.socket.shutdown(True)
         self.socket.close()
 
+
+def broadcast(websockets, message):
+    """Send *message* to every websocket in *websockets*.
+
+    The frame is built once and queued on each connection, without waiting
+    for any of them. Slow clients are skipped or disconnected as their
+    ``slow_policy`` says. Returns the number of websockets that took it.
+    """
+    return server.broadcast([ws._out for ws in websockets], message)
@@ -74,18 +74,39 @@ else:
     define_macros=[
             ("WITH_GREENLET",None),
             ("HTTP_PARSER_DEBUG", "0") ]
-    install_requires=['greenlet>=0.4.5,<0.5']
+    install_requires=['greenlet>=2.0']
 
 if develop:
     define_macros.append(("DEVELOP",None))
 
-sources = get_sources("meinheld", ["*picoev_*"])
-sources.append(get_picoev_file())
-
+libraries = []
 library_dirs=[]
 #TODO set python include dirs
 include_dirs=[]
 
+# HTTPS with kernel TLS, only built with MEINHELD_TLS=1
+def find_openssl():
+    for d in ("/usr/include", "/usr/local/include"):
+        if os.path.exists(os.path.join(d, "openssl", "ssl.h")):
+            return d
+    return None
+
+openssl_dir = None
+if "Linux" == platform.system() and os.environ.get("MEINHELD_TLS") == "1":
+    openssl_dir = find_openssl()
+    if openssl_dir is None:
+        print("MEINHELD_TLS=1 needs the OpenSSL headers (openssl/ssl.h)")
+        sys.exit(1)
+if openssl_dir:
+    define_macros.append(("WITH_OPENSSL", None))
+    libraries += ["ssl", "crypto"]
+    if openssl_dir != "/usr/include":
+        include_dirs.append(openssl_dir)
+        library_dirs.append(os.path.join(os.path.dirname(openssl_dir), "lib"))
+
+sources = get_sources("meinheld", ["*picoev_*"])
+sources.append(get_picoev_file())
+
 setup(name='meinheld',
     version="1.0.2",
     description="High performance asynchronous Python WSGI Web Server",
@@ -96,6 +117,8 @@ setup(name='meinheld',
     license='BSD',
     platforms='Linux, BSD, Darwin, SunOS',
     packages= ['meinheld'],
+    # what greenlet 2 supports
+    python_requires='>=2.7, !=3.0.*, !=3.1.*, !=3.2.*, !=3.3.*, !=3.4.*',
     install_requires=install_requires,
 
     entry_points="""
@@ -108,6 +131,7 @@ setup(name='meinheld',
             sources=sources,
             include_dirs=include_dirs,
             library_dirs=library_dirs,
+            libraries=libraries,
             # libraries=["profiler"],
             # extra_compile_args=[""],
             define_macros=define_macros
@@ -123,7 +147,16 @@ setup(name='meinheld',
         'Operating System :: POSIX :: BSD :: FreeBSD',
         'Programming Language :: C',
         'Programming Language :: Python',
+        'Programming Language :: Python :: 2',
+        'Programming Language :: Python :: 2.7',
         'Programming Language :: Python :: 3',
+        'Programming Language :: Python :: 3.5',
+        'Programming Language :: Python :: 3.6',
+        'Programming Language :: Python :: 3.7',
+        'Programming Language :: Python :: 3.8',
+        'Programming Language :: Python :: 3.9',
+        'Programming Language :: Python :: 3.10',
+        'Programming Language :: Python :: 3.11',
         'Topic :: Internet :: WWW/HTTP :: WSGI :: Server'
     ],
 )
@@ -83,3 +83,23 @@ class BaseApp(object):
 
     environ = None
 
+
+class OkApp(BaseApp):
+
+    def __call__(self, environ, start_response):
+        self.environ = environ.copy()
+        start_response("200 OK", [("Content-type", "text/plain")])
+        return [b"ok"]
+
+
+def run_green(func):
+    """call func from a client greenlet of a running server"""
+    result = {}
+
+    def client():
+        result["value"] = func()
+        return requests.get("http://127.0.0.1:8000/")
+
+    env, res = run_client(client, OkApp)
+    assert(res.content == b"ok")
+    return result["value"]
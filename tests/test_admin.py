@@ -0,0 +1,103 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import os
+import pytest
+import requests
+import _socket
+
+ASSERT_RESPONSE = b"Hello world!"
+RESPONSE = [b"Hello ", b"world!"]
+
+class App(BaseApp):
+
+    environ = None
+
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        return RESPONSE
+
+def raw_get(path, sock_path):
+    # msocket does not support unix sockets, wait with trampoline
+    s = _socket.socket(_socket.AF_UNIX, _socket.SOCK_STREAM)
+    s.connect(sock_path)
+    s.sendall(("GET %s HTTP/1.0\r\n\r\n" % path).encode())
+    s.setblocking(False)
+    data = b""
+    while True:
+        server.trampoline(s.fileno(), read=True, timeout=5)
+        d = s.recv(4096)
+        if not d:
+            break
+        data += d
+    s.close()
+    return data
+
+def test_metrics():
+
+    def client():
+        requests.get("http://localhost:8000/")
+        metrics = requests.get("http://localhost:8001/metrics")
+        health = requests.get("http://localhost:8001/healthz")
+        missing = requests.get("http://localhost:8001/foo")
+        post = requests.post("http://localhost:8001/metrics", data="x")
+        return metrics, health, missing, post
+
+    server.set_admin_listen(("127.0.0.1", 8001))
+    before = server.get_stats()
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_admin_listen(None)
+    metrics, health, missing, post = res
+    assert(metrics.status_code == 200)
+    assert(metrics.headers["content-type"].startswith(
+        "application/openmetrics-text"))
+    body = metrics.text
+    assert(body.endswith("# EOF\n"))
+    assert("# TYPE meinheld_requests counter\n" in body)
+    assert('meinheld_requests_total{code="2xx"} ' in body)
+    assert("meinheld_connections_accepted_total " in body)
+    assert('meinheld_request_duration_seconds_bucket{le="+Inf"} ' in body)
+    assert("meinheld_request_duration_seconds_count " in body)
+    assert('meinheld_loop_stall_seconds_bucket{le="0.01"} ' in body)
+    assert("meinheld_loop_busy_seconds_total " in body)
+    assert("meinheld_greenlet_pool_hits_total " in body)
+    # admin requests are not counted
+    assert(server.get_stats()["requests"] - before["requests"] == 1)
+
+    assert(health.status_code == 200)
+    assert(health.text == "ok\n")
+    assert(missing.status_code == 404)
+    assert(post.status_code == 405)
+
+def test_metrics_unix(tmpdir):
+    path = str(tmpdir.join("admin.sock"))
+
+    def client():
+        r = raw_get("/healthz", path)
+        requests.get("http://localhost:8000/")
+        return r, raw_get("/metrics", path)
+
+    server.set_admin_listen(path)
+    before = server.get_stats()
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_admin_listen(None)
+    health, metrics = res
+    assert(health.startswith(b"HTTP/1.1 200 OK\r\n"))
+    assert(health.endswith(b"\r\n\r\nok\n"))
+    assert(metrics.startswith(b"HTTP/1.1 200 OK\r\n"))
+    assert(metrics.endswith(b"# EOF\n"))
+    assert(server.get_stats()["requests"] - before["requests"] == 1)
+    assert(not os.path.exists(path))
+
+def test_invalid_admin_listen():
+    with pytest.raises(TypeError):
+        server.set_admin_listen(8001)
+    with pytest.raises(IOError):
+        server.set_admin_listen(("256.256.256.256", 8001))
@@ -0,0 +1,99 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import os
+import pytest
+import requests
+import struct
+import tempfile
+
+ASSERT_RESPONSE = b"Hello world!"
+RESPONSE = [b"Hello ", b"world!"]
+
+RECORD = struct.Struct("<IBxHQI")
+OPEN, DATA, CLOSE = 1, 2, 3
+
+class App(BaseApp):
+
+    environ = None
+
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        return RESPONSE
+
+def read_records(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    assert(data[:8] == b"MHCAP001")
+    records = []
+    pos = 16
+    while pos < len(data):
+        conn, typ, reqs, offset, length = RECORD.unpack_from(data, pos)
+        pos += RECORD.size
+        records.append((conn, typ, reqs, offset, data[pos:pos + length]))
+        pos += length
+    return records
+
+def test_capture():
+
+    def client():
+        s = requests.Session()
+        s.get("http://localhost:8000/foo?a=1")
+        return s.post("http://localhost:8000/bar", data=b"hello")
+
+    fd, path = tempfile.mkstemp()
+    os.close(fd)
+    server.set_keepalive(10)
+    server.set_capture(path)
+    try:
+        assert(server.is_capture_enabled())
+        env, res = run_client(client, App)
+    finally:
+        server.set_capture(None)
+        server.set_keepalive(0)
+    assert(res.content == ASSERT_RESPONSE)
+    assert(not server.is_capture_enabled())
+
+    records = read_records(path)
+    os.remove(path)
+    assert(records[0][:3] == (1, OPEN, 0))
+    data = [r for r in records if r[1] == DATA]
+    # one connection reused by both requests
+    assert(set(r[0] for r in records) == set([1]))
+    assert(sum(r[2] for r in data) == 2)
+    payload = b"".join(r[4] for r in data)
+    assert(payload.startswith(b"GET /foo?a=1 HTTP/1.1\r\n"))
+    assert(b"POST /bar HTTP/1.1\r\n" in payload)
+    assert(payload.endswith(b"hello"))
+    offsets = [r[3] for r in records]
+    assert(offsets == sorted(offsets))
+
+def test_capture_max_bytes():
+
+    def client():
+        return requests.get("http://localhost:8000/")
+
+    fd, path = tempfile.mkstemp()
+    os.close(fd)
+    server.set_capture(path, max_bytes=40)
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_capture(None)
+    assert(res.content == ASSERT_RESPONSE)
+    records = read_records(path)
+    os.remove(path)
+    # the header and the OPEN record fit, the request does not
+    assert([r[1] for r in records] == [OPEN])
+
+def test_capture_error():
+    with pytest.raises(IOError):
+        server.set_capture("/nonexistent/dir/capture.bin")
+    with pytest.raises(ValueError):
+        server.set_capture("/tmp/capture.bin", max_bytes=-1)
+    with pytest.raises(TypeError):
+        server.set_capture(1)
+    assert(not server.is_capture_enabled())
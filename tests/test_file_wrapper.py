@@ -0,0 +1,86 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import os
+import _socket
+import subprocess
+import sys
+import tempfile
+
+BODY = b"a" * 100000 + b"b" * 100000
+
+# writes BODY in two parts, the server has to wait for the second
+WRITER = ("import sys, time\n"
+          "out = sys.stdout.buffer if hasattr(sys.stdout, 'buffer') "
+          "else sys.stdout\n"
+          "out.write(b'a' * 100000)\n"
+          "out.flush()\n"
+          "time.sleep(0.5)\n"
+          "out.write(b'b' * 100000)\n")
+
+
+class FileApp(BaseApp):
+
+    def __init__(self, make, headers=()):
+        self.make = make
+        self.headers = list(headers)
+
+    def __call__(self, environ, start_response):
+        self.environ = environ.copy()
+        start_response("200 OK", [("Content-Type", "text/plain")] +
+                       self.headers)
+        return environ["wsgi.file_wrapper"](self.make())
+
+
+def get(app):
+
+    def client():
+        return requests.get("http://localhost:8000/")
+
+    r = ClientRunner(app, client)
+    r.run()
+    ServerRunner(app).run()
+    return r.receive_data
+
+
+def test_regular_file():
+    f = tempfile.TemporaryFile()
+    f.write(BODY)
+    f.seek(0)
+    res = get(FileApp(lambda: f))
+    assert(res.status_code == 200)
+    assert(res.headers["content-length"] == str(len(BODY)))
+    assert(res.content == BODY)
+
+
+def test_pipe():
+    procs = []
+
+    def make():
+        proc = subprocess.Popen([sys.executable, "-c", WRITER],
+                                stdout=subprocess.PIPE)
+        procs.append(proc)
+        return proc.stdout
+    res = get(FileApp(make))
+    procs[0].wait()
+    # spliced up to the end of the pipe, the connection ends the body
+    assert(res.status_code == 200)
+    assert("content-length" not in res.headers)
+    assert(res.headers["connection"] == "close")
+    assert(res.content == BODY)
+
+
+def test_socket_content_length():
+    a, b = _socket.socketpair()
+
+    def make():
+        a.sendall(BODY[:50000])
+        a.close()
+        return b
+    try:
+        res = get(FileApp(make, [("Content-Length", "50000")]))
+    finally:
+        b.close()
+    assert(res.status_code == 200)
+    assert(res.headers["content-length"] == "50000")
+    assert(res.content == BODY[:50000])
@@ -0,0 +1,210 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import greenlet
+import pytest
+import requests
+import socket
+from meinheld.middleware import ContinuationMiddleware, CONTINUATION_KEY
+
+try:
+    import contextvars
+except ImportError:
+    contextvars = None
+
+ASSERT_RESPONSE = b"Hello world!"
+RESPONSE = [b"Hello ", b"world!"]
+
+if contextvars:
+    request_var = contextvars.ContextVar("request_var", default=None)
+
+class App(BaseApp):
+
+    environ = None
+
+    def __init__(self):
+        self.greenlets = []
+        self.leaked = []
+
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        self.greenlets.append(id(greenlet.getcurrent()))
+        if contextvars:
+            self.leaked.append(request_var.get())
+            request_var.set(environ["PATH_INFO"])
+        return RESPONSE
+
+class ResumeApp(BaseApp):
+
+    waiter = None
+
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        if self.waiter is None:
+            c = environ[CONTINUATION_KEY]
+            self.waiter = c
+            c.suspend(3)
+            return [b"RESUMED"]
+        self.waiter.resume()
+        return RESPONSE
+
+class InterleaveApp(BaseApp):
+
+    def __init__(self):
+        self.waiters = []
+        self.seen = {}
+
+    def __call__(self, environ, start_response):
+        start_response('200 OK', [('Content-type','text/plain')])
+        path = environ["PATH_INFO"]
+        if path == "/resume":
+            # the last one suspended runs first
+            for c in reversed(self.waiters):
+                c.resume()
+            return RESPONSE
+        before = request_var.get()
+        request_var.set(path)
+        c = environ[CONTINUATION_KEY]
+        self.waiters.append(c)
+        c.suspend(3)
+        self.seen[path] = [before, request_var.get()]
+        return [path.encode()]
+
+def pool_stats():
+    s = server.get_stats()
+    return s["pool_hits"], s["pool_misses"]
+
+def run_pooled(client, app, size=4, max_requests=0, middleware=None):
+    server.set_greenlet_pool_size(size)
+    server.set_greenlet_max_requests(max_requests)
+    server.set_keepalive(10)
+    before = pool_stats()
+    try:
+        env, res = run_client(client, app, middleware)
+    finally:
+        server.set_keepalive(0)
+        server.set_greenlet_max_requests(0)
+        server.set_greenlet_pool_size(0)
+    after = pool_stats()
+    return res, after[0] - before[0], after[1] - before[1]
+
+def test_pool_reuse():
+
+    def client():
+        s = requests.Session()
+        return [s.get("http://localhost:8000/%d" % i) for i in range(5)]
+
+    app = App()
+    res, hits, misses = run_pooled(client, lambda: app)
+    assert([r.content for r in res] == [ASSERT_RESPONSE] * 5)
+    assert(misses == 1)
+    assert(hits == 4)
+    assert(len(set(app.greenlets)) == 1)
+    if contextvars:
+        # every request starts with a fresh context
+        assert(app.leaked == [None] * 5)
+    assert(server.get_stats()["pool_idle"] == 0)
+
+def test_pool_max_requests():
+
+    def client():
+        s = requests.Session()
+        return [s.get("http://localhost:8000/") for i in range(4)]
+
+    app = App()
+    res, hits, misses = run_pooled(client, lambda: app, max_requests=2)
+    assert([r.content for r in res] == [ASSERT_RESPONSE] * 4)
+    assert(misses == 2)
+    assert(len(set(app.greenlets)) == 2)
+
+def test_pool_pipeline():
+
+    def client():
+        s = socket.create_connection(("localhost", 8000))
+        s.sendall(b"GET /a HTTP/1.1\r\nHost: localhost\r\n\r\n" * 3)
+        data = b""
+        while data.count(ASSERT_RESPONSE) < 3:
+            chunk = s.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+        s.close()
+        return data
+
+    app = App()
+    res, hits, misses = run_pooled(client, lambda: app)
+    assert(res.count(b"HTTP/1.1 200 OK") == 3)
+    assert(misses == 1)
+    assert(len(set(app.greenlets)) == 1)
+
+def test_pool_suspend():
+
+    def client():
+        results = []
+
+        def waiter():
+            results.append(requests.get("http://localhost:8000/"))
+
+        server.spawn(waiter)
+        server.sleep(1)
+        r = requests.get("http://localhost:8000/")
+        server.sleep(1)
+        return r, results
+
+    app = ResumeApp()
+    res, hits, misses = run_pooled(client, lambda: app,
+                                   middleware=ContinuationMiddleware)
+    r, results = res
+    assert(r.content == ASSERT_RESPONSE)
+    assert([x.content for x in results] == [b"RESUMED"])
+    # the suspended request holds its worker, the second one needs another
+    assert(misses == 2)
+
+@pytest.mark.skipif(contextvars is None, reason="no contextvars")
+def test_pool_context_interleaved():
+
+    def client():
+        socks = []
+        for path in ("/a", "/b"):
+            s = socket.create_connection(("localhost", 8000))
+            s.sendall(("GET %s HTTP/1.0\r\n\r\n" % path).encode())
+            socks.append(s)
+            server.sleep(1)
+        r = requests.get("http://localhost:8000/resume")
+        bodies = []
+        for s in socks:
+            data = b""
+            while True:
+                chunk = s.recv(4096)
+                if not chunk:
+                    break
+                data += chunk
+            s.close()
+            bodies.append(data.split(b"\r\n\r\n", 1)[1])
+        return r, bodies
+
+    app = InterleaveApp()
+    res, hits, misses = run_pooled(client, lambda: app,
+                                   middleware=ContinuationMiddleware)
+    r, bodies = res
+    assert(r.content == ASSERT_RESPONSE)
+    assert(bodies == [b"/a", b"/b"])
+    assert(list(app.seen) == ["/b", "/a"])
+    # each request keeps its own context across the switches
+    assert(app.seen == {"/a": [None, "/a"], "/b": [None, "/b"]})
+
+def test_pool_size():
+    assert(server.get_greenlet_pool_size() == 0)
+    server.set_greenlet_pool_size(8)
+    assert(server.get_greenlet_pool_size() == 8)
+    server.set_greenlet_pool_size(0)
+    with pytest.raises(ValueError):
+        server.set_greenlet_pool_size(-1)
+    with pytest.raises(ValueError):
+        server.set_greenlet_max_requests(-1)
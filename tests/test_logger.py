@@ -3,6 +3,7 @@
 from base import *
 import requests
 import os
+import pytest
 
 ASSERT_RESPONSE = b"Hello world!"
 RESPONSE = [b"Hello ", b"world!"]
@@ -91,3 +92,125 @@ def test_custom_err_log():
     assert(res.status_code == 500)
 
 
+
+def test_native_access_log(tmpdir):
+
+    def client():
+        return requests.get("http://localhost:8000/foo/bar?a=1",
+                            headers={"User-Agent": 'te"st', "X-Id": "42"})
+
+    from meinheld import server
+    path = str(tmpdir.join("access.log"))
+    server.set_access_logger(None)
+    server.set_access_log(path,
+                          '%(h)s "%(r)s" %(s)s %(b)s "%(a)s" %{x-id}i %m %U %q %%')
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_access_log(None)
+    assert(res.content == ASSERT_RESPONSE)
+
+    with open(path) as f:
+        lines = f.readlines()
+    assert(lines == ['127.0.0.1 "GET /foo/bar?a=1 HTTP/1.1" 200 12 "te\\"st" 42 GET /foo/bar a=1 %\n'])
+
+def test_native_access_log_reopen(tmpdir):
+
+    def client():
+        r = requests.get("http://localhost:8000/")
+        os.rename(path, path + ".1")
+        os.kill(os.getpid(), signal.SIGUSR1)
+        server.sleep(1)
+        requests.get("http://localhost:8000/")
+        return r
+
+    from meinheld import server
+    import signal
+    path = str(tmpdir.join("access.log"))
+    server.set_access_logger(None)
+    server.set_access_log(path, "%(U)s %(s)s")
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_access_log(None)
+
+    with open(path + ".1") as f:
+        assert(f.read() == "/ 200\n")
+    with open(path) as f:
+        assert(f.read() == "/ 200\n")
+
+def test_native_access_log_invalid_format(tmpdir):
+    from meinheld import server
+    path = str(tmpdir.join("access.log"))
+    with pytest.raises(ValueError):
+        server.set_access_log(path, "%(zz)s")
+    with pytest.raises(ValueError):
+        server.set_access_log(path, "%(h")
+    with pytest.raises(ValueError):
+        server.set_access_log(path, "%{nope}P")
+
+class TimingApp(BaseApp):
+
+    timing = None
+
+    def __call__(self, environ, start_response):
+        start_response('200 OK', [('Content-type','text/plain')])
+        self.environ = environ.copy()
+        TimingApp.timing = server.get_request_timing()
+        return RESPONSE
+
+class TimingLogger(object):
+
+    timing = None
+
+    def access(self, environ):
+        TimingLogger.timing = environ["REQUEST_TIMING"]
+
+    def error(self, exc, val, tb):
+        pass
+
+def test_request_timing():
+
+    def client():
+        return requests.get("http://localhost:8000/")
+
+    from meinheld import server
+    server.set_access_logger(TimingLogger())
+    try:
+        env, res = run_client(client, TimingApp)
+    finally:
+        server.set_access_logger(None)
+    assert(res.content == ASSERT_RESPONSE)
+
+    # while the app runs
+    t = TimingApp.timing
+    assert(isinstance(t, server.RequestTiming))
+    assert(0 < t.accept <= t.first_byte <= t.headers_complete <=
+           t.message_complete <= t.app_start)
+    assert(t.app_end == 0 and t.first_write == 0 and t.last_write == 0)
+
+    # at the access log
+    t = TimingLogger.timing
+    assert(t.app_start <= t.app_end <= t.first_write <= t.last_write)
+    assert(len(t) == 8)
+
+def test_native_access_log_phase(tmpdir):
+
+    def client():
+        return requests.get("http://localhost:8000/")
+
+    from meinheld import server
+    path = str(tmpdir.join("access.log"))
+    server.set_access_logger(None)
+    server.set_access_log(path,
+                          "%{wait}P %{header}P %{body}P %{queue}P "
+                          "%({app}P)s %{start}P %{send}P")
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_access_log(None)
+
+    with open(path) as f:
+        fields = f.read().split()
+    assert(len(fields) == 7)
+    assert(all(v.isdigit() for v in fields))
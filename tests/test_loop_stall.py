@@ -0,0 +1,95 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import pytest
+import requests
+import time
+import traceback
+
+ASSERT_RESPONSE = b"Hello world!"
+RESPONSE = [b"Hello ", b"world!"]
+
+class App(BaseApp):
+
+    environ = None
+
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        if environ.get("PATH_INFO") == "/block":
+            blocking_call()
+        return RESPONSE
+
+def blocking_call():
+    time.sleep(0.3)
+
+class StallLogger(object):
+
+    def __init__(self):
+        self.errors = []
+
+    def error(self, exc, val, tb):
+        self.errors.append((exc, str(val), traceback.extract_tb(tb)))
+
+def loop_stats():
+    return server.get_stats()["loop"]
+
+def test_loop_stall():
+
+    def client():
+        return requests.get("http://localhost:8000/block")
+
+    logger = StallLogger()
+    server.set_error_logger(logger)
+    server.set_loop_stall_threshold(100)
+    before = loop_stats()
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_loop_stall_threshold(0)
+        server.set_error_logger(None)
+    assert(res.content == ASSERT_RESPONSE)
+
+    assert(len(logger.errors) == 1)
+    exc, msg, stack = logger.errors[0]
+    assert(exc is RuntimeWarning)
+    assert(msg.startswith("event loop blocked for "))
+    names = [frame[2] for frame in stack]
+    assert(names[-2:] == ["__call__", "blocking_call"])
+
+    after = loop_stats()
+    assert(after["stalls"] - before["stalls"] == 1)
+    assert(after["stall_sum_usec"] - before["stall_sum_usec"] >= 300000)
+    # 250ms < stall <= 500ms
+    assert(after["stall_buckets"][4][0] == 500000)
+    assert(after["stall_buckets"][4][1] - before["stall_buckets"][4][1] == 1)
+    assert(after["lag_max_usec"] >= 300000)
+    assert(after["iterations"] > before["iterations"])
+
+def test_no_stall():
+
+    def client():
+        return requests.get("http://localhost:8000/")
+
+    logger = StallLogger()
+    server.set_error_logger(logger)
+    server.set_loop_stall_threshold(100)
+    before = loop_stats()
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_loop_stall_threshold(0)
+        server.set_error_logger(None)
+    assert(res.content == ASSERT_RESPONSE)
+    assert(logger.errors == [])
+    assert(loop_stats()["stalls"] == before["stalls"])
+
+def test_loop_stall_threshold():
+    assert(server.get_loop_stall_threshold() == 0)
+    server.set_loop_stall_threshold(250)
+    assert(server.get_loop_stall_threshold() == 250)
+    server.set_loop_stall_threshold(0)
+    with pytest.raises(ValueError):
+        server.set_loop_stall_threshold(-1)
@@ -0,0 +1,48 @@
+# -*- coding: utf-8 -*-
+
+from meinheld import server
+import pytest
+
+REQUEST = (b"GET /foo/bar?a=1 HTTP/1.1\r\n"
+           b"Host: localhost\r\n"
+           b"User-Agent: test\r\n"
+           b"\r\n")
+
+POST = (b"POST /echo HTTP/1.1\r\n"
+        b"Host: localhost\r\n"
+        b"Content-Length: 5\r\n"
+        b"\r\n"
+        b"hello")
+
+def test_bench_parse():
+    before = server.get_stats()["requests"]
+    r = server._bench_parse(REQUEST, 100)
+    assert(r["requests"] == 100)
+    assert(r["ns_per_request"] > 0)
+    assert(r["allocs_per_request"] > 0)
+    assert(r["bytes_per_request"] == len(REQUEST))
+    # worker counters are untouched
+    assert(server.get_stats()["requests"] == before)
+
+def test_bench_parse_pipeline():
+    r = server._bench_parse(REQUEST + POST, 10)
+    assert(r["requests"] == 20)
+
+def test_bench_parse_error():
+    with pytest.raises(ValueError):
+        server._bench_parse(b"GET / HTTP/1.1\r\nHost localhost\r\n\r\n", 1)
+    with pytest.raises(ValueError):
+        server._bench_parse(REQUEST[:-2], 1)
+    with pytest.raises(ValueError):
+        server._bench_parse(REQUEST, 0)
+    with pytest.raises(TypeError):
+        server._bench_parse(u"GET / HTTP/1.1\r\n\r\n", 1)
+
+def test_bench_response():
+    r = server._bench_response("200 OK", [("Content-Type", "text/plain")],
+                               [b"Hello ", b"world!"], 100)
+    assert(r["requests"] == 100)
+    assert(r["ns_per_request"] > 0)
+    assert(r["bytes_per_request"] > 0)
+    with pytest.raises(TypeError):
+        server._bench_response("200 OK", None, [b""], 1)
@@ -0,0 +1,158 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import pytest
+import socket
+
+CHUNK = b"x" * 65536
+
+
+class StreamApp(BaseApp):
+
+    def __init__(self, chunks, chunk=CHUNK):
+        self.chunks = chunks
+        self.chunk = chunk
+        self.produced = 0
+        self.closed = False
+
+    def __call__(self, environ, start_response):
+        self.environ = environ.copy()
+        length = self.chunks * len(self.chunk)
+        start_response("200 OK", [("Content-Length", str(length))])
+        return self.body()
+
+    def body(self):
+        try:
+            for i in range(self.chunks):
+                self.produced += 1
+                yield self.chunk
+        finally:
+            self.closed = True
+
+
+def connect():
+    s = socket.socket()
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    s.connect(("127.0.0.1", 8000))
+    s.sendall(b"GET / HTTP/1.0\r\n\r\n")
+    return s
+
+
+def read_body(s, slow=0):
+    """the body length read until the server closed, the first slow reads
+    take a sec each"""
+    head = b""
+    while b"\r\n\r\n" not in head:
+        head += s.recv(4096)
+    total = len(head.split(b"\r\n\r\n", 1)[1])
+    while True:
+        data = s.recv(4096 if slow else 65536)
+        if not data:
+            break
+        total += len(data)
+        if slow:
+            slow -= 1
+            server.sleep(1)
+    s.close()
+    return total
+
+
+def run_stream(app, client):
+    r = ClientRunner(app, client)
+    r.run()
+    ServerRunner(app).run()
+    return r.receive_data
+
+
+@pytest.fixture
+def settings():
+    yield
+    server.set_output_watermarks(65536, 16384)
+    server.set_notsent_lowat(0)
+    server.set_write_timeout(300)
+    server.set_min_send_rate(0)
+
+
+def test_settings(settings):
+    server.set_output_watermarks(4096, 1024)
+    assert(server.get_output_watermarks() == (4096, 1024))
+    server.set_min_send_rate(1024, 2)
+    assert(server.get_min_send_rate() == (1024, 2))
+    server.set_write_timeout(10)
+    assert(server.get_write_timeout() == 10)
+    server.set_notsent_lowat(16384)
+    assert(server.get_notsent_lowat() == 16384)
+    with pytest.raises(ValueError):
+        server.set_output_watermarks(1024, 4096)
+    with pytest.raises(ValueError):
+        server.set_output_watermarks(0, 0)
+    with pytest.raises(ValueError):
+        server.set_write_timeout(-1)
+    with pytest.raises(ValueError):
+        server.set_min_send_rate(-1)
+
+
+def test_backpressure(settings):
+    app = StreamApp(400)
+
+    def client():
+        s = connect()
+        server.sleep(1)
+        ahead = app.produced
+        return ahead, read_body(s)
+
+    server.set_output_watermarks(65536 * 2, 65536)
+    server.set_notsent_lowat(16384)
+    ahead, total = run_stream(app, client)
+    # the body is pulled only as fast as the client reads
+    assert(ahead < 10)
+    assert(total == 400 * len(CHUNK))
+    assert(app.produced == 400)
+    assert(app.closed)
+
+
+def test_body_queued(settings):
+    """once the whole body is queued the app is done with it"""
+    app = StreamApp(1, b"x" * (1 << 23))
+
+    def client():
+        s = connect()
+        server.sleep(1)
+        closed = app.closed
+        return closed, read_body(s)
+
+    closed, total = run_stream(app, client)
+    assert(closed)
+    assert(total == 1 << 23)
+
+
+def test_write_timeout(settings):
+    app = StreamApp(400)
+
+    def client():
+        s = connect()
+        server.sleep(3)
+        return read_body(s)
+
+    before = server.get_stats()
+    server.set_write_timeout(1)
+    total = run_stream(app, client)
+    assert(total < 400 * len(CHUNK))
+    assert(app.closed)
+    stats = server.get_stats()
+    assert(stats["slow_writes"] - before["slow_writes"] == 1)
+
+
+def test_min_send_rate(settings):
+    app = StreamApp(400)
+
+    def client():
+        return read_body(connect(), 3)
+
+    before = server.get_stats()
+    server.set_min_send_rate(1 << 20, 1)
+    total = run_stream(app, client)
+    assert(total < 400 * len(CHUNK))
+    assert(app.closed)
+    stats = server.get_stats()
+    assert(stats["slow_writes"] - before["slow_writes"] == 1)
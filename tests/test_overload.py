@@ -0,0 +1,173 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import pytest
+import requests
+import socket
+import time
+
+RESPONSE = b"Hello world!"
+
+class SlowApp(BaseApp):
+
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        path = environ.get("PATH_INFO")
+        if path == "/slow":
+            server.sleep(3)
+        elif path == "/busy":
+            # block the loop
+            time.sleep(0.3)
+        return [RESPONSE]
+
+def run_overload(application, runners):
+
+    def _shutdown():
+        server.sleep(6)
+        server.shutdown(1)
+
+    before = server.get_overload_stats()
+    try:
+        for r in runners:
+            r.run()
+        server.spawn(_shutdown)
+        server.listen(("0.0.0.0", 8000))
+        server.run(application)
+        stats = server.get_overload_stats()
+        for k in ("pause_count", "paused_msec", "shed_requests", "codel_drops"):
+            stats[k] -= before[k]
+        return stats
+    finally:
+        server.set_keepalive(0)
+        server.set_max_inflight(0)
+        server.set_overload_retry_after(0)
+        server.set_codel_target(0)
+
+def test_limits():
+    server.set_max_connections(128)
+    server.set_max_inflight(16)
+    server.set_max_suspended(8)
+    server.set_overload_retry_after(3)
+    assert(server.get_max_connections() == 128)
+    assert(server.get_max_inflight() == 16)
+    assert(server.get_max_suspended() == 8)
+    assert(server.get_overload_retry_after() == 3)
+
+    server.set_max_connections(0)
+    server.set_max_inflight(0)
+    server.set_max_suspended(0)
+    server.set_overload_retry_after(0)
+    assert(server.get_max_inflight() == 0)
+
+def test_invalid_limit():
+    with pytest.raises(ValueError):
+        server.set_max_inflight(-1)
+    with pytest.raises(ValueError):
+        server.set_codel_interval(0)
+
+def test_codel_params():
+    assert(server.get_codel_target() == 0)
+    assert(server.get_codel_interval() == 100)
+    server.set_codel_target(5)
+    server.set_codel_interval(200)
+    assert(server.get_codel_target() == 5)
+    assert(server.get_codel_interval() == 200)
+    server.set_codel_target(0)
+    server.set_codel_interval(100)
+
+def test_pause_accept():
+
+    def client1():
+        return requests.get("http://localhost:8000/slow")
+
+    def client2():
+        server.sleep(1)
+        return requests.get("http://localhost:8000/")
+
+    server.set_max_inflight(1)
+    application = SlowApp()
+    r1 = ClientRunner(application, client1, False)
+    r2 = ClientRunner(application, client2, False)
+    stats = run_overload(application, [r1, r2])
+
+    env1, res1 = r1.get_result()
+    env2, res2 = r2.get_result()
+    assert(res1.status_code == 200)
+    assert(res2.status_code == 200)
+    assert(res2.content == RESPONSE)
+    assert(stats["pause_count"] >= 1)
+    assert(stats["paused_msec"] > 0)
+    assert(stats["shed_requests"] == 0)
+
+def test_shed_request():
+
+    def client1():
+        server.sleep(1)
+        return requests.get("http://localhost:8000/slow",
+                            headers={"Connection": "close"})
+
+    def client2():
+        # keep-alive connection accepted before the server is overloaded
+        s = socket.create_connection(("localhost", 8000))
+        s.sendall(b"GET / HTTP/1.1\r\nHost: localhost\r\n\r\n")
+        server.sleep(2)
+        s.sendall(b"GET / HTTP/1.1\r\nHost: localhost\r\n\r\n")
+        data = b""
+        while True:
+            buf = s.recv(4096)
+            if not buf:
+                break
+            data += buf
+        s.close()
+        return data
+
+    server.set_keepalive(10)
+    server.set_max_inflight(1)
+    server.set_overload_retry_after(5)
+    application = SlowApp()
+    r1 = ClientRunner(application, client1, False)
+    r2 = ClientRunner(application, client2, False)
+    stats = run_overload(application, [r1, r2])
+
+    env1, res1 = r1.get_result()
+    env2, res2 = r2.get_result()
+    assert(res1.status_code == 200)
+    assert(res1.content == RESPONSE)
+    assert(res2.startswith(b"HTTP/1.1 200 OK\r\n"))
+    assert(b"HTTP/1.0 503 Service Unavailable\r\n" in res2)
+    assert(b"\r\nRetry-After: 5\r\n" in res2)
+    assert(stats["shed_requests"] == 1)
+    assert(stats["inflight"] == 0)
+
+def test_codel_shed():
+
+    def client():
+        # the pipelined requests wait behind the slow one
+        s = socket.create_connection(("localhost", 8000))
+        s.sendall(b"GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                  b"GET /busy HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                  b"GET / HTTP/1.1\r\nHost: localhost\r\n\r\n")
+        data = b""
+        while True:
+            buf = s.recv(4096)
+            if not buf:
+                break
+            data += buf
+        s.close()
+        return data
+
+    server.set_keepalive(10)
+    server.set_codel_target(10)
+    application = SlowApp()
+    r = ClientRunner(application, client, False)
+    stats = run_overload(application, [r])
+
+    env, res = r.get_result()
+    assert(res.count(b"HTTP/1.1 200 OK\r\n") == 2)
+    assert(b"HTTP/1.0 503 Service Unavailable\r\n" in res)
+    assert(b"Retry-After" not in res)
+    assert(stats["codel_drops"] == 1)
+    assert(stats["shed_requests"] == 1)
@@ -0,0 +1,206 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import pytest
+import requests
+import socket
+
+ASSERT_RESPONSE = b"Hello world!"
+
+
+class Handler(object):
+
+    environ = None
+
+    def __init__(self):
+        self.requests = []
+        self.seen = []
+
+    def __call__(self, request):
+        self.requests.append(request)
+        self.seen.append({
+            "method": request.method,
+            "path": request.path,
+            "query": request.query,
+            "version": request.version,
+            "headers": request.headers,
+            "x_test": request.header("X-TEST"),
+            "missing": request.header("x-missing", "none"),
+            "body": bytes(request.body),
+            "keep_alive": request.keep_alive,
+            "remote_addr": request.remote_addr,
+        })
+        self.environ = self.seen[-1]
+        return server.Response(ASSERT_RESPONSE,
+                               headers=[("Content-Type", "text/plain"),
+                                        ("Content-Length", "999")])
+
+
+def run_raw(client, handler):
+    r = ClientRunner(handler, client)
+    r.run()
+    server.listen(("0.0.0.0", 8000))
+    server.run_raw(handler)
+    return r.environ, r.receive_data
+
+
+def test_raw_get():
+
+    def client():
+        return requests.get("http://localhost:8000/foo%20bar?a=1&b=2",
+                            headers={"X-Test": "yes"})
+
+    handler = Handler()
+    seen, res = run_raw(client, handler)
+    assert(res.status_code == 200)
+    assert(res.content == ASSERT_RESPONSE)
+    assert(res.headers["content-type"] == "text/plain")
+    # Content-Length is always taken from the body
+    assert(res.headers["content-length"] == str(len(ASSERT_RESPONSE)))
+    assert(seen["method"] == "GET")
+    assert(seen["path"] == "/foo bar")
+    assert(seen["query"] == "a=1&b=2")
+    assert(seen["version"] == "HTTP/1.1")
+    assert(seen["headers"]["x-test"] == "yes")
+    assert(seen["headers"]["host"] == "localhost:8000")
+    assert(seen["x_test"] == "yes")
+    assert(seen["missing"] == "none")
+    assert(seen["body"] == b"")
+    assert(seen["remote_addr"] == "127.0.0.1")
+
+    # the request outlives the connection
+    req = handler.requests[0]
+    assert(req.remote_addr is None)
+    assert(req.path == "/foo bar")
+
+
+def test_raw_post():
+    body = b"x" * 1024 * 600
+
+    def client():
+        return [requests.post("http://localhost:8000/small", data=b"hello"),
+                requests.post("http://localhost:8000/large", data=body)]
+
+    handler = Handler()
+    seen, res = run_raw(client, handler)
+    assert([r.status_code for r in res] == [200, 200])
+    assert(handler.seen[0]["method"] == "POST")
+    assert(handler.seen[0]["body"] == b"hello")
+    # large bodies are read from the tmpfile through mmap
+    assert(handler.seen[1]["body"] == body)
+    assert(len(handler.requests[1].body) == len(body))
+
+
+def test_raw_pipeline():
+
+    def client():
+        s = socket.create_connection(("localhost", 8000))
+        s.sendall(b"GET /a HTTP/1.1\r\nHost: localhost\r\nX-A:\r\nX-B: 1\r\n\r\n"
+                  b"HEAD /b HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                  b"GET /c HTTP/1.1\r\nHost: localhost\r\nConnection: close"
+                  b"\r\n\r\n")
+        data = b""
+        while True:
+            chunk = s.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+        s.close()
+        return data
+
+    handler = Handler()
+    seen, res = run_raw(client, handler)
+    assert(res.count(b"HTTP/1.1 200 OK\r\n") == 3)
+    # no body for HEAD
+    assert(res.count(ASSERT_RESPONSE) == 2)
+    assert(res.endswith(b"Connection: close\r\n\r\n" + ASSERT_RESPONSE))
+    assert([s["path"] for s in handler.seen] == ["/a", "/b", "/c"])
+    assert([s["method"] for s in handler.seen] == ["GET", "HEAD", "GET"])
+    assert(handler.seen[0]["headers"]["x-a"] == "")
+    assert(handler.seen[0]["headers"]["x-b"] == "1")
+    assert(handler.seen[0]["keep_alive"])
+    assert(not handler.seen[2]["keep_alive"])
+
+
+def test_raw_status():
+
+    class StatusHandler(Handler):
+        def __call__(self, request):
+            self.environ = {}
+            if request.path == "/none":
+                return server.Response(status=204)
+            if request.path == "/error":
+                raise Exception("raw handler error")
+            if request.path == "/bad":
+                return [b"not a response"]
+            return server.Response(b"missing", 404, [("X-Reason", "gone")])
+
+    def client():
+        return [requests.get("http://localhost:8000/" + p)
+                for p in ("missing", "none", "error", "bad")]
+
+    seen, res = run_raw(client, StatusHandler())
+    assert([r.status_code for r in res] == [404, 204, 500, 500])
+    assert(res[0].content == b"missing")
+    assert(res[0].headers["x-reason"] == "gone")
+    assert(res[0].reason == "Not Found")
+    assert("content-length" not in res[1].headers)
+
+
+def test_raw_greenlet_pool():
+
+    class SleepHandler(Handler):
+        def __call__(self, request):
+            server.sleep(0)
+            return Handler.__call__(self, request)
+
+    def client():
+        s = requests.Session()
+        return [s.get("http://localhost:8000/%d" % i) for i in range(3)]
+
+    server.set_greenlet_pool_size(4)
+    server.set_keepalive(10)
+    try:
+        handler = SleepHandler()
+        seen, res = run_raw(client, handler)
+    finally:
+        server.set_keepalive(0)
+        server.set_greenlet_pool_size(0)
+    assert([r.content for r in res] == [ASSERT_RESPONSE] * 3)
+    assert([s["path"] for s in handler.seen] == ["/0", "/1", "/2"])
+
+
+def test_raw_response():
+    r = server.Response()
+    assert(r.status == 200)
+    assert(r.body == b"")
+    assert(r.headers is None)
+    r = server.Response(b"abc", status=201, headers=[("A", "b")])
+    assert((r.status, r.body, r.headers) == (201, b"abc", [("A", "b")]))
+    with pytest.raises(ValueError):
+        server.Response(status=99)
+    with pytest.raises(TypeError):
+        server.Response(u"text")
+    with pytest.raises(TypeError):
+        server.Response(b"", 200, "A: b")
+    with pytest.raises(TypeError):
+        server.run_raw(1)
+
+
+def test_raw_access_log(tmpdir):
+
+    def client():
+        return requests.get("http://localhost:8000/foo/bar?a=1",
+                            headers={"X-Id": "42"})
+
+    path = str(tmpdir.join("access.log"))
+    server.set_access_logger(None)
+    server.set_access_log(path, '"%(r)s" %(s)s %(b)s %{x-id}i %U %q')
+    try:
+        seen, res = run_raw(client, Handler())
+    finally:
+        server.set_access_log(None)
+    assert(res.content == ASSERT_RESPONSE)
+    with open(path) as f:
+        lines = f.readlines()
+    assert(lines == ['"GET /foo/bar?a=1 HTTP/1.1" 200 12 42 /foo/bar a=1\n'])
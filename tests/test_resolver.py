@@ -0,0 +1,215 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import _socket
+import pytest
+import requests
+import socket
+import struct
+import threading
+import time
+
+DNS_PORT = 5353
+
+RECORDS = {
+    (b"example.test", 1): [b"\x0a\x01\x02\x03"],
+    (b"example.test", 28): [b"\xfd" + b"\x00" * 14 + b"\x01"],
+    (b"local.test", 1): [b"\x7f\x00\x00\x01"],
+    (b"local.test", 28): [],
+    (b"api.corp.test", 1): [b"\x0a\x00\x00\x07"],
+}
+
+
+class StubDNS(object):
+    """Answers from RECORDS, NXDOMAIN with a SOA for anything else,
+    nothing at all for names starting with slow and the records of
+    example.test under that name for names starting with spoof."""
+
+    def __init__(self):
+        self.sock = _socket.socket(_socket.AF_INET, _socket.SOCK_DGRAM)
+        self.sock.bind(("127.0.0.1", DNS_PORT))
+        self.sock.settimeout(0.1)
+        self.queries = []
+        self.running = True
+        self.thread = threading.Thread(target=self.serve)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def close(self):
+        self.running = False
+        self.thread.join()
+        self.sock.close()
+
+    def serve(self):
+        while self.running:
+            try:
+                data, addr = self.sock.recvfrom(512)
+            except _socket.timeout:
+                continue
+            res = self.answer(data)
+            if res:
+                self.sock.sendto(res, addr)
+
+    def answer(self, data):
+        qid, = struct.unpack("!H", data[:2])
+        off, labels = 12, []
+        while data[off:off + 1] != b"\x00":
+            n = ord(data[off:off + 1])
+            labels.append(data[off + 1:off + 1 + n])
+            off += n + 1
+        question = data[12:off + 5]
+        qtype, = struct.unpack("!H", data[off + 1:off + 3])
+        name = b".".join(labels)
+        self.queries.append((name, qtype))
+        if name.startswith(b"slow"):
+            return None
+        if name.startswith(b"spoof"):
+            # right id and type, another question
+            question = (b"\x07example\x04test\x00" +
+                        data[off + 1:off + 5])
+            name = b"example.test"
+        records = RECORDS.get((name, qtype))
+        if records is None:
+            if (name, 1) in RECORDS:
+                records = []
+            else:
+                # NXDOMAIN, SOA minimum 30
+                soa = (b"\x00\x00\x06\x00\x01" + struct.pack("!I", 60) +
+                       struct.pack("!H", 22) + b"\x00\x00" +
+                       struct.pack("!IIIII", 1, 60, 60, 60, 30))
+                return (struct.pack("!HHHHHH", qid, 0x8183, 1, 0, 1, 0) +
+                        question + soa)
+        answers = b"".join(b"\xc0\x0c" + struct.pack("!HHIH", qtype, 1, 300,
+                                                      len(r)) + r
+                           for r in records)
+        return (struct.pack("!HHHHHH", qid, 0x8180, 1, len(records), 0, 0) +
+                question + answers)
+
+
+@pytest.fixture
+def dns(tmpdir):
+    conf = tmpdir.join("resolv.conf")
+    conf.write("search corp.test\noptions timeout:1 attempts:1\n")
+    hosts = tmpdir.join("hosts")
+    hosts.write("127.0.0.1 localhost\n10.9.9.9 static.test alias.test\n")
+    stub = StubDNS()
+    server.set_resolver(str(conf), str(hosts), [("127.0.0.1", DNS_PORT)])
+    yield stub
+    server.set_resolver()
+    stub.close()
+
+
+def addrs(infos):
+    return [info[4][0] for info in infos]
+
+
+def test_resolve(dns):
+
+    def lookup():
+        return [server.getaddrinfo("example.test", 80, 0, socket.SOCK_STREAM),
+                server.getaddrinfo("Example.Test.", 80, socket.AF_INET),
+                server.getaddrinfo("static.test", 80, socket.AF_INET),
+                server.getaddrinfo("api", 80, socket.AF_INET)]
+
+    both, v4, static, searched = run_green(lookup)
+    assert(addrs(both) == ["10.1.2.3", "fd00::1"])
+    assert(both[0] == (socket.AF_INET, socket.SOCK_STREAM, socket.IPPROTO_TCP,
+                       "", ("10.1.2.3", 80)))
+    assert(addrs(v4) == ["10.1.2.3"] * len(v4))
+    assert(addrs(static) == ["10.9.9.9"] * len(static))
+    assert(addrs(searched) == ["10.0.0.7"] * len(searched))
+    # A and AAAA once, then from the cache; the hosts file needs none
+    assert(dns.queries.count((b"example.test", 1)) == 1)
+    assert(dns.queries.count((b"example.test", 28)) == 1)
+    assert(b"static.test" not in [q[0] for q in dns.queries])
+    assert((b"api.corp.test", 1) in dns.queries)
+
+
+def test_resolve_errors(dns):
+
+    def lookup():
+        errors = []
+        for name in ("missing.test", "missing.test", "slow.test"):
+            begin = time.time()
+            try:
+                server.getaddrinfo(name, 80, socket.AF_INET)
+            except socket.gaierror as e:
+                errors.append(e.args[0])
+        return errors, time.time() - begin
+
+    errors, elapsed = run_green(lookup)
+    assert(errors == [socket.EAI_NONAME, socket.EAI_NONAME, socket.EAI_AGAIN])
+    # the negative answer is cached for the SOA minimum
+    assert(dns.queries.count((b"missing.test", 1)) == 1)
+    # timeout:1, each unanswered query gives up after a second
+    slow = [q for q in dns.queries if q[0].startswith(b"slow")]
+    assert(len(slow) >= 1)
+    assert(len(slow) * 0.9 < elapsed < len(slow) * 1.0 + 0.3)
+
+
+def test_resolve_other_question(dns):
+
+    def lookup():
+        try:
+            return server.getaddrinfo("spoof.test", 80, socket.AF_INET)
+        except socket.gaierror as e:
+            return e.args[0]
+
+    # the answer for example.test is dropped, the query times out
+    assert(run_green(lookup) == socket.EAI_AGAIN)
+    assert(dns.queries.count((b"spoof.test", 1)) == 1)
+
+
+def test_resolve_does_not_block(dns):
+    ticks = []
+
+    def ticker():
+        for i in range(5):
+            ticks.append(time.time())
+            server.sleep(0)
+
+    def lookup():
+        server.spawn(ticker)
+        begin = time.time()
+        try:
+            server.getaddrinfo("slow.test", 80, socket.AF_INET)
+        except socket.gaierror:
+            pass
+        return begin
+
+    begin = run_green(lookup)
+    assert(len(ticks) == 5)
+    assert(ticks[-1] - begin < 0.5)
+
+
+def test_patched_connect(dns):
+
+    def connect():
+        # create_connection goes through the patched getaddrinfo
+        res = requests.get("http://local.test:8000/").content
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.connect(("local.test", 8000))
+        s.sendall(b"GET / HTTP/1.0\r\n\r\n")
+        data = b""
+        while True:
+            chunk = s.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+        s.close()
+        return res, data
+
+    res, data = run_green(connect)
+    assert(res == b"ok")
+    assert(data.endswith(b"\r\n\r\nok"))
+    assert(dns.queries.count((b"local.test", 1)) == 1)
+
+
+def test_resolve_outside_loop():
+    infos = server.getaddrinfo("localhost", 80, socket.AF_INET)
+    assert("127.0.0.1" in addrs(infos))
+    assert(socket.gethostbyname("127.0.0.1") == "127.0.0.1")
+    with pytest.raises(ValueError):
+        server.set_resolver(nameservers=["not an address"])
+    with pytest.raises(ValueError):
+        server.set_resolver(nameservers=[])
@@ -0,0 +1,184 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import pytest
+import requests
+import socket
+
+
+class App(BaseApp):
+
+    def __init__(self, body):
+        self.body = body
+        self.paths = []
+
+    def __call__(self, environ, start_response):
+        self.environ = environ.copy()
+        self.paths.append(environ["PATH_INFO"])
+        start_response("200 OK", [("Content-type", "text/plain")])
+        return [self.body]
+
+
+def run_routed(client, app, routes):
+    for args, kwargs in routes:
+        server.add_route(*args, **kwargs)
+    try:
+        return run_client(client, lambda: app)
+    finally:
+        server.clear_routes()
+
+
+def route(*args, **kwargs):
+    return args, kwargs
+
+
+def test_route_apps():
+    main = App(b"main")
+    api = App(b"api")
+    post = App(b"post")
+
+    def client():
+        s = requests.Session()
+        return [s.get("http://localhost:8000/" + p)
+                for p in ("", "api", "api/items?x=1", "apix", "healthz",
+                          "other", "api/users")] + \
+               [s.post("http://localhost:8000/api/users", data=b"x")]
+
+    env, res = run_routed(client, main, [
+        route("/api", api, prefix=True),
+        route("/api/users", post, methods=["POST"]),
+        route("/healthz", server.Response(b"ok")),
+    ])
+    assert([r.content for r in res] ==
+           [b"main", b"api", b"api", b"api", b"ok", b"main",
+            b"Method Not Allowed", b"post"])
+    assert(main.paths == ["/", "/other"])
+    # the exact route wins even when the method only fits the prefix one
+    assert(res[6].status_code == 405)
+    assert(res[6].headers["allow"] == "POST")
+    assert(api.paths == ["/api", "/api/items", "/apix"])
+    assert(post.paths == ["/api/users"])
+    assert(res[4].headers["content-length"] == "2")
+
+
+def test_route_reject():
+    main = App(b"main")
+
+    def client():
+        return [requests.get("http://localhost:8000/missing"),
+                requests.head("http://localhost:8000/healthz"),
+                requests.post("http://localhost:8000/healthz", data=b"x"),
+                requests.delete("http://localhost:8000/static/a.css")]
+
+    env, res = run_routed(client, main, [
+        route("/", server.Response(b"Not Found", 404), prefix=True),
+        route("/healthz", server.Response(b"ok"), methods=["GET"]),
+        route("/static/", main, methods=["GET", "PUT"], prefix=True),
+    ])
+    assert([r.status_code for r in res] == [404, 200, 405, 405])
+    assert(res[0].content == b"Not Found")
+    # GET implies HEAD
+    assert(res[1].content == b"")
+    assert(res[2].headers["allow"] == "GET, HEAD")
+    assert(res[3].headers["allow"] == "GET, HEAD, PUT")
+    assert(main.paths == [])
+
+
+def test_route_decoded():
+    main = App(b"main")
+
+    def client():
+        s = socket.create_connection(("localhost", 8000))
+        s.sendall(b"GET /%61dmin/x HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                  b"GET /admin?a=1 HTTP/1.1\r\nHost: localhost\r\n"
+                  b"Connection: close\r\n\r\n")
+        data = b""
+        while True:
+            chunk = s.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+        s.close()
+        return data
+
+    env, res = run_routed(client, main, [
+        route("/admin", server.Response(b"denied", 403), prefix=True),
+    ])
+    assert(res.count(b"HTTP/1.1 403 Forbidden\r\n") == 2)
+    assert(main.paths == [])
+
+
+def test_route_raw():
+
+    def handler(request):
+        return server.Response(b"raw " + request.path.encode())
+
+    def routed(request):
+        return server.Response(b"routed")
+
+    def client():
+        return [requests.get("http://localhost:8000/a").content,
+                requests.get("http://localhost:8000/r").content,
+                requests.get("http://localhost:8000/f").content]
+
+    handler.environ = None
+    server.add_route("/r", routed)
+    server.add_route("/f", server.Response(b"fixed"))
+    try:
+        r = ClientRunner(handler, client)
+        r.run()
+        server.listen(("0.0.0.0", 8000))
+        server.run_raw(handler)
+    finally:
+        server.clear_routes()
+    assert(r.receive_data == [b"raw /a", b"routed", b"fixed"])
+
+
+def test_route_raw_path():
+
+    def handler(request):
+        return server.Response(b"raw " + request.path.encode())
+
+    def api(request):
+        return server.Response(b"api " + request.path.encode())
+
+    def get(path):
+        s = socket.create_connection(("localhost", 8000))
+        s.sendall(b"GET " + path + b" HTTP/1.0\r\n\r\n")
+        data = b""
+        while True:
+            chunk = s.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+        s.close()
+        return data.split(b"\r\n\r\n", 1)[1]
+
+    def client():
+        return [get(b"/%61pi"), get(b"/%2561pi"), get(b"/%2562?x=%2561")]
+
+    handler.environ = None
+    server.add_route("/api", api)
+    try:
+        r = ClientRunner(handler, client)
+        r.run()
+        server.listen(("0.0.0.0", 8000))
+        server.run_raw(handler)
+    finally:
+        server.clear_routes()
+    # request.path and the route key are decoded once, "%2561" is no "/api"
+    assert(r.receive_data == [b"api /api", b"raw /%61pi", b"raw /%62"])
+
+
+def test_route_args():
+    with pytest.raises(ValueError):
+        server.add_route("api", server.Response())
+    with pytest.raises(TypeError):
+        server.add_route("/api", b"not callable")
+    with pytest.raises(ValueError):
+        server.add_route("/api", server.Response(), methods=["FETCH"])
+    with pytest.raises(ValueError):
+        server.add_route("/api", server.Response(), methods=[])
+    with pytest.raises(TypeError):
+        server.add_route("/api", server.Response(), methods=[1])
+    server.clear_routes()
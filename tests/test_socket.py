@@ -315,3 +315,44 @@ def test_close_duble():
 
 
 
+
+def test_recv_timeout():
+    def _test():
+        s = msocket.socket(msocket.AF_INET, msocket.SOCK_STREAM)
+        s.connect(("localhost", 8000))
+        s.settimeout(0.5)
+        # no request was sent, the server does not answer
+        with raises(socket.timeout):
+            s.recv(1024)
+        server.shutdown()
+
+    server.listen(("0.0.0.0", 8000))
+    server.spawn(_test)
+    server.run(App())
+
+def test_sendall_large():
+    body = b"x" * 1024 * 1024 * 4
+
+    def _test():
+        s = msocket.socket(msocket.AF_INET, msocket.SOCK_STREAM)
+        s.connect(("localhost", 8000))
+        # more than the socket buffers, sendall waits for the server to read
+        s.sendall(b"POST / HTTP/1.0\r\nContent-Length: %d\r\n\r\n" % len(body))
+        s.sendall(body)
+        assert(len(s.recv(1024)) == RESPONSE_LEN)
+        server.shutdown()
+
+    server.listen(("0.0.0.0", 8000))
+    server.spawn(_test)
+    server.run(App())
+
+def test_connect_refused():
+    def _test():
+        s = msocket.socket(msocket.AF_INET, msocket.SOCK_STREAM)
+        with raises(socket.error):
+            s.connect(("127.0.0.1", 1))
+        server.shutdown()
+
+    server.listen(("0.0.0.0", 8000))
+    server.spawn(_test)
+    server.run(App())
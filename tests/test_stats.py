@@ -0,0 +1,139 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import os
+import pytest
+import requests
+
+ASSERT_RESPONSE = b"Hello world!"
+RESPONSE = [b"Hello ", b"world!"]
+
+class App(BaseApp):
+
+    environ = None
+
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        if environ.get("PATH_INFO") == "/missing":
+            status = '404 Not Found'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        return RESPONSE
+
+def client():
+    requests.get("http://localhost:8000/")
+    requests.get("http://localhost:8000/missing")
+    return requests.get("http://localhost:8000/")
+
+def diff(before, after):
+    d = {}
+    for k in ("accepted", "requests", "bytes_in", "bytes_out"):
+        d[k] = after[k] - before[k]
+    for k in ("2xx", "4xx", "5xx"):
+        d[k] = after["status"][k] - before["status"][k]
+    d["count"] = after["latency"]["count"] - before["latency"]["count"]
+    return d
+
+def test_get_stats():
+    stats = server.get_stats()
+    for k in ("workers", "accepted", "active", "inflight", "suspended",
+              "paused", "requests", "keepalive_reuse", "pipelined", "bytes_in",
+              "bytes_out", "shed", "codel_drops", "pool_hits", "pool_misses",
+              "pool_idle", "status", "latency"):
+        assert(k in stats)
+    assert(sorted(stats["status"].keys()) ==
+           ["1xx", "2xx", "3xx", "4xx", "5xx", "other"])
+    for k in ("count", "sum_usec", "max_usec", "p50", "p90", "p99", "p999",
+              "buckets"):
+        assert(k in stats["latency"])
+
+def test_stats_count():
+    before = server.get_stats()
+    env, res = run_client(client, App)
+    assert(res.content == ASSERT_RESPONSE)
+    d = diff(before, server.get_stats())
+    assert(d["accepted"] == 3)
+    assert(d["requests"] == 3)
+    assert(d["2xx"] == 2)
+    assert(d["4xx"] == 1)
+    assert(d["5xx"] == 0)
+    assert(d["count"] == 3)
+    assert(d["bytes_in"] > 0)
+    assert(d["bytes_out"] > len(ASSERT_RESPONSE) * 3)
+
+    latency = server.get_stats()["latency"]
+    assert(latency["p50"] <= latency["p99"] <= latency["max_usec"])
+    assert(sum(c for _, c in latency["buckets"]) == latency["count"])
+
+def test_stats_file(tmpdir):
+    path = str(tmpdir.join("meinheld.stats"))
+    server.set_stats(path, slots=4)
+    seen = []
+
+    def stats_client():
+        res = client()
+        seen.append(server.get_stats(path))
+        seen.append(server.get_stats(path, per_worker=True))
+        return res
+
+    env, res = run_client(stats_client, App)
+    assert(res.content == ASSERT_RESPONSE)
+
+    stats, workers = seen
+    assert(stats["workers"] == 1)
+    assert(stats["requests"] == 3)
+    assert(stats["status"]["4xx"] == 1)
+    assert(len(workers) == 1)
+    assert(workers[0]["pid"] == os.getpid())
+    assert(workers[0]["requests"] == 3)
+
+    # the slot is released when the server stops
+    assert(server.get_stats(path)["workers"] == 0)
+    assert(server.get_stats(path, per_worker=True) == [])
+
+    # and taken back by the next run of this process
+    del seen[:]
+    env, res = run_client(stats_client, App)
+    assert(seen[0]["workers"] == 1)
+    assert(seen[0]["requests"] == 6)
+
+def test_stats_fork():
+    server.set_stats(slots=4)
+    r, w = os.pipe()
+    pid = os.fork()
+    if pid == 0:
+        def dying_client():
+            client()
+            stats = server.get_stats()
+            os.write(w, ("%d %d" % (stats["workers"], stats["requests"]))
+                     .encode())
+            # die without stopping the server
+            os._exit(0)
+        try:
+            run_client(dying_client, App)
+        finally:
+            os._exit(1)
+    os.close(w)
+    seen = os.read(r, 64)
+    os.close(r)
+    os.waitpid(pid, 0)
+    assert(seen == b"1 3")
+    # the slot of the dead worker is skipped and freed
+    stats = server.get_stats()
+    assert(stats["workers"] == 0)
+    assert(stats["requests"] == 0)
+    assert(server.get_stats(per_worker=True) == [])
+
+def test_invalid_stats(tmpdir):
+    with pytest.raises(ValueError):
+        server.set_stats(slots=0)
+    path = str(tmpdir.join("broken.stats"))
+    with open(path, "w") as f:
+        f.write("x" * 64)
+    with pytest.raises(ValueError):
+        server.get_stats(path)
+    with pytest.raises(IOError):
+        server.set_stats(path)
+    with pytest.raises(IOError):
+        server.get_stats(str(tmpdir.join("missing.stats")))
@@ -211,3 +211,46 @@ def test_many_resume():
     assert(results == [b'/0', b'/1', b'/2', b'/3', b'/4', b'/5', b'/6', b'/7', b'/8', b'/9', b'/wakeup'])
 
 
+
+
+class OrderedResumeApp(BaseApp):
+    waiters = []
+    woken = []
+    environ = dict()
+    def __call__(self, environ, start_response):
+        status = '200 OK'
+        response_headers = [('Content-type','text/plain')]
+        start_response(status, response_headers)
+        self.environ = environ.copy()
+        path = environ.get("PATH_INFO")
+        if path == "/wakeup":
+            for i, waiter in enumerate(reversed(self.waiters)):
+                waiter.resume(i)
+            # resumed on the next turn of the loop, not from resume()
+            assert(self.woken == [])
+        else:
+            c = environ[CONTINUATION_KEY]
+            self.waiters.append(c)
+            self.woken.append((path, c.suspend(10)))
+        return [path.encode()]
+
+def test_resume_order():
+
+    def mk_client(i):
+        def client():
+            return requests.get("http://localhost:8000/%s" % i)
+        return client
+
+    application = OrderedResumeApp()
+    s = ServerRunner(application, ContinuationMiddleware)
+    for i in range(5):
+        ClientRunner(application, mk_client(i), False).run()
+
+    def _wakeup():
+        ClientRunner(application, mk_client("wakeup"), True).run()
+
+    server.schedule_call(2, _wakeup)
+    s.run()
+    assert(len(application.woken) == 5)
+    # in the order resume() was called
+    assert([v for p, v in application.woken] == list(range(5)))
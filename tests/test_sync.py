@@ -0,0 +1,216 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import gc
+import greenlet
+import pytest
+import requests
+import sys
+import time
+
+try:
+    import queue
+except ImportError:
+    import Queue as queue
+
+
+def test_event():
+    parked = []
+    woken = []
+
+    def waiter(event, ready, i):
+        ready.put(i)
+        woken.append((event.wait(), i))
+
+    def run():
+        event, ready = server.Event(), server.Queue()
+        for i in range(3):
+            server.spawn(waiter, (event, ready, i))
+        for i in range(3):
+            parked.append(ready.get())
+        assert(not event.is_set())
+        event.set()
+        assert(event.wait())
+        event.clear()
+        begin = time.time()
+        timed_out = event.wait(0.5)
+        return timed_out, time.time() - begin
+
+    timed_out, elapsed = run_green(run)
+    # woken in the order they waited
+    assert(sorted(parked) == [0, 1, 2])
+    assert(woken == [(True, i) for i in parked])
+    assert(timed_out is False)
+    assert(0.5 <= elapsed < 3)
+
+
+def test_lock():
+    parked = []
+    log = []
+
+    def worker(lock, ready, i):
+        ready.put(i)
+        with lock:
+            log.append(("in", i))
+            server.sleep(0)
+            log.append(("out", i))
+
+    def run():
+        lock, ready = server.Lock(), server.Queue()
+        assert(lock.acquire())
+        for i in range(3):
+            server.spawn(worker, (lock, ready, i))
+        for i in range(3):
+            parked.append(ready.get())
+        assert(lock.locked())
+        assert(not lock.acquire(False))
+        assert(not lock.acquire(timeout=1))
+        lock.release()
+        # the waiters get the lock in order, none barges in
+        assert(lock.acquire())
+        lock.release()
+        with pytest.raises(RuntimeError):
+            lock.release()
+        return lock.locked()
+
+    assert(run_green(run) is False)
+    assert(log == [(s, i) for i in parked for s in ("in", "out")])
+
+
+def test_semaphore():
+    running = []
+    peak = []
+
+    def worker(sem, gate, done):
+        with sem:
+            running.append(1)
+            peak.append(len(running))
+            done.put(0)
+            gate.get()
+            running.pop()
+        done.put(1)
+
+    def run():
+        sem, gate, done = server.Semaphore(2), server.Queue(), server.Queue()
+        for i in range(6):
+            server.spawn(worker, (sem, gate, done))
+        # two are in, the others wait for the semaphore
+        assert([done.get(), done.get()] == [0, 0])
+        assert(len(running) == 2)
+        for i in range(6):
+            gate.put(None)
+        for i in range(10):
+            done.get()
+        return sem.value
+
+    assert(run_green(run) == 2)
+    assert(len(peak) == 6)
+    assert(max(peak) == 2)
+    with pytest.raises(ValueError):
+        server.Semaphore(-1)
+
+
+def test_queue():
+    got = []
+
+    def consumer(q):
+        while True:
+            item = q.get()
+            if item is None:
+                break
+            got.append(item)
+
+    def run():
+        q = server.Queue(1)
+        server.spawn(consumer, (q,))
+        for i in range(5):
+            q.put(i)
+        q.put(None)
+        q.put("last")
+        assert(q.full())
+        with pytest.raises(queue.Full):
+            q.put_nowait("more")
+        with pytest.raises(queue.Full):
+            q.put("more", timeout=0.1)
+        assert(q.get_nowait() == "last")
+        with pytest.raises(queue.Empty):
+            q.get(timeout=1)
+        return q.qsize(), q.empty()
+
+    assert(run_green(run) == (0, True))
+    assert(got == list(range(5)))
+
+
+def test_wakeup_without_poll():
+    """a round trip only waits for the next turn of the loop"""
+
+    def pong(ping, pong, n):
+        for i in range(n):
+            pong.put(ping.get())
+
+    def run():
+        a, b = server.Queue(), server.Queue()
+        server.spawn(pong, (a, b, 1000))
+        begin = time.time()
+        for i in range(1000):
+            a.put(i)
+            assert(b.get() == i)
+        return time.time() - begin
+
+    assert(run_green(run) < 1)
+
+
+def test_wait_in_app():
+    event = server.Event()
+
+    class WaitApp(OkApp):
+
+        def __call__(self, environ, start_response):
+            server.spawn(event.set)
+            event.wait(5)
+            return OkApp.__call__(self, environ, start_response)
+
+    def client():
+        return requests.get("http://127.0.0.1:8000/")
+
+    env, res = run_client(client, WaitApp)
+    assert(res.content == b"ok")
+    assert(event.is_set())
+
+
+def test_outside_loop():
+    lock = server.Lock()
+    with lock:
+        assert(lock.locked())
+    q = server.Queue()
+    q.put(1)
+    assert(q.get() == 1)
+    with pytest.raises(queue.Empty):
+        q.get(False)
+    # waiting needs a greenlet
+    with pytest.raises(IOError):
+        server.Event().wait()
+
+
+def test_shutdown_releases_ready():
+    pingers = []
+
+    def ping(mine, other):
+        pingers.append(greenlet.getcurrent())
+        while True:
+            other.set()
+            mine.wait()
+            mine.clear()
+
+    def run():
+        # they keep waking each other, one is always scheduled to run
+        a, b = server.Event(), server.Event()
+        server.spawn(ping, (a, b))
+        server.spawn(ping, (b, a))
+
+    run_green(run)
+    gc.collect()
+    # both are suspended in wait(); the one scheduled when the loop ended
+    # is not held by the server any more than the parked one
+    refs = [sys.getrefcount(g) for g in pingers]
+    assert(refs[0] == refs[1])
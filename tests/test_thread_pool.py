@@ -0,0 +1,143 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import pytest
+import requests
+import threading
+import time
+
+
+class App(BaseApp):
+
+    def __init__(self):
+        self.results = []
+
+    def __call__(self, environ, start_response):
+        self.environ = environ.copy()
+
+        def work(a, b=0):
+            return threading.current_thread().name, a + b
+
+        def fail():
+            raise ValueError("boom")
+
+        self.results.append(server.run_in_thread(work, 1, b=2))
+        try:
+            server.run_in_thread(fail)
+        except ValueError as e:
+            self.results.append(str(e))
+        start_response("200 OK", [("Content-type", "text/plain")])
+        return [b"ok"]
+
+
+def test_run_in_thread():
+    app = App()
+
+    def client():
+        return requests.get("http://localhost:8000/")
+
+    before = server.get_stats()
+    r = ClientRunner(app, client)
+    r.run()
+    ServerRunner(app).run()
+    assert(r.receive_data.content == b"ok")
+    name, value = app.results[0]
+    assert(name != threading.current_thread().name)
+    assert(value == 3)
+    assert(app.results[1] == "boom")
+    stats = server.get_stats()
+    assert(stats["thread_jobs"] - before["thread_jobs"] == 2)
+    assert(stats["thread_queued"] == 0)
+    assert(stats["thread_running"] == 0)
+
+
+def test_run_in_thread_concurrent():
+    done = []
+    ticks = []
+
+    def blocking(i):
+        time.sleep(0.5)
+        return i
+
+    def call(i):
+        done.append(server.run_in_thread(blocking, i))
+
+    def ticker():
+        # the loop keeps running while the threads block
+        for i in range(5):
+            ticks.append(time.time())
+            server.sleep(0)
+
+    def client():
+        for i in range(4):
+            server.spawn(call, (i,))
+        server.spawn(ticker)
+        server.sleep(1)
+        return requests.get("http://localhost:8000/")
+
+    server.set_thread_pool_size(4)
+    begin = time.time()
+    env, res = run_client(client, App)
+    assert(sorted(done) == [0, 1, 2, 3])
+    assert(len(ticks) == 5)
+    assert(ticks[-1] - begin < 0.5)
+    assert(time.time() - begin < 3)
+
+
+def wait_for(cond):
+    for i in range(10):
+        if cond():
+            return True
+        server.sleep(1)
+    return False
+
+
+def test_thread_queue_limit():
+    release = threading.Event()
+    results = []
+
+    def call(func):
+        try:
+            results.append(server.run_in_thread(func))
+        except IOError as e:
+            results.append(str(e))
+
+    def client():
+        server.spawn(call, (release.wait,))
+        assert(wait_for(lambda: server.get_stats()["thread_running"] == 1))
+        # the only thread is busy, one call may wait
+        for i in range(3):
+            server.spawn(call, (lambda: "queued",))
+        assert(wait_for(lambda: len(results) == 2))
+        release.set()
+        assert(wait_for(lambda: len(results) == 4))
+        return requests.get("http://localhost:8000/")
+
+    server.set_thread_pool_size(1)
+    server.set_thread_queue_limit(1)
+    before = server.get_stats()
+    try:
+        env, res = run_client(client, App)
+    finally:
+        server.set_thread_queue_limit(0)
+        server.set_thread_pool_size(4)
+    assert(res.content == b"ok")
+    assert(results == ["thread pool queue full"] * 2 + [True, "queued"])
+    stats = server.get_stats()
+    assert(stats["thread_rejected"] - before["thread_rejected"] == 2)
+
+
+def test_thread_pool_args():
+    with pytest.raises(ValueError):
+        server.set_thread_pool_size(0)
+    with pytest.raises(ValueError):
+        server.set_thread_queue_limit(-1)
+    with pytest.raises(TypeError):
+        server.run_in_thread()
+    with pytest.raises(TypeError):
+        server.run_in_thread(b"not callable")
+    # not on a greenlet
+    with pytest.raises(IOError):
+        server.run_in_thread(time.time)
+    assert(server.get_thread_pool_size() == 4)
+    assert(server.get_thread_queue_limit() == 0)
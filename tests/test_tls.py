@@ -0,0 +1,166 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import json
+import os
+import pytest
+import shutil
+import subprocess
+import sys
+import tempfile
+import _socket
+
+BODY = b"x" * 300000
+
+# two connections, the second resumes the session of the first
+CLIENT = ("import json, socket, ssl\n"
+          "ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)\n"
+          "ctx.check_hostname = False\n"
+          "ctx.verify_mode = ssl.CERT_NONE\n"
+          "session, out = None, []\n"
+          "for i in range(2):\n"
+          "    s = ctx.wrap_socket(socket.create_connection(\n"
+          "        ('127.0.0.1', 8000), timeout=5), session=session)\n"
+          "    s.sendall(b'GET / HTTP/1.0\\r\\n\\r\\n')\n"
+          "    data = b''\n"
+          "    while True:\n"
+          "        d = s.recv(65536)\n"
+          "        if not d:\n"
+          "            break\n"
+          "        data += d\n"
+          "    session = s.session\n"
+          "    out.append([data.split(b'\\r\\n', 1)[0].decode(),\n"
+          "                len(data.split(b'\\r\\n\\r\\n', 1)[1]),\n"
+          "                s.session_reused])\n"
+          "    s.close()\n"
+          "print(json.dumps(out))\n")
+
+
+class TLSApp(BaseApp):
+
+    def __call__(self, environ, start_response):
+        self.environ = environ.copy()
+        start_response("200 OK", [("Content-Length", str(len(BODY)))])
+        return [BODY]
+
+
+@pytest.fixture
+def cert():
+    d = tempfile.mkdtemp()
+    path = os.path.join(d, "cert.pem")
+    try:
+        subprocess.check_call(["openssl", "req", "-x509", "-newkey",
+                               "rsa:2048", "-nodes", "-days", "1",
+                               "-subj", "/CN=localhost", "-keyout", path,
+                               "-out", path], stderr=subprocess.DEVNULL)
+    except (OSError, subprocess.CalledProcessError):
+        shutil.rmtree(d)
+        pytest.skip("no openssl command")
+    yield path
+    server.set_tls(None)
+    shutil.rmtree(d)
+
+
+def use_tls(path):
+    try:
+        server.set_tls(path)
+    except NotImplementedError:
+        pytest.skip("built without kernel TLS")
+    except RuntimeError:
+        pytest.skip("kernel TLS is not available")
+
+
+def test_settings(cert):
+    assert(not server.get_tls())
+    with pytest.raises(ValueError):
+        server.set_tls(cert, session_cache=-1)
+    try:
+        with pytest.raises(IOError):
+            server.set_tls("/nonexistent.pem")
+    except NotImplementedError:
+        pytest.skip("built without kernel TLS")
+    assert(not server.get_tls())
+
+
+def available_ulps():
+    try:
+        with open("/proc/sys/net/ipv4/tcp_available_ulp") as f:
+            return f.read().split()
+    except IOError:
+        return None
+
+
+def test_no_ktls(cert):
+    ulps = available_ulps()
+    if ulps is None or "tls" in ulps:
+        pytest.skip("kernel TLS is available")
+    try:
+        server.set_tls(cert)
+    except NotImplementedError:
+        pytest.skip("built without kernel TLS")
+    except RuntimeError as e:
+        assert("kernel TLS is not available" in str(e))
+        assert(not server.get_tls())
+    else:
+        # the probe loaded the module
+        assert("tls" in available_ulps())
+
+
+def test_unix_plain(cert, tmpdir):
+    path = str(tmpdir.join("tls.sock"))
+
+    def client():
+        # msocket does not support unix sockets, wait with trampoline
+        s = _socket.socket(_socket.AF_UNIX, _socket.SOCK_STREAM)
+        s.connect(path)
+        s.sendall(b"GET / HTTP/1.0\r\n\r\n")
+        s.setblocking(False)
+        data = b""
+        while True:
+            server.trampoline(s.fileno(), read=True, timeout=5)
+            d = s.recv(65536)
+            if not d:
+                break
+            data += d
+        s.close()
+        return data
+
+    use_tls(cert)
+    app = TLSApp()
+    r = ClientRunner(app, client)
+    r.run()
+    # the only listener, set_tls applies to TCP ones
+    server.listen(path.encode())
+    server.run(app)
+    head, body = r.receive_data.split(b"\r\n\r\n", 1)
+    assert(head.startswith(b"HTTP/1.0 200 OK"))
+    assert(body == BODY)
+    assert(app.environ["wsgi.url_scheme"] == "http")
+
+
+def test_https(cert):
+
+    def client():
+        # a blocking TLS client in this process would stall the loop
+        proc = subprocess.Popen([sys.executable, "-c", CLIENT],
+                                stdout=subprocess.PIPE)
+        while proc.poll() is None:
+            server.sleep(1)
+        return json.loads(proc.stdout.read().decode())
+
+    use_tls(cert)
+    assert(server.get_tls())
+    before = server.get_stats()
+    app = TLSApp()
+    r = ClientRunner(app, client)
+    r.run()
+    ServerRunner(app).run()
+    for status, length, reused in r.receive_data:
+        assert(status == "HTTP/1.0 200 OK")
+        assert(length == len(BODY))
+    assert(r.receive_data[1][2])
+    assert(app.environ["wsgi.url_scheme"] == "https")
+    stats = server.get_stats()
+    assert(stats["tls_handshakes"] - before["tls_handshakes"] == 2)
+    assert(stats["tls_resumed"] - before["tls_resumed"] == 1)
+    assert(stats["tls_failed"] == before["tls_failed"])
@@ -0,0 +1,179 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+from meinheld import websocket
+from meinheld.middleware import WebSocketMiddleware
+import _socket
+import errno
+import pytest
+import socket
+import struct
+import time
+
+HANDSHAKE = (b"GET /chat HTTP/1.1\r\n"
+             b"Host: localhost\r\n"
+             b"Upgrade: websocket\r\n"
+             b"Connection: Upgrade\r\n"
+             b"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+             b"Sec-WebSocket-Version: 13\r\n\r\n")
+
+
+def ws_connect():
+    s = socket.create_connection(("127.0.0.1", 8000))
+    s.sendall(HANDSHAKE)
+    buf = b""
+    while b"\r\n\r\n" not in buf:
+        buf += s.recv(4096)
+    head, buf = buf.split(b"\r\n\r\n", 1)
+    assert(head.startswith(b"HTTP/1.1 101"))
+    return s, buf
+
+
+def read_frame(s, buf):
+
+    def need(n):
+        data = buf
+        while len(data) < n:
+            data += s.recv(65536)
+        return data
+
+    buf = need(2)
+    opcode, length = bytearray(buf[:2])
+    idx = 2
+    length &= 0x7f
+    if length == 126:
+        buf = need(4)
+        length, = struct.unpack(">H", buf[2:4])
+        idx = 4
+    elif length == 127:
+        buf = need(10)
+        length, = struct.unpack(">Q", buf[2:10])
+        idx = 10
+    buf = need(idx + length)
+    return opcode, buf[idx:idx + length], buf[idx + length:]
+
+
+class BroadcastApp(BaseApp):
+
+    def __init__(self):
+        self.participants = []
+        self.sent = []
+
+    def __call__(self, environ, start_response):
+        self.environ = environ.copy()
+        ws = environ["wsgi.websocket"]
+        self.participants.append(ws)
+        if len(self.participants) == 3:
+            self.sent.append(websocket.broadcast(self.participants, u"hello"))
+            self.sent.append(websocket.broadcast(self.participants,
+                                                 b"\x00" * 70000))
+            ws.send(u"last")
+            websocket.broadcast(self.participants, u"bye")
+        while ws.wait() is not None:
+            pass
+        return []
+
+
+def test_ws_frame():
+    assert(server.ws_frame(u"hi") == b"\x81\x02hi")
+    assert(server.ws_frame(b"hi") == b"\x82\x02hi")
+    assert(server.ws_frame(u"é") == b"\x81\x02\xc3\xa9")
+    assert(server.ws_frame(b"x" * 200)[:4] == b"\x82\x7e\x00\xc8")
+    assert(server.ws_frame(b"x" * 70000)[:10] ==
+           b"\x82\x7f" + struct.pack(">Q", 70000))
+    with pytest.raises(TypeError):
+        server.ws_frame(1)
+
+
+def test_broadcast():
+    received = server.Queue()
+
+    def client():
+        s, buf = ws_connect()
+        frames = []
+        while not frames or frames[-1][1] != b"bye":
+            op, payload, buf = read_frame(s, buf)
+            frames.append((op, payload))
+        s.close()
+        received.put(frames)
+
+    def clients():
+        for i in range(3):
+            server.spawn(client)
+        return [received.get() for i in range(3)]
+
+    app = BroadcastApp()
+    r = ClientRunner(app, clients)
+    r.run()
+    ServerRunner(app, WebSocketMiddleware).run()
+    results = r.receive_data
+    assert(app.sent == [3, 3])
+    for frames in results:
+        assert(frames[0] == (0x81, b"hello"))
+        assert(frames[1] == (0x82, b"\x00" * 70000))
+        assert(frames[-1] == (0x81, b"bye"))
+    # the one that broadcast sent its own frame in between
+    assert(sorted(len(f) for f in results) == [3, 3, 4])
+    assert([f for f in results if len(f) == 4][0][2] == (0x81, b"last"))
+
+
+def fill(out):
+    big = b"x" * 65536
+    while out.pending <= out.high_watermark:
+        server.broadcast([out], big)
+    return out.pending
+
+
+def test_slow_consumer():
+    a, b = _socket.socketpair()
+    c, d = _socket.socketpair()
+    try:
+        drop = server.Outbox(a.fileno(), 1024)
+        close = server.Outbox(c.fileno(), 1024, "close")
+        assert(fill(drop) > 1024)
+        assert(fill(close) > 1024)
+        assert(server.broadcast([drop, close], b"late") == 0)
+        assert(drop.dropped == 1)
+        assert(not drop.closed)
+        # shut down, the peer reads to the end
+        assert(close.closed)
+        assert(close.pending == 0)
+        d.settimeout(5)
+        while d.recv(65536):
+            pass
+        drop.close()
+        assert(drop.closed)
+        with pytest.raises(IOError):
+            drop.send(b"x")
+        with pytest.raises(ValueError):
+            server.Outbox(a.fileno(), 1024, "block")
+    finally:
+        for s in (a, b, c, d):
+            s.close()
+
+
+def test_flush_timeout():
+    a, b = _socket.socketpair()
+    try:
+        out = server.Outbox(a.fileno(), 1024)
+        fill(out)
+
+        def flush():
+            begin = time.time()
+            try:
+                out.flush(1)
+            except IOError as e:
+                return e.errno, time.time() - begin
+            return None, time.time() - begin
+
+        err, elapsed = run_green(flush)
+        # the peer never reads, the queue is dropped and the socket shut
+        assert(err == errno.ETIMEDOUT)
+        assert(elapsed < 3)
+        assert(out.closed)
+        assert(out.pending == 0)
+        with pytest.raises(ValueError):
+            out.flush(0)
+    finally:
+        a.close()
+        b.close()
@@ -242,3 +242,51 @@ def test_no_content():
     assert(res.status_code == 204)
     assert("Content-Length" not in headers)
     assert("Transfer-Encoding" not in headers)
+
+
+def test_start_response_keywords():
+
+    class App(BaseApp):
+        def __call__(self, environ, start_response):
+            self.environ = environ.copy()
+            write = start_response(status="200 OK",
+                                   headers=[('Content-type','text/plain')],
+                                   exc_info=None)
+            self.write = write
+            return [b"keywords"]
+
+    def client():
+        return requests.get("http://localhost:8000")
+
+    env, res = run_client(client, App)
+    assert(res.status_code == 200)
+    assert(res.content == b"keywords")
+
+
+def test_start_response_bad_args():
+
+    class App(BaseApp):
+        def __call__(self, environ, start_response):
+            self.environ = environ.copy()
+            errors = []
+            for args, kwargs in (((), {}),
+                                 (("200 OK",), {}),
+                                 (("200 OK", [], None, 1), {}),
+                                 (("200 OK", []), {"status": "200 OK"}),
+                                 (("200 OK", []), {"bad": 1}),
+                                 ((b"200 OK", []), {})):
+                try:
+                    start_response(*args, **kwargs)
+                except TypeError:
+                    errors.append(True)
+            environ["errors"] = errors
+            self.environ = environ.copy()
+            start_response("200 OK", [('Content-type','text/plain')])
+            return [b"ok"]
+
+    def client():
+        return requests.get("http://localhost:8000")
+
+    env, res = run_client(client, App)
+    assert(res.content == b"ok")
+    assert(env["errors"] == [True] * 6)
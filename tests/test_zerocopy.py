@@ -0,0 +1,66 @@
+# -*- coding: utf-8 -*-
+
+from base import *
+import pytest
+import socket
+
+BODY = bytes(bytearray(range(256))) * 4096
+
+
+class BigApp(BaseApp):
+
+    def __call__(self, environ, start_response):
+        self.environ = environ.copy()
+        start_response("200 OK", [("Content-Length", str(len(BODY) * 2))])
+        return [BODY, b"y" * len(BODY)]
+
+
+def zerocopy_supported():
+    s = socket.socket()
+    try:
+        s.setsockopt(socket.SOL_SOCKET, getattr(socket, "SO_ZEROCOPY", 60), 1)
+        return True
+    except (OSError, socket.error):
+        return False
+    finally:
+        s.close()
+
+
+@pytest.fixture
+def threshold():
+    yield
+    server.set_zerocopy_threshold(0)
+    server.set_keepalive(0)
+
+
+def test_settings(threshold):
+    assert(server.get_zerocopy_threshold() == 0)
+    server.set_zerocopy_threshold(65536)
+    assert(server.get_zerocopy_threshold() == 65536)
+    with pytest.raises(ValueError):
+        server.set_zerocopy_threshold(-1)
+    with pytest.raises(ValueError):
+        server.set_zerocopy_threshold(100)
+
+
+def test_body(threshold):
+
+    def client():
+        with requests.Session() as session:
+            return [session.get("http://localhost:8000/") for i in range(2)]
+
+    before = server.get_stats()
+    server.set_zerocopy_threshold(65536)
+    server.set_keepalive(10)
+    r = ClientRunner(BigApp(), client)
+    r.run()
+    ServerRunner(BigApp()).run()
+    # zerocopy or not the body arrives intact, also on a reused connection
+    for res in r.receive_data:
+        assert(res.status_code == 200)
+        assert(res.content == BODY + b"y" * len(BODY))
+    if zerocopy_supported():
+        stats = server.get_stats()
+        assert(stats["zerocopy_sends"] - before["zerocopy_sends"] >= 1)
+        # the loopback always copies, the connection falls back once
+        assert(stats["zerocopy_copied"] - before["zerocopy_copied"] == 1)